@@ -0,0 +1,110 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include "nlohmann/json.hpp"
+#include "src/json_arena.h"
+#include "src/json_decode.h"
+
+namespace {
+
+std::atomic_int64_t heap_allocations = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size)) {
+    return p;
+  }
+  std::abort();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t /* size */) noexcept { std::free(p); }
+
+namespace uchen::json {
+namespace {
+
+const std::string& ResponseBody() {
+  static const std::string* body = [] {
+    nlohmann::json response = {
+        {"id", "chatcmpl-123"},
+        {"object", "chat.completion"},
+        {"choices",
+         {{{"index", 0},
+           {"message",
+            {{"role", "assistant"}, {"content", std::string(2000, 'a')}}},
+           {"finish_reason", "stop"}}}},
+        {"usage",
+         {{"prompt_tokens", 9},
+          {"completion_tokens", 12},
+          {"total_tokens", 21}}},
+    };
+    return new std::string(response.dump());
+  }();
+  return *body;
+}
+
+void ReportAllocations(benchmark::State& state, int64_t before) {
+  state.counters["allocs"] = benchmark::Counter(
+      static_cast<double>(heap_allocations.load() - before),
+      benchmark::Counter::kAvgIterations);
+}
+
+// One turn the way it was done before request arenas: every node on the
+// heap, and every step of the decoder copying the subtree it points at.
+void BM_TurnOnHeap(benchmark::State& state) {
+  const std::string prompt(2000, 'p');
+  int64_t before = heap_allocations.load();
+  for (auto _ : state) {
+    nlohmann::json request = {
+        {"model", "gpt-4o-mini"},
+        {"max_tokens", 1024},
+        {"messages", nlohmann::json::array(
+                         {{{"role", "user"}, {"content", prompt}}})},
+    };
+    std::string payload = request.dump();
+    benchmark::DoNotOptimize(payload);
+    nlohmann::json response =
+        nlohmann::json::parse(ResponseBody(), nullptr, false);
+    nlohmann::json choices = response["choices"];
+    nlohmann::json choice = choices[0];
+    nlohmann::json message = choice["message"];
+    nlohmann::json content = message["content"];
+    std::string text = content.get<std::string>();
+    benchmark::DoNotOptimize(text);
+  }
+  ReportAllocations(state, before);
+}
+BENCHMARK(BM_TurnOnHeap);
+
+void BM_TurnInArena(benchmark::State& state) {
+  const std::string prompt(2000, 'p');
+  int64_t before = heap_allocations.load();
+  for (auto _ : state) {
+    Arena arena;
+    ArenaScope scope(arena);
+    Json request = {
+        {"model", "gpt-4o-mini"},
+        {"max_tokens", 1024},
+        {"messages",
+         Json::array({{{"role", "user"}, {"content", prompt}}})},
+    };
+    String payload = request.dump();
+    benchmark::DoNotOptimize(payload);
+    JsonDecode decoded(Json::parse(ResponseBody(), nullptr, false));
+    auto text = decoded["choices"][0]["message"]["content"].String();
+    benchmark::DoNotOptimize(text);
+  }
+  ReportAllocations(state, before);
+}
+BENCHMARK(BM_TurnInArena);
+
+}  // namespace
+}  // namespace uchen::json
+
+BENCHMARK_MAIN();
@@ -0,0 +1,119 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include "nlohmann/json.hpp"
+#include "src/json_arena.h"
+#include "src/json_template.h"
+
+namespace {
+
+std::atomic_int64_t heap_allocations = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size)) {
+    return p;
+  }
+  std::abort();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t /* size */) noexcept { std::free(p); }
+
+namespace uchen::json {
+namespace {
+
+// A long prompt, mostly plain text with the odd line break and quote.
+std::string Prompt(size_t size) {
+  std::string prompt;
+  while (prompt.size() < size) {
+    prompt += "Summarize the following \"report\" in three sentences.\n";
+  }
+  prompt.resize(size);
+  return prompt;
+}
+
+void ReportAllocations(benchmark::State& state, int64_t before) {
+  state.counters["allocs"] = benchmark::Counter(
+      static_cast<double>(heap_allocations.load() - before),
+      benchmark::Counter::kAvgIterations);
+}
+
+void ReportBytes(benchmark::State& state, size_t size) {
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * size));
+}
+
+// The request body built as a JSON tree and dumped, the way it was done
+// before the templates.
+void BM_RequestFromJson(benchmark::State& state) {
+  const std::string prompt = Prompt(state.range(0));
+  int64_t before = heap_allocations.load();
+  for (auto _ : state) {
+    Arena arena;
+    ArenaScope scope(arena);
+    Json request = {
+        {"model", "gpt-4o-mini"},
+        {"max_tokens", 1024},
+        {"messages",
+         Json::array({{{"role", "user"}, {"content", prompt}}})},
+    };
+    String payload = request.dump();
+    benchmark::DoNotOptimize(payload);
+  }
+  ReportAllocations(state, before);
+  ReportBytes(state, prompt.size());
+}
+BENCHMARK(BM_RequestFromJson)->Arg(2 << 10)->Arg(256 << 10);
+
+void BM_RequestFromTemplate(benchmark::State& state) {
+  const std::string prompt = Prompt(state.range(0));
+  const JsonTemplate request_template(
+      {{"model", "gpt-4o-mini"}, {"max_tokens", 1024}}, "messages");
+  int64_t before = heap_allocations.load();
+  for (auto _ : state) {
+    std::string payload = request_template.Render(
+        [&](std::string& out) {
+          out += R"([{"role":"user","content":)";
+          AppendJsonString(out, prompt);
+          out += "}]";
+        },
+        prompt.size() + 64);
+    benchmark::DoNotOptimize(payload);
+  }
+  ReportAllocations(state, before);
+  ReportBytes(state, prompt.size());
+}
+BENCHMARK(BM_RequestFromTemplate)->Arg(2 << 10)->Arg(256 << 10);
+
+void BM_EscapeWithNlohmann(benchmark::State& state) {
+  const nlohmann::json prompt = Prompt(state.range(0));
+  for (auto _ : state) {
+    std::string escaped = prompt.dump();
+    benchmark::DoNotOptimize(escaped);
+  }
+  ReportBytes(state, state.range(0));
+}
+BENCHMARK(BM_EscapeWithNlohmann)->Arg(256 << 10);
+
+void BM_EscapeWithKernel(benchmark::State& state) {
+  const std::string prompt = Prompt(state.range(0));
+  state.SetLabel(std::string(JsonEscapeKernelName()));
+  for (auto _ : state) {
+    std::string escaped;
+    AppendJsonString(escaped, prompt);
+    benchmark::DoNotOptimize(escaped);
+  }
+  ReportBytes(state, prompt.size());
+}
+BENCHMARK(BM_EscapeWithKernel)->Arg(256 << 10);
+
+}  // namespace
+}  // namespace uchen::json
+
+BENCHMARK_MAIN();
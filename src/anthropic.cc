@@ -1,6 +1,8 @@
 #include "src/anthropic.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <string>
@@ -8,88 +10,583 @@
 #include <vector>
 
 #include "absl/flags/flag.h"
+#include "absl/functional/function_ref.h"
 #include "absl/log/log.h"
 #include "absl/status/status.h"
+#include "absl/strings/ascii.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
 
-#include "nlohmann/json.hpp"
 #include "src/fetch.h"
+#include "src/json_arena.h"
 #include "src/json_decode.h"
+#include "src/json_template.h"
 #include "src/model.h"
+#include "src/sse.h"
+#include "src/stop.h"
+#include "src/trace.h"
 
 ABSL_FLAG(std::optional<std::string>, anthropic_api_key, std::nullopt,
           "Anthropic API key. If not set, will use the environment variable "
           "ANTHROPIC_API_KEY.");
+ABSL_FLAG(std::string, anthropic_api_url, "https://api.anthropic.com/v1",
+          "Base URL of the Anthropic API, e.g. of a proxy.");
 
 namespace uchen::chat {
 namespace {
 
-class AnthropicModel : public Model {
+class AnthropicModel : public Model, public BatchApi {
  public:
-  AnthropicModel(std::string_view model,
-                 std::string_view api_key, int max_tokens)
+  AnthropicModel(std::string_view model, std::string_view api_url,
+                 std::string_view api_key, int max_tokens,
+                 int max_continuations)
       : model_(model),
+        api_url_(api_url),
+        messages_url_(absl::StrCat(api_url, "/messages")),
         api_key_(api_key),
-        max_tokens_(max_tokens) {}
+        max_tokens_(max_tokens),
+        max_continuations_(max_continuations),
+        headers_({
+            {.key = "Content-Type", .value = "application/json"},
+            {.key = "x-api-key", .value = api_key_},
+            {.key = "anthropic-version", .value = "2023-06-01"},
+        }),
+        request_template_({{"model", model_}, {"max_tokens", max_tokens_}},
+                          "messages"),
+        stream_template_({{"model", model_},
+                          {"max_tokens", max_tokens_},
+                          {"stream", true}},
+                         "messages") {}
   ~AnthropicModel() override = default;
 
   std::string_view name() const override { return model_; }
+  std::string_view endpoint() const override { return messages_url_; }
 
   absl::StatusOr<std::string> Prompt(
       const Fetch& fetch, std::string_view prompt,
-      absl::Span<const std::string_view> input_contents) override;
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options) override;
+
+  absl::Status StreamPrompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override;
+
+  absl::Status StreamPromptUntil(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override;
+
+  absl::Status StreamConversationUntil(
+      const Fetch& fetch, absl::Span<const Message> history, Message prompt,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override;
+
+  absl::StatusOr<Reply> Complete(const Fetch& fetch,
+                                 absl::Span<const Message> messages,
+                                 absl::Span<const ToolSpec> tools,
+                                 const RequestOptions& options) override;
+
+  BatchApi* batch_api() override { return this; }
+
+  // The limit of the Message Batches API.
+  size_t max_batch_requests() const override { return 100000; }
+
+  absl::StatusOr<std::string> SubmitBatch(
+      const Fetch& fetch, absl::Span<const BatchRequest> requests,
+      const RequestOptions& options) override;
+
+  absl::StatusOr<bool> PollBatch(const Fetch& fetch,
+                                 std::string_view batch_id,
+                                 const RequestOptions& options) override;
+
+  absl::Status BatchResults(
+      const Fetch& fetch, std::string_view batch_id,
+      const RequestOptions& options,
+      absl::FunctionRef<void(BatchResult)> on_result) override;
 
  private:
+  // Builds the body of a Messages API request. Allocates from the arena of
+  // the caller.
+  absl::StatusOr<json::Json> BuildRequest(
+      absl::Span<const Message> messages,
+      absl::Span<const ToolSpec> tools) const;
+  // The serialized body of a Messages API request. Conversations without
+  // tools only serialize their messages into request_template_, or
+  // stream_template_ when the reply is to be streamed.
+  absl::StatusOr<std::string> SerializeRequest(
+      absl::Span<const Message> messages, absl::Span<const ToolSpec> tools,
+      bool stream = false,
+      absl::Span<const std::string> stop_sequences = {}) const;
+  // Complete without tools, with the reply streamed. Its text goes to
+  // `on_text` as it arrives, until that returns false.
+  absl::StatusOr<Reply> StreamComplete(
+      const Fetch& fetch, absl::Span<const Message> messages,
+      absl::Span<const std::string> stop_sequences,
+      const RequestOptions& options,
+      absl::FunctionRef<bool(std::string_view)> on_text);
+
+  // The batch `batch_id`, with its status and where its results are.
+  absl::StatusOr<json::JsonDecode> GetBatch(
+      const Fetch& fetch, std::string_view batch_id,
+      const RequestOptions& options) const;
+
   std::string model_;
+  std::string api_url_;
+  std::string messages_url_;
   std::string api_key_;
   int max_tokens_;
+  int max_continuations_;
+  std::vector<Header> headers_;
+  json::JsonTemplate request_template_;
+  json::JsonTemplate stream_template_;
 };
 
+// Tool results travel as blocks of a user message. Results of consecutive
+// kTool messages are merged into one, as the API expects all results of a
+// turn together.
+absl::StatusOr<json::Json> EncodeMessages(absl::Span<const Message> messages) {
+  json::Json encoded = json::Json::array();
+  for (const Message& message : messages) {
+    switch (message.role) {
+      case Message::Role::kUser:
+        encoded.push_back({{"role", "user"}, {"content", message.content}});
+        break;
+      case Message::Role::kTool: {
+        json::Json result = {{"type", "tool_result"},
+                             {"tool_use_id", message.tool_call_id},
+                             {"content", message.content}};
+        if (encoded.empty() || encoded.back()["role"] != "user" ||
+            !encoded.back()["content"].is_array()) {
+          encoded.push_back(
+              {{"role", "user"}, {"content", json::Json::array()}});
+        }
+        encoded.back()["content"].push_back(std::move(result));
+        break;
+      }
+      case Message::Role::kAssistant: {
+        json::Json content = json::Json::array();
+        if (!message.content.empty()) {
+          content.push_back({{"type", "text"}, {"text", message.content}});
+        }
+        for (const ToolCall& call : message.tool_calls) {
+          auto input = ParseToolJson(call.arguments);
+          if (!input.ok()) {
+            return std::move(input).status();
+          }
+          content.push_back({{"type", "tool_use"},
+                             {"id", call.id},
+                             {"name", call.name},
+                             {"input", *std::move(input)}});
+        }
+        encoded.push_back({{"role", "assistant"}, {"content", content}});
+        break;
+      }
+    }
+  }
+  return encoded;
+}
+
+// Decodes a Messages API response.
+absl::StatusOr<Reply> DecodeReply(const json::JsonDecode& decoded) {
+  if (auto error = decoded["error"]; error.ok()) {
+    return absl::InternalError(
+        absl::StrCat("Anthropic API error: ", error->dump(2)));
+  }
+
+  json::JsonDecode content = decoded["content"];
+  if (!content.ok() || !content->is_array()) {
+    return absl::InternalError(absl::StrCat(
+        "Anthropic API error: ", content[0]["text"].String().error()));
+  }
+  Reply reply;
+  reply.truncated = decoded["stop_reason"].String() == "max_tokens";
+  for (size_t i = 0; i < content->size(); ++i) {
+    json::JsonDecode block = content[i];
+    if (block["type"].String() == "tool_use") {
+      auto id = block["id"].String();
+      auto name = block["name"].String();
+      for (const auto* field : {&id, &name}) {
+        if (!field->ok()) {
+          return absl::InternalError(
+              absl::StrCat("Anthropic API error: ", field->error()));
+        }
+      }
+      auto input = block["input"];
+      reply.tool_calls.push_back(
+          {.id = id.value(),
+           .name = name.value(),
+           .arguments = input.ok() ? std::string(input->dump()) : "{}"});
+    } else if (auto text = block["text"].String(); text.ok()) {
+      reply.text += text.value();
+    }
+  }
+  return reply;
+}
+
 absl::StatusOr<std::string> AnthropicModel::Prompt(
     const Fetch& fetch, std::string_view prompt,
-    absl::Span<const std::string_view> input_contents) {
+    absl::Span<const std::string_view> input_contents,
+    const RequestOptions& options) {
+  return PromptFromStream(*this, fetch, prompt, input_contents, options);
+}
+
+absl::Status AnthropicModel::StreamPrompt(
+    const Fetch& fetch, std::string_view prompt,
+    absl::Span<const std::string_view> input_contents,
+    const RequestOptions& options,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
   std::string combined_input = absl::StrJoin(input_contents, "\n\n");
+  Message message = {.content = absl::StrCat(prompt, "\n\n", combined_input)};
+  return CompleteWithContinuations(*this, fetch, std::move(message), options,
+                                   max_continuations_, on_segment);
+}
+
+absl::Status AnthropicModel::StreamPromptUntil(
+    const Fetch& fetch, std::string_view prompt,
+    absl::Span<const std::string_view> input_contents,
+    absl::Span<const StopCondition> stop, const RequestOptions& options,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  if (stop.empty()) {
+    return StreamPrompt(fetch, prompt, input_contents, options, on_segment);
+  }
+  std::string combined_input = absl::StrJoin(input_contents, "\n\n");
+  Message message = {.content = absl::StrCat(prompt, "\n\n", combined_input)};
+  return StreamConversationUntil(fetch, {}, std::move(message), stop, options,
+                                 on_segment);
+}
+
+absl::Status AnthropicModel::StreamConversationUntil(
+    const Fetch& fetch, absl::Span<const Message> history, Message prompt,
+    absl::Span<const StopCondition> stop, const RequestOptions& options,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  // The API rejects stop sequences of only whitespace. The matcher still
+  // applies them.
+  std::vector<std::string> stop_sequences =
+      LiteralStops(stop, std::numeric_limits<size_t>::max());
+  std::erase_if(stop_sequences, [](const std::string& sequence) {
+    return absl::StripAsciiWhitespace(sequence).empty();
+  });
+  return StreamWithContinuations(
+      history, std::move(prompt), stop, max_continuations_,
+      [&](absl::Span<const Message> messages,
+          absl::FunctionRef<bool(std::string_view)> on_text) {
+        return StreamComplete(fetch, messages, stop_sequences, options,
+                              on_text);
+      },
+      on_segment);
+}
 
-  nlohmann::json request = {
+absl::StatusOr<json::Json> AnthropicModel::BuildRequest(
+    absl::Span<const Message> messages,
+    absl::Span<const ToolSpec> tools) const {
+  TraceSpan span("AnthropicModel::BuildRequest");
+  auto encoded_messages = EncodeMessages(messages);
+  if (!encoded_messages.ok()) {
+    return std::move(encoded_messages).status();
+  }
+  json::Json request = {
       {"model", model_},
       {"max_tokens", max_tokens_},
-      {"messages",
-       nlohmann::json::array(
-           {{{"role", "user"},
-             {"content", absl::StrCat(prompt, "\n\n", combined_input)}}})},
+      {"messages", *std::move(encoded_messages)},
   };
+  for (const ToolSpec& tool : tools) {
+    auto input_schema = ParseToolJson(tool.parameters);
+    if (!input_schema.ok()) {
+      return std::move(input_schema).status();
+    }
+    request["tools"].push_back({{"name", tool.name},
+                                {"description", tool.description},
+                                {"input_schema", *std::move(input_schema)}});
+  }
+  return request;
+}
+
+absl::StatusOr<std::string> AnthropicModel::SerializeRequest(
+    absl::Span<const Message> messages, absl::Span<const ToolSpec> tools,
+    bool stream, absl::Span<const std::string> stop_sequences) const {
+  const bool plain =
+      tools.empty() &&
+      std::ranges::none_of(messages, [](const Message& message) {
+        return message.role == Message::Role::kTool ||
+               !message.tool_calls.empty();
+      });
+  if (!plain) {
+    auto request = BuildRequest(messages, tools);
+    if (!request.ok()) {
+      return std::move(request).status();
+    }
+    if (stream) {
+      (*request)["stream"] = true;
+    }
+    for (const std::string& stop : stop_sequences) {
+      (*request)["stop_sequences"].push_back(stop);
+    }
+    return std::string(request->dump());
+  }
+  TraceSpan span("AnthropicModel::RenderRequest");
+  size_t size = 0;
+  for (const Message& message : messages) {
+    size += message.content.size() + 64;
+  }
+  return (stream ? stream_template_ : request_template_)
+      .Render(
+          [&](std::string& out) {
+            out.push_back('[');
+            for (const Message& message : messages) {
+              if (out.back() != '[') {
+                out.push_back(',');
+              }
+              if (message.role == Message::Role::kUser) {
+                out += R"({"role":"user","content":)";
+                json::AppendJsonString(out, message.content);
+                out.push_back('}');
+              } else if (message.content.empty()) {
+                out += R"({"role":"assistant","content":[]})";
+              } else {
+                out +=
+                    R"({"role":"assistant","content":[{"type":"text","text":)";
+                json::AppendJsonString(out, message.content);
+                out += "}]}";
+              }
+            }
+            out.push_back(']');
+            if (!stop_sequences.empty()) {
+              out += R"(,"stop_sequences":[)";
+              for (const std::string& stop : stop_sequences) {
+                if (out.back() != '[') {
+                  out.push_back(',');
+                }
+                json::AppendJsonString(out, stop);
+              }
+              out.push_back(']');
+            }
+          },
+          size);
+}
 
-  auto response =
-      fetch.Post("https://api.anthropic.com/v1/messages",
-                 {
-                     {.key = "Content-Type", .value = "application/json"},
-                     {.key = "x-api-key", .value = api_key_},
-                     {.key = "anthropic-version", .value = "2023-06-01"},
-                 },
-                 request);
+absl::StatusOr<Reply> AnthropicModel::Complete(
+    const Fetch& fetch, absl::Span<const Message> messages,
+    absl::Span<const ToolSpec> tools, const RequestOptions& options) {
+  TraceSpan span("AnthropicModel::Complete");
+  // All JSON of this turn is released at once when the arena goes away.
+  json::Arena arena;
+  json::ArenaScope arena_scope(arena);
+  auto request = SerializeRequest(messages, tools);
+  if (!request.ok()) {
+    return std::move(request).status();
+  }
 
+  auto response = fetch.PostJson(messages_url_, headers_, *request, options);
+
+  if (!response.ok()) {
+    return std::move(response).status();
+  }
+
+  auto json_response = response->Json();
+  if (!json_response.ok()) {
+    return std::move(json_response).status();
+  }
+
+  TraceSpan decode_span("AnthropicModel::DecodeResponse");
+  return DecodeReply(json::JsonDecode(*std::move(json_response)));
+}
+
+absl::StatusOr<Reply> AnthropicModel::StreamComplete(
+    const Fetch& fetch, absl::Span<const Message> messages,
+    absl::Span<const std::string> stop_sequences,
+    const RequestOptions& options,
+    absl::FunctionRef<bool(std::string_view)> on_text) {
+  TraceSpan span("AnthropicModel::StreamComplete");
+  json::Arena arena;
+  json::ArenaScope arena_scope(arena);
+  auto request = SerializeRequest(messages, {}, /*stream=*/true,
+                                  stop_sequences);
+  if (!request.ok()) {
+    return std::move(request).status();
+  }
+  Reply reply;
+  SseReader events;
+  // The body as long as it is not an event stream, e.g. an error.
+  std::string body;
+  absl::Status error;
+  auto on_event = [&](std::string_view event, std::string_view data) {
+    if (event == "error") {
+      error = absl::InternalError(absl::StrCat("Anthropic API error: ", data));
+      return false;
+    }
+    if (event != "content_block_delta" && event != "message_delta") {
+      return true;
+    }
+    json::Json chunk = json::Json::parse(data, nullptr, false);
+    auto delta = chunk.is_object() ? chunk.find("delta") : chunk.end();
+    if (delta == chunk.end() || !delta->is_object()) {
+      error = absl::InternalError(absl::StrCat("Invalid event: ", data));
+      return false;
+    }
+    if (event == "message_delta") {
+      if (auto reason = delta->find("stop_reason");
+          reason != delta->end() && *reason == "max_tokens") {
+        reply.truncated = true;
+      }
+      return true;
+    }
+    auto text = delta->find("text");
+    if (text == delta->end() || !text->is_string()) {
+      return true;
+    }
+    const auto& value = text->get_ref<const json::String&>();
+    reply.text.append(value.data(), value.size());
+    return on_text(std::string_view(value.data(), value.size()));
+  };
+  absl::Status status = fetch.PostJsonStream(
+      messages_url_, headers_, *request, options, [&](std::string_view data) {
+        if (events.events() == 0) {
+          body.append(data);
+        }
+        return events.Feed(data, on_event);
+      });
+  if (!status.ok()) {
+    return status;
+  }
+  if (!error.ok()) {
+    return error;
+  }
+  if (events.events() == 0) {
+    // Errors come back as a plain JSON response.
+    auto response = json::Json::parse(body, nullptr, false);
+    if (response.is_discarded()) {
+      return absl::InternalError(
+          absl::StrCat("Failed to parse JSON: ", body));
+    }
+    return DecodeReply(json::JsonDecode(std::move(response)));
+  }
+  return reply;
+}
+
+absl::StatusOr<std::string> AnthropicModel::SubmitBatch(
+    const Fetch& fetch, absl::Span<const BatchRequest> requests,
+    const RequestOptions& options) {
+  TraceSpan span("AnthropicModel::SubmitBatch");
+  json::Arena arena;
+  json::ArenaScope arena_scope(arena);
+  json::Json batch = {{"requests", json::Json::array()}};
+  for (const BatchRequest& request : requests) {
+    auto params = BuildRequest(request.messages, {});
+    if (!params.ok()) {
+      return std::move(params).status();
+    }
+    batch["requests"].push_back(
+        {{"custom_id", request.id}, {"params", *std::move(params)}});
+  }
+  auto response = fetch.Post(absl::StrCat(api_url_, "/messages/batches"),
+                             headers_, batch, options);
   if (!response.ok()) {
     return std::move(response).status();
   }
+  auto json_response = response->Json();
+  if (!json_response.ok()) {
+    return std::move(json_response).status();
+  }
+  json::JsonDecode decoded(*std::move(json_response));
+  if (auto error = decoded["error"]; error.ok()) {
+    return absl::InternalError(
+        absl::StrCat("Anthropic API error: ", error->dump(2)));
+  }
+  auto id = decoded["id"].String();
+  if (!id.ok()) {
+    return absl::InternalError(
+        absl::StrCat("Anthropic API error: ", id.error()));
+  }
+  return id.value();
+}
 
+absl::StatusOr<json::JsonDecode> AnthropicModel::GetBatch(
+    const Fetch& fetch, std::string_view batch_id,
+    const RequestOptions& options) const {
+  auto response = fetch.Get(
+      absl::StrCat(api_url_, "/messages/batches/", batch_id), headers_,
+      options);
+  if (!response.ok()) {
+    return std::move(response).status();
+  }
   auto json_response = response->Json();
   if (!json_response.ok()) {
     return std::move(json_response).status();
   }
+  json::JsonDecode decoded(*std::move(json_response));
+  if (auto error = decoded["error"]; error.ok()) {
+    return absl::InternalError(
+        absl::StrCat("Anthropic API error: ", error->dump(2)));
+  }
+  return decoded;
+}
 
-  if (json_response->contains("error")) {
-    return absl::InternalError(absl::StrCat("Anthropic API error: ",
-                                            (*json_response)["error"].dump(2)));
+absl::StatusOr<bool> AnthropicModel::PollBatch(const Fetch& fetch,
+                                               std::string_view batch_id,
+                                               const RequestOptions& options) {
+  TraceSpan span("AnthropicModel::PollBatch");
+  auto batch = GetBatch(fetch, batch_id, options);
+  if (!batch.ok()) {
+    return std::move(batch).status();
   }
+  // Cancelled and expired batches end too, their requests that did not run
+  // have results saying so.
+  return (*batch)["processing_status"].String() == "ended";
+}
 
-  auto message =
-      json::JsonDecode(*json_response)["content"][0]["text"].String();
-  if (!message.ok()) {
+absl::Status AnthropicModel::BatchResults(
+    const Fetch& fetch, std::string_view batch_id,
+    const RequestOptions& options,
+    absl::FunctionRef<void(BatchResult)> on_result) {
+  TraceSpan span("AnthropicModel::BatchResults");
+  auto batch = GetBatch(fetch, batch_id, options);
+  if (!batch.ok()) {
+    return batch.status();
+  }
+  auto results_url = (*batch)["results_url"].String();
+  if (!results_url.ok()) {
     return absl::InternalError(
-        absl::StrCat("Anthropic API error: ", message.error()));
+        absl::StrCat("Anthropic API error: ", results_url.error()));
+  }
+  auto results = fetch.Get(results_url.value(), headers_, options);
+  if (!results.ok()) {
+    return results.status();
+  }
+  for (std::string_view line :
+       absl::StrSplit(results->body(), '\n', absl::SkipWhitespace())) {
+    auto parsed = json::Json::parse(line, nullptr, false);
+    if (parsed.is_discarded()) {
+      return absl::InternalError(
+          absl::StrCat("Invalid line in the batch results: ", line));
+    }
+    json::JsonDecode decoded(std::move(parsed));
+    auto id = decoded["custom_id"].String();
+    if (!id.ok()) {
+      return absl::InternalError(
+          absl::StrCat("Anthropic API error: ", id.error()));
+    }
+    json::JsonDecode result = decoded["result"];
+    auto type = result["type"].String();
+    absl::StatusOr<Reply> reply;
+    if (type == "succeeded") {
+      reply = DecodeReply(result["message"]);
+    } else if (type == "canceled") {
+      reply = absl::CancelledError("Batch cancelled");
+    } else if (type == "expired") {
+      reply = absl::DeadlineExceededError("Batch expired before it ran");
+    } else {
+      json::JsonDecode error = result["error"];
+      reply = absl::InternalError(absl::StrCat(
+          "Anthropic API error: ",
+          error.ok() ? std::string(error->dump()) : "Unknown result"));
+    }
+    on_result({.id = id.value(), .reply = std::move(reply)});
   }
-  return message.value();
+  return absl::OkStatus();
 }
 
 class AnthropicModelProvider : public ModelProvider {
@@ -106,8 +603,9 @@ class AnthropicModelProvider : public ModelProvider {
     if (!api_key.has_value()) {
       return absl::InvalidArgumentError("Anthropic API key is required");
     }
-    auto client = std::make_unique<AnthropicModel>(model, *api_key,
-                                                   parameters_.max_tokens());
+    auto client = std::make_unique<AnthropicModel>(
+        model, absl::GetFlag(FLAGS_anthropic_api_url), *api_key,
+        parameters_.max_tokens(), absl::GetFlag(FLAGS_max_continuations));
     return ModelHandle(std::move(client));
   }
 
@@ -117,12 +615,13 @@ class AnthropicModelProvider : public ModelProvider {
       LOG(INFO) << "Anthropic API key is required to list models.";
       return {};
     }
-    auto response =
-        fetch_->Get("https://api.anthropic.com/v1/models",
-                    {
-                        {.key = "x-api-key", .value = *api_key},
-                        {.key = "anthropic-version", .value = "2023-06-01"},
-                    });
+    auto response = fetch_->Get(
+        absl::StrCat(absl::GetFlag(FLAGS_anthropic_api_url), "/models"),
+        {
+            {.key = "x-api-key", .value = *api_key},
+            {.key = "anthropic-version", .value = "2023-06-01"},
+        },
+        {});
 
     if (!response.ok()) {
       LOG(ERROR) << "Failed to fetch models: " << response.status();
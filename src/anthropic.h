@@ -7,6 +7,7 @@
 #include "src/model.h"
 
 ABSL_DECLARE_FLAG(std::optional<std::string>, anthropic_api_key);
+ABSL_DECLARE_FLAG(std::string, anthropic_api_url);
 
 namespace uchen::chat {
 
@@ -0,0 +1,182 @@
+#include "src/batch.h"
+
+#include <algorithm>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/functional/function_ref.h"
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/trace.h"
+
+namespace uchen::chat {
+namespace {
+
+// Uploads and result files of large batches take a while.
+constexpr absl::Duration kRequestTimeout = absl::Minutes(10);
+constexpr absl::Duration kCancellationCheckInterval = absl::Milliseconds(100);
+
+struct Submitted {
+  std::string id;
+  absl::Span<const BatchRequest> requests;
+  // Ids of the requests without a result yet.
+  absl::flat_hash_set<std::string_view> pending;
+};
+
+// Sleeps for `duration`, or until `deadline`, waking up regularly to check
+// for cancellation.
+absl::Status Sleep(absl::Duration duration, absl::Time deadline,
+                   const BatchOptions& options) {
+  const absl::Time end = absl::Now() + duration;
+  while (true) {
+    if (options.cancellation != nullptr && options.cancellation->cancelled()) {
+      return absl::CancelledError("Cancelled");
+    }
+    const absl::Time now = absl::Now();
+    if (now >= deadline) {
+      return absl::DeadlineExceededError(
+          absl::StrCat("Batch not done after ",
+                       absl::FormatDuration(options.timeout)));
+    }
+    if (now >= end) {
+      return absl::OkStatus();
+    }
+    absl::SleepFor(std::min({end - now, deadline - now,
+                             kCancellationCheckInterval}));
+  }
+}
+
+}  // namespace
+
+absl::StatusOr<std::vector<BatchRequest>> ReadBatchRequests(
+    std::istream& input) {
+  std::vector<BatchRequest> requests;
+  std::string line;
+  for (size_t line_number = 1; std::getline(input, line); ++line_number) {
+    if (absl::StripAsciiWhitespace(line).empty()) {
+      continue;
+    }
+    nlohmann::json record = nlohmann::json::parse(line, nullptr, false);
+    if (!record.is_object() || !record.contains("prompt") ||
+        !record["prompt"].is_string()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Line ", line_number, ": expected {\"id\": ..., \"prompt\": ...}"));
+    }
+    std::string id = absl::StrCat(line_number);
+    if (auto it = record.find("id"); it != record.end()) {
+      if (!it->is_string()) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Line ", line_number, ": the id is not a string"));
+      }
+      id = it->get<std::string>();
+    }
+    requests.push_back(
+        {.id = std::move(id),
+         .messages = {{.content = record["prompt"].get<std::string>()}}});
+  }
+  return requests;
+}
+
+std::string FormatBatchResult(const BatchResult& result) {
+  nlohmann::json record = {{"id", result.id}};
+  if (result.reply.ok()) {
+    record["text"] = result.reply->text;
+    if (result.reply->truncated) {
+      record["truncated"] = true;
+    }
+  } else {
+    record["error"] = result.reply.status().ToString();
+  }
+  return record.dump();
+}
+
+absl::Status RunBatch(BatchApi& api, const Fetch& fetch,
+                      absl::Span<const BatchRequest> requests,
+                      const BatchOptions& options,
+                      absl::FunctionRef<void(BatchResult)> on_result) {
+  TraceSpan span("RunBatch");
+  absl::flat_hash_set<std::string_view> ids;
+  for (const BatchRequest& request : requests) {
+    if (!ids.insert(request.id).second) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Duplicate request id ", request.id));
+    }
+  }
+  const absl::Time deadline = absl::Now() + options.timeout;
+  const RequestOptions request_options = {.cancellation = options.cancellation,
+                                          .timeout = kRequestTimeout};
+  std::vector<Submitted> batches;
+  const size_t batch_size = std::max<size_t>(api.max_batch_requests(), 1);
+  for (size_t start = 0; start < requests.size(); start += batch_size) {
+    absl::Span<const BatchRequest> chunk =
+        requests.subspan(start, batch_size);
+    auto id = api.SubmitBatch(fetch, chunk, request_options);
+    if (!id.ok()) {
+      return id.status();
+    }
+    LOG(INFO) << "Submitted batch " << *id << " of " << chunk.size()
+              << " requests";
+    Submitted& batch = batches.emplace_back(
+        Submitted{.id = *std::move(id), .requests = chunk});
+    for (const BatchRequest& request : chunk) {
+      batch.pending.insert(request.id);
+    }
+  }
+
+  absl::Duration interval = options.poll_interval;
+  while (!batches.empty()) {
+    if (absl::Status status = Sleep(interval, deadline, options);
+        !status.ok()) {
+      return status;
+    }
+    interval = std::min(interval * options.poll_backoff,
+                        options.max_poll_interval);
+    for (auto batch = batches.begin(); batch != batches.end();) {
+      auto done = api.PollBatch(fetch, batch->id, request_options);
+      if (!done.ok()) {
+        return done.status();
+      }
+      if (!*done) {
+        ++batch;
+        continue;
+      }
+      absl::Status status = api.BatchResults(
+          fetch, batch->id, request_options, [&](BatchResult result) {
+            if (batch->pending.erase(result.id) == 0) {
+              LOG(WARNING) << "Batch " << batch->id
+                           << " has an unexpected result for " << result.id;
+              return;
+            }
+            on_result(std::move(result));
+          });
+      if (!status.ok()) {
+        return status;
+      }
+      for (const BatchRequest& request : batch->requests) {
+        if (batch->pending.contains(request.id)) {
+          on_result({.id = request.id,
+                     .reply = absl::InternalError(absl::StrCat(
+                         "No result in batch ", batch->id))});
+        }
+      }
+      batch = batches.erase(batch);
+    }
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,52 @@
+#ifndef SRC_BATCH_H_
+#define SRC_BATCH_H_
+
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+
+namespace uchen::chat {
+
+struct BatchOptions {
+  // The first status check happens this long after the submission, every
+  // later one waits `poll_backoff` times longer, up to `max_poll_interval`.
+  absl::Duration poll_interval = absl::Seconds(10);
+  double poll_backoff = 1.5;
+  absl::Duration max_poll_interval = absl::Minutes(5);
+  // Stops waiting after this long. The batches keep running at the provider.
+  absl::Duration timeout = absl::Hours(25);
+  // Checked between status checks and while requests are in flight.
+  const Cancellation* cancellation = nullptr;
+};
+
+// Reads one prompt per JSON line, {"id": "...", "prompt": "..."}. Prompts
+// without an id are given their line number.
+absl::StatusOr<std::vector<BatchRequest>> ReadBatchRequests(
+    std::istream& input);
+
+// {"id": "...", "text": "..."} for an answer, {"id": "...", "error": "..."}
+// for a failed request.
+std::string FormatBatchResult(const BatchResult& result);
+
+// Submits `requests` to `api`, split into as few batches as it allows, and
+// checks on the batches with exponential backoff. The results of a batch
+// are passed to `on_result` as soon as it is done, in the order the provider
+// returns them; requests it has no result for fail with kInternal. Request
+// ids must be unique.
+absl::Status RunBatch(BatchApi& api, const Fetch& fetch,
+                      absl::Span<const BatchRequest> requests,
+                      const BatchOptions& options,
+                      absl::FunctionRef<void(BatchResult)> on_result);
+
+}  // namespace uchen::chat
+
+#endif  // SRC_BATCH_H_
@@ -0,0 +1,237 @@
+#include "src/channel.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/mutex.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/trace.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr std::string_view kUser = "user";
+
+bool Mentions(std::string_view text, std::string_view name) {
+  std::string mention = absl::StrCat("@", name);
+  for (size_t pos = text.find(mention); pos != std::string_view::npos;
+       pos = text.find(mention, pos + 1)) {
+    size_t end = pos + mention.size();
+    if (end == text.size() ||
+        !(absl::ascii_isalnum(text[end]) || text[end] == '_' ||
+          text[end] == '-')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+ChannelMessage::ChannelMessage(std::string_view author, std::string_view text)
+    : line_(absl::StrCat(author, ": ", text)), author_size_(author.size()) {}
+
+ChannelHistory::~ChannelHistory() {
+  Block* block = head_.next.load(std::memory_order_relaxed);
+  while (block != nullptr) {
+    Block* next = block->next.load(std::memory_order_relaxed);
+    delete block;
+    block = next;
+  }
+}
+
+const ChannelMessage& ChannelHistory::Append(std::string_view author,
+                                             std::string_view text) {
+  absl::MutexLock lock(&mu_);
+  size_t size = size_.load(std::memory_order_relaxed);
+  if (size > 0 && size % kBlockSize == 0) {
+    auto* block = new Block();
+    tail_->next.store(block, std::memory_order_release);
+    tail_ = block;
+  }
+  ChannelMessage& message = tail_->messages[size % kBlockSize];
+  message = ChannelMessage(author, text);
+  size_.store(size + 1, std::memory_order_release);
+  return message;
+}
+
+ChannelHistory::View ChannelHistory::Snapshot() const {
+  return View(&head_, size_.load(std::memory_order_acquire));
+}
+
+absl::StatusOr<std::vector<AgentConfig>> LoadAgents(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) {
+    return absl::NotFoundError(absl::StrCat("Cannot open ", path));
+  }
+  auto config =
+      nlohmann::json::parse(file, nullptr, /*allow_exceptions=*/false);
+  if (config.is_discarded() || !config.is_array()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat(path, ": expected a JSON array of agents"));
+  }
+  std::vector<AgentConfig> agents;
+  for (const auto& entry : config) {
+    if (!entry.is_object() || !entry.contains("name") ||
+        !entry["name"].is_string() || !entry.contains("model") ||
+        !entry["model"].is_string()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          path, ": an agent needs a name and a model: ", entry.dump()));
+    }
+    if (entry.contains("prompt") && !entry["prompt"].is_string()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          path, ": the prompt of an agent must be a string: ", entry.dump()));
+    }
+    if (entry.contains("inputs") &&
+        (!entry["inputs"].is_array() ||
+         !std::ranges::all_of(entry["inputs"], &nlohmann::json::is_string))) {
+      return absl::InvalidArgumentError(
+          absl::StrCat(path, ": the inputs of an agent must be agent names: ",
+                       entry.dump()));
+    }
+    agents.push_back({
+        .name = entry["name"].get<std::string>(),
+        .model = entry["model"].get<std::string>(),
+        .prompt = entry.value("prompt", ""),
+        .inputs = entry.value("inputs", std::vector<std::string>()),
+    });
+  }
+  return agents;
+}
+
+struct Channel::Round {
+  Round(size_t agents, size_t addressed,
+        absl::FunctionRef<void(const ChannelMessage&)> on_reply,
+        const RequestOptions& options)
+      : on_reply(on_reply),
+        options(options),
+        pending_inputs(agents, 0),
+        done(addressed) {}
+
+  absl::FunctionRef<void(const ChannelMessage&)> on_reply;
+  const RequestOptions& options;
+  absl::Mutex mu;
+  // Per agent, the number of its addressed inputs that did not reply yet.
+  std::vector<size_t> pending_inputs ABSL_GUARDED_BY(mu);
+  absl::Status status ABSL_GUARDED_BY(mu);
+  absl::BlockingCounter done;
+};
+
+absl::Status Channel::AddAgent(AgentConfig config, ModelHandle model) {
+  auto by_name = [](std::string_view name) {
+    return [name](const Agent& agent) { return agent.config.name == name; };
+  };
+  if (config.name.empty() || config.name == kUser ||
+      std::ranges::any_of(agents_, by_name(config.name))) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid or duplicate agent name: ", config.name));
+  }
+  Agent agent = {.model = std::move(model)};
+  for (const std::string& input : config.inputs) {
+    auto it = std::ranges::find_if(agents_, by_name(input));
+    if (it == agents_.end()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          config.name, " takes input from unknown agent ", input));
+    }
+    size_t input_index = it - agents_.begin();
+    if (std::ranges::find(agent.inputs, input_index) == agent.inputs.end()) {
+      agent.inputs.push_back(input_index);
+    }
+  }
+  agent.config = std::move(config);
+  agents_.push_back(std::move(agent));
+  return absl::OkStatus();
+}
+
+absl::Status Channel::Post(
+    std::string_view text,
+    absl::FunctionRef<void(const ChannelMessage&)> on_reply,
+    const RequestOptions& options) {
+  if (agents_.empty()) {
+    return absl::FailedPreconditionError("The channel has no agents");
+  }
+  std::vector<bool> addressed(agents_.size());
+  for (size_t i = 0; i < agents_.size(); ++i) {
+    addressed[i] = Mentions(text, agents_[i].config.name);
+  }
+  if (std::ranges::none_of(addressed, std::identity())) {
+    addressed.assign(agents_.size(), true);
+  }
+  history_.Append(kUser, text);
+
+  Round round(agents_.size(), std::ranges::count(addressed, true), on_reply,
+              options);
+  std::vector<size_t> ready;
+  {
+    absl::MutexLock lock(&round.mu);
+    for (size_t i = 0; i < agents_.size(); ++i) {
+      if (!addressed[i]) {
+        continue;
+      }
+      round.pending_inputs[i] = std::ranges::count_if(
+          agents_[i].inputs, [&](size_t input) { return addressed[input]; });
+      if (round.pending_inputs[i] == 0) {
+        ready.push_back(i);
+      }
+    }
+  }
+  for (size_t agent : ready) {
+    pool_.Schedule([this, &round, agent]() { RunTurn(round, agent); });
+  }
+  round.done.Wait();
+  absl::MutexLock lock(&round.mu);
+  return round.status;
+}
+
+void Channel::RunTurn(Round& round, size_t index) {
+  TraceSpan span("Channel::RunTurn");
+  const Agent& agent = agents_[index];
+  ChannelHistory::View view = history_.Snapshot();
+  std::vector<std::string_view> lines;
+  lines.reserve(view.size());
+  for (const ChannelMessage& message : view) {
+    lines.push_back(message.line());
+  }
+  auto response =
+      agent.model->Prompt(fetch_, agent.config.prompt, lines, round.options);
+  std::vector<size_t> ready;
+  {
+    absl::MutexLock lock(&round.mu);
+    if (response.ok()) {
+      round.on_reply(history_.Append(agent.config.name, *response));
+    } else if (round.status.ok()) {
+      round.status = absl::Status(
+          response.status().code(),
+          absl::StrCat(agent.config.name, ": ", response.status().message()));
+    }
+    // Dependents run even if this turn failed, with whatever inputs did reply.
+    for (size_t i = 0; i < agents_.size(); ++i) {
+      if (round.pending_inputs[i] > 0 &&
+          std::ranges::find(agents_[i].inputs, index) !=
+              agents_[i].inputs.end() &&
+          --round.pending_inputs[i] == 0) {
+        ready.push_back(i);
+      }
+    }
+  }
+  for (size_t agent : ready) {
+    pool_.Schedule([this, &round, agent]() { RunTurn(round, agent); });
+  }
+  round.done.DecrementCount();
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,182 @@
+#ifndef SRC_CHANNEL_H_
+#define SRC_CHANNEL_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/thread_pool.h"
+
+namespace uchen::chat {
+
+class ChannelMessage {
+ public:
+  ChannelMessage() = default;
+  ChannelMessage(std::string_view author, std::string_view text);
+
+  std::string_view author() const {
+    return std::string_view(line_).substr(0, author_size_);
+  }
+  std::string_view text() const {
+    return std::string_view(line_).substr(author_size_ + 2);
+  }
+  // "<author>: <text>", the form in which agents see the message.
+  std::string_view line() const { return line_; }
+
+ private:
+  std::string line_;
+  size_t author_size_ = 0;
+};
+
+// Append-only message log of a channel. Messages never move once appended,
+// and readers take a View without locking or copying: appending publishes the
+// new size with a release store, and a view only ever looks at the messages
+// that were published when it was taken.
+class ChannelHistory {
+ public:
+  class View;
+
+  ChannelHistory() = default;
+  ~ChannelHistory();
+
+  ChannelHistory(const ChannelHistory&) = delete;
+  ChannelHistory& operator=(const ChannelHistory&) = delete;
+
+  const ChannelMessage& Append(std::string_view author, std::string_view text);
+
+  // The messages appended so far. Stays valid while the history is alive.
+  View Snapshot() const;
+
+ private:
+  static constexpr size_t kBlockSize = 64;
+
+  struct Block {
+    std::array<ChannelMessage, kBlockSize> messages;
+    std::atomic<Block*> next = nullptr;
+  };
+
+  Block head_;
+  absl::Mutex mu_;
+  Block* tail_ ABSL_GUARDED_BY(mu_) = &head_;
+  std::atomic<size_t> size_ = 0;
+};
+
+class ChannelHistory::View {
+ public:
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = ChannelMessage;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const ChannelMessage*;
+    using reference = const ChannelMessage&;
+
+    Iterator() = default;
+
+    reference operator*() const {
+      return block_->messages[index_ % kBlockSize];
+    }
+    pointer operator->() const { return &**this; }
+    Iterator& operator++() {
+      if (++index_ % kBlockSize == 0) {
+        block_ = block_->next.load(std::memory_order_acquire);
+      }
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator previous = *this;
+      ++*this;
+      return previous;
+    }
+    bool operator==(const Iterator& other) const {
+      return index_ == other.index_;
+    }
+
+   private:
+    friend class View;
+    Iterator(const Block* block, size_t index)
+        : block_(block), index_(index) {}
+
+    const Block* block_ = nullptr;
+    size_t index_ = 0;
+  };
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  Iterator begin() const { return Iterator(head_, 0); }
+  Iterator end() const { return Iterator(nullptr, size_); }
+
+ private:
+  friend class ChannelHistory;
+  View(const Block* head, size_t size) : head_(head), size_(size) {}
+
+  const Block* head_;
+  size_t size_;
+};
+
+struct AgentConfig {
+  std::string name;
+  std::string model;
+  // Instructions given to the model in front of the channel history.
+  std::string prompt;
+  // Agents whose replies this agent waits for when they are addressed by the
+  // same message.
+  std::vector<std::string> inputs;
+};
+
+// Reads agents from a JSON file holding an array of
+// {"name", "model", "prompt", "inputs"} objects.
+absl::StatusOr<std::vector<AgentConfig>> LoadAgents(const std::string& path);
+
+// Several agents sharing one conversation. A user message addresses agents
+// with @name, or all of them when it names none. Addressed agents run as
+// tasks on `pool`: those without pending inputs start at once and in
+// parallel, and every other agent is scheduled the moment its last input
+// has replied. Each agent sees the history as it was when its turn started.
+class Channel {
+ public:
+  Channel(const Fetch& fetch, ThreadPool& pool) : fetch_(fetch), pool_(pool) {}
+
+  // Inputs must name agents that were added before, which rules out cycles.
+  absl::Status AddAgent(AgentConfig config, ModelHandle model);
+
+  // Appends `text` from the user and runs the addressed agents. `on_reply`
+  // is called with each reply as it is appended, one call at a time. Returns
+  // the first error of any agent once all turns are over.
+  absl::Status Post(std::string_view text,
+                    absl::FunctionRef<void(const ChannelMessage&)> on_reply,
+                    const RequestOptions& options);
+
+  const ChannelHistory& history() const { return history_; }
+
+ private:
+  struct Agent {
+    AgentConfig config;
+    ModelHandle model;
+    std::vector<size_t> inputs;
+  };
+  struct Round;
+
+  void RunTurn(Round& round, size_t agent);
+
+  const Fetch& fetch_;
+  ThreadPool& pool_;
+  std::vector<Agent> agents_;
+  ChannelHistory history_;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_CHANNEL_H_
@@ -0,0 +1,356 @@
+#include "src/context_window.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/functional/function_ref.h"
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/stop.h"
+#include "src/trace.h"
+
+namespace uchen::chat {
+namespace {
+
+// Role, separators and the like that every message costs on top of its
+// text.
+constexpr size_t kMessageOverhead = 4;
+
+constexpr std::string_view kSummaryHeading =
+    "Summary of the conversation so far:\n";
+
+size_t TextTokens(std::string_view text) { return (text.size() + 3) / 4; }
+
+size_t EstimateTokens(absl::Span<const Message> messages) {
+  size_t tokens = 0;
+  for (const Message& message : messages) {
+    tokens += EstimateTokens(message);
+  }
+  return tokens;
+}
+
+Message SummaryMessage(std::string_view summary) {
+  return {.content = absl::StrCat(kSummaryHeading, summary)};
+}
+
+// The request that has the model fold `turns` into `previous`.
+std::string SummaryRequest(std::string_view previous,
+                           absl::Span<const Message> turns, size_t words) {
+  std::string request = absl::StrCat(
+      "Summarize the conversation below for yourself, to continue it "
+      "later without the full text. Keep facts, decisions, names, numbers, "
+      "identifiers and open questions; drop pleasantries. Use at most ",
+      words, " words and reply with the summary only.\n\n");
+  if (!previous.empty()) {
+    absl::StrAppend(&request, "Summary of the conversation before:\n",
+                    previous, "\n\n");
+  }
+  absl::StrAppend(&request, "Conversation:\n");
+  for (const Message& message : turns) {
+    switch (message.role) {
+      case Message::Role::kUser:
+        absl::StrAppend(&request, "User: ", message.content, "\n\n");
+        break;
+      case Message::Role::kAssistant:
+        if (!message.content.empty()) {
+          absl::StrAppend(&request, "Assistant: ", message.content, "\n\n");
+        }
+        for (const ToolCall& call : message.tool_calls) {
+          absl::StrAppend(&request, "Assistant called ", call.name, "(",
+                          call.arguments, ")\n\n");
+        }
+        break;
+      case Message::Role::kTool:
+        absl::StrAppend(&request, "Tool output: ", message.content, "\n\n");
+        break;
+    }
+  }
+  return request;
+}
+
+class ContextModel : public Model {
+ public:
+  ContextModel(ModelHandle model, std::shared_ptr<const Fetch> fetch,
+               ContextOptions options, bool pin_first_prompt)
+      : model_(std::move(model)),
+        context_(*model_, std::move(fetch), options),
+        pin_next_(pin_first_prompt),
+        max_continuations_(absl::GetFlag(FLAGS_max_continuations)) {}
+
+  std::string_view name() const override { return model_->name(); }
+  std::string_view endpoint() const override { return model_->endpoint(); }
+
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options) override {
+    return PromptFromStream(*this, fetch, prompt, input_contents, options);
+  }
+
+  absl::Status StreamPrompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override {
+    return StreamPromptUntil(fetch, prompt, input_contents, {}, options,
+                             on_segment);
+  }
+
+  // Only the text that was passed on is recorded, so the answer cut at a
+  // stop is what the model sees in the next turn.
+  absl::Status StreamPromptUntil(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override {
+    TraceSpan span("ContextModel::StreamPrompt");
+    std::vector<Message> turn = {{.content = std::string(prompt)}};
+    if (!input_contents.empty()) {
+      absl::StrAppend(&turn[0].content, "\n\n",
+                      absl::StrJoin(input_contents, "\n\n"));
+    }
+    std::vector<Message> history = context_.History(turn);
+    std::string answer;
+    auto on_answer = [&](std::string_view segment) {
+      answer += segment;
+      on_segment(segment);
+    };
+    absl::Status status =
+        stop.empty()
+            ? CompleteWithContinuations(*model_, fetch, history, turn[0],
+                                        options, max_continuations_, on_answer)
+            : model_->StreamConversationUntil(fetch, history, turn[0], stop,
+                                              options, on_answer);
+    if (!status.ok()) {
+      return status;
+    }
+    turn.push_back(
+        {.role = Message::Role::kAssistant, .content = std::move(answer)});
+    Record(std::move(turn));
+    return absl::OkStatus();
+  }
+
+  absl::StatusOr<Reply> Complete(const Fetch& fetch,
+                                 absl::Span<const Message> messages,
+                                 absl::Span<const ToolSpec> tools,
+                                 const RequestOptions& options) override {
+    std::vector<Message> request = context_.History(messages);
+    request.insert(request.end(), messages.begin(), messages.end());
+    auto reply = model_->Complete(fetch, request, tools, options);
+    if (reply.ok() && reply->tool_calls.empty()) {
+      std::vector<Message> turn(messages.begin(), messages.end());
+      turn.push_back(
+          {.role = Message::Role::kAssistant, .content = reply->text});
+      Record(std::move(turn));
+    }
+    return reply;
+  }
+
+  BatchApi* batch_api() override { return model_->batch_api(); }
+
+ private:
+  void Record(std::vector<Message> turn) {
+    bool pinned = pin_next_.exchange(false);
+    for (Message& message : turn) {
+      context_.Add(std::move(message), pinned);
+      pinned = false;
+    }
+  }
+
+  // Declared before the context, which summarizes with it until destroyed.
+  ModelHandle model_;
+  ContextWindow context_;
+  std::atomic_bool pin_next_;
+  const int max_continuations_;
+};
+
+}  // namespace
+
+size_t EstimateTokens(const Message& message) {
+  size_t tokens = kMessageOverhead + TextTokens(message.content) +
+                  TextTokens(message.tool_call_id);
+  for (const ToolCall& call : message.tool_calls) {
+    tokens += kMessageOverhead + TextTokens(call.id) +
+              TextTokens(call.name) + TextTokens(call.arguments);
+  }
+  return tokens;
+}
+
+ContextWindow::ContextWindow(Model& model, std::shared_ptr<const Fetch> fetch,
+                             ContextOptions options)
+    : model_(model), fetch_(std::move(fetch)), options_(options) {}
+
+ContextWindow::~ContextWindow() {
+  cancellation_.Cancel();
+  if (summarizer_.joinable()) {
+    summarizer_.join();
+  }
+}
+
+void ContextWindow::Add(Message message, bool pinned) {
+  absl::MutexLock lock(&mu_);
+  const size_t tokens = EstimateTokens(message);
+  window_.push_back({.message = std::move(message),
+                     .tokens = tokens,
+                     .pinned = pinned,
+                     .sequence = next_sequence_++});
+  window_tokens_ += tokens;
+  MaybeSummarize();
+}
+
+std::vector<Message> ContextWindow::History(absl::Span<const Message> turn) {
+  const size_t turn_tokens = EstimateTokens(turn);
+  absl::MutexLock lock(&mu_);
+  while (tokens_locked() + turn_tokens > options_.max_tokens &&
+         !window_.empty()) {
+    if (ApplySummary()) {
+      continue;
+    }
+    // The oldest turn goes, up to the next user message.
+    size_t count = 1;
+    while (count < window_.size() &&
+           window_[count].message.role != Message::Role::kUser) {
+      ++count;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      stats_.dropped += window_[i].pinned ? 0 : 1;
+    }
+    Evict(count);
+  }
+  std::vector<Message> history;
+  history.reserve(pinned_.size() + 1 + window_.size());
+  history.insert(history.end(), pinned_.begin(), pinned_.end());
+  if (!summary_.empty()) {
+    history.push_back(SummaryMessage(summary_));
+  }
+  for (const Entry& entry : window_) {
+    history.push_back(entry.message);
+  }
+  return history;
+}
+
+size_t ContextWindow::tokens() const {
+  absl::ReaderMutexLock lock(&mu_);
+  return tokens_locked();
+}
+
+ContextStats ContextWindow::stats() const {
+  absl::ReaderMutexLock lock(&mu_);
+  return stats_;
+}
+
+size_t ContextWindow::tokens_locked() const {
+  return pinned_tokens_ + summary_tokens_ + window_tokens_;
+}
+
+size_t ContextWindow::TurnsBeyond(size_t budget) const {
+  size_t rest = window_tokens_;
+  for (size_t i = 0; i < window_.size(); ++i) {
+    if (rest <= budget && window_[i].message.role == Message::Role::kUser) {
+      return i;
+    }
+    rest -= window_[i].tokens;
+  }
+  return window_.size();
+}
+
+void ContextWindow::Evict(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    Entry& entry = window_.front();
+    window_tokens_ -= entry.tokens;
+    if (entry.pinned) {
+      pinned_tokens_ += entry.tokens;
+      pinned_.push_back(std::move(entry.message));
+    }
+    window_.pop_front();
+  }
+}
+
+bool ContextWindow::ApplySummary() {
+  if (!pending_.has_value() || !pending_->text.has_value()) {
+    return false;
+  }
+  absl::StatusOr<std::string> text = *std::move(pending_->text);
+  const uint64_t end = pending_->end;
+  pending_.reset();
+  if (!text.ok()) {
+    ++stats_.failed_summaries;
+    LOG(WARNING) << "Failed to summarize the conversation: " << text.status();
+    return false;
+  }
+  // Turns dropped while the summary was written are in it too.
+  size_t count = 0;
+  while (count < window_.size() && window_[count].sequence < end) {
+    ++count;
+  }
+  Evict(count);
+  summary_ = *std::move(text);
+  summary_tokens_ = EstimateTokens(SummaryMessage(summary_));
+  ++stats_.summaries;
+  return true;
+}
+
+void ContextWindow::MaybeSummarize() {
+  if (pending_.has_value() ||
+      tokens_locked() < options_.summarize_at * options_.max_tokens) {
+    return;
+  }
+  const size_t count = TurnsBeyond(options_.keep * options_.max_tokens);
+  std::vector<Message> turns;
+  for (size_t i = 0; i < count; ++i) {
+    if (!window_[i].pinned) {
+      turns.push_back(window_[i].message);
+    }
+  }
+  if (turns.empty()) {
+    return;
+  }
+  pending_ = PendingSummary{.end = window_[count - 1].sequence + 1};
+  // The previous summarizer is done: it handed in its summary, which was
+  // applied.
+  if (summarizer_.joinable()) {
+    summarizer_.join();
+  }
+  summarizer_ = std::thread(&ContextWindow::Summarize, this, summary_,
+                            std::move(turns));
+}
+
+void ContextWindow::Summarize(std::string previous,
+                              std::vector<Message> turns) {
+  TraceSpan span("ContextWindow::Summarize");
+  auto reply = model_.Complete(
+      *fetch_,
+      {{.content = SummaryRequest(previous, turns, options_.summary_words)}},
+      {}, {.cancellation = &cancellation_});
+  absl::MutexLock lock(&mu_);
+  if (reply.ok()) {
+    pending_->text = std::move(reply->text);
+  } else {
+    pending_->text = std::move(reply).status();
+  }
+}
+
+ModelHandle WithContextWindow(ModelHandle model,
+                              std::shared_ptr<const Fetch> fetch,
+                              ContextOptions options, bool pin_first_prompt) {
+  return std::make_unique<ContextModel>(std::move(model), std::move(fetch),
+                                        options, pin_first_prompt);
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,144 @@
+#ifndef SRC_CONTEXT_WINDOW_H_
+#define SRC_CONTEXT_WINDOW_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+
+namespace uchen::chat {
+
+// Rough number of tokens `message` takes in a request: four bytes of text
+// per token, which is about right for English with the tokenizers of the
+// providers, plus the framing of the message.
+size_t EstimateTokens(const Message& message);
+
+struct ContextOptions {
+  // Most tokens of history sent along with a turn, the turn itself
+  // included.
+  size_t max_tokens = 8192;
+  // Once the history takes this fraction of max_tokens, its oldest turns
+  // are summarized in the background, so the summary is ready by the time
+  // the history no longer fits.
+  double summarize_at = 0.75;
+  // Fraction of max_tokens the newest turns may take after the summary
+  // replaces the older ones.
+  double keep = 0.5;
+  // Words the summary is asked to stay within.
+  size_t summary_words = 300;
+};
+
+struct ContextStats {
+  // Summaries that replaced older turns.
+  size_t summaries = 0;
+  // Messages dropped without a summary, because none was ready when the
+  // history no longer fit or summarizing failed.
+  size_t dropped = 0;
+  size_t failed_summaries = 0;
+};
+
+// The history of a conversation, cut to a token budget. Every message keeps
+// its token estimate, and the sums are kept as messages come and go, so
+// fitting a turn into the budget takes no counting. What is sent ahead of a
+// turn is, in order: the pinned messages that fell out of the window, a
+// summary of the turns before the window, and the window of the newest
+// turns, which always starts with a user message.
+//
+// Summaries are written by `model` on a thread of their own, from the
+// previous summary and the turns that are about to leave the window. A
+// turn that does not fit never waits for one: without a summary, the oldest
+// turns are dropped.
+class ContextWindow {
+ public:
+  ContextWindow(Model& model, std::shared_ptr<const Fetch> fetch,
+                ContextOptions options = {});
+  // Cancels a summary in progress.
+  ~ContextWindow();
+
+  ContextWindow(const ContextWindow&) = delete;
+  ContextWindow& operator=(const ContextWindow&) = delete;
+
+  // Appends `message` to the history. Pinned messages are never dropped or
+  // summarized.
+  void Add(Message message, bool pinned = false);
+
+  // The history to send ahead of `turn`. Older turns give way until both
+  // fit into max_tokens, or the window is empty.
+  std::vector<Message> History(absl::Span<const Message> turn);
+
+  // Estimated tokens of what History sends, without a turn.
+  size_t tokens() const;
+
+  ContextStats stats() const;
+
+ private:
+  struct Entry {
+    Message message;
+    size_t tokens;
+    bool pinned;
+    // Position in the conversation, counting from 0.
+    uint64_t sequence;
+  };
+  // A summary of the turns before `end`, and of the previous summary.
+  struct PendingSummary {
+    uint64_t end;
+    std::optional<absl::StatusOr<std::string>> text;
+  };
+
+  size_t tokens_locked() const ABSL_SHARED_LOCKS_REQUIRED(mu_);
+  // Number of leading window entries that make up whole turns, with the
+  // rest fitting into `budget` tokens.
+  size_t TurnsBeyond(size_t budget) const ABSL_SHARED_LOCKS_REQUIRED(mu_);
+  // Moves the first `count` entries out of the window, keeping the pinned
+  // ones.
+  void Evict(size_t count) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Puts a finished summary in place of the turns it covers. Returns whether
+  // the history changed.
+  bool ApplySummary() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void MaybeSummarize() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Runs on summarizer_.
+  void Summarize(std::string previous, std::vector<Message> turns);
+
+  Model& model_;
+  const std::shared_ptr<const Fetch> fetch_;
+  const ContextOptions options_;
+  Cancellation cancellation_;
+  mutable absl::Mutex mu_;
+  std::deque<Entry> window_ ABSL_GUARDED_BY(mu_);
+  size_t window_tokens_ ABSL_GUARDED_BY(mu_) = 0;
+  std::vector<Message> pinned_ ABSL_GUARDED_BY(mu_);
+  size_t pinned_tokens_ ABSL_GUARDED_BY(mu_) = 0;
+  // Empty until the first summary replaced older turns.
+  std::string summary_ ABSL_GUARDED_BY(mu_);
+  size_t summary_tokens_ ABSL_GUARDED_BY(mu_) = 0;
+  uint64_t next_sequence_ ABSL_GUARDED_BY(mu_) = 0;
+  std::optional<PendingSummary> pending_ ABSL_GUARDED_BY(mu_);
+  ContextStats stats_ ABSL_GUARDED_BY(mu_);
+  std::thread summarizer_;
+};
+
+// Turns the prompts sent to `model` into one conversation, sent with the
+// history kept by a ContextWindow. The first prompt is pinned if
+// `pin_first_prompt`. Tool conversations through Complete become part of the
+// history once the model replies without calling a tool. Replies are not
+// streamed from the provider, and batches are passed through.
+ModelHandle WithContextWindow(ModelHandle model,
+                              std::shared_ptr<const Fetch> fetch,
+                              ContextOptions options,
+                              bool pin_first_prompt = false);
+
+}  // namespace uchen::chat
+
+#endif  // SRC_CONTEXT_WINDOW_H_
@@ -0,0 +1,493 @@
+#include "src/daemon.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "absl/cleanup/cleanup.h"
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+#include "src/job_queue.h"
+#include "src/model.h"
+#include "src/render.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr int kListenBacklog = 64;
+constexpr absl::Duration kCatalogTtl = absl::Hours(1);
+constexpr absl::Duration kHangupPollInterval = absl::Milliseconds(50);
+
+absl::Status ErrnoStatus(std::string_view what) {
+  return absl::UnavailableError(absl::StrCat(what, ": ", std::strerror(errno)));
+}
+
+absl::StatusOr<sockaddr_un> SocketAddress(const std::string& path) {
+  sockaddr_un address = {};
+  if (path.size() >= sizeof(address.sun_path)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Socket path is too long: ", path));
+  }
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+// Newline-delimited JSON over a stream socket.
+class FrameStream {
+ public:
+  explicit FrameStream(int fd) : fd_(fd) {}
+
+  std::optional<nlohmann::json> Read() {
+    while (true) {
+      if (size_t end = buffer_.find('\n'); end != std::string::npos) {
+        auto frame =
+            nlohmann::json::parse(std::string_view(buffer_).substr(0, end),
+                                  nullptr, /*allow_exceptions=*/false);
+        buffer_.erase(0, end + 1);
+        if (frame.is_discarded()) {
+          return std::nullopt;
+        }
+        return frame;
+      }
+      char chunk[4096];
+      ssize_t read = recv(fd_, chunk, sizeof(chunk), 0);
+      if (read < 0 && errno == EINTR) {
+        continue;
+      }
+      if (read <= 0) {
+        return std::nullopt;
+      }
+      buffer_.append(chunk, read);
+    }
+  }
+
+  bool Write(const nlohmann::json& frame) {
+    std::string line = frame.dump();
+    line.push_back('\n');
+    std::string_view remaining = line;
+    while (!remaining.empty()) {
+      ssize_t written =
+          send(fd_, remaining.data(), remaining.size(), MSG_NOSIGNAL);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        return false;
+      }
+      remaining.remove_prefix(written);
+    }
+    return true;
+  }
+
+ private:
+  int fd_;
+  std::string buffer_;
+};
+
+nlohmann::json StatusFrame(const absl::Status& status) {
+  return {{"code", static_cast<int>(status.code())},
+          {"error", std::string(status.message())}};
+}
+
+absl::Status StatusFromFrame(const nlohmann::json& frame) {
+  auto code = static_cast<absl::StatusCode>(frame.value("code", 0));
+  return absl::Status(code, frame.value("error", ""));
+}
+
+// Rejects frames that are not objects or hold a field of the wrong type,
+// which reading the field would abort on.
+absl::Status CheckRequest(const nlohmann::json& request) {
+  if (!request.is_object()) {
+    return absl::InvalidArgumentError("A request must be a JSON object");
+  }
+  for (const auto& [name, value] : request.items()) {
+    bool valid = true;
+    if (name == "list" || name == "submit") {
+      valid = value.is_boolean();
+    } else if (name == "model" || name == "prompt") {
+      valid = value.is_string();
+    } else if (name == "timeout_ms") {
+      valid = value.is_number_integer();
+    } else if (name == "poll" || name == "fetch") {
+      valid = value.is_number_unsigned();
+    }
+    if (!valid) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid \"", name, "\": ", value.dump()));
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Runs `func` on another thread and cancels it when the peer on `fd` hangs
+// up. The connection thread only waits for the hangup, so a request from a
+// client that was killed stops costing tokens. A client that only shut down
+// its sending side is still reading and keeps its request.
+template <typename T>
+std::invoke_result_t<T> CancelOnHangup(int fd, Cancellation& cancellation,
+                                       const T& func) {
+  absl::Notification done;
+  std::optional<std::invoke_result_t<T>> result;
+  std::thread worker([&]() {
+    result = func();
+    done.Notify();
+  });
+  while (!done.WaitForNotificationWithTimeout(kHangupPollInterval)) {
+    pollfd poll_fd = {.fd = fd, .events = 0, .revents = 0};
+    if (poll(&poll_fd, 1, 0) > 0 &&
+        (poll_fd.revents & (POLLHUP | POLLERR)) != 0) {
+      cancellation.Cancel();
+    }
+  }
+  worker.join();
+  return std::move(result).value();
+}
+
+// Answers a submit, poll or fetch request.
+absl::Status HandleJobRequest(JobQueue* jobs, const nlohmann::json& request,
+                              FrameStream& stream) {
+  if (jobs == nullptr) {
+    return absl::FailedPreconditionError(
+        "The daemon was started without a job journal");
+  }
+  if (request.value("submit", false)) {
+    auto id = jobs->Submit(request.value("model", std::string()),
+                           request.value("prompt", std::string()));
+    if (!id.ok()) {
+      return std::move(id).status();
+    }
+    stream.Write({{"job", *id}});
+    return absl::OkStatus();
+  }
+  bool fetch = request.contains("fetch");
+  uint64_t id = request.value(fetch ? "fetch" : "poll", uint64_t{0});
+  std::optional<Job> job = jobs->Get(id);
+  if (!job.has_value()) {
+    return absl::NotFoundError(absl::StrCat("No job ", id));
+  }
+  if (!fetch) {
+    stream.Write({{"job", id}, {"state", JobStateName(job->state)}});
+    return absl::OkStatus();
+  }
+  if (job->state == JobState::kFailed) {
+    return job->status;
+  }
+  if (job->state != JobState::kDone) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("Job ", id, " is ", JobStateName(job->state)));
+  }
+  stream.Write({{"text", job->result}});
+  return absl::OkStatus();
+}
+
+std::optional<JobState> JobStateFromName(std::string_view name) {
+  for (JobState state : {JobState::kPending, JobState::kRunning,
+                         JobState::kDone, JobState::kFailed}) {
+    if (JobStateName(state) == name) {
+      return state;
+    }
+  }
+  return std::nullopt;
+}
+
+}  // namespace
+
+absl::Status Daemon::Serve(const std::string& socket_path) {
+  auto address = SocketAddress(socket_path);
+  if (!address.ok()) {
+    return std::move(address).status();
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoStatus("socket");
+  }
+  // Only a socket nobody answers on is left over from a daemon that died.
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&*address),
+              sizeof(*address)) == 0) {
+    close(fd);
+    return absl::FailedPreconditionError(
+        absl::StrCat("A daemon is already serving on ", socket_path));
+  }
+  close(fd);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoStatus("socket");
+  }
+  unlink(socket_path.c_str());
+  // Prompts carry the user's API keys, keep other users out. The socket is
+  // created with these permissions, so there is no window where it is open.
+  mode_t old_umask = umask(S_IRWXG | S_IRWXO);
+  int bound = bind(fd, reinterpret_cast<const sockaddr*>(&*address),
+                   sizeof(*address));
+  umask(old_umask);
+  if (bound != 0) {
+    close(fd);
+    return ErrnoStatus(absl::StrCat("bind ", socket_path));
+  }
+  if (listen(fd, kListenBacklog) != 0) {
+    close(fd);
+    return ErrnoStatus("listen");
+  }
+  {
+    absl::MutexLock lock(&mu_);
+    if (shut_down_) {
+      close(fd);
+      unlink(socket_path.c_str());
+      return absl::OkStatus();
+    }
+    listen_fd_ = fd;
+  }
+  LOG(INFO) << "Serving on " << socket_path;
+  while (true) {
+    int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+    absl::MutexLock lock(&mu_);
+    if (listen_fd_ < 0) {
+      close(client);
+      break;
+    }
+    connections_.insert(client);
+    std::thread([this, client]() { HandleConnection(client); }).detach();
+  }
+  absl::MutexLock lock(&mu_);
+  mu_.Await(absl::Condition(
+      +[](absl::flat_hash_set<int>* connections) {
+        return connections->empty();
+      },
+      &connections_));
+  close(fd);
+  unlink(socket_path.c_str());
+  return absl::OkStatus();
+}
+
+void Daemon::Shutdown() {
+  absl::MutexLock lock(&mu_);
+  shut_down_ = true;
+  if (listen_fd_ >= 0) {
+    shutdown(listen_fd_, SHUT_RDWR);
+    listen_fd_ = -1;
+  }
+  for (int fd : connections_) {
+    shutdown(fd, SHUT_RDWR);
+  }
+}
+
+void Daemon::HandleConnection(int fd) {
+  absl::Cleanup cleanup = [this, fd]() {
+    absl::MutexLock lock(&mu_);
+    connections_.erase(fd);
+    close(fd);
+  };
+  FrameStream stream(fd);
+  while (auto request = stream.Read()) {
+    if (absl::Status status = CheckRequest(*request); !status.ok()) {
+      stream.Write(StatusFrame(status));
+      continue;
+    }
+    if (request->value("list", false)) {
+      for (const auto& provider : ListModels()) {
+        stream.Write({{"provider", provider.provider},
+                      {"models", provider.models}});
+      }
+      stream.Write(StatusFrame(absl::OkStatus()));
+      continue;
+    }
+    if (request->contains("submit") || request->contains("poll") ||
+        request->contains("fetch")) {
+      stream.Write(StatusFrame(HandleJobRequest(jobs_, *request, stream)));
+      continue;
+    }
+    auto model =
+        ConnectToModel(providers_, request->value("model", std::string()));
+    if (!model.ok()) {
+      stream.Write(StatusFrame(model.status()));
+      continue;
+    }
+    Cancellation cancellation;
+    RequestOptions options = {.cancellation = &cancellation};
+    if (int64_t timeout_ms = request->value("timeout_ms", int64_t{0});
+        timeout_ms > 0) {
+      options.timeout = absl::Milliseconds(timeout_ms);
+    }
+    std::string prompt = request->value("prompt", std::string());
+    absl::Status status = CancelOnHangup(fd, cancellation, [&]() {
+      return (*model)->StreamPrompt(
+          fetch_, prompt, {}, options, [&](std::string_view segment) {
+            if (!stream.Write({{"text", segment}})) {
+              cancellation.Cancel();
+            }
+          });
+    });
+    stream.Write(StatusFrame(status));
+  }
+}
+
+std::vector<ProviderModels> Daemon::ListModels() {
+  absl::MutexLock lock(&catalog_mu_);
+  if (absl::Now() - catalog_time_ > kCatalogTtl) {
+    catalog_.clear();
+    for (const auto& provider : providers_) {
+      auto models = provider->ListModels();
+      if (!models.empty()) {
+        catalog_.push_back({.provider = std::string(provider->name()),
+                            .models = std::move(models)});
+      }
+    }
+    catalog_time_ = absl::Now();
+  }
+  return catalog_;
+}
+
+absl::StatusOr<DaemonClient> DaemonClient::Connect(
+    const std::string& socket_path) {
+  auto address = SocketAddress(socket_path);
+  if (!address.ok()) {
+    return std::move(address).status();
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoStatus("socket");
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&*address),
+              sizeof(*address)) != 0) {
+    close(fd);
+    return ErrnoStatus(absl::StrCat("connect ", socket_path));
+  }
+  return DaemonClient(fd);
+}
+
+DaemonClient::~DaemonClient() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+absl::Status DaemonClient::Prompt(std::string_view model,
+                                  std::string_view prompt,
+                                  absl::Duration timeout, Renderer& renderer) {
+  FrameStream stream(fd_);
+  nlohmann::json request = {{"model", model}, {"prompt", prompt}};
+  if (timeout != absl::InfiniteDuration()) {
+    request["timeout_ms"] = absl::ToInt64Milliseconds(timeout);
+  }
+  if (!stream.Write(request)) {
+    return ErrnoStatus("send");
+  }
+  while (auto frame = stream.Read()) {
+    if (frame->contains("code")) {
+      renderer.Finish();
+      return StatusFromFrame(*frame);
+    }
+    renderer.Append(frame->value("text", ""));
+  }
+  return absl::UnavailableError("Daemon closed the connection");
+}
+
+absl::StatusOr<std::vector<ProviderModels>> DaemonClient::ListModels() {
+  FrameStream stream(fd_);
+  if (!stream.Write({{"list", true}})) {
+    return ErrnoStatus("send");
+  }
+  std::vector<ProviderModels> providers;
+  while (auto frame = stream.Read()) {
+    if (frame->contains("code")) {
+      if (absl::Status status = StatusFromFrame(*frame); !status.ok()) {
+        return status;
+      }
+      return providers;
+    }
+    providers.push_back(
+        {.provider = frame->value("provider", ""),
+         .models = frame->value("models", std::vector<std::string>())});
+  }
+  return absl::UnavailableError("Daemon closed the connection");
+}
+
+absl::StatusOr<uint64_t> DaemonClient::Submit(std::string_view model,
+                                              std::string_view prompt) {
+  FrameStream stream(fd_);
+  if (!stream.Write({{"submit", true}, {"model", model}, {"prompt", prompt}})) {
+    return ErrnoStatus("send");
+  }
+  std::optional<uint64_t> id;
+  while (auto frame = stream.Read()) {
+    if (frame->contains("code")) {
+      if (absl::Status status = StatusFromFrame(*frame); !status.ok()) {
+        return status;
+      }
+      if (!id.has_value()) {
+        return absl::InternalError("Daemon did not return a job id");
+      }
+      return *id;
+    }
+    id = frame->value("job", uint64_t{0});
+  }
+  return absl::UnavailableError("Daemon closed the connection");
+}
+
+absl::StatusOr<JobState> DaemonClient::Poll(uint64_t job) {
+  FrameStream stream(fd_);
+  if (!stream.Write({{"poll", job}})) {
+    return ErrnoStatus("send");
+  }
+  std::optional<JobState> state;
+  while (auto frame = stream.Read()) {
+    if (frame->contains("code")) {
+      if (absl::Status status = StatusFromFrame(*frame); !status.ok()) {
+        return status;
+      }
+      if (!state.has_value()) {
+        return absl::InternalError("Daemon did not return a job state");
+      }
+      return *state;
+    }
+    state = JobStateFromName(frame->value("state", ""));
+  }
+  return absl::UnavailableError("Daemon closed the connection");
+}
+
+absl::StatusOr<std::string> DaemonClient::FetchResult(uint64_t job) {
+  FrameStream stream(fd_);
+  if (!stream.Write({{"fetch", job}})) {
+    return ErrnoStatus("send");
+  }
+  std::string text;
+  while (auto frame = stream.Read()) {
+    if (frame->contains("code")) {
+      if (absl::Status status = StatusFromFrame(*frame); !status.ok()) {
+        return status;
+      }
+      return text;
+    }
+    text += frame->value("text", "");
+  }
+  return absl::UnavailableError("Daemon closed the connection");
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,104 @@
+#ifndef SRC_DAEMON_H_
+#define SRC_DAEMON_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/job_queue.h"
+#include "src/model.h"
+#include "src/render.h"
+
+namespace uchen::chat {
+
+struct ProviderModels {
+  std::string provider;
+  std::vector<std::string> models;
+};
+
+// Long-lived server that answers prompts sent over a Unix domain socket. The
+// providers, the connection pool of `fetch` and the model catalog stay warm
+// between requests, so clients only pay for a local round trip.
+//
+// The protocol is one JSON object per line. A request is one of
+// {"model": ..., "prompt": ..., "timeout_ms": ...}, {"list": true},
+// {"submit": true, "model": ..., "prompt": ...}, {"poll": <job>} or
+// {"fetch": <job>}. The reply is any number of frames, such as one {"text"}
+// frame per streamed segment of an answer, followed by
+// {"code": <absl::StatusCode>, "error": ...}. A prompt is cancelled if the
+// client hangs up before the reply is complete; a submitted job runs in the
+// background regardless.
+class Daemon {
+ public:
+  // Background jobs are only accepted when `jobs` is given.
+  Daemon(const Fetch& fetch,
+         absl::Span<const std::unique_ptr<ModelProvider>> providers,
+         JobQueue* jobs = nullptr)
+      : fetch_(fetch), providers_(providers), jobs_(jobs) {}
+
+  // Accepts connections until Shutdown() is called, then waits for the open
+  // ones to finish. Fails if another daemon is serving on `socket_path`; a
+  // socket left over from one that died is replaced.
+  absl::Status Serve(const std::string& socket_path);
+  void Shutdown();
+
+ private:
+  void HandleConnection(int fd);
+  std::vector<ProviderModels> ListModels();
+
+  const Fetch& fetch_;
+  absl::Span<const std::unique_ptr<ModelProvider>> providers_;
+  JobQueue* jobs_;
+  absl::Mutex mu_;
+  int listen_fd_ ABSL_GUARDED_BY(mu_) = -1;
+  bool shut_down_ ABSL_GUARDED_BY(mu_) = false;
+  absl::flat_hash_set<int> connections_ ABSL_GUARDED_BY(mu_);
+  absl::Mutex catalog_mu_;
+  std::vector<ProviderModels> catalog_ ABSL_GUARDED_BY(catalog_mu_);
+  absl::Time catalog_time_ ABSL_GUARDED_BY(catalog_mu_) =
+      absl::InfinitePast();
+};
+
+// Thin client for a running Daemon.
+class DaemonClient {
+ public:
+  static absl::StatusOr<DaemonClient> Connect(const std::string& socket_path);
+
+  DaemonClient(DaemonClient&& other) noexcept
+      : fd_(std::exchange(other.fd_, -1)) {}
+  DaemonClient& operator=(DaemonClient&& other) = delete;
+  ~DaemonClient();
+
+  // Streams the reply to `renderer` as it arrives.
+  absl::Status Prompt(std::string_view model, std::string_view prompt,
+                      absl::Duration timeout, Renderer& renderer);
+  absl::StatusOr<std::vector<ProviderModels>> ListModels();
+
+  // Queues a background job and returns its id.
+  absl::StatusOr<uint64_t> Submit(std::string_view model,
+                                  std::string_view prompt);
+  absl::StatusOr<JobState> Poll(uint64_t job);
+  // Returns the response of a finished job.
+  absl::StatusOr<std::string> FetchResult(uint64_t job);
+
+ private:
+  explicit DaemonClient(int fd) : fd_(fd) {}
+
+  int fd_;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_DAEMON_H_
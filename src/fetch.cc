@@ -3,34 +3,70 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include "absl/cleanup/cleanup.h"
+#include "absl/functional/function_ref.h"
+#include "absl/hash/hash.h"
 #include "absl/log/log.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 
 #include "curl/curl.h"
+#include "src/journal.h"
+#include "src/trace.h"
 
 namespace uchen::chat {
 
 namespace {
-constexpr uint16_t kMaxLogLevel = 5;
+constexpr uint16_t kRequestLog = 5;
 constexpr uint16_t kHeadersLog = 3;
+constexpr uint16_t kWarmLog = 1;
+constexpr absl::Duration kWarmTimeout = absl::Seconds(10);
+
+// Called by curl at least once a second while a transfer is running, and
+// more often while data is flowing. A non-zero return aborts the transfer.
+int CurlXferInfoCallback(void* clientp, curl_off_t /* dltotal */,
+                         curl_off_t /* dlnow */, curl_off_t /* ultotal */,
+                         curl_off_t /* ulnow */) {
+  return static_cast<const Cancellation*>(clientp)->cancelled() ? 1 : 0;
+}
+
 }  // namespace
 
+Response Response::FromBody(std::string_view body, int http_status) {
+  Response response;
+  response.body_.assign(body.begin(), body.end());
+  response.http_status_ = http_status;
+  return response;
+}
+
 // Write callback function for CURL
 size_t Response::CurlWriteCallback(char* ptr, size_t size, size_t nmemb,
                                    void* userdata) {
   auto* response = static_cast<Response*>(userdata);
+  if (response->on_data_ != nullptr) {
+    if (!(*response->on_data_)(std::string_view(ptr, size * nmemb))) {
+      // Anything but the full size makes curl abort the transfer.
+      response->closed_ = true;
+      return 0;
+    }
+    return size * nmemb;
+  }
   std::copy(ptr, ptr + (size * nmemb), std::back_inserter(response->body_));
   return size * nmemb;
 }
 
-absl::StatusOr<nlohmann::json> Response::Json() const {
+absl::StatusOr<json::Json> Response::Json() const {
+  TraceSpan span("Response::Json");
   // Parse response without exceptions
-  nlohmann::json json_response = nlohmann::json::parse(body_, nullptr, false);
+  json::Json json_response = json::Json::parse(body_, nullptr, false);
 
   if (json_response.is_discarded()) {
     return absl::InternalError(
@@ -40,43 +76,257 @@ absl::StatusOr<nlohmann::json> Response::Json() const {
   return json_response;
 }
 
-absl::StatusOr<Response> CurlFetch::Get(
-    const std::string& url, absl::Span<const Header> headers) const {
-  return CurlFetch::Request(HttpMethod::kGet, url, headers, {});
+CurlFetch::CurlFetch() : share_(curl_share_init()) {
+  curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &CurlFetch::LockShare);
+  curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &CurlFetch::UnlockShare);
+  curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+CurlFetch::~CurlFetch() {
+  {
+    absl::MutexLock lock(&keep_warm_mu_);
+    stopping_ = true;
+  }
+  keep_warm_cancellation_.Cancel();
+  if (keep_warm_thread_.joinable()) {
+    keep_warm_thread_.join();
+  }
+  absl::MutexLock lock(&mu_);
+  for (CURL* curl : idle_handles_) {
+    curl_easy_cleanup(curl);
+  }
+  for (HeaderList& header_list : header_lists_) {
+    curl_slist_free_all(header_list.list);
+  }
+  curl_share_cleanup(share_);
+}
+
+void CurlFetch::LockShare(CURL* /* handle */, curl_lock_data data,
+                          curl_lock_access /* access */, void* userptr)
+    ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  static_cast<CurlFetch*>(userptr)->share_locks_[data].Lock();
+}
+
+void CurlFetch::UnlockShare(CURL* /* handle */, curl_lock_data data,
+                            void* userptr) ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  static_cast<CurlFetch*>(userptr)->share_locks_[data].Unlock();
+}
+
+CURL* CurlFetch::AcquireHandle() const {
+  {
+    absl::MutexLock lock(&mu_);
+    if (!idle_handles_.empty()) {
+      CURL* curl = idle_handles_.back();
+      idle_handles_.pop_back();
+      return curl;
+    }
+  }
+  return curl_easy_init();
+}
+
+size_t CurlFetch::idle_handles() const {
+  absl::MutexLock lock(&mu_);
+  return idle_handles_.size();
+}
+
+void CurlFetch::ReleaseHandle(CURL* curl) const {
+  // Reset drops the options of the previous request but keeps the handle's
+  // caches. Aborted transfers have already had their connection closed.
+  curl_easy_reset(curl);
+  absl::MutexLock lock(&mu_);
+  idle_handles_.push_back(curl);
+}
+
+curl_slist* CurlFetch::GetHeaderList(absl::Span<const Header> headers,
+                                     curl_slist** uncached) const {
+  *uncached = nullptr;
+  if (headers.empty()) {
+    return nullptr;
+  }
+  size_t hash = 0;
+  for (const Header& header : headers) {
+    hash = absl::HashOf(hash, header.key, header.value);
+  }
+  auto same_headers = [&](const HeaderList& header_list) {
+    return header_list.hash == hash &&
+           std::ranges::equal(header_list.headers, headers,
+                              [](const Header& a, const Header& b) {
+                                return a.key == b.key && a.value == b.value;
+                              });
+  };
+  {
+    absl::MutexLock lock(&mu_);
+    if (auto it = std::ranges::find_if(header_lists_, same_headers);
+        it != header_lists_.end()) {
+      return it->list;
+    }
+  }
+  curl_slist* list = nullptr;
+  for (const Header& header : headers) {
+    list = curl_slist_append(
+        list, absl::StrCat(header.key, ": ", header.value).c_str());
+  }
+  absl::MutexLock lock(&mu_);
+  if (auto it = std::ranges::find_if(header_lists_, same_headers);
+      it != header_lists_.end()) {
+    // Another request built the same list in the meantime.
+    curl_slist_free_all(list);
+    return it->list;
+  }
+  if (header_lists_.size() == kMaxHeaderLists) {
+    *uncached = list;
+    return list;
+  }
+  header_lists_.push_back(
+      {.hash = hash,
+       .headers = std::vector<Header>(headers.begin(), headers.end()),
+       .list = list});
+  return list;
+}
+
+absl::StatusOr<Response> CurlFetch::Get(const std::string& url,
+                                        absl::Span<const Header> headers,
+                                        const RequestOptions& options) const {
+  return Request(HttpMethod::kGet, url, headers, {}, {}, options);
 }
 
 absl::StatusOr<Response> CurlFetch::Post(const std::string& url,
                                          absl::Span<const Header> headers,
-                                         const nlohmann::json& payload) const {
-  const std::string payload_str = payload.dump();
+                                         const json::Json& payload,
+                                         const RequestOptions& options) const {
+  TraceSpan span("CurlFetch::Post");
+  json::String payload_str;
+  {
+    TraceSpan dump_span("CurlFetch::SerializePayload");
+    payload_str = payload.dump();
+  }
   std::span<const char> payload_span(payload_str.data(), payload_str.size());
-  return CurlFetch::Request(HttpMethod::kPost, url, headers, payload_span);
+  return Request(HttpMethod::kPost, url, headers, payload_span, {}, options);
+}
+
+absl::StatusOr<Response> CurlFetch::PostJson(
+    const std::string& url, absl::Span<const Header> headers,
+    std::string_view body, const RequestOptions& options) const {
+  TraceSpan span("CurlFetch::PostJson");
+  return Request(HttpMethod::kPost, url, headers,
+                 std::span<const char>(body.data(), body.size()), {},
+                 options);
+}
+
+absl::Status CurlFetch::PostJsonStream(
+    const std::string& url, absl::Span<const Header> headers,
+    std::string_view body, const RequestOptions& options,
+    absl::FunctionRef<bool(std::string_view)> on_data) const {
+  TraceSpan span("CurlFetch::PostJsonStream");
+  return Request(HttpMethod::kPost, url, headers,
+                 std::span<const char>(body.data(), body.size()), {}, options,
+                 &on_data)
+      .status();
+}
+
+absl::StatusOr<Response> CurlFetch::PostForm(
+    const std::string& url, absl::Span<const Header> headers,
+    absl::Span<const FormField> fields, const RequestOptions& options) const {
+  TraceSpan span("CurlFetch::PostForm");
+  if (fields.empty()) {
+    return absl::InvalidArgumentError("POST method requires payload");
+  }
+  return Request(HttpMethod::kPost, url, headers, {}, fields, options);
+}
+
+void CurlFetch::KeepWarm(std::string url, absl::Duration interval) {
+  absl::MutexLock lock(&keep_warm_mu_);
+  keep_warm_url_ = std::move(url);
+  keep_warm_interval_ = interval;
+  warm_now_ = true;
+  if (!keep_warm_thread_.joinable()) {
+    keep_warm_thread_ = std::thread([this]() { KeepWarmLoop(); });
+  }
 }
 
-absl::StatusOr<Response> CurlFetch::Request(HttpMethod method,
-                                            const std::string& url,
-                                            absl::Span<const Header> headers,
-                                            std::span<const char> payload) {
+void CurlFetch::KeepWarmLoop() {
+  absl::MutexLock lock(&keep_warm_mu_);
+  while (!stopping_) {
+    absl::Time due =
+        warm_now_ ? absl::InfinitePast()
+                  : absl::FromUnixNanos(last_transfer_ns_.load(
+                        std::memory_order_relaxed)) +
+                        keep_warm_interval_;
+    if (absl::Now() < due) {
+      keep_warm_mu_.AwaitWithDeadline(
+          absl::Condition(
+              +[](CurlFetch* fetch) ABSL_EXCLUSIVE_LOCKS_REQUIRED(
+                   fetch->keep_warm_mu_) {
+                return fetch->stopping_ || fetch->warm_now_;
+              },
+              this),
+          due);
+      continue;
+    }
+    warm_now_ = false;
+    std::string url = keep_warm_url_;
+    keep_warm_mu_.Unlock();
+    // Reuses the pooled connection if it is still open, which restarts its
+    // idle timer on both ends, and opens a new one otherwise.
+    auto response =
+        Request(HttpMethod::kHead, url, {}, {}, {},
+                {.cancellation = &keep_warm_cancellation_,
+                 .timeout = kWarmTimeout});
+    if (!response.ok()) {
+      VLOG(kWarmLog) << "Failed to warm up " << url << ": "
+                     << response.status();
+    }
+    keep_warm_mu_.Lock();
+  }
+}
+
+absl::StatusOr<Response> CurlFetch::Request(
+    HttpMethod method, const std::string& url,
+    absl::Span<const Header> headers, std::span<const char> payload,
+    absl::Span<const FormField> form, const RequestOptions& options,
+    const absl::FunctionRef<bool(std::string_view)>* on_data) const {
+  TraceSpan span("CurlFetch::Request");
   Response response;
-  CURL* curl = curl_easy_init();
+  response.on_data_ = on_data;
+  CURL* curl = AcquireHandle();
   if (!curl) return absl::InternalError("curl_easy_init failed");
-  absl::Cleanup curl_cleanup = [curl] { curl_easy_cleanup(curl); };
+  absl::Cleanup curl_cleanup = [this, curl] { ReleaseHandle(curl); };
 
+  curl_easy_setopt(curl, CURLOPT_SHARE, share_);
   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, Response::CurlWriteCallback);
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
 
-  struct curl_slist* curl_headers = nullptr;
-  absl::Cleanup headers_cleanup = [&curl_headers] {
-    curl_slist_free_all(curl_headers);
+  curl_mime* mime = nullptr;
+  absl::Cleanup mime_cleanup = [&mime] { curl_mime_free(mime); };
+
+  curl_slist* uncached_headers = nullptr;
+  absl::Cleanup headers_cleanup = [&uncached_headers] {
+    curl_slist_free_all(uncached_headers);
   };
+  if (VLOG_IS_ON(kHeadersLog)) {
+    for (const Header& header : headers) {
+      VLOG(kHeadersLog) << header.key << ": " << header.value;
+    }
+  }
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER,
+                   GetHeaderList(headers, &uncached_headers));
 
-  for (const Header& header : headers) {
-    VLOG(kHeadersLog) << absl::StrCat(header.key, ": ", header.value);
-    curl_headers = curl_slist_append(
-        curl_headers, absl::StrCat(header.key, ": ", header.value).c_str());
+  if (options.cancellation != nullptr) {
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, CurlXferInfoCallback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, options.cancellation);
+  }
+  if (options.timeout != absl::InfiniteDuration()) {
+    // 0 would be no timeout to curl.
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS,
+                     static_cast<long>(  // NOLINT(google-runtime-int)
+                         std::max<int64_t>(
+                             1, absl::ToInt64Milliseconds(options.timeout))));
   }
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, curl_headers);
 
   switch (method) {
     case HttpMethod::kGet:
@@ -86,6 +336,19 @@ absl::StatusOr<Response> CurlFetch::Request(HttpMethod method,
       }
       break;
     case HttpMethod::kPost:
+      if (!form.empty()) {
+        mime = curl_mime_init(curl);
+        for (const FormField& field : form) {
+          curl_mimepart* part = curl_mime_addpart(mime);
+          curl_mime_name(part, field.name.c_str());
+          curl_mime_data(part, field.value.data(), field.value.size());
+          if (!field.filename.empty()) {
+            curl_mime_filename(part, field.filename.c_str());
+          }
+        }
+        curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+        break;
+      }
       if (payload.size() == 0) {
         return absl::InvalidArgumentError("POST method requires payload");
       }
@@ -93,23 +356,84 @@ absl::StatusOr<Response> CurlFetch::Request(HttpMethod method,
       curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload.data());
       curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, payload.size());
       break;
+    case HttpMethod::kHead:
+      if (payload.size() > 0) {
+        return absl::InvalidArgumentError(
+            "HEAD method does not support payload");
+      }
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+      break;
     default:
       return absl::InvalidArgumentError("Unsupported HTTP method");
   }
 
-  VLOG(kMaxLogLevel) << (method == HttpMethod::kPost ? "POST " : "GET ") << url;
-  if (payload.size()) {
-    VLOG(kMaxLogLevel) << "Payload: "
-                       << std::string_view(payload.data(), payload.size());
-  }
+  VLOG(kRequestLog) << (method == HttpMethod::kPost   ? "POST "
+                        : method == HttpMethod::kHead ? "HEAD "
+                                                      : "GET ")
+                    << url;
 
-  CURLcode res = curl_easy_perform(curl);
+  RequestJournal* journal = GlobalRequestJournal();
+  const absl::Time start =
+      journal != nullptr ? absl::Now() : absl::InfinitePast();
+  CURLcode res;
+  {
+    TraceSpan perform_span("curl_easy_perform");
+    res = curl_easy_perform(curl);
+  }
+  if (res == CURLE_WRITE_ERROR && response.closed_) {
+    res = CURLE_OK;
+  }
+  const absl::Time end = absl::Now();
+  last_transfer_ns_.store(absl::ToUnixNanos(end), std::memory_order_relaxed);
+  if (journal != nullptr) {
+    JournalEntry entry = {
+        .method = method == HttpMethod::kPost   ? JournalRecord::kPost
+                  : method == HttpMethod::kHead ? JournalRecord::kHead
+                                                : JournalRecord::kGet,
+        .url = url,
+        .request_body = std::string_view(payload.data(), payload.size()),
+        .request_bytes = payload.size(),
+        .response_body = response.body(),
+        .start = start,
+        .total_time = end - start,
+        .curl_code = static_cast<int>(res),
+    };
+    for (const FormField& field : form) {
+      entry.request_bytes += field.value.size();
+    }
+    curl_off_t first_byte_us = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T,
+                          &first_byte_us) == CURLE_OK) {
+      entry.time_to_first_byte = absl::Microseconds(first_byte_us);
+    }
+    long http_status = 0;  // NOLINT(google-runtime-int)
+    if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status) ==
+        CURLE_OK) {
+      entry.http_status = static_cast<int>(http_status);
+    }
+    journal->Record(entry);
+  }
+  if (res == CURLE_ABORTED_BY_CALLBACK) {
+    return absl::CancelledError("Request cancelled");
+  }
+  if (res == CURLE_OPERATION_TIMEDOUT) {
+    return absl::DeadlineExceededError(absl::StrCat(
+        "Request timed out after ", absl::FormatDuration(options.timeout)));
+  }
   if (res != CURLE_OK) {
     return absl::InternalError(
         absl::StrCat("Failed to perform request: ", curl_easy_strerror(res)));
   }
-
-  VLOG(kMaxLogLevel) << "Response: " << absl::StrCat(response);
+  curl_off_t first_byte_us = 0;
+  if (curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us) ==
+      CURLE_OK) {
+    response.time_to_first_byte_ = absl::Microseconds(first_byte_us);
+  }
+  long http_status = 0;  // NOLINT(google-runtime-int)
+  if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status) ==
+      CURLE_OK) {
+    response.http_status_ = static_cast<int>(http_status);
+  }
   return response;
 }
 
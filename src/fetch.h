@@ -1,10 +1,25 @@
 #ifndef SRC_FETCH_H_
 #define SRC_FETCH_H_
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "absl/types/span.h"
 
-#include "nlohmann/json.hpp"  // IWYU pragma: keep
+#include "curl/curl.h"
+#include "src/json_arena.h"
 
 namespace uchen::chat {
 
@@ -13,12 +28,55 @@ struct Header {
   std::string value;
 };
 
+// A field of a multipart/form-data request.
+struct FormField {
+  std::string name;
+  std::string value;
+  // When set, `value` is sent as the contents of a file with this name.
+  std::string filename;
+};
+
+// Lets one thread abort a request that is running on another. Cancel() only
+// touches a lock-free atomic, so it is safe to call from a signal handler.
+class Cancellation {
+ public:
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  void Reset() { cancelled_.store(false, std::memory_order_relaxed); }
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic_bool cancelled_ = false;
+  static_assert(std::atomic_bool::is_always_lock_free);
+};
+
+struct RequestOptions {
+  // Checked while the request is in flight. Cancelled requests fail with
+  // absl::StatusCode::kCancelled.
+  const Cancellation* cancellation = nullptr;
+  // Requests running longer than this fail with
+  // absl::StatusCode::kDeadlineExceeded.
+  absl::Duration timeout = absl::InfiniteDuration();
+};
+
 class Response {
  public:
+  // A response that did not come from the network, e.g. from a cache.
+  static Response FromBody(std::string_view body, int http_status = 200);
+
   static size_t CurlWriteCallback(char* ptr, size_t size, size_t nmemb,
                                   void* userdata);
 
-  absl::StatusOr<nlohmann::json> Json() const;
+  // The document is allocated from the current json::ArenaScope, if any.
+  absl::StatusOr<json::Json> Json() const;
+
+  std::string_view body() const { return {body_.data(), body_.size()}; }
+
+  // From the start of the request, including connection setup, until the
+  // first byte of the response arrived. Zero if the Fetch does not know.
+  absl::Duration time_to_first_byte() const { return time_to_first_byte_; }
+
+  // The HTTP status code, 0 if the Fetch does not know.
+  int http_status() const { return http_status_; }
 
   template <typename Sink>
   friend void AbslStringify(Sink& sink, const Response& response) {
@@ -32,7 +90,15 @@ class Response {
   }
 
  private:
+  friend class CurlFetch;
+
   std::vector<char> body_;
+  absl::Duration time_to_first_byte_;
+  int http_status_ = 0;
+  // Takes the body instead of `body_` while streaming.
+  const absl::FunctionRef<bool(std::string_view)>* on_data_ = nullptr;
+  // Whether `on_data_` asked to close the transfer.
+  bool closed_ = false;
 };
 
 class Fetch {
@@ -41,28 +107,140 @@ class Fetch {
 
   virtual absl::StatusOr<Response> Post(
       const std::string& url, absl::Span<const Header> headers,
-      const nlohmann::json& payload) const = 0;
+      const json::Json& payload, const RequestOptions& options) const = 0;
+
+  // Like Post, with the body serialized already. By default the body is
+  // parsed and handed to Post.
+  virtual absl::StatusOr<Response> PostJson(
+      const std::string& url, absl::Span<const Header> headers,
+      std::string_view body, const RequestOptions& options) const {
+    auto payload = json::Json::parse(body, nullptr, false);
+    if (payload.is_discarded()) {
+      return absl::InvalidArgumentError("Payload is not JSON");
+    }
+    return Post(url, headers, payload, options);
+  }
+
+  // Like PostJson, handing the body to `on_data` piece by piece as it
+  // arrives instead of keeping it. The transfer is closed as soon as
+  // `on_data` returns false, and the request succeeds with what arrived
+  // until then. By default the body is handed over in one piece.
+  virtual absl::Status PostJsonStream(
+      const std::string& url, absl::Span<const Header> headers,
+      std::string_view body, const RequestOptions& options,
+      absl::FunctionRef<bool(std::string_view)> on_data) const {
+    auto response = PostJson(url, headers, body, options);
+    if (!response.ok()) {
+      return std::move(response).status();
+    }
+    on_data(response->body());
+    return absl::OkStatus();
+  }
 
   virtual absl::StatusOr<Response> Get(
-      const std::string& url, absl::Span<const Header> headers) const = 0;
+      const std::string& url, absl::Span<const Header> headers,
+      const RequestOptions& options) const = 0;
+
+  // Posts `fields` as a multipart/form-data body, e.g. to upload a file.
+  virtual absl::StatusOr<Response> PostForm(
+      const std::string& /* url */, absl::Span<const Header> /* headers */,
+      absl::Span<const FormField> /* fields */,
+      const RequestOptions& /* options */) const {
+    return absl::UnimplementedError("Form uploads are not supported");
+  }
 };
 
+// Keeps finished curl handles around so that later requests reuse their
+// connections. All handles share one connection, DNS and TLS session cache.
 class CurlFetch : public Fetch {
  public:
+  // Refreshes a warm connection well before curl (118s by default) or typical
+  // servers (60s and up) give up on it for being idle.
+  static constexpr absl::Duration kKeepWarmInterval = absl::Seconds(45);
+
+  CurlFetch();
+  ~CurlFetch() override;
+
+  CurlFetch(const CurlFetch&) = delete;
+  CurlFetch& operator=(const CurlFetch&) = delete;
+
   absl::StatusOr<Response> Get(const std::string& url,
-                               absl::Span<const Header> headers) const override;
+                               absl::Span<const Header> headers,
+                               const RequestOptions& options) const override;
   absl::StatusOr<Response> Post(const std::string& url,
                                 absl::Span<const Header> headers,
-                                const nlohmann::json& payload) const override;
+                                const json::Json& payload,
+                                const RequestOptions& options) const override;
+  absl::StatusOr<Response> PostJson(
+      const std::string& url, absl::Span<const Header> headers,
+      std::string_view body, const RequestOptions& options) const override;
+  absl::Status PostJsonStream(
+      const std::string& url, absl::Span<const Header> headers,
+      std::string_view body, const RequestOptions& options,
+      absl::FunctionRef<bool(std::string_view)> on_data) const override;
+  absl::StatusOr<Response> PostForm(
+      const std::string& url, absl::Span<const Header> headers,
+      absl::Span<const FormField> fields,
+      const RequestOptions& options) const override;
+
+  // Sends a HEAD request to `url` on a background thread right away, and
+  // again whenever no request went out for `interval`, so that no request
+  // has to wait for a new connection. Replaces the URL of an earlier call.
+  void KeepWarm(std::string url, absl::Duration interval = kKeepWarmInterval);
+
+  // Handles of finished requests, waiting for the next ones.
+  size_t idle_handles() const;
 
  private:
-  enum class HttpMethod { kGet, kPost };
-  static absl::StatusOr<Response> Request(
+  enum class HttpMethod { kGet, kPost, kHead };
+
+  // A curl list of headers, kept for later requests with the same headers.
+  struct HeaderList {
+    size_t hash;
+    std::vector<Header> headers;
+    curl_slist* list;
+  };
+  // Lists beyond these many are built for every request.
+  static constexpr size_t kMaxHeaderLists = 16;
+
+  static void LockShare(CURL* handle, curl_lock_data data,
+                        curl_lock_access access, void* userptr);
+  static void UnlockShare(CURL* handle, curl_lock_data data, void* userptr);
+
+  // The body goes to `on_data` instead of the response when it is set.
+  absl::StatusOr<Response> Request(
       HttpMethod method, const std::string& url,
-      absl::Span<const Header> headers,
-      std::span<const char> payload);
+      absl::Span<const Header> headers, std::span<const char> payload,
+      absl::Span<const FormField> form, const RequestOptions& options,
+      const absl::FunctionRef<bool(std::string_view)>* on_data =
+          nullptr) const;
+
+  CURL* AcquireHandle() const;
+  void ReleaseHandle(CURL* curl) const;
+  // The curl list of `headers`. The lists of the first kMaxHeaderLists
+  // different sets of headers are kept, so the headers of a model are only
+  // formatted on its first request. A list that is not kept is also returned
+  // in `uncached`, for the caller to free.
+  curl_slist* GetHeaderList(absl::Span<const Header> headers,
+                            curl_slist** uncached) const;
+  void KeepWarmLoop() ABSL_LOCKS_EXCLUDED(keep_warm_mu_);
+
+  CURLSH* share_;
+  std::array<absl::Mutex, CURL_LOCK_DATA_LAST> share_locks_;
+  mutable absl::Mutex mu_;
+  mutable std::vector<CURL*> idle_handles_ ABSL_GUARDED_BY(mu_);
+  mutable std::vector<HeaderList> header_lists_ ABSL_GUARDED_BY(mu_);
+  // End of the last transfer, in Unix nanoseconds.
+  mutable std::atomic<int64_t> last_transfer_ns_ = 0;
+  absl::Mutex keep_warm_mu_;
+  std::string keep_warm_url_ ABSL_GUARDED_BY(keep_warm_mu_);
+  absl::Duration keep_warm_interval_ ABSL_GUARDED_BY(keep_warm_mu_);
+  bool warm_now_ ABSL_GUARDED_BY(keep_warm_mu_) = false;
+  bool stopping_ ABSL_GUARDED_BY(keep_warm_mu_) = false;
+  Cancellation keep_warm_cancellation_;
+  std::thread keep_warm_thread_;
 };
 
 }  // namespace uchen::chat
 
-#endif  // SRC_FETCH_H_
\ No newline at end of file
+#endif  // SRC_FETCH_H_
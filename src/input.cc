@@ -4,9 +4,12 @@
 
 #include "absl/strings/str_join.h"
 
+#include "src/trace.h"
+
 namespace uchen::chat {
 
 std::optional<std::string> InputReader::operator()() const {
+  TraceSpan span("InputReader::Read");
   std::string line;
   if (!std::getline(input_, line)) {
     return std::nullopt;
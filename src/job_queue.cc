@@ -0,0 +1,293 @@
+#include "src/job_queue.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+#include "src/model.h"
+
+namespace uchen::chat {
+namespace {
+
+absl::Status ErrnoStatus(std::string_view what) {
+  return absl::InternalError(absl::StrCat(what, ": ", std::strerror(errno)));
+}
+
+bool HasString(const nlohmann::json& record, const char* key) {
+  auto it = record.find(key);
+  return it != record.end() && it->is_string();
+}
+
+// Applies one journal record. Returns false if the record is malformed.
+bool Replay(const nlohmann::json& record, std::map<uint64_t, Job>& jobs) {
+  if (!record.is_object() || !record.contains("id") ||
+      !record["id"].is_number_unsigned() || !HasString(record, "op")) {
+    return false;
+  }
+  uint64_t id = record["id"].get<uint64_t>();
+  std::string op = record["op"].get<std::string>();
+  if (op == "submit") {
+    if (!HasString(record, "model") || !HasString(record, "prompt")) {
+      return false;
+    }
+    jobs[id] = {.id = id,
+                .model = record.value("model", ""),
+                .prompt = record.value("prompt", "")};
+    return true;
+  }
+  auto it = jobs.find(id);
+  if (it == jobs.end()) {
+    return false;
+  }
+  if (op == "done") {
+    if (!HasString(record, "result")) {
+      return false;
+    }
+    it->second.state = JobState::kDone;
+    it->second.result = record.value("result", "");
+    return true;
+  }
+  if (op == "failed") {
+    if (!record.contains("code") || !record["code"].is_number_integer() ||
+        !HasString(record, "error")) {
+      return false;
+    }
+    it->second.state = JobState::kFailed;
+    it->second.status =
+        absl::Status(static_cast<absl::StatusCode>(record.value("code", 2)),
+                     record.value("error", ""));
+    return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+std::string_view JobStateName(JobState state) {
+  switch (state) {
+    case JobState::kPending:
+      return "pending";
+    case JobState::kRunning:
+      return "running";
+    case JobState::kDone:
+      return "done";
+    case JobState::kFailed:
+      return "failed";
+  }
+  return "unknown";
+}
+
+absl::StatusOr<std::unique_ptr<JobQueue>> JobQueue::Open(
+    const std::string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return ErrnoStatus(absl::StrCat("open ", path));
+  }
+  std::string contents;
+  char buffer[1 << 16];
+  ssize_t read_bytes;
+  while ((read_bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (read_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      absl::Status status = ErrnoStatus(absl::StrCat("read ", path));
+      close(fd);
+      return status;
+    }
+    contents.append(buffer, read_bytes);
+  }
+  std::map<uint64_t, Job> jobs;
+  size_t intact = 0;
+  for (size_t end; (end = contents.find('\n', intact)) != std::string::npos;
+       intact = end + 1) {
+    auto record = nlohmann::json::parse(
+        std::string_view(contents).substr(intact, end - intact), nullptr,
+        /*allow_exceptions=*/false);
+    if (record.is_discarded() || !Replay(record, jobs)) {
+      LOG(WARNING) << path << ": skipping malformed record at offset "
+                   << intact;
+    }
+  }
+  if (intact < contents.size()) {
+    LOG(WARNING) << path << ": dropping " << contents.size() - intact
+                 << " bytes of an incomplete record";
+    if (ftruncate(fd, intact) != 0) {
+      absl::Status status = ErrnoStatus(absl::StrCat("truncate ", path));
+      close(fd);
+      return status;
+    }
+  }
+  return std::unique_ptr<JobQueue>(new JobQueue(fd, std::move(jobs)));
+}
+
+JobQueue::JobQueue(int fd, std::map<uint64_t, Job> jobs)
+    : fd_(fd), jobs_(std::move(jobs)) {
+  for (const auto& [id, job] : jobs_) {
+    if (job.state == JobState::kPending) {
+      pending_.push_back(id);
+    }
+    next_id_ = id + 1;
+  }
+}
+
+JobQueue::~JobQueue() { close(fd_); }
+
+absl::Status JobQueue::Append(const nlohmann::json& record) {
+  std::string line = record.dump();
+  line.push_back('\n');
+  off_t end = lseek(fd_, 0, SEEK_END);
+  absl::Status status;
+  std::string_view remaining = line;
+  while (!remaining.empty()) {
+    ssize_t written = write(fd_, remaining.data(), remaining.size());
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      status = ErrnoStatus("write journal");
+      break;
+    }
+    remaining.remove_prefix(written);
+  }
+  if (status.ok() && fdatasync(fd_) != 0) {
+    status = ErrnoStatus("sync journal");
+  }
+  // Keeps a partial record from corrupting the next one, and a record the
+  // caller was told failed from being replayed.
+  if (!status.ok() && end >= 0 && ftruncate(fd_, end) != 0) {
+    return absl::InternalError(absl::StrCat(
+        status.message(), "; truncate journal: ", std::strerror(errno)));
+  }
+  return status;
+}
+
+absl::StatusOr<uint64_t> JobQueue::Submit(std::string_view model,
+                                          std::string_view prompt) {
+  absl::MutexLock lock(&mu_);
+  // Never reused, even if the record made it to the file after all.
+  uint64_t id = next_id_++;
+  if (absl::Status status = Append(
+          {{"op", "submit"}, {"id", id}, {"model", model}, {"prompt", prompt}});
+      !status.ok()) {
+    return status;
+  }
+  jobs_[id] = {.id = id,
+               .model = std::string(model),
+               .prompt = std::string(prompt)};
+  pending_.push_back(id);
+  return id;
+}
+
+std::optional<Job> JobQueue::Get(uint64_t id) const {
+  absl::MutexLock lock(&mu_);
+  auto it = jobs_.find(id);
+  if (it == jobs_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+std::optional<Job> JobQueue::Claim() {
+  absl::MutexLock lock(&mu_);
+  mu_.Await(absl::Condition(
+      +[](JobQueue* queue) ABSL_EXCLUSIVE_LOCKS_REQUIRED(queue->mu_) {
+        return queue->closed_ || !queue->pending_.empty();
+      },
+      this));
+  if (closed_) {
+    return std::nullopt;
+  }
+  Job& job = jobs_[pending_.front()];
+  pending_.pop_front();
+  job.state = JobState::kRunning;
+  return job;
+}
+
+absl::Status JobQueue::Finish(uint64_t id,
+                              const absl::StatusOr<std::string>& result) {
+  absl::MutexLock lock(&mu_);
+  auto it = jobs_.find(id);
+  if (it == jobs_.end() || it->second.state != JobState::kRunning) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("Job ", id, " is not running"));
+  }
+  Job& job = it->second;
+  if (absl::IsCancelled(result.status())) {
+    job.state = JobState::kPending;
+    pending_.push_front(id);
+    return absl::OkStatus();
+  }
+  absl::Status status =
+      result.ok() ? Append({{"op", "done"}, {"id", id}, {"result", *result}})
+                  : Append({{"op", "failed"},
+                            {"id", id},
+                            {"code", static_cast<int>(result.status().code())},
+                            {"error", result.status().message()}});
+  // The outcome is kept even if it did not make it to disk: running the job
+  // again right away would pay for it twice.
+  if (result.ok()) {
+    job.state = JobState::kDone;
+    job.result = *result;
+  } else {
+    job.state = JobState::kFailed;
+    job.status = result.status();
+  }
+  return status;
+}
+
+void JobQueue::Close() {
+  absl::MutexLock lock(&mu_);
+  closed_ = true;
+}
+
+JobRunner::JobRunner(JobQueue& queue, const Fetch& fetch,
+                     absl::Span<const std::unique_ptr<ModelProvider>> providers,
+                     size_t workers)
+    : queue_(queue), fetch_(fetch), providers_(providers) {
+  for (size_t i = 0; i < workers; ++i) {
+    workers_.emplace_back([this]() { Work(); });
+  }
+}
+
+JobRunner::~JobRunner() {
+  cancellation_.Cancel();
+  queue_.Close();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void JobRunner::Work() {
+  RequestOptions options = {.cancellation = &cancellation_};
+  while (std::optional<Job> job = queue_.Claim()) {
+    auto model = ConnectToModel(providers_, job->model);
+    absl::StatusOr<std::string> result =
+        model.ok() ? (*model)->Prompt(fetch_, job->prompt, {}, options)
+                   : model.status();
+    if (absl::Status status = queue_.Finish(job->id, result); !status.ok()) {
+      LOG(ERROR) << "Job " << job->id << ": " << status;
+    }
+  }
+}
+
+}  // namespace uchen::chat
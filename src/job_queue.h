@@ -0,0 +1,110 @@
+#ifndef SRC_JOB_QUEUE_H_
+#define SRC_JOB_QUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+#include "src/model.h"
+
+namespace uchen::chat {
+
+enum class JobState { kPending, kRunning, kDone, kFailed };
+
+std::string_view JobStateName(JobState state);
+
+struct Job {
+  uint64_t id = 0;
+  std::string model;
+  std::string prompt;
+  JobState state = JobState::kPending;
+  // The response of the model once the job is kDone.
+  std::string result;
+  // The error once the job is kFailed.
+  absl::Status status;
+};
+
+// Prompts to be answered in the background, kept in an append-only journal.
+// A job is journaled when it is submitted and again when it is done or
+// failed, each record synced to disk before the call returns. Reopening the
+// journal after a crash or restart queues the submitted jobs that have no
+// outcome yet; finished jobs are never run again. A record that was cut short
+// by a crash is dropped.
+class JobQueue {
+ public:
+  static absl::StatusOr<std::unique_ptr<JobQueue>> Open(
+      const std::string& path);
+  ~JobQueue();
+
+  JobQueue(const JobQueue&) = delete;
+  JobQueue& operator=(const JobQueue&) = delete;
+
+  // Returns the id of the new job once it is on disk.
+  absl::StatusOr<uint64_t> Submit(std::string_view model,
+                                  std::string_view prompt);
+  std::optional<Job> Get(uint64_t id) const;
+
+  // Blocks until a job is pending and marks it running. Returns nullopt once
+  // the queue is closed.
+  std::optional<Job> Claim();
+  // Records the outcome of a claimed job. A cancelled job is not journaled
+  // and will run again after a restart.
+  absl::Status Finish(uint64_t id, const absl::StatusOr<std::string>& result);
+  // Wakes up and turns away all Claim() calls.
+  void Close();
+
+ private:
+  JobQueue(int fd, std::map<uint64_t, Job> jobs);
+
+  absl::Status Append(const nlohmann::json& record)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  mutable absl::Mutex mu_;
+  const int fd_;
+  std::map<uint64_t, Job> jobs_ ABSL_GUARDED_BY(mu_);
+  std::deque<uint64_t> pending_ ABSL_GUARDED_BY(mu_);
+  uint64_t next_id_ ABSL_GUARDED_BY(mu_) = 1;
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+};
+
+// Worker threads answering the jobs of a queue with Model::Prompt.
+class JobRunner {
+ public:
+  JobRunner(JobQueue& queue, const Fetch& fetch,
+            absl::Span<const std::unique_ptr<ModelProvider>> providers,
+            size_t workers);
+  // Cancels running jobs, which stay pending in the journal, and joins the
+  // workers.
+  ~JobRunner();
+
+  JobRunner(const JobRunner&) = delete;
+  JobRunner& operator=(const JobRunner&) = delete;
+
+ private:
+  void Work();
+
+  JobQueue& queue_;
+  const Fetch& fetch_;
+  absl::Span<const std::unique_ptr<ModelProvider>> providers_;
+  Cancellation cancellation_;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_JOB_QUEUE_H_
@@ -0,0 +1,216 @@
+#include "src/journal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+
+#include "curl/curl.h"
+#include "nlohmann/json.hpp"
+
+namespace uchen::chat {
+namespace {
+
+// "UCJRNL" and the format version.
+constexpr char kMagic[8] = {'U', 'C', 'J', 'R', 'N', 'L', 0, 1};
+
+struct FileHeader {
+  char magic[8];
+  // Catches files of a build with other record sizes.
+  uint32_t record_size;
+  uint32_t record_count;
+  uint64_t dropped;
+};
+
+// Copies the start of `text` into `out` and returns the size copied.
+uint16_t CopyTruncated(std::string_view text, char* out, size_t capacity) {
+  const size_t size = std::min(text.size(), capacity);
+  std::memcpy(out, text.data(), size);
+  return static_cast<uint16_t>(size);
+}
+
+std::string_view MethodName(JournalRecord::Method method) {
+  switch (method) {
+    case JournalRecord::kGet:
+      return "GET";
+    case JournalRecord::kPost:
+      return "POST";
+    case JournalRecord::kHead:
+      return "HEAD";
+  }
+  return "UNKNOWN";
+}
+
+}  // namespace
+
+RequestJournal::RequestJournal(size_t capacity)
+    : capacity_(std::max<size_t>(capacity, 1)),
+      slots_(std::make_unique<Slot[]>(capacity_)) {}
+
+void RequestJournal::Record(const JournalEntry& entry) {
+  const uint64_t sequence = next_.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots_[sequence % capacity_];
+  uint64_t version = slot.version.load(std::memory_order_relaxed);
+  if (version % 2 == 1 ||
+      !slot.version.compare_exchange_strong(version, version + 1,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed)) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  JournalRecord& record = slot.record;
+  record.sequence = sequence;
+  record.start_unix_ns = absl::ToUnixNanos(entry.start);
+  record.time_to_first_byte_ns =
+      absl::ToInt64Nanoseconds(entry.time_to_first_byte);
+  record.total_time_ns = absl::ToInt64Nanoseconds(entry.total_time);
+  record.request_bytes = entry.request_bytes;
+  record.response_bytes = entry.response_body.size();
+  record.http_status = entry.http_status;
+  record.curl_code = entry.curl_code;
+  record.method = entry.method;
+  record.url_size =
+      CopyTruncated(entry.url, record.url_data, JournalRecord::kMaxUrl);
+  record.request_body_size =
+      CopyTruncated(entry.request_body, record.request_body_data,
+                    JournalRecord::kMaxBody);
+  record.response_body_size =
+      CopyTruncated(entry.response_body, record.response_body_data,
+                    JournalRecord::kMaxBody);
+  slot.version.store(version + 2, std::memory_order_release);
+}
+
+std::vector<JournalRecord> RequestJournal::Records() const {
+  std::vector<JournalRecord> records;
+  records.reserve(capacity_);
+  for (size_t i = 0; i < capacity_; ++i) {
+    const Slot& slot = slots_[i];
+    const uint64_t version = slot.version.load(std::memory_order_acquire);
+    if (version == 0 || version % 2 == 1) {
+      continue;
+    }
+    JournalRecord record;
+    std::memcpy(&record, &slot.record, sizeof(record));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.version.load(std::memory_order_relaxed) == version) {
+      records.push_back(record);
+    }
+  }
+  std::sort(records.begin(), records.end(),
+            [](const JournalRecord& a, const JournalRecord& b) {
+              return a.sequence < b.sequence;
+            });
+  return records;
+}
+
+absl::Status RequestJournal::Write(const std::string& path) const {
+  const std::vector<JournalRecord> records = Records();
+  FileHeader header = {.record_size = sizeof(JournalRecord),
+                       .record_count = static_cast<uint32_t>(records.size()),
+                       .dropped = dropped()};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(records.data()),
+             records.size() * sizeof(JournalRecord));
+  file.close();
+  if (!file) {
+    return absl::InternalError(
+        absl::StrCat("Failed to write the request journal to ", path));
+  }
+  return absl::OkStatus();
+}
+
+void EnableRequestJournal(size_t capacity) {
+  if (GlobalRequestJournal() != nullptr) {
+    return;
+  }
+  // Never deleted: requests on other threads may be recording until exit.
+  auto* journal = new RequestJournal(capacity);
+  RequestJournal* expected = nullptr;
+  if (!journal_internal::journal.compare_exchange_strong(
+          expected, journal, std::memory_order_release)) {
+    delete journal;
+  }
+}
+
+absl::StatusOr<std::vector<JournalRecord>> ReadRequestJournal(
+    const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return absl::NotFoundError(absl::StrCat("Cannot open ", path));
+  }
+  FileHeader header;
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat(path, " is not a request journal"));
+  }
+  if (header.record_size != sizeof(JournalRecord)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        path, " has records of ", header.record_size, " bytes, expected ",
+        sizeof(JournalRecord)));
+  }
+  // A corrupt count must not allocate more than the file holds.
+  file.seekg(0, std::ios::end);
+  const std::streamoff records_bytes =
+      static_cast<std::streamoff>(file.tellg()) - sizeof(header);
+  file.seekg(sizeof(header));
+  const uint64_t records_size =
+      uint64_t{header.record_count} * sizeof(JournalRecord);
+  if (!file || records_size > static_cast<uint64_t>(records_bytes)) {
+    return absl::DataLossError(absl::StrCat(path, " is truncated"));
+  }
+  std::vector<JournalRecord> records(header.record_count);
+  if (!file.read(reinterpret_cast<char*>(records.data()),
+                 records.size() * sizeof(JournalRecord))) {
+    return absl::DataLossError(absl::StrCat(path, " is truncated"));
+  }
+  for (const JournalRecord& record : records) {
+    if (record.url_size > JournalRecord::kMaxUrl ||
+        record.request_body_size > JournalRecord::kMaxBody ||
+        record.response_body_size > JournalRecord::kMaxBody) {
+      return absl::DataLossError(
+          absl::StrCat(path, " has a corrupt record ", record.sequence));
+    }
+  }
+  return records;
+}
+
+std::string FormatJournalRecord(const JournalRecord& record) {
+  nlohmann::json line = {
+      {"sequence", record.sequence},
+      {"start",
+       absl::FormatTime(absl::RFC3339_full,
+                        absl::FromUnixNanos(record.start_unix_ns),
+                        absl::UTCTimeZone())},
+      {"method", MethodName(record.method)},
+      {"url", record.url()},
+      {"http_status", record.http_status},
+      {"time_to_first_byte_ms", record.time_to_first_byte_ns / 1e6},
+      {"total_time_ms", record.total_time_ns / 1e6},
+      {"request_bytes", record.request_bytes},
+      {"response_bytes", record.response_bytes},
+      {"request_body", record.request_body()},
+      {"response_body", record.response_body()},
+  };
+  if (record.curl_code != CURLE_OK) {
+    line["error"] =
+        curl_easy_strerror(static_cast<CURLcode>(record.curl_code));
+  }
+  return line.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,139 @@
+#ifndef SRC_JOURNAL_H_
+#define SRC_JOURNAL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+
+namespace uchen::chat {
+
+// One request as the journal keeps it in memory and writes it to its file.
+// Fixed size and trivially copyable, so recording a request is a handful of
+// copies and nothing is formatted until the journal is dumped.
+struct JournalRecord {
+  static constexpr size_t kMaxUrl = 256;
+  // Longer bodies are cut; `request_bytes` and `response_bytes` keep the
+  // full sizes.
+  static constexpr size_t kMaxBody = 1024;
+
+  enum Method : uint8_t { kGet, kPost, kHead };
+
+  std::string_view url() const { return {url_data, url_size}; }
+  std::string_view request_body() const {
+    return {request_body_data, request_body_size};
+  }
+  std::string_view response_body() const {
+    return {response_body_data, response_body_size};
+  }
+
+  // Requests recorded before this one.
+  uint64_t sequence;
+  int64_t start_unix_ns;
+  int64_t time_to_first_byte_ns;
+  int64_t total_time_ns;
+  uint64_t request_bytes;
+  uint64_t response_bytes;
+  // 0 if no response arrived.
+  int32_t http_status;
+  // The CURLcode of the transfer.
+  int32_t curl_code;
+  Method method;
+  uint8_t reserved;
+  uint16_t url_size;
+  uint16_t request_body_size;
+  uint16_t response_body_size;
+  char url_data[kMaxUrl];
+  char request_body_data[kMaxBody];
+  char response_body_data[kMaxBody];
+};
+static_assert(std::is_trivially_copyable_v<JournalRecord>);
+
+// What a Fetch knows about a finished request. Only valid for the duration
+// of RequestJournal::Record().
+struct JournalEntry {
+  JournalRecord::Method method = JournalRecord::kGet;
+  std::string_view url;
+  std::string_view request_body;
+  // Can be more than `request_body`, e.g. for form uploads.
+  size_t request_bytes = 0;
+  std::string_view response_body;
+  absl::Time start;
+  absl::Duration time_to_first_byte;
+  absl::Duration total_time;
+  int http_status = 0;
+  int curl_code = 0;
+};
+
+// The last `capacity` requests in a ring buffer. Record() claims a slot with
+// one atomic increment and copies the entry in under a per-slot sequence
+// lock, so threads never wait for each other. A record whose slot is still
+// being written by a thread from a full lap earlier is dropped instead.
+class RequestJournal {
+ public:
+  explicit RequestJournal(size_t capacity);
+
+  RequestJournal(const RequestJournal&) = delete;
+  RequestJournal& operator=(const RequestJournal&) = delete;
+
+  void Record(const JournalEntry& entry);
+
+  // The records in the buffer, oldest first. Safe to call while other
+  // threads record; records that are being overwritten are left out.
+  std::vector<JournalRecord> Records() const;
+
+  // Records lost to a slot that was busy.
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  // Writes Records() to `path`, for uchenchat_journal_dump to decode.
+  absl::Status Write(const std::string& path) const;
+
+ private:
+  struct Slot {
+    // Odd while the record is being written, 0 before the first write.
+    std::atomic<uint64_t> version = 0;
+    JournalRecord record;
+  };
+
+  const size_t capacity_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> next_ = 0;
+  std::atomic<uint64_t> dropped_ = 0;
+};
+
+namespace journal_internal {
+
+inline std::atomic<RequestJournal*> journal = nullptr;
+
+}  // namespace journal_internal
+
+// The journal CurlFetch records every request into, nullptr until enabled.
+// While it is off, requests pay for a single relaxed load.
+inline RequestJournal* GlobalRequestJournal() {
+  return journal_internal::journal.load(std::memory_order_acquire);
+}
+
+// Starts the global journal. It cannot be turned off again, and calls after
+// the first do nothing.
+void EnableRequestJournal(size_t capacity);
+
+// Reads a file written by RequestJournal::Write() on a machine of the same
+// byte order.
+absl::StatusOr<std::vector<JournalRecord>> ReadRequestJournal(
+    const std::string& path);
+
+// `record` as one line of JSON. Bytes of UTF-8 sequences cut by the
+// truncation are replaced with U+FFFD.
+std::string FormatJournalRecord(const JournalRecord& record);
+
+}  // namespace uchen::chat
+
+#endif  // SRC_JOURNAL_H_
@@ -0,0 +1,41 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/status/statusor.h"
+
+#include "src/journal.h"
+
+ABSL_FLAG(bool, bodies, true,
+          "Include the recorded start of the request and response bodies.");
+
+int main(int argc, char* argv[]) {
+  absl::SetProgramUsageMessage(
+      "Prints a request journal written by uchenchat --request_journal as "
+      "JSON lines, oldest request first.\n"
+      "Usage: uchenchat_journal_dump [--nobodies] <journal>...");
+  std::vector<char*> paths = absl::ParseCommandLine(argc, argv);
+  if (paths.size() < 2) {
+    std::cerr << "Error: No journal given" << std::endl;
+    return 1;
+  }
+  const bool bodies = absl::GetFlag(FLAGS_bodies);
+  for (size_t i = 1; i < paths.size(); ++i) {
+    auto records = uchen::chat::ReadRequestJournal(paths[i]);
+    if (!records.ok()) {
+      std::cerr << "Error: " << records.status().message() << std::endl;
+      return 1;
+    }
+    for (uchen::chat::JournalRecord& record : *records) {
+      if (!bodies) {
+        record.request_body_size = 0;
+        record.response_body_size = 0;
+      }
+      std::cout << uchen::chat::FormatJournalRecord(record) << "\n";
+    }
+  }
+  return 0;
+}
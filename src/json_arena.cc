@@ -0,0 +1,20 @@
+#include "src/json_arena.h"
+
+#include <memory_resource>
+
+namespace uchen::json {
+namespace {
+
+thread_local std::pmr::memory_resource* current_resource = nullptr;
+
+}  // namespace
+
+ArenaScope::ArenaScope(Arena& arena) : previous_(current_resource) {
+  current_resource = arena.resource();
+}
+
+ArenaScope::~ArenaScope() { current_resource = previous_; }
+
+std::pmr::memory_resource* CurrentArenaResource() { return current_resource; }
+
+}  // namespace uchen::json
@@ -0,0 +1,113 @@
+#ifndef SRC_JSON_ARENA_H_
+#define SRC_JSON_ARENA_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "nlohmann/json.hpp"  // IWYU pragma: keep
+
+namespace uchen::json {
+
+// Memory for the JSON documents of one request. Nodes allocated while an
+// ArenaScope for the arena is active come from a monotonic buffer and are all
+// released together when the arena is destroyed, instead of one by one.
+//
+// Documents allocated from an arena must be destroyed before it.
+class Arena {
+ public:
+  Arena() : resource_(buffer_.data(), buffer_.size()) {}
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  std::pmr::memory_resource* resource() { return &resource_; }
+
+ private:
+  // Covers a typical request payload without touching the heap.
+  std::array<std::byte, 4096> buffer_;
+  std::pmr::monotonic_buffer_resource resource_;
+};
+
+// Makes `arena` the allocation target of Json values on this thread until
+// the scope ends. Scopes nest.
+class ArenaScope {
+ public:
+  explicit ArenaScope(Arena& arena);
+  ~ArenaScope();
+
+  ArenaScope(const ArenaScope&) = delete;
+  ArenaScope& operator=(const ArenaScope&) = delete;
+
+ private:
+  std::pmr::memory_resource* previous_;
+};
+
+// Returns the resource of the innermost ArenaScope on this thread, or nullptr
+// outside of any scope.
+std::pmr::memory_resource* CurrentArenaResource();
+
+// nlohmann::basic_json default-constructs its allocators wherever it needs
+// one, so the allocator cannot carry the arena. It picks up the current scope
+// at allocation time instead and records the source in a small header in
+// front of each block. Values created outside of a scope use the global heap,
+// and any value may be freed anywhere.
+template <typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+  using is_always_equal = std::true_type;
+
+  ArenaAllocator() = default;
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& /* other */) {}  // NOLINT
+
+  T* allocate(size_t n) {
+    std::pmr::memory_resource* resource = CurrentArenaResource();
+    size_t bytes = kHeaderSize + n * sizeof(T);
+    void* block = resource == nullptr
+                      ? ::operator new(bytes, std::align_val_t(kAlignment))
+                      : resource->allocate(bytes, kAlignment);
+    *static_cast<std::pmr::memory_resource**>(block) = resource;
+    return reinterpret_cast<T*>(static_cast<std::byte*>(block) + kHeaderSize);
+  }
+
+  void deallocate(T* p, size_t n) {
+    void* block = reinterpret_cast<std::byte*>(p) - kHeaderSize;
+    auto* resource = *static_cast<std::pmr::memory_resource**>(block);
+    if (resource == nullptr) {
+      ::operator delete(block, std::align_val_t(kAlignment));
+    } else {
+      resource->deallocate(block, kHeaderSize + n * sizeof(T), kAlignment);
+    }
+  }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U>& /* other */) const {
+    return true;
+  }
+
+ private:
+  static constexpr size_t kAlignment =
+      std::max(alignof(T), alignof(std::max_align_t));
+  static constexpr size_t kHeaderSize =
+      std::max(kAlignment, sizeof(std::pmr::memory_resource*));
+};
+
+using String = std::basic_string<char, std::char_traits<char>,
+                                 ArenaAllocator<char>>;
+
+// JSON document type used for provider requests and responses.
+using Json = nlohmann::basic_json<std::map, std::vector, String, bool,
+                                  int64_t, uint64_t, double, ArenaAllocator>;
+
+}  // namespace uchen::json
+
+#endif  // SRC_JSON_ARENA_H_
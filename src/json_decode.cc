@@ -8,46 +8,50 @@ JsonDecode JsonDecode::operator[](size_t index) const {
   if (std::holds_alternative<DecodeError>(contents_)) {
     return *this;
   }
-  const auto& json = std::get<nlohmann::json>(contents_);
+  const auto& json = *std::get<const Json*>(contents_);
   if (!json.is_array()) {
-    return JsonDecode{context_,
+    return JsonDecode{root_, context_,
                       DecodeError(context_.path(), "Is not an array", json)};
   }
   if (index >= json.size()) {
     return JsonDecode{
-        context_,
+        root_, context_,
         DecodeError(
             context_.path(),
             absl::Substitute("Trying to access index $0, but array size is $1",
                              index, json.size()),
             json)};
   }
-  return {context_.Append(absl::Substitute("[$0]", index)), json[index]};
+  return {root_, context_.Append(absl::Substitute("[$0]", index)),
+          &json[index]};
 }
 
 JsonDecode JsonDecode::operator[](std::string_view key) const {
   if (std::holds_alternative<DecodeError>(contents_)) {
     return *this;
   }
-  const auto& json = std::get<nlohmann::json>(contents_);
+  const auto& json = *std::get<const Json*>(contents_);
   if (!json.is_object()) {
     return JsonDecode{
-        context_, DecodeError(context_.path(), "Not an object", json.dump())};
+        root_, context_,
+        DecodeError(context_.path(), "Not an object", json.dump())};
   }
-  if (!json.contains(key)) {
+  auto it = json.find(key);
+  if (it == json.end()) {
     return JsonDecode{
-        context_, DecodeError(context_.path(),
-                              absl::Substitute("Key $0 not found", key), json)};
+        root_, context_,
+        DecodeError(context_.path(), absl::Substitute("Key $0 not found", key),
+                    json)};
   }
   DecodeContext context = context_.Append(absl::Substitute(".$0", key));
-  return {context, json[key]};
+  return {root_, std::move(context), &*it};
 }
 
 DecodeResult<std::string> JsonDecode::String() const {
   if (std::holds_alternative<DecodeError>(contents_)) {
     return std::get<DecodeError>(contents_);
   }
-  const auto& json = std::get<nlohmann::json>(contents_);
+  const auto& json = *std::get<const Json*>(contents_);
   if (!json.is_string()) {
     return DecodeResult<std::string>{
         DecodeError{context_.path(), "Is not a string", json}};
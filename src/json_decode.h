@@ -1,24 +1,26 @@
 #ifndef SRC_JSON_VALIDATOR_H_
 #define SRC_JSON_VALIDATOR_H_
 
+#include <memory>
 #include <ostream>
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <variant>
 
 #include "absl/functional/any_invocable.h"
 #include "absl/log/log.h"  // IWYU pragma: keep
 #include "absl/strings/str_cat.h"
 #include "absl/strings/substitute.h"
 
-#include "nlohmann/json.hpp"  // IWYU pragma: keep
+#include "src/json_arena.h"
 
 namespace uchen::json {
 
 class DecodeError {
  public:
   explicit DecodeError(std::string_view path, std::string_view message,
-                       const nlohmann::json& json)
+                       const Json& json)
       : message_(absl::Substitute("($0) $1 $2", path, message, json.dump())) {}
 
   std::string_view message() const { return message_; }
@@ -70,17 +72,23 @@ std::ostream& operator<<(std::ostream& os, const DecodeResult<T>& result) {
   return os << absl::StrCat(result);
 }
 
+// Navigates a document without copying it. The root is taken over by the
+// decoder (move it in to avoid a copy) and shared by all values derived from
+// it, which only point into it.
 class JsonDecode {
  public:
-  explicit JsonDecode(nlohmann::json json) : contents_(std::move(json)) {}
+  explicit JsonDecode(Json json)
+      : root_(std::allocate_shared<const Json>(ArenaAllocator<Json>(),
+                                               std::move(json))),
+        contents_(root_.get()) {}
 
   JsonDecode operator[](size_t index) const;
   JsonDecode operator[](std::string_view key) const;
   DecodeResult<std::string> String() const;
 
-  bool ok() const { return std::holds_alternative<nlohmann::json>(contents_); }
+  bool ok() const { return std::holds_alternative<const Json*>(contents_); }
 
-  nlohmann::json* operator->() { return &std::get<nlohmann::json>(contents_); }
+  const Json* operator->() const { return std::get<const Json*>(contents_); }
 
  private:
   class DecodeContext {
@@ -100,12 +108,17 @@ class JsonDecode {
     std::string path_;
   };
 
-  JsonDecode(DecodeContext context, DecodeError error)
-      : contents_(std::move(error)), context_(std::move(context)) {}
-  JsonDecode(DecodeContext context, nlohmann::json json)
-      : contents_(std::move(json)), context_(std::move(context)) {}
-
-  std::variant<DecodeError, nlohmann::json> contents_;
+  JsonDecode(std::shared_ptr<const Json> root, DecodeContext context,
+             DecodeError error)
+      : root_(std::move(root)),
+        contents_(std::move(error)),
+        context_(std::move(context)) {}
+  JsonDecode(std::shared_ptr<const Json> root, DecodeContext context,
+             const Json* json)
+      : root_(std::move(root)), contents_(json), context_(std::move(context)) {}
+
+  std::shared_ptr<const Json> root_;
+  std::variant<DecodeError, const Json*> contents_;
   DecodeContext context_;
 };
 
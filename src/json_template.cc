@@ -0,0 +1,200 @@
+#include "src/json_template.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "absl/functional/function_ref.h"
+
+#include "nlohmann/json.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace uchen::json {
+namespace {
+
+constexpr std::string_view kReplacementCharacter = "\xEF\xBF\xBD";
+
+// Bytes that end a run of plain text: the ones JSON strings escape, and the
+// lead and continuation bytes of multi-byte UTF-8, which are validated.
+bool IsSpecial(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\' || c >= 0x80;
+}
+
+// Length of the run of plain bytes at the start of `p`.
+size_t PlainPrefix(const char* p, size_t n) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; i + 16 <= n; i += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    // The comparison is signed, so bytes from 0x80 up count as below 0x20.
+    const __m128i special = _mm_or_si128(
+        _mm_cmplt_epi8(chunk, space),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)));
+    if (int mask = _mm_movemask_epi8(special); mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t space = vdupq_n_u8(0x20);
+  const uint8x16_t high = vdupq_n_u8(0x80);
+  const uint8x16_t quote = vdupq_n_u8('"');
+  const uint8x16_t backslash = vdupq_n_u8('\\');
+  for (; i + 16 <= n; i += 16) {
+    const uint8x16_t chunk =
+        vld1q_u8(reinterpret_cast<const uint8_t*>(p + i));
+    const uint8x16_t special =
+        vorrq_u8(vorrq_u8(vcltq_u8(chunk, space), vcgeq_u8(chunk, high)),
+                 vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)));
+    if (vmaxvq_u8(special) != 0) {
+      break;
+    }
+  }
+#endif
+  while (i < n && !IsSpecial(p[i])) {
+    ++i;
+  }
+  return i;
+}
+
+// Length of the valid UTF-8 sequence at the start of `p`, 0 if there is
+// none. Overlong forms, surrogates and code points past U+10FFFF are
+// invalid.
+size_t Utf8SequenceLength(const unsigned char* p, size_t n) {
+  size_t length;
+  if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+    length = 2;
+  } else if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+    length = 3;
+  } else if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+    length = 4;
+  } else {
+    return 0;
+  }
+  if (n < length) {
+    return 0;
+  }
+  for (size_t i = 1; i < length; ++i) {
+    if ((p[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+  if ((p[0] == 0xE0 && p[1] < 0xA0) || (p[0] == 0xED && p[1] > 0x9F) ||
+      (p[0] == 0xF0 && p[1] < 0x90) || (p[0] == 0xF4 && p[1] > 0x8F)) {
+    return 0;
+  }
+  return length;
+}
+
+void AppendEscaped(std::string& out, unsigned char c) {
+  switch (c) {
+    case '"':
+      out += "\\\"";
+      return;
+    case '\\':
+      out += "\\\\";
+      return;
+    case '\b':
+      out += "\\b";
+      return;
+    case '\f':
+      out += "\\f";
+      return;
+    case '\n':
+      out += "\\n";
+      return;
+    case '\r':
+      out += "\\r";
+      return;
+    case '\t':
+      out += "\\t";
+      return;
+    default:
+      break;
+  }
+  constexpr char kHex[] = "0123456789abcdef";
+  const char escaped[] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xF]};
+  out.append(escaped, sizeof(escaped));
+}
+
+}  // namespace
+
+void AppendJsonString(std::string& out, std::string_view text) {
+  out.reserve(out.size() + text.size() + 2);
+  out.push_back('"');
+  const char* p = text.data();
+  size_t n = text.size();
+  while (n > 0) {
+    size_t plain = PlainPrefix(p, n);
+    out.append(p, plain);
+    p += plain;
+    n -= plain;
+    if (n == 0) {
+      break;
+    }
+    const auto c = static_cast<unsigned char>(*p);
+    if (c < 0x80) {
+      AppendEscaped(out, c);
+      ++p;
+      --n;
+      continue;
+    }
+    if (size_t length =
+            Utf8SequenceLength(reinterpret_cast<const unsigned char*>(p), n);
+        length > 0) {
+      out.append(p, length);
+      p += length;
+      n -= length;
+    } else {
+      out += kReplacementCharacter;
+      ++p;
+      --n;
+    }
+  }
+  out.push_back('"');
+}
+
+std::string_view JsonEscapeKernelName() {
+#if defined(__SSE2__)
+  return "sse2";
+#elif defined(__ARM_NEON)
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+JsonTemplate::JsonTemplate(const nlohmann::json& constant_members,
+                           std::string_view variable_member) {
+  prefix_ = constant_members.dump();
+  // Reopens the object for one more member.
+  prefix_.pop_back();
+  if (prefix_.size() > 1) {
+    prefix_.push_back(',');
+  }
+  AppendJsonString(prefix_, variable_member);
+  prefix_.push_back(':');
+}
+
+std::string JsonTemplate::Render(
+    absl::FunctionRef<void(std::string&)> write_value,
+    size_t size_hint) const {
+  std::string body;
+  body.reserve(prefix_.size() + size_hint + 1);
+  body += prefix_;
+  write_value(body);
+  body.push_back('}');
+  return body;
+}
+
+}  // namespace uchen::json
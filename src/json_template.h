@@ -0,0 +1,44 @@
+#ifndef SRC_JSON_TEMPLATE_H_
+#define SRC_JSON_TEMPLATE_H_
+
+#include <string>
+#include <string_view>
+
+#include "absl/functional/function_ref.h"
+
+#include "nlohmann/json.hpp"
+
+namespace uchen::json {
+
+// Appends `text` to `out` as a quoted JSON string, escaped the way
+// nlohmann::json::dump() does it. Runs of bytes that need no escaping are
+// found 16 at a time with SSE2 or NEON and copied in one go. Invalid UTF-8
+// is replaced with U+FFFD instead of failing.
+void AppendJsonString(std::string& out, std::string_view text);
+
+// Name of the SIMD instructions AppendJsonString uses, "scalar" if none.
+std::string_view JsonEscapeKernelName();
+
+// A request body of which all members but one are the same in every
+// request. Those are serialized once, so a request only serializes the one
+// that varies, e.g. the messages.
+class JsonTemplate {
+ public:
+  // `constant_members` must be an object without `variable_member`.
+  JsonTemplate(const nlohmann::json& constant_members,
+               std::string_view variable_member);
+
+  // The object with `write_value` appending the serialized value of the
+  // variable member, optionally followed by more `,"key":value` members.
+  // `size_hint` is the expected size of what it appends.
+  std::string Render(absl::FunctionRef<void(std::string&)> write_value,
+                     size_t size_hint = 0) const;
+
+ private:
+  // `{"max_tokens":1024,"model":"gpt-4o","messages":`
+  std::string prefix_;
+};
+
+}  // namespace uchen::json
+
+#endif  // SRC_JSON_TEMPLATE_H_
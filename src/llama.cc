@@ -0,0 +1,524 @@
+#include "src/llama.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/functional/function_ref.h"
+#include "absl/log/check.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/types/span.h"
+
+#include "src/q8.h"
+#include "src/thread_pool.h"
+#include "src/trace.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr uint32_t kMagic = 0x616b3432;  // "ak42"
+constexpr int32_t kVersion = 2;
+constexpr size_t kHeaderSize = 256;
+
+// Rows below this are not worth handing to another thread.
+constexpr size_t kMinRowsPerShard = 32;
+
+constexpr std::array<char, 256> kBytes = [] {
+  std::array<char, 256> bytes = {};
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = static_cast<char>(i);
+  }
+  return bytes;
+}();
+
+absl::Status ErrnoStatus(std::string_view what) {
+  return absl::InternalError(absl::StrCat(what, ": ", std::strerror(errno)));
+}
+
+// Hands out consecutive pieces of the mapped checkpoint. Running past the
+// end leaves the cursor failed instead of reading out of bounds.
+class Cursor {
+ public:
+  Cursor(const char* data, size_t size, size_t offset)
+      : data_(data), size_(size), offset_(offset) {}
+
+  template <typename T>
+  const T* Take(size_t count) {
+    if (!ok_ || count > (size_ - offset_) / sizeof(T)) {
+      ok_ = false;
+      return nullptr;
+    }
+    const T* values = reinterpret_cast<const T*>(data_ + offset_);
+    offset_ += count * sizeof(T);
+    return values;
+  }
+
+  // Values followed by their group scales.
+  Q8Tensor TakeQ8(size_t n, size_t group_size) {
+    Q8Tensor tensor;
+    tensor.q = Take<int8_t>(n);
+    tensor.s = Take<float>(n / group_size);
+    return tensor;
+  }
+
+  bool ok() const { return ok_; }
+
+ private:
+  const char* const data_;
+  const size_t size_;
+  size_t offset_;
+  bool ok_ = true;
+};
+
+absl::StatusOr<LlamaConfig> ParseHeader(const char* data, size_t size) {
+  if (size < kHeaderSize) {
+    return absl::InvalidArgumentError("Checkpoint is truncated");
+  }
+  uint32_t magic;
+  std::memcpy(&magic, data, sizeof(magic));
+  int32_t version;
+  std::memcpy(&version, data + 4, sizeof(version));
+  if (magic != kMagic || version != kVersion) {
+    return absl::InvalidArgumentError(
+        "Not an int8 llama2.c checkpoint (export.py --version 2)");
+  }
+  std::array<int32_t, 7> dims;
+  std::memcpy(dims.data(), data + 8, sizeof(dims));
+  const uint8_t shared_classifier = data[36];
+  int32_t group_size;
+  std::memcpy(&group_size, data + 37, sizeof(group_size));
+  if (std::ranges::any_of(dims, [](int32_t dim) { return dim <= 0; }) ||
+      group_size <= 0) {
+    return absl::InvalidArgumentError("Checkpoint has invalid dimensions");
+  }
+  LlamaConfig config = {
+      .dim = static_cast<size_t>(dims[0]),
+      .hidden_dim = static_cast<size_t>(dims[1]),
+      .n_layers = static_cast<size_t>(dims[2]),
+      .n_heads = static_cast<size_t>(dims[3]),
+      .n_kv_heads = static_cast<size_t>(dims[4]),
+      .vocab_size = static_cast<size_t>(dims[5]),
+      .seq_len = static_cast<size_t>(dims[6]),
+      .group_size = static_cast<size_t>(group_size),
+      .shared_classifier = shared_classifier != 0,
+  };
+  // A group size divisible by 4 keeps every scale array aligned.
+  if (config.dim % config.n_heads != 0 ||
+      config.n_heads % config.n_kv_heads != 0 || config.head_size() % 2 != 0 ||
+      config.group_size % 4 != 0 || config.dim % config.group_size != 0 ||
+      config.hidden_dim % config.group_size != 0) {
+    return absl::InvalidArgumentError(
+        "Checkpoint dimensions are not supported");
+  }
+  return config;
+}
+
+void RmsNorm(float* out, const float* x, const float* weight, size_t n) {
+  float sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += x[i] * x[i];
+  }
+  const float scale = 1.0f / std::sqrt(sum / n + 1e-5f);
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = weight[i] * (scale * x[i]);
+  }
+}
+
+void Softmax(float* x, size_t n) {
+  const float max = *std::max_element(x, x + n);
+  float sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = std::exp(x[i] - max);
+    sum += x[i];
+  }
+  for (size_t i = 0; i < n; ++i) {
+    x[i] /= sum;
+  }
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<LlamaWeights>> LlamaWeights::Load(
+    const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return ErrnoStatus(absl::StrCat("Failed to open ", path));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    absl::Status status = ErrnoStatus(absl::StrCat("Failed to stat ", path));
+    close(fd);
+    return status;
+  }
+  const size_t size = st.st_size;
+  void* data = size == 0 ? MAP_FAILED
+                         : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file alive.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return size == 0 ? absl::InvalidArgumentError("Checkpoint is empty")
+                     : ErrnoStatus(absl::StrCat("Failed to map ", path));
+  }
+  std::unique_ptr<LlamaWeights> weights(new LlamaWeights(data, size));
+  const char* bytes = static_cast<const char*>(data);
+  auto config = ParseHeader(bytes, size);
+  if (!config.ok()) {
+    return std::move(config).status();
+  }
+  weights->config_ = *config;
+  const size_t dim = config->dim;
+  const size_t hidden_dim = config->hidden_dim;
+  const size_t kv_dim = config->kv_dim();
+  const size_t group_size = config->group_size;
+
+  Cursor cursor(bytes, size, kHeaderSize);
+  weights->layers_.resize(config->n_layers);
+  for (Layer& layer : weights->layers_) {
+    layer.rms_att = cursor.Take<float>(dim);
+  }
+  for (Layer& layer : weights->layers_) {
+    layer.rms_ffn = cursor.Take<float>(dim);
+  }
+  weights->rms_final_ = cursor.Take<float>(dim);
+  weights->token_embeddings_ =
+      cursor.TakeQ8(config->vocab_size * dim, group_size);
+  // Each kind of matrix is stored for all layers before the next kind.
+  for (auto [member, n] :
+       {std::pair{&Layer::wq, dim * dim}, std::pair{&Layer::wk, dim * kv_dim},
+        std::pair{&Layer::wv, dim * kv_dim}, std::pair{&Layer::wo, dim * dim},
+        std::pair{&Layer::w1, dim * hidden_dim},
+        std::pair{&Layer::w2, hidden_dim * dim},
+        std::pair{&Layer::w3, dim * hidden_dim}}) {
+    for (Layer& layer : weights->layers_) {
+      layer.*member = cursor.TakeQ8(n, group_size);
+    }
+  }
+  weights->classifier_ =
+      config->shared_classifier
+          ? weights->token_embeddings_
+          : cursor.TakeQ8(config->vocab_size * dim, group_size);
+  if (!cursor.ok()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Checkpoint is truncated: ", path));
+  }
+  return weights;
+}
+
+LlamaWeights::~LlamaWeights() { munmap(data_, size_); }
+
+absl::StatusOr<LlamaTokenizer> LlamaTokenizer::Load(const std::string& path,
+                                                    size_t vocab_size) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return absl::NotFoundError(
+        absl::StrCat("Failed to open tokenizer ", path));
+  }
+  LlamaTokenizer tokenizer;
+  tokenizer.byte_tokens_.fill(-1);
+  tokenizer.pieces_.resize(vocab_size);
+  int32_t max_token_length;
+  file.read(reinterpret_cast<char*>(&max_token_length),
+            sizeof(max_token_length));
+  for (size_t id = 0; id < vocab_size && file; ++id) {
+    Piece& piece = tokenizer.pieces_[id];
+    int32_t length = 0;
+    file.read(reinterpret_cast<char*>(&piece.score), sizeof(piece.score));
+    file.read(reinterpret_cast<char*>(&length), sizeof(length));
+    if (!file || length < 0 || length > max_token_length) {
+      file.setstate(std::ios::failbit);
+      break;
+    }
+    piece.text.resize(length);
+    file.read(piece.text.data(), length);
+    uint32_t byte;
+    if (piece.text.size() == 6 && absl::StartsWith(piece.text, "<0x") &&
+        piece.text.back() == '>' &&
+        absl::SimpleHexAtoi(std::string_view(piece.text).substr(3, 2),
+                            &byte)) {
+      piece.byte = byte;
+      tokenizer.byte_tokens_[byte] = id;
+    }
+    tokenizer.ids_.try_emplace(piece.text, id);
+  }
+  if (!file) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Tokenizer is truncated or corrupt: ", path));
+  }
+  return tokenizer;
+}
+
+int LlamaTokenizer::Lookup(std::string_view text) const {
+  auto it = ids_.find(text);
+  return it == ids_.end() ? -1 : it->second;
+}
+
+std::vector<int> LlamaTokenizer::Encode(std::string_view text) const {
+  TraceSpan span("LlamaTokenizer::Encode");
+  std::vector<int> tokens = {kBos};
+  if (text.empty()) {
+    return tokens;
+  }
+  if (int space = Lookup(" "); space >= 0) {
+    tokens.push_back(space);
+  }
+  // One token per UTF-8 character, or per byte if the character has none.
+  for (size_t i = 0; i < text.size();) {
+    size_t length = 1;
+    while (length < 4 && i + length < text.size() &&
+           (text[i + length] & 0xc0) == 0x80) {
+      ++length;
+    }
+    std::string_view character = text.substr(i, length);
+    if (int id = Lookup(character); id >= 0) {
+      tokens.push_back(id);
+    } else {
+      for (char c : character) {
+        if (int id = byte_tokens_[static_cast<unsigned char>(c)]; id >= 0) {
+          tokens.push_back(id);
+        }
+      }
+    }
+    i += length;
+  }
+  // Merges the adjacent pair that forms the piece with the best score until
+  // no pair forms a piece.
+  std::string pair;
+  while (true) {
+    float best_score = 0;
+    int best_id = -1;
+    size_t best_index = 0;
+    for (size_t i = 1; i + 1 < tokens.size(); ++i) {
+      pair = pieces_[tokens[i]].text;
+      pair += pieces_[tokens[i + 1]].text;
+      int id = Lookup(pair);
+      if (id >= 0 && (best_id < 0 || pieces_[id].score > best_score)) {
+        best_score = pieces_[id].score;
+        best_id = id;
+        best_index = i;
+      }
+    }
+    if (best_id < 0) {
+      return tokens;
+    }
+    tokens[best_index] = best_id;
+    tokens.erase(tokens.begin() + best_index + 1);
+  }
+}
+
+std::string_view LlamaTokenizer::Decode(int previous, int token) const {
+  if (token < 0 || static_cast<size_t>(token) >= pieces_.size()) {
+    return {};
+  }
+  const Piece& piece = pieces_[token];
+  if (piece.byte >= 0) {
+    return std::string_view(&kBytes[piece.byte], 1);
+  }
+  std::string_view text = piece.text;
+  // Drops the space Encode put in front of the text.
+  if (previous == kBos && absl::StartsWith(text, " ")) {
+    text.remove_prefix(1);
+  }
+  return text;
+}
+
+LlamaSession::LlamaSession(std::shared_ptr<const LlamaWeights> weights,
+                           ThreadPool* pool)
+    : weights_(std::move(weights)), pool_(pool) {
+  const LlamaConfig& config = weights_->config();
+  x_.resize(config.dim);
+  xb_.resize(config.dim);
+  xb2_.resize(config.dim);
+  hb_.resize(config.hidden_dim);
+  hb2_.resize(config.hidden_dim);
+  q_.resize(config.dim);
+  att_.resize(config.n_heads * config.seq_len);
+  logits_.resize(config.vocab_size);
+  xq_.resize(std::max(config.dim, config.hidden_dim));
+  xs_.resize(xq_.size() / config.group_size);
+  key_cache_.resize(config.n_layers * config.seq_len * config.kv_dim());
+  value_cache_.resize(key_cache_.size());
+}
+
+absl::Span<const float> LlamaSession::Prefill(absl::Span<const int> tokens) {
+  TraceSpan span("LlamaSession::Prefill");
+  CHECK(!tokens.empty());
+  // The last token is always run again for its logits.
+  size_t cached = 0;
+  while (cached + 1 < tokens.size() && cached < tokens_.size() &&
+         tokens_[cached] == tokens[cached]) {
+    ++cached;
+  }
+  tokens_.resize(cached);
+  for (size_t i = cached; i + 1 < tokens.size(); ++i) {
+    Forward(tokens[i], i, /*logits=*/false);
+    tokens_.push_back(tokens[i]);
+  }
+  return Append(tokens.back());
+}
+
+absl::Span<const float> LlamaSession::Append(int token) {
+  CHECK_LT(tokens_.size(), config().seq_len);
+  Forward(token, tokens_.size(), /*logits=*/true);
+  tokens_.push_back(token);
+  return logits_;
+}
+
+void LlamaSession::ParallelFor(size_t n, size_t min_shard,
+                               absl::FunctionRef<void(size_t, size_t)> fn) {
+  const size_t shards =
+      pool_ == nullptr
+          ? 1
+          : std::min(pool_->size() + 1, std::max<size_t>(1, n / min_shard));
+  if (shards == 1) {
+    fn(0, n);
+    return;
+  }
+  const size_t per_shard = (n + shards - 1) / shards;
+  absl::BlockingCounter done(shards - 1);
+  for (size_t shard = 1; shard < shards; ++shard) {
+    const size_t begin = std::min(n, shard * per_shard);
+    const size_t end = std::min(n, begin + per_shard);
+    pool_->Schedule([&fn, &done, begin, end] {
+      fn(begin, end);
+      done.DecrementCount();
+    });
+  }
+  fn(0, per_shard);
+  done.Wait();
+}
+
+void LlamaSession::MatMul(float* out, Q8Tensor w, const int8_t* xq,
+                          const float* xs, size_t rows, size_t cols) {
+  const size_t group_size = config().group_size;
+  ParallelFor(rows, kMinRowsPerShard, [&](size_t begin, size_t end) {
+    for (size_t row = begin; row < end; ++row) {
+      Q8Tensor w_row = {.q = w.q + row * cols,
+                        .s = w.s + row * cols / group_size};
+      out[row] = DotQ8(w_row, {.q = xq, .s = xs}, cols, group_size);
+    }
+  });
+}
+
+void LlamaSession::Forward(int token, size_t pos, bool logits) {
+  TraceSpan span("LlamaSession::Forward");
+  const LlamaConfig& config = weights_->config();
+  const size_t dim = config.dim;
+  const size_t hidden_dim = config.hidden_dim;
+  const size_t kv_dim = config.kv_dim();
+  const size_t head_size = config.head_size();
+  const size_t kv_per_head = config.n_heads / config.n_kv_heads;
+  const size_t group_size = config.group_size;
+  int8_t* xq = xq_.data();
+  float* xs = xs_.data();
+
+  Q8Tensor embeddings = weights_->token_embeddings();
+  DequantizeQ8({.q = embeddings.q + token * dim,
+                .s = embeddings.s + token * dim / group_size},
+               dim, group_size, x_.data());
+
+  for (size_t l = 0; l < config.n_layers; ++l) {
+    const LlamaWeights::Layer& layer = weights_->layer(l);
+    const size_t layer_offset = l * config.seq_len * kv_dim;
+    float* k = key_cache_.data() + layer_offset + pos * kv_dim;
+    float* v = value_cache_.data() + layer_offset + pos * kv_dim;
+
+    RmsNorm(xb_.data(), x_.data(), layer.rms_att, dim);
+    QuantizeQ8(xb_.data(), dim, group_size, xq, xs);
+    MatMul(q_.data(), layer.wq, xq, xs, dim, dim);
+    MatMul(k, layer.wk, xq, xs, kv_dim, dim);
+    MatMul(v, layer.wv, xq, xs, kv_dim, dim);
+
+    // Rotary position embedding of the query and key of every head.
+    for (size_t i = 0; i < dim; i += 2) {
+      const float freq =
+          1.0f / std::pow(10000.0f, static_cast<float>(i % head_size) /
+                                        static_cast<float>(head_size));
+      const float angle = pos * freq;
+      const float cos = std::cos(angle);
+      const float sin = std::sin(angle);
+      for (float* vec : {q_.data(), i < kv_dim ? k : nullptr}) {
+        if (vec != nullptr) {
+          const float v0 = vec[i];
+          const float v1 = vec[i + 1];
+          vec[i] = v0 * cos - v1 * sin;
+          vec[i + 1] = v0 * sin + v1 * cos;
+        }
+      }
+    }
+
+    ParallelFor(config.n_heads, 1, [&](size_t begin, size_t end) {
+      for (size_t h = begin; h < end; ++h) {
+        const float* q = q_.data() + h * head_size;
+        float* att = att_.data() + h * config.seq_len;
+        const size_t kv_offset = layer_offset + (h / kv_per_head) * head_size;
+        for (size_t t = 0; t <= pos; ++t) {
+          const float* key = key_cache_.data() + kv_offset + t * kv_dim;
+          float score = 0;
+          for (size_t i = 0; i < head_size; ++i) {
+            score += q[i] * key[i];
+          }
+          att[t] = score / std::sqrt(static_cast<float>(head_size));
+        }
+        Softmax(att, pos + 1);
+        float* out = xb_.data() + h * head_size;
+        std::fill(out, out + head_size, 0.0f);
+        for (size_t t = 0; t <= pos; ++t) {
+          const float* value = value_cache_.data() + kv_offset + t * kv_dim;
+          for (size_t i = 0; i < head_size; ++i) {
+            out[i] += att[t] * value[i];
+          }
+        }
+      }
+    });
+
+    QuantizeQ8(xb_.data(), dim, group_size, xq, xs);
+    MatMul(xb2_.data(), layer.wo, xq, xs, dim, dim);
+    for (size_t i = 0; i < dim; ++i) {
+      x_[i] += xb2_[i];
+    }
+
+    // SwiGLU feed-forward network.
+    RmsNorm(xb_.data(), x_.data(), layer.rms_ffn, dim);
+    QuantizeQ8(xb_.data(), dim, group_size, xq, xs);
+    MatMul(hb_.data(), layer.w1, xq, xs, hidden_dim, dim);
+    MatMul(hb2_.data(), layer.w3, xq, xs, hidden_dim, dim);
+    for (size_t i = 0; i < hidden_dim; ++i) {
+      const float silu = hb_[i] / (1.0f + std::exp(-hb_[i]));
+      hb_[i] = silu * hb2_[i];
+    }
+    QuantizeQ8(hb_.data(), hidden_dim, group_size, xq, xs);
+    MatMul(xb_.data(), layer.w2, xq, xs, dim, hidden_dim);
+    for (size_t i = 0; i < dim; ++i) {
+      x_[i] += xb_[i];
+    }
+  }
+
+  if (logits) {
+    RmsNorm(x_.data(), x_.data(), weights_->rms_final(), dim);
+    QuantizeQ8(x_.data(), dim, group_size, xq, xs);
+    MatMul(logits_.data(), weights_->classifier(), xq, xs, config.vocab_size,
+           dim);
+  }
+}
+
+}  // namespace uchen::chat
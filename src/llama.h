@@ -0,0 +1,158 @@
+#ifndef SRC_LLAMA_H_
+#define SRC_LLAMA_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+
+#include "src/q8.h"
+#include "src/thread_pool.h"
+
+namespace uchen::chat {
+
+struct LlamaConfig {
+  size_t dim = 0;
+  size_t hidden_dim = 0;
+  size_t n_layers = 0;
+  size_t n_heads = 0;
+  // Fewer than n_heads for grouped-query attention.
+  size_t n_kv_heads = 0;
+  size_t vocab_size = 0;
+  // Longest sequence the model was trained on, which bounds the KV cache.
+  size_t seq_len = 0;
+  size_t group_size = 0;
+  bool shared_classifier = false;
+
+  size_t head_size() const { return dim / n_heads; }
+  size_t kv_dim() const { return dim * n_kv_heads / n_heads; }
+};
+
+// Weights of a Llama-architecture model in the int8 checkpoint format of
+// llama2.c ("version 2", written by `export.py --version 2`): a 256 byte
+// header, the RMSNorm weights as float32 and every matrix quantized to int8
+// in groups of `group_size` values sharing a float32 scale. The file is
+// mapped read-only and shared by all sessions, so loading is instant and the
+// pages are only read in as they are used.
+class LlamaWeights {
+ public:
+  struct Layer {
+    const float* rms_att;
+    const float* rms_ffn;
+    Q8Tensor wq;
+    Q8Tensor wk;
+    Q8Tensor wv;
+    Q8Tensor wo;
+    Q8Tensor w1;
+    Q8Tensor w2;
+    Q8Tensor w3;
+  };
+
+  static absl::StatusOr<std::unique_ptr<LlamaWeights>> Load(
+      const std::string& path);
+  ~LlamaWeights();
+
+  LlamaWeights(const LlamaWeights&) = delete;
+  LlamaWeights& operator=(const LlamaWeights&) = delete;
+
+  const LlamaConfig& config() const { return config_; }
+  const Layer& layer(size_t index) const { return layers_[index]; }
+  Q8Tensor token_embeddings() const { return token_embeddings_; }
+  const float* rms_final() const { return rms_final_; }
+  Q8Tensor classifier() const { return classifier_; }
+
+ private:
+  LlamaWeights(void* data, size_t size) : data_(data), size_(size) {}
+
+  void* const data_;
+  const size_t size_;
+  LlamaConfig config_;
+  std::vector<Layer> layers_;
+  Q8Tensor token_embeddings_;
+  const float* rms_final_ = nullptr;
+  Q8Tensor classifier_;
+};
+
+// SentencePiece-style BPE vocabulary in the tokenizer.bin format of
+// llama2.c: pieces with merge scores and byte fallback tokens.
+class LlamaTokenizer {
+ public:
+  static constexpr int kBos = 1;
+  static constexpr int kEos = 2;
+
+  static absl::StatusOr<LlamaTokenizer> Load(const std::string& path,
+                                             size_t vocab_size);
+
+  // Starts with kBos, then the text with a space prepended, as the models
+  // were trained.
+  std::vector<int> Encode(std::string_view text) const;
+  // Text of `token` following `previous`.
+  std::string_view Decode(int previous, int token) const;
+
+ private:
+  struct Piece {
+    std::string text;
+    float score = 0;
+    // For the <0xXX> byte fallback tokens, the byte.
+    int byte = -1;
+  };
+
+  int Lookup(std::string_view text) const;
+
+  std::vector<Piece> pieces_;
+  absl::flat_hash_map<std::string, int> ids_;
+  // Token of each byte, for text not covered by the pieces. -1 if missing.
+  std::array<int, 256> byte_tokens_;
+};
+
+// Decoding state of one conversation: activations and the KV cache of every
+// token fed so far. Matrix rows and attention heads are split over `pool`,
+// with the calling thread taking a share. Not thread safe.
+class LlamaSession {
+ public:
+  LlamaSession(std::shared_ptr<const LlamaWeights> weights, ThreadPool* pool);
+
+  // Feeds `tokens` and returns the logits for the token after them. The
+  // longest prefix of `tokens` that is already in the KV cache is not
+  // computed again, so a prompt that extends the previous one only pays for
+  // the new part. `tokens` must be non-empty and fit in seq_len.
+  absl::Span<const float> Prefill(absl::Span<const int> tokens);
+  // Feeds one more token.
+  absl::Span<const float> Append(int token);
+
+  // Tokens in the KV cache.
+  const std::vector<int>& tokens() const { return tokens_; }
+  const LlamaConfig& config() const { return weights_->config(); }
+
+ private:
+  // Runs `token` at position `pos`, filling the KV cache. The logits are
+  // only computed when asked for.
+  void Forward(int token, size_t pos, bool logits);
+  // Runs fn(begin, end) over shards of [0, n).
+  void ParallelFor(size_t n, size_t min_shard,
+                   absl::FunctionRef<void(size_t, size_t)> fn);
+  // out = w * (xq, xs), w being `rows` x `cols`.
+  void MatMul(float* out, Q8Tensor w, const int8_t* xq, const float* xs,
+              size_t rows, size_t cols);
+
+  const std::shared_ptr<const LlamaWeights> weights_;
+  ThreadPool* const pool_;
+  std::vector<int> tokens_;
+  std::vector<float> x_, xb_, xb2_, hb_, hb2_, q_, att_, logits_;
+  std::vector<int8_t> xq_;
+  std::vector<float> xs_;
+  // n_layers x seq_len x kv_dim each.
+  std::vector<float> key_cache_, value_cache_;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_LLAMA_H_
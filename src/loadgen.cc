@@ -0,0 +1,631 @@
+#include "src/loadgen.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/cleanup/cleanup.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+#include "src/model.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr int kListenBacklog = 128;
+
+absl::Status ErrnoStatus(std::string_view what) {
+  return absl::UnavailableError(absl::StrCat(what, ": ", std::strerror(errno)));
+}
+
+bool Receive(int fd, std::string& buffer) {
+  char chunk[16384];
+  while (true) {
+    ssize_t read = recv(fd, chunk, sizeof(chunk), 0);
+    if (read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read <= 0) {
+      return false;
+    }
+    buffer.append(chunk, read);
+    return true;
+  }
+}
+
+bool Send(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data.remove_prefix(written);
+  }
+  return true;
+}
+
+// When the first byte of a response arrived on this thread, for the request
+// of a session that is in progress.
+thread_local std::optional<absl::Time> first_byte_time;
+
+// Notes when the first response of a prompt started arriving.
+class FirstByteFetch : public Fetch {
+ public:
+  explicit FirstByteFetch(const Fetch& fetch) : fetch_(fetch) {}
+
+  absl::StatusOr<Response> Post(const std::string& url,
+                                absl::Span<const Header> headers,
+                                const json::Json& payload,
+                                const RequestOptions& options) const override {
+    absl::Time start = absl::Now();
+    auto response = fetch_.Post(url, headers, payload, options);
+    Note(start, response);
+    return response;
+  }
+
+  absl::StatusOr<Response> PostJson(
+      const std::string& url, absl::Span<const Header> headers,
+      std::string_view body, const RequestOptions& options) const override {
+    absl::Time start = absl::Now();
+    auto response = fetch_.PostJson(url, headers, body, options);
+    Note(start, response);
+    return response;
+  }
+
+  absl::StatusOr<Response> Get(const std::string& url,
+                               absl::Span<const Header> headers,
+                               const RequestOptions& options) const override {
+    absl::Time start = absl::Now();
+    auto response = fetch_.Get(url, headers, options);
+    Note(start, response);
+    return response;
+  }
+
+ private:
+  static void Note(absl::Time start,
+                   const absl::StatusOr<Response>& response) {
+    if (response.ok() && !first_byte_time.has_value()) {
+      first_byte_time = start + response->time_to_first_byte();
+    }
+  }
+
+  const Fetch& fetch_;
+};
+
+absl::Duration ThreadCpuTime() {
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return absl::DurationFromTimeval(usage.ru_utime) +
+         absl::DurationFromTimeval(usage.ru_stime);
+}
+
+int64_t PeakRssBytes() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return int64_t{usage.ru_maxrss} * 1024;
+}
+
+// Nearest-rank percentile of sorted `values`.
+absl::Duration Percentile(const std::vector<absl::Duration>& values,
+                          double percent) {
+  if (values.empty()) {
+    return absl::ZeroDuration();
+  }
+  size_t rank = static_cast<size_t>(percent / 100 * values.size() + 0.5);
+  return values[std::clamp<size_t>(rank, 1, values.size()) - 1];
+}
+
+void AppendPercentiles(std::string& out, std::string_view label,
+                       std::vector<absl::Duration> values) {
+  std::ranges::sort(values);
+  absl::StrAppendFormat(&out, "%-14s", label);
+  for (double percent : {50.0, 90.0, 99.0}) {
+    absl::StrAppendFormat(
+        &out, "%10.1fms",
+        absl::ToDoubleMilliseconds(Percentile(values, percent)));
+  }
+  out.push_back('\n');
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<StubServer>> StubServer::Start(
+    StubOptions options) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoStatus("socket");
+  }
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  if (bind(fd, reinterpret_cast<const sockaddr*>(&address), length) != 0 ||
+      listen(fd, kListenBacklog) != 0 ||
+      getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+    absl::Status status = ErrnoStatus("Failed to listen on the loopback");
+    close(fd);
+    return status;
+  }
+  return std::unique_ptr<StubServer>(
+      new StubServer(fd, ntohs(address.sin_port), std::move(options)));
+}
+
+StubServer::StubServer(int listen_fd, int port, StubOptions options)
+    : listen_fd_(listen_fd),
+      port_(port),
+      options_(std::move(options)),
+      openai_body_(nlohmann::json{
+          {"choices",
+           {{{"message",
+              {{"role", "assistant"}, {"content", options_.reply}}},
+             {"finish_reason", "stop"}}}}}.dump()),
+      anthropic_body_(nlohmann::json{
+          {"content", {{{"type", "text"}, {"text", options_.reply}}}},
+          {"stop_reason", "end_turn"}}.dump()),
+      acceptor_([this]() { Accept(); }) {}
+
+StubServer::~StubServer() {
+  {
+    absl::MutexLock lock(&mu_);
+    stopped_.Notify();
+    shutdown(listen_fd_, SHUT_RDWR);
+    for (int fd : connections_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+  acceptor_.join();
+  absl::MutexLock lock(&mu_);
+  mu_.Await(absl::Condition(
+      +[](absl::flat_hash_set<int>* connections) {
+        return connections->empty();
+      },
+      &connections_));
+  close(listen_fd_);
+}
+
+size_t StubServer::connections_accepted() {
+  absl::MutexLock lock(&mu_);
+  return connections_accepted_;
+}
+
+size_t StubServer::requests_received() {
+  absl::MutexLock lock(&mu_);
+  return requests_received_;
+}
+
+std::string StubServer::api_url() const {
+  return absl::StrCat("http://127.0.0.1:", port_, "/v1");
+}
+
+void StubServer::Accept() {
+  while (true) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+    // Headers and body go out in separate writes.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    absl::MutexLock lock(&mu_);
+    if (stopped_.HasBeenNotified()) {
+      close(fd);
+      return;
+    }
+    connections_.insert(fd);
+    ++connections_accepted_;
+    std::thread([this, fd]() { Serve(fd); }).detach();
+  }
+}
+
+void StubServer::Serve(int fd) {
+  absl::Cleanup cleanup = [this, fd]() {
+    absl::MutexLock lock(&mu_);
+    connections_.erase(fd);
+    close(fd);
+  };
+  std::string buffer;
+  while (true) {
+    size_t header_end;
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      if (!Receive(fd, buffer)) {
+        return;
+      }
+    }
+    std::string head = absl::AsciiStrToLower(
+        std::string_view(buffer).substr(0, header_end + 2));
+    size_t content_length = 0;
+    if (size_t field = head.find("\r\ncontent-length:");
+        field != std::string::npos) {
+      field += std::string_view("\r\ncontent-length:").size();
+      if (!absl::SimpleAtoi(std::string_view(head).substr(
+                                field, head.find("\r\n", field) - field),
+                            &content_length)) {
+        return;
+      }
+    }
+    if (absl::StrContains(head, "\r\nexpect: 100-continue\r\n") &&
+        !Send(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+      return;
+    }
+    size_t request_size = header_end + 4 + content_length;
+    while (buffer.size() < request_size) {
+      if (!Receive(fd, buffer)) {
+        return;
+      }
+    }
+    if (!Reply(fd, std::string_view(head).substr(0, head.find("\r\n")),
+               std::string_view(buffer).substr(header_end + 4,
+                                                content_length))) {
+      return;
+    }
+    buffer.erase(0, request_size);
+  }
+}
+
+bool StubServer::Reply(int fd, std::string_view request_line,
+                       std::string_view request_body) {
+  {
+    absl::MutexLock lock(&mu_);
+    ++requests_received_;
+  }
+  // "post /v1/chat/completions http/1.1", lowercased.
+  std::string_view method = request_line.substr(0, request_line.find(' '));
+  std::string_view path = request_line.substr(request_line.find(' ') + 1);
+  path = path.substr(0, path.find(' '));
+  std::string_view status = "200 OK";
+  std::string_view body;
+  std::optional<std::string> batch_body;
+  if ((path == "/v1/chat/completions" || path == "/v1/messages") &&
+      absl::StrContains(request_body, R"("stream":true)")) {
+    return StreamReply(fd, path);
+  }
+  if (path == "/v1/chat/completions") {
+    body = openai_body_;
+  } else if (path == "/v1/messages") {
+    body = anthropic_body_;
+  } else if (batch_body = BatchReply(method, path, request_body);
+             batch_body.has_value()) {
+    body = *batch_body;
+  } else {
+    status = "404 Not Found";
+    body = R"({"error":{"message":"Not found"}})";
+  }
+  std::string headers =
+      absl::StrCat("HTTP/1.1 ", status,
+                   "\r\nContent-Type: application/json\r\nContent-Length: ",
+                   body.size(), "\r\n\r\n");
+  if (absl::StartsWith(request_line, "head ")) {
+    // Connection warm-ups are answered right away.
+    return Send(fd, headers);
+  }
+  if (stopped_.WaitForNotificationWithTimeout(options_.time_to_first_byte) ||
+      !Send(fd, headers)) {
+    return false;
+  }
+  return !stopped_.WaitForNotificationWithTimeout(
+             options_.latency - options_.time_to_first_byte) &&
+         Send(fd, body);
+}
+
+bool StubServer::StreamReply(int fd, std::string_view path) {
+  const bool openai = path == "/v1/chat/completions";
+  // Frames `text` as a chunk of the body.
+  auto frame = [](std::string_view text) {
+    return absl::StrCat(absl::Hex(text.size()), "\r\n", text, "\r\n");
+  };
+  auto chunk = [&](std::string_view event, const nlohmann::json& data) {
+    return frame(event.empty()
+                     ? absl::StrCat("data: ", data.dump(), "\n\n")
+                     : absl::StrCat("event: ", event, "\ndata: ",
+                                    data.dump(), "\n\n"));
+  };
+  if (stopped_.WaitForNotificationWithTimeout(options_.time_to_first_byte) ||
+      !Send(fd,
+            "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n") ||
+      stopped_.WaitForNotificationWithTimeout(options_.latency -
+                                              options_.time_to_first_byte)) {
+    return false;
+  }
+  std::string_view rest = options_.reply;
+  while (!rest.empty()) {
+    // A word with the space before it.
+    size_t end = rest.find(' ', 1);
+    std::string_view word = rest.substr(0, end);
+    rest.remove_prefix(word.size());
+    std::string event =
+        openai ? chunk("", {{"choices",
+                             {{{"delta", {{"content", word}}},
+                               {"finish_reason", nullptr}}}}})
+               : chunk("content_block_delta",
+                       {{"type", "content_block_delta"},
+                        {"index", 0},
+                        {"delta", {{"type", "text_delta"}, {"text", word}}}});
+    if (!Send(fd, event) || (!rest.empty() &&
+                             stopped_.WaitForNotificationWithTimeout(
+                                 options_.stream_interval))) {
+      return false;
+    }
+  }
+  std::string end =
+      openai
+          ? absl::StrCat(
+                chunk("", {{"choices",
+                            {{{"delta", nlohmann::json::object()},
+                              {"finish_reason", "stop"}}}}}),
+                frame("data: [DONE]\n\n"))
+          : absl::StrCat(
+                chunk("message_delta",
+                      {{"type", "message_delta"},
+                       {"delta", {{"stop_reason", "end_turn"}}}}),
+                chunk("message_stop", {{"type", "message_stop"}}));
+  return Send(fd, absl::StrCat(end, "0\r\n\r\n"));
+}
+
+std::optional<std::string> StubServer::BatchReply(std::string_view method,
+                                                  std::string_view path,
+                                                  std::string_view body) {
+  auto failed = [](std::string_view request_id) {
+    return absl::StrContains(request_id, "error");
+  };
+  absl::MutexLock lock(&mu_);
+  if (method == "post") {
+    if (path == "/v1/files") {
+      // The JSON lines of the requests, between the multipart boundaries.
+      std::vector<std::string> ids;
+      for (std::string_view line : absl::StrSplit(body, '\n')) {
+        nlohmann::json line_request = nlohmann::json::parse(
+            absl::StripTrailingAsciiWhitespace(line), nullptr, false);
+        if (line_request.is_object() && line_request.contains("custom_id")) {
+          ids.push_back(line_request["custom_id"].get<std::string>());
+        }
+      }
+      std::string id = absl::StrCat("file-", files_.size() + 1);
+      files_[id] = std::move(ids);
+      return nlohmann::json{{"id", id}, {"object", "file"}}.dump();
+    }
+    nlohmann::json request = nlohmann::json::parse(body, nullptr, false);
+    if (!request.is_object()) {
+      return std::nullopt;
+    }
+    if (path == "/v1/batches") {
+      auto file = files_.find(request.value("input_file_id", ""));
+      if (file == files_.end()) {
+        return std::nullopt;
+      }
+      std::string id = absl::StrCat("batch_", batches_.size() + 1);
+      batches_[id] = {.request_ids = file->second};
+      return nlohmann::json{{"id", id}, {"status", "validating"}}.dump();
+    }
+    if (path == "/v1/messages/batches") {
+      Batch batch;
+      if (auto items = request.find("requests");
+          items != request.end() && items->is_array()) {
+        for (const nlohmann::json& item : *items) {
+          batch.request_ids.push_back(item.value("custom_id", ""));
+        }
+      }
+      std::string id = absl::StrCat("msgbatch_", batches_.size() + 1);
+      batches_[id] = std::move(batch);
+      return nlohmann::json{{"id", id}, {"processing_status", "in_progress"}}
+          .dump();
+    }
+    return std::nullopt;
+  }
+
+  std::string_view id = path;
+  if (absl::ConsumePrefix(&id, "/v1/batches/")) {
+    auto batch = batches_.find(id);
+    if (batch == batches_.end()) {
+      return std::nullopt;
+    }
+    const bool done = ++batch->second.polls > options_.batch_polls;
+    const bool errors =
+        std::ranges::any_of(batch->second.request_ids, failed);
+    nlohmann::json response = {{"id", id},
+                               {"status", done ? "completed" : "in_progress"},
+                               {"output_file_id", nullptr},
+                               {"error_file_id", nullptr}};
+    if (done) {
+      response["output_file_id"] = absl::StrCat("file-out-", id);
+      if (errors) {
+        response["error_file_id"] = absl::StrCat("file-err-", id);
+      }
+    }
+    return response.dump();
+  }
+  if (absl::ConsumePrefix(&id, "/v1/files/") &&
+      absl::ConsumeSuffix(&id, "/content")) {
+    const bool output = absl::ConsumePrefix(&id, "file-out-");
+    if (!output && !absl::ConsumePrefix(&id, "file-err-")) {
+      return std::nullopt;
+    }
+    auto batch = batches_.find(id);
+    if (batch == batches_.end()) {
+      return std::nullopt;
+    }
+    std::string lines;
+    for (const std::string& request_id :
+         std::ranges::reverse_view(batch->second.request_ids)) {
+      if (failed(request_id) == output) {
+        continue;
+      }
+      nlohmann::json line = {{"custom_id", request_id},
+                             {"response", nullptr},
+                             {"error", nullptr}};
+      if (output) {
+        line["response"] = {{"status_code", 200},
+                            {"body", nlohmann::json::parse(openai_body_)}};
+      } else {
+        line["error"] = {{"code", "stub"}, {"message", "Failed in the stub"}};
+      }
+      absl::StrAppend(&lines, line.dump(), "\n");
+    }
+    return lines;
+  }
+  if (absl::ConsumePrefix(&id, "/v1/messages/batches/")) {
+    const bool results = absl::ConsumeSuffix(&id, "/results");
+    auto batch = batches_.find(id);
+    if (batch == batches_.end()) {
+      return std::nullopt;
+    }
+    if (!results) {
+      const bool done = ++batch->second.polls > options_.batch_polls;
+      nlohmann::json response = {
+          {"id", id},
+          {"processing_status", done ? "ended" : "in_progress"},
+          {"results_url", nullptr}};
+      if (done) {
+        response["results_url"] =
+            absl::StrCat(api_url(), "/messages/batches/", id, "/results");
+      }
+      return response.dump();
+    }
+    std::string lines;
+    for (const std::string& request_id :
+         std::ranges::reverse_view(batch->second.request_ids)) {
+      nlohmann::json result = {
+          {"type", "succeeded"},
+          {"message", nlohmann::json::parse(anthropic_body_)}};
+      if (failed(request_id)) {
+        result = {{"type", "errored"},
+                  {"error",
+                   {{"type", "error"},
+                    {"error",
+                     {{"type", "api_error"},
+                      {"message", "Failed in the stub"}}}}}};
+      }
+      absl::StrAppend(
+          &lines,
+          nlohmann::json{{"custom_id", request_id}, {"result", result}}.dump(),
+          "\n");
+    }
+    return lines;
+  }
+  return std::nullopt;
+}
+
+LoadReport RunLoad(const Fetch& fetch, absl::Span<const ModelHandle> sessions,
+                   const LoadOptions& options) {
+  LoadReport report = {.samples = std::vector<RequestSample>(options.requests),
+                       .sessions = sessions.size(),
+                       .peak_rss_before_bytes = PeakRssBytes()};
+  FirstByteFetch timed_fetch(fetch);
+  const absl::Duration interval = options.qps > 0
+                                      ? absl::Seconds(1) / options.qps
+                                      : absl::ZeroDuration();
+  std::atomic<size_t> next_request = 0;
+  const absl::Time start = absl::Now();
+  std::vector<std::thread> threads;
+  for (const ModelHandle& session : sessions) {
+    threads.emplace_back([&, model = session.get()]() {
+      RequestOptions request_options = {.timeout = options.timeout};
+      for (size_t i; (i = next_request.fetch_add(1)) < options.requests;) {
+        absl::Time scheduled = start + interval * static_cast<int64_t>(i);
+        absl::SleepFor(scheduled - absl::Now());
+        RequestSample& sample = report.samples[i];
+        first_byte_time.reset();
+        absl::Duration cpu_start = ThreadCpuTime();
+        absl::Time begin = absl::Now();
+        sample.status =
+            model->Prompt(timed_fetch, options.prompt, {}, request_options)
+                .status();
+        sample.latency = absl::Now() - begin;
+        sample.cpu_time = ThreadCpuTime() - cpu_start;
+        sample.start_delay = std::max(begin - scheduled, absl::ZeroDuration());
+        if (first_byte_time.has_value()) {
+          sample.time_to_first_byte = *first_byte_time - begin;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  report.wall_time = absl::Now() - start;
+  report.peak_rss_bytes = PeakRssBytes();
+  return report;
+}
+
+std::string FormatReport(const LoadReport& report) {
+  std::vector<absl::Duration> first_byte, latency, start_delay, cpu;
+  std::map<absl::StatusCode, std::pair<size_t, std::string>> errors;
+  for (const RequestSample& sample : report.samples) {
+    start_delay.push_back(sample.start_delay);
+    cpu.push_back(sample.cpu_time);
+    if (sample.status.ok()) {
+      first_byte.push_back(sample.time_to_first_byte);
+      latency.push_back(sample.latency);
+      continue;
+    }
+    auto& [count, example] = errors[sample.status.code()];
+    if (count++ == 0) {
+      example = sample.status.message();
+    }
+  }
+  const size_t total = report.samples.size();
+  const size_t failed = total - latency.size();
+  std::string out = absl::StrFormat(
+      "%d requests over %d sessions in %.2fs (%.1f/s)\n"
+      "%d ok, %d failed (%.1f%%)\n",
+      total, report.sessions, absl::ToDoubleSeconds(report.wall_time),
+      total / std::max(absl::ToDoubleSeconds(report.wall_time), 1e-9),
+      latency.size(), failed, total > 0 ? 100.0 * failed / total : 0.0);
+  for (const auto& [code, error] : errors) {
+    absl::StrAppend(&out, "  ", absl::StatusCodeToString(code), " x",
+                    error.first, ": ", error.second, "\n");
+  }
+  absl::StrAppendFormat(&out, "%-14s%12s%12s%12s\n", "", "p50", "p90", "p99");
+  AppendPercentiles(out, "first byte", std::move(first_byte));
+  AppendPercentiles(out, "latency", std::move(latency));
+  AppendPercentiles(out, "start delay", std::move(start_delay));
+  AppendPercentiles(out, "cpu", std::move(cpu));
+  // The sessions share one heap, so the growth of the process is all that
+  // can be told apart, spread over the sessions and requests.
+  const double rss_growth_kib =
+      (report.peak_rss_bytes - report.peak_rss_before_bytes) / 1024.0;
+  absl::StrAppendFormat(
+      &out, "peak rss %.1f MiB, grew %.2f MiB per session, %.1f KiB per "
+      "request\n",
+      report.peak_rss_bytes / 1048576.0,
+      report.sessions > 0 ? rss_growth_kib / 1024 / report.sessions : 0.0,
+      total > 0 ? rss_growth_kib / total : 0.0);
+  return out;
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,147 @@
+#ifndef SRC_LOADGEN_H_
+#define SRC_LOADGEN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+
+namespace uchen::chat {
+
+struct StubOptions {
+  // Delay before the response headers are sent.
+  absl::Duration time_to_first_byte = absl::Milliseconds(100);
+  // Delay before the body is sent, counted from the end of the request.
+  absl::Duration latency = absl::Milliseconds(300);
+  std::string reply = "Hello from the load test stub.";
+  // Between the events of a streamed reply, one per word.
+  absl::Duration stream_interval = absl::ZeroDuration();
+  // Status checks that find a batch still in progress before it is done.
+  size_t batch_polls = 1;
+};
+
+// Plain HTTP server on the loopback interface answering Chat Completions and
+// Messages requests with a canned reply after a fixed delay. Pointing
+// --openai_api_url or --anthropic_api_url at it load tests the client without
+// a provider. Every connection is served by its own thread.
+//
+// Requests with "stream":true get the reply as server-sent events, one word
+// per event.
+//
+// Batches of both providers are answered with the canned reply too, except
+// requests with "error" in their id, which fail. Results come back in
+// reverse order.
+class StubServer {
+ public:
+  static absl::StatusOr<std::unique_ptr<StubServer>> Start(
+      StubOptions options);
+  // Drops the open connections, including requests still waiting for their
+  // reply.
+  ~StubServer();
+
+  StubServer(const StubServer&) = delete;
+  StubServer& operator=(const StubServer&) = delete;
+
+  // Base URL for the providers, e.g. http://127.0.0.1:34567/v1.
+  std::string api_url() const;
+  size_t connections_accepted();
+  size_t requests_received();
+
+ private:
+  StubServer(int listen_fd, int port, StubOptions options);
+
+  struct Batch {
+    std::vector<std::string> request_ids;
+    size_t polls = 0;
+  };
+
+  void Accept();
+  void Serve(int fd);
+  bool Reply(int fd, std::string_view request_line, std::string_view body);
+  // Sends the reply as events of the API of `path` in a chunked body.
+  bool StreamReply(int fd, std::string_view path);
+  // The response to a request of the batch APIs, nullopt if `path` is not
+  // one of their endpoints.
+  std::optional<std::string> BatchReply(std::string_view method,
+                                        std::string_view path,
+                                        std::string_view body);
+
+  const int listen_fd_;
+  const int port_;
+  const StubOptions options_;
+  const std::string openai_body_;
+  const std::string anthropic_body_;
+  absl::Notification stopped_;
+  absl::Mutex mu_;
+  absl::flat_hash_set<int> connections_ ABSL_GUARDED_BY(mu_);
+  size_t connections_accepted_ ABSL_GUARDED_BY(mu_) = 0;
+  size_t requests_received_ ABSL_GUARDED_BY(mu_) = 0;
+  // Uploaded OpenAI batch input files, by file id.
+  absl::flat_hash_map<std::string, std::vector<std::string>> files_
+      ABSL_GUARDED_BY(mu_);
+  absl::flat_hash_map<std::string, Batch> batches_ ABSL_GUARDED_BY(mu_);
+  std::thread acceptor_;
+};
+
+struct LoadOptions {
+  // Requests are started on a fixed schedule at this rate, whether or not
+  // earlier ones are done, as long as a session is free to send them. Zero
+  // sends them back to back.
+  double qps = 10;
+  size_t requests = 100;
+  std::string prompt = "Say hello.";
+  absl::Duration timeout = absl::Seconds(60);
+};
+
+struct RequestSample {
+  absl::Status status;
+  // How much later than scheduled the request started because every session
+  // was busy.
+  absl::Duration start_delay;
+  // From the call to Model::Prompt until the first byte of the response.
+  absl::Duration time_to_first_byte;
+  absl::Duration latency;
+  // CPU time of the session thread, which builds the request, runs the
+  // transfer and decodes the response.
+  absl::Duration cpu_time;
+};
+
+struct LoadReport {
+  std::vector<RequestSample> samples;
+  size_t sessions = 0;
+  absl::Duration wall_time;
+  // Peak resident set size of the process before and after the run.
+  int64_t peak_rss_before_bytes = 0;
+  int64_t peak_rss_bytes = 0;
+};
+
+// Sends options.requests prompts, each session on its own thread with its own
+// model and all sharing `fetch`.
+LoadReport RunLoad(const Fetch& fetch, absl::Span<const ModelHandle> sessions,
+                   const LoadOptions& options);
+
+// Request and error counts, p50/p90/p99 of the time to first byte, latency,
+// start delay and CPU time per request, and the growth of the peak resident
+// set size per session and per request.
+std::string FormatReport(const LoadReport& report);
+
+}  // namespace uchen::chat
+
+#endif  // SRC_LOADGEN_H_
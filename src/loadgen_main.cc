@@ -0,0 +1,108 @@
+#include <array>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/log/initialize.h"
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+
+#include "curl/curl.h"
+#include "src/anthropic.h"
+#include "src/fetch.h"
+#include "src/loadgen.h"
+#include "src/local_model.h"
+#include "src/model.h"
+#include "src/openai.h"
+
+ABSL_FLAG(std::string, model, "gpt-4o-mini",
+          "A well known model or provider:model tuple.");
+ABSL_FLAG(size_t, max_tokens, 64, "Maximum number of tokens to generate.");
+ABSL_FLAG(std::string, prompt, "Say hello.", "Prompt sent by every request.");
+ABSL_FLAG(size_t, sessions, 8, "Number of sessions sending requests.");
+ABSL_FLAG(double, qps, 10,
+          "Requests started per second. 0 sends them back to back.");
+ABSL_FLAG(size_t, requests, 100, "Total number of requests.");
+ABSL_FLAG(absl::Duration, request_timeout, absl::Seconds(60),
+          "Abort a request that takes longer than this.");
+
+ABSL_FLAG(bool, stub, false,
+          "Send the requests to a local stub server instead of the provider.");
+ABSL_FLAG(absl::Duration, stub_ttfb, absl::Milliseconds(100),
+          "How long the stub waits before sending the response headers.");
+ABSL_FLAG(absl::Duration, stub_latency, absl::Milliseconds(300),
+          "How long the stub takes to send the whole response.");
+
+int main(int argc, char* argv[], char* envp[]) {
+  absl::SetProgramUsageMessage(
+      "Load test for the model stack.\n"
+      "Usage: uchenchat_loadgen --model=<model> --sessions=8 --qps=10 "
+      "[--stub]");
+  absl::ParseCommandLine(argc, argv);
+  absl::InitializeLog();
+  if (absl::GetFlag(FLAGS_request_timeout) <= absl::ZeroDuration()) {
+    std::cerr << "Error: --request_timeout must be positive" << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_sessions) == 0) {
+    std::cerr << "Error: --sessions must be positive" << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_max_continuations) < 0) {
+    std::cerr << "Error: --max_continuations must not be negative"
+              << std::endl;
+    return 1;
+  }
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  std::unique_ptr<uchen::chat::StubServer> stub;
+  if (absl::GetFlag(FLAGS_stub)) {
+    auto started = uchen::chat::StubServer::Start(
+        {.time_to_first_byte = absl::GetFlag(FLAGS_stub_ttfb),
+         .latency = absl::GetFlag(FLAGS_stub_latency)});
+    if (!started.ok()) {
+      std::cerr << "Error: " << started.status().message() << std::endl;
+      return 1;
+    }
+    stub = *std::move(started);
+    absl::SetFlag(&FLAGS_openai_api_url, stub->api_url());
+    absl::SetFlag(&FLAGS_anthropic_api_url, stub->api_url());
+    absl::SetFlag(&FLAGS_openai_api_key, "stub");
+    absl::SetFlag(&FLAGS_anthropic_api_key, "stub");
+  }
+
+  auto fetch = std::make_shared<uchen::chat::CurlFetch>();
+  uchen::chat::Parameters parameters(absl::GetFlag(FLAGS_max_tokens), envp);
+  // The OpenAI provider takes any model name, so it goes after the providers
+  // matching a prefix.
+  std::array<std::unique_ptr<uchen::chat::ModelProvider>, 3> providers = {
+      uchen::chat::MakeLocalModelProvider(parameters),
+      uchen::chat::MakeOpenAIModelProvider(fetch, parameters),
+      uchen::chat::MakeAnthropicModelProvider(fetch, parameters),
+  };
+  std::vector<uchen::chat::ModelHandle> sessions;
+  for (size_t i = 0; i < absl::GetFlag(FLAGS_sessions); ++i) {
+    auto model =
+        uchen::chat::ConnectToModel(providers, absl::GetFlag(FLAGS_model));
+    if (!model.ok()) {
+      std::cerr << "Error: " << model.status().message() << std::endl;
+      return 1;
+    }
+    sessions.push_back(*std::move(model));
+  }
+
+  uchen::chat::LoadReport report = uchen::chat::RunLoad(
+      *fetch, sessions,
+      {.qps = absl::GetFlag(FLAGS_qps),
+       .requests = absl::GetFlag(FLAGS_requests),
+       .prompt = absl::GetFlag(FLAGS_prompt),
+       .timeout = absl::GetFlag(FLAGS_request_timeout)});
+  std::cout << uchen::chat::FormatReport(report);
+  return 0;
+}
@@ -0,0 +1,251 @@
+#include "src/local_model.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/flags/flag.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/llama.h"
+#include "src/model.h"
+#include "src/thread_pool.h"
+#include "src/trace.h"
+
+ABSL_FLAG(size_t, local_threads, 0,
+          "Threads decoding a local model. 0 uses one per CPU.");
+ABSL_FLAG(std::string, local_tokenizer, "",
+          "tokenizer.bin of local models. Defaults to the one next to the "
+          "checkpoint.");
+
+namespace uchen::chat {
+namespace {
+
+struct Checkpoint {
+  std::unique_ptr<LlamaWeights> weights;
+  LlamaTokenizer tokenizer;
+};
+
+class LocalModel : public Model {
+ public:
+  LocalModel(std::string_view name,
+             std::shared_ptr<const Checkpoint> checkpoint,
+             std::shared_ptr<ThreadPool> pool, size_t max_tokens)
+      : name_(name),
+        checkpoint_(std::move(checkpoint)),
+        pool_(std::move(pool)),
+        // The session keeps the whole checkpoint alive, not just the weights.
+        session_(std::shared_ptr<const LlamaWeights>(
+                     checkpoint_, checkpoint_->weights.get()),
+                 pool_.get()),
+        max_tokens_(max_tokens) {}
+  ~LocalModel() override = default;
+
+  std::string_view name() const override { return name_; }
+
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options) override;
+
+  // Conversations without tools, with their messages one after another as a
+  // single document. Answers that hit max_tokens are not continued: the
+  // checkpoints are not trained to take the request to go on.
+  absl::StatusOr<Reply> Complete(const Fetch& fetch,
+                                 absl::Span<const Message> messages,
+                                 absl::Span<const ToolSpec> tools,
+                                 const RequestOptions& options) override;
+
+ private:
+  absl::StatusOr<std::string> Generate(std::string_view text,
+                                       const RequestOptions& options);
+
+  std::string name_;
+  std::shared_ptr<const Checkpoint> checkpoint_;
+  std::shared_ptr<ThreadPool> pool_;
+  // Requests of one model take turns, e.g. a chat and the summaries of its
+  // history.
+  absl::Mutex mu_;
+  // Keeps the KV cache of the previous prompt and response, so a prompt that
+  // continues them starts decoding right away.
+  LlamaSession session_ ABSL_GUARDED_BY(mu_);
+  size_t max_tokens_;
+};
+
+absl::StatusOr<std::string> LocalModel::Prompt(
+    const Fetch& /* fetch */, std::string_view prompt,
+    absl::Span<const std::string_view> input_contents,
+    const RequestOptions& options) {
+  TraceSpan span("LocalModel::Prompt");
+  std::string text(prompt);
+  if (!input_contents.empty()) {
+    absl::StrAppend(&text, "\n\n", absl::StrJoin(input_contents, "\n\n"));
+  }
+  return Generate(text, options);
+}
+
+absl::StatusOr<Reply> LocalModel::Complete(const Fetch& /* fetch */,
+                                           absl::Span<const Message> messages,
+                                           absl::Span<const ToolSpec> tools,
+                                           const RequestOptions& options) {
+  TraceSpan span("LocalModel::Complete");
+  std::string text;
+  for (const Message& message : messages) {
+    if (!tools.empty() || message.role == Message::Role::kTool ||
+        !message.tool_calls.empty()) {
+      return absl::UnimplementedError(
+          absl::StrCat(name_, " does not support tool calls"));
+    }
+    absl::StrAppend(&text, text.empty() ? "" : "\n\n", message.content);
+  }
+  auto response = Generate(text, options);
+  if (!response.ok()) {
+    return std::move(response).status();
+  }
+  return Reply{.text = *std::move(response)};
+}
+
+absl::StatusOr<std::string> LocalModel::Generate(
+    std::string_view text, const RequestOptions& options) {
+  const absl::Time deadline = absl::Now() + options.timeout;
+  auto interrupted = [&]() -> absl::Status {
+    if (options.cancellation != nullptr && options.cancellation->cancelled()) {
+      return absl::CancelledError("Cancelled");
+    }
+    if (absl::Now() > deadline) {
+      return absl::DeadlineExceededError("Local model timed out");
+    }
+    return absl::OkStatus();
+  };
+
+  absl::MutexLock lock(&mu_);
+  const LlamaTokenizer& tokenizer = checkpoint_->tokenizer;
+  const size_t seq_len = session_.config().seq_len;
+  std::vector<int> tokens = tokenizer.Encode(text);
+  if (tokens.size() >= seq_len) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Prompt of ", tokens.size(),
+                     " tokens does not fit in the ", seq_len,
+                     " token context of ", name_));
+  }
+  absl::Span<const float> logits = session_.Prefill(tokens);
+  std::string response;
+  int previous = tokens.back();
+  for (size_t i = 0; i < max_tokens_; ++i) {
+    if (absl::Status status = interrupted(); !status.ok()) {
+      return status;
+    }
+    const int next = std::max_element(logits.begin(), logits.end()) -
+                     logits.begin();
+    if (next == LlamaTokenizer::kBos || next == LlamaTokenizer::kEos) {
+      break;
+    }
+    absl::StrAppend(&response, tokenizer.Decode(previous, next));
+    if (session_.tokens().size() == seq_len) {
+      break;
+    }
+    logits = session_.Append(next);
+    previous = next;
+  }
+  return response;
+}
+
+class LocalModelProvider : public ModelProvider {
+ public:
+  explicit LocalModelProvider(Parameters parameters)
+      : parameters_(std::move(parameters)) {}
+  ~LocalModelProvider() override = default;
+
+  std::string_view name() const override { return "Local"; }
+
+  absl::StatusOr<ModelHandle> ConnectToModel(
+      std::string_view model) const override {
+    if (!absl::StartsWith(model, kLocalModelPrefix)) {
+      return absl::NotFoundError(absl::StrCat("Not a local model: ", model));
+    }
+    auto checkpoint =
+        GetCheckpoint(std::string(model.substr(kLocalModelPrefix.size())));
+    if (!checkpoint.ok()) {
+      return std::move(checkpoint).status();
+    }
+    return ModelHandle(std::make_unique<LocalModel>(
+        model, *std::move(checkpoint), GetPool(), parameters_.max_tokens()));
+  }
+
+  // Local models are files, there is nothing to discover.
+  std::vector<std::string> ListModels() const override { return {}; }
+
+ private:
+  absl::StatusOr<std::shared_ptr<const Checkpoint>> GetCheckpoint(
+      const std::string& path) const {
+    absl::MutexLock lock(&mu_);
+    if (auto it = checkpoints_.find(path); it != checkpoints_.end()) {
+      return it->second;
+    }
+    auto weights = LlamaWeights::Load(path);
+    if (!weights.ok()) {
+      return std::move(weights).status();
+    }
+    std::string tokenizer_path = absl::GetFlag(FLAGS_local_tokenizer);
+    if (tokenizer_path.empty()) {
+      tokenizer_path =
+          (std::filesystem::path(path).parent_path() / "tokenizer.bin")
+              .string();
+    }
+    auto tokenizer =
+        LlamaTokenizer::Load(tokenizer_path, (*weights)->config().vocab_size);
+    if (!tokenizer.ok()) {
+      return std::move(tokenizer).status();
+    }
+    auto checkpoint = std::make_shared<const Checkpoint>(
+        Checkpoint{.weights = *std::move(weights),
+                   .tokenizer = *std::move(tokenizer)});
+    checkpoints_.emplace(path, checkpoint);
+    return checkpoint;
+  }
+
+  // Shared by all local models. The thread running a model decodes too, so
+  // the pool has one thread less than --local_threads.
+  std::shared_ptr<ThreadPool> GetPool() const {
+    absl::MutexLock lock(&mu_);
+    size_t threads = absl::GetFlag(FLAGS_local_threads);
+    if (threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (pool_ == nullptr && threads > 1) {
+      pool_ = std::make_shared<ThreadPool>(threads - 1);
+    }
+    return pool_;
+  }
+
+  Parameters parameters_;
+  mutable absl::Mutex mu_;
+  mutable absl::flat_hash_map<std::string, std::shared_ptr<const Checkpoint>>
+      checkpoints_ ABSL_GUARDED_BY(mu_);
+  mutable std::shared_ptr<ThreadPool> pool_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace
+
+std::unique_ptr<ModelProvider> MakeLocalModelProvider(Parameters parameters) {
+  return std::make_unique<LocalModelProvider>(std::move(parameters));
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,31 @@
+#ifndef SRC_LOCAL_MODEL_H_
+#define SRC_LOCAL_MODEL_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "absl/flags/declare.h"
+
+#include "src/model.h"
+
+ABSL_DECLARE_FLAG(size_t, local_threads);
+ABSL_DECLARE_FLAG(std::string, local_tokenizer);
+
+namespace uchen::chat {
+
+// Model names with this prefix are followed by the path of an int8 llama2.c
+// checkpoint that runs on the CPU, e.g. "local:models/stories15M_q80.bin".
+// Meant for small models doing cheap work, like classifying or summarizing a
+// diff, without a round trip to a provider.
+inline constexpr std::string_view kLocalModelPrefix = "local:";
+
+// Serves "local:" models. Checkpoints are mapped once and shared by all
+// models using them. Generation is greedy, so a prompt always gets the same
+// response.
+std::unique_ptr<ModelProvider> MakeLocalModelProvider(Parameters parameters);
+
+}  // namespace uchen::chat
+
+#endif  // SRC_LOCAL_MODEL_H_
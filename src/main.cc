@@ -1,33 +1,316 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <array>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/cleanup/cleanup.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/flags/usage.h"
 #include "absl/log/check.h"
 #include "absl/log/initialize.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/substitute.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 
 #include "curl/curl.h"
 #include "src/anthropic.h"
+#include "src/batch.h"
+#include "src/channel.h"
+#include "src/context_window.h"
+#include "src/daemon.h"
+#include "src/fetch.h"
 #include "src/input.h"
+#include "src/job_queue.h"
+#include "src/journal.h"
+#include "src/local_model.h"
 #include "src/model.h"
 #include "src/openai.h"
+#include "src/prompt_cache.h"
+#include "src/render.h"
+#include "src/shared_cache.h"
+#include "src/stop.h"
+#include "src/thread_pool.h"
+#include "src/tools.h"
+#include "src/trace.h"
 #include "src/tui.h"
 
+ABSL_FLAG(std::string, model, "gpt-4o-mini-search-preview",
+          "A well known model or provider:model tuple.");
+ABSL_FLAG(size_t, max_tokens, 1024, "Maximum number of tokens to generate.");
+
+ABSL_FLAG(bool, list, false, "List available models.");
+
+ABSL_FLAG(absl::Duration, request_timeout, absl::InfiniteDuration(),
+          "Abort a request that takes longer than this, e.g. 90s. Must be "
+          "positive; requests have no timeout by default.");
+
+ABSL_FLAG(absl::Duration, keep_warm_interval,
+          uchen::chat::CurlFetch::kKeepWarmInterval,
+          "Connect to the provider while the first prompt is typed and "
+          "refresh the connection whenever it was idle this long. 0 turns "
+          "this off.");
+
+ABSL_FLAG(std::string, daemon_socket, "",
+          "Unix socket of the resident daemon. Without --serve, the prompt "
+          "from the command line or stdin is sent to the daemon listening "
+          "there.");
+ABSL_FLAG(bool, serve, false,
+          "Run as a resident daemon listening on --daemon_socket.");
+
+ABSL_FLAG(std::string, jobs_journal, "",
+          "With --serve, run background jobs and keep them in this journal "
+          "file, so they survive a restart.");
+ABSL_FLAG(size_t, job_workers, 4,
+          "Number of background jobs the daemon runs at the same time.");
+ABSL_FLAG(bool, submit, false,
+          "Queue the prompt as a background job on the daemon and print its "
+          "id instead of waiting for the response.");
+ABSL_FLAG(std::optional<uint64_t>, poll, std::nullopt,
+          "Print the state of a background job.");
+ABSL_FLAG(std::optional<uint64_t>, fetch, std::nullopt,
+          "Print the response of a finished background job.");
+
+ABSL_FLAG(std::string, tools, "",
+          "JSON file with the tools the model may run, see src/tools.h.");
+
+ABSL_FLAG(std::string, agents, "",
+          "JSON file with the agents of a multi-agent channel, see "
+          "src/channel.h. Replaces --model.");
+
+ABSL_FLAG(std::string, prompt_cache, "",
+          "Answer prompts that are near duplicates of earlier ones from this "
+          "cache file instead of the model.");
+ABSL_FLAG(double, prompt_cache_similarity, 0.95,
+          "How similar, from 0.77 to 1, a prompt must be to a cached one to "
+          "get its response. Numbers other than dates and times must match "
+          "exactly.");
+ABSL_FLAG(size_t, prompt_cache_size, 10000,
+          "Number of responses the prompt cache keeps.");
+
+ABSL_FLAG(std::string, shared_cache, "",
+          "File of a response cache shared by all uchenchat processes on the "
+          "host. The same request from any of them goes to the provider "
+          "once, and concurrent duplicates wait for it.");
+ABSL_FLAG(size_t, shared_cache_size, 64 << 20,
+          "Bytes of responses in a new --shared_cache file.");
+ABSL_FLAG(uchen::chat::EvictionPolicy, shared_cache_eviction,
+          uchen::chat::EvictionPolicy::kLeastRecentlyUsed,
+          "Which response of the --shared_cache makes room for a new one "
+          "when its slots are taken: lru or fifo.");
+ABSL_FLAG(absl::Duration, shared_cache_max_age, absl::Hours(24),
+          "Responses of the --shared_cache older than this are not served.");
+
+ABSL_FLAG(std::string, batch, "",
+          "JSON lines file of prompts, {\"id\": ..., \"prompt\": ...} per "
+          "line, to send through the batch API of the provider. The results "
+          "are printed as JSON lines as the batches finish.");
+ABSL_FLAG(absl::Duration, batch_poll_interval, absl::Seconds(10),
+          "Wait before the first status check of a batch. Every later check "
+          "waits longer.");
+
+ABSL_FLAG(std::string, trace_file, "",
+          "Record trace spans and write them to this file as Chrome "
+          "trace-event JSON when the program exits. Open it in "
+          "chrome://tracing or ui.perfetto.dev.");
+
+ABSL_FLAG(std::string, request_journal, "",
+          "Keep the last --request_journal_records HTTP requests, with the "
+          "start of their bodies, in memory and write them to this file when "
+          "the program exits. Decode it with uchenchat_journal_dump.");
+ABSL_FLAG(size_t, request_journal_records, 1024,
+          "Requests kept by --request_journal, about 2.3 KiB each.");
+
+ABSL_FLAG(std::vector<std::string>, stop, {},
+          "Comma-separated sequences that end an answer, with C escapes such "
+          "as \\n. The answer is cut before the first one and the rest is not "
+          "downloaded.");
+ABSL_FLAG(std::vector<std::string>, stop_regex, {},
+          "Comma-separated RE2 regexes that end an answer with their first "
+          "match.");
+ABSL_FLAG(bool, stop_at_json, false,
+          "End answers with their first complete JSON object or array.");
+
+ABSL_FLAG(size_t, context_tokens, 0,
+          "Send the earlier turns of the chat with every prompt, up to this "
+          "many tokens. Older turns are summarized in the background and "
+          "make way for the summary. 0 sends every prompt on its own.");
+ABSL_FLAG(bool, pin_first_prompt, false,
+          "With --context_tokens, send the first prompt of the chat with "
+          "every later one, however long the chat gets.");
+
 namespace uchen::chat {
 namespace {
 
-int Chat(Model* model) {
+// Most tool round trips the model may take to answer one prompt.
+constexpr int kMaxToolRounds = 16;
+
+// Answers `prompt`, running the tools the model asks for along the way. All
+// calls of a round run side by side and their results go back in a single
+// request. Tool output is echoed to stderr line by line, prefixed with the
+// tool name.
+absl::StatusOr<std::string> PromptWithTools(Model* model, const Fetch& fetch,
+                                            const ToolRunner& runner,
+                                            std::string prompt,
+                                            const RequestOptions& options,
+                                            Renderer& renderer) {
+  std::vector<ToolSpec> specs = runner.specs();
+  std::vector<Message> messages = {{.content = std::move(prompt)}};
+  for (int round = 0; round < kMaxToolRounds; ++round) {
+    auto reply = SpinWhile(
+        [&]() { return model->Complete(fetch, messages, specs, options); });
+    if (!reply.ok()) {
+      return std::move(reply).status();
+    }
+    if (reply->tool_calls.empty()) {
+      return std::move(reply->text);
+    }
+    if (!reply->text.empty()) {
+      renderer.Append(reply->text);
+      renderer.Finish();
+    }
+    const std::vector<ToolCall>& calls = reply->tool_calls;
+    std::vector<std::string> partial_lines(calls.size());
+    auto results = runner.Run(
+        calls,
+        [&](size_t call, std::string_view output) {
+          std::string& line = partial_lines[call];
+          for (char c : output) {
+            if (c == '\n') {
+              std::cerr << calls[call].name << "| " << line << "\n";
+              line.clear();
+            } else {
+              line.push_back(c);
+            }
+          }
+        },
+        options.cancellation);
+    for (size_t i = 0; i < calls.size(); ++i) {
+      if (!partial_lines[i].empty()) {
+        std::cerr << calls[i].name << "| " << partial_lines[i] << "\n";
+      }
+    }
+    if (options.cancellation != nullptr && options.cancellation->cancelled()) {
+      return absl::CancelledError("Cancelled");
+    }
+    messages.push_back({.role = Message::Role::kAssistant,
+                        .content = std::move(reply->text),
+                        .tool_calls = std::move(reply->tool_calls)});
+    messages.insert(messages.end(), std::make_move_iterator(results.begin()),
+                    std::make_move_iterator(results.end()));
+  }
+  return absl::ResourceExhaustedError(
+      absl::StrCat("Gave up after ", kMaxToolRounds, " rounds of tool calls"));
+}
+
+// The stop conditions of --stop, --stop_regex and --stop_at_json.
+absl::StatusOr<std::vector<StopCondition>> StopConditionsFromFlags() {
+  std::vector<StopCondition> stop;
+  for (const std::string& sequence : absl::GetFlag(FLAGS_stop)) {
+    std::string unescaped;
+    std::string error;
+    if (!absl::CUnescape(sequence, &unescaped, &error)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid --stop ", sequence, ": ", error));
+    }
+    stop.push_back(
+        {.kind = StopCondition::Kind::kLiteral, .pattern = unescaped});
+  }
+  for (const std::string& regex : absl::GetFlag(FLAGS_stop_regex)) {
+    stop.push_back({.kind = StopCondition::Kind::kRegex, .pattern = regex});
+  }
+  if (absl::GetFlag(FLAGS_stop_at_json)) {
+    stop.push_back({.kind = StopCondition::Kind::kBalancedJson});
+  }
+  // Fails here rather than on the first prompt.
+  if (auto matcher = StopMatcher::Create(stop); !matcher.ok()) {
+    return std::move(matcher).status();
+  }
+  return stop;
+}
+
+// Renders the response to `prompt` as it comes in. When a long answer takes
+// continuation requests, each segment is rendered while the next one is on
+// its way.
+absl::Status StreamAndRender(Model* model, const Fetch& fetch,
+                             std::string_view prompt,
+                             absl::Span<const StopCondition> stop,
+                             const RequestOptions& options,
+                             Renderer& renderer) {
+  struct Segments {
+    absl::Mutex mu;
+    std::deque<std::string> pending ABSL_GUARDED_BY(mu);
+    std::optional<absl::Status> status ABSL_GUARDED_BY(mu);
+  } segments;
+  std::thread receiver([&]() {
+    absl::Status status = model->StreamPromptUntil(
+        fetch, prompt, {}, stop, options, [&](std::string_view segment) {
+          absl::MutexLock lock(&segments.mu);
+          segments.pending.emplace_back(segment);
+        });
+    absl::MutexLock lock(&segments.mu);
+    segments.status = std::move(status);
+  });
+  absl::Cleanup join = [&]() { receiver.join(); };
+  while (true) {
+    std::optional<std::string> segment =
+        SpinWhile([&]() -> std::optional<std::string> {
+          absl::MutexLock lock(&segments.mu);
+          segments.mu.Await(absl::Condition(
+              +[](Segments* queue) ABSL_EXCLUSIVE_LOCKS_REQUIRED(queue->mu) {
+                return !queue->pending.empty() || queue->status.has_value();
+              },
+              &segments));
+          if (segments.pending.empty()) {
+            return std::nullopt;
+          }
+          std::string next = std::move(segments.pending.front());
+          segments.pending.pop_front();
+          return next;
+        });
+    if (!segment.has_value()) {
+      break;
+    }
+    renderer.Append(*segment);
+  }
+  absl::MutexLock lock(&segments.mu);
+  return *segments.status;
+}
+
+int Chat(Model* model, const Fetch& fetch, const ToolRunner* tools) {
+  auto stop = StopConditionsFromFlags();
+  if (!stop.ok()) {
+    std::cerr << "Error: " << stop.status().message() << std::endl;
+    return 1;
+  }
   std::cout << absl::Substitute("Model: $0\nType your message below:",
                                 model->name());
   uchen::chat::InputReader reader(std::cin);
+  Renderer renderer(std::cout, StdoutRenderSettings());
   while (true) {
     std::cout << "\n> ";
     auto prompt = reader();
@@ -35,29 +318,243 @@ int Chat(Model* model) {
       return 0;
     }
     if (!prompt->empty()) {
-      uchen::chat::CurlFetch fetch;
-      auto response =
-          SpinWhile([&]() { return model->Prompt(fetch, *prompt, {}); });
-      if (!response.ok()) {
-        std::cerr << "Error: " << response.status().message() << std::endl;
+      Cancellation cancellation;
+      RequestOptions options = {
+          .cancellation = &cancellation,
+          .timeout = absl::GetFlag(FLAGS_request_timeout),
+      };
+      InterruptScope interrupt_scope(&cancellation);
+      absl::Status status;
+      if (tools != nullptr) {
+        auto response = PromptWithTools(model, fetch, *tools, *prompt,
+                                        options, renderer);
+        if (response.ok()) {
+          renderer.Append(*response);
+        }
+        status = response.status();
+      } else {
+        status = StreamAndRender(model, fetch, *prompt, *stop, options,
+                                 renderer);
+      }
+      renderer.Finish();
+      if (absl::IsCancelled(status) || absl::IsDeadlineExceeded(status)) {
+        // Only this turn is lost, the session goes on.
+        std::cerr << status.message() << std::endl;
+        continue;
+      }
+      if (!status.ok()) {
+        std::cerr << "Error: " << status.message() << std::endl;
         return 1;
       }
-      std::cout << *response << std::endl;
     }
   }
 }
 
-}  // namespace
-}  // namespace uchen::chat
+// Chat with several agents in one channel. Replies are printed as they come
+// in, prefixed with the name of the agent.
+int RunChannel(const Fetch& fetch,
+               absl::Span<const std::unique_ptr<ModelProvider>> providers,
+               const std::string& agents_path) {
+  auto agents = LoadAgents(agents_path);
+  if (!agents.ok()) {
+    std::cerr << "Error: " << agents.status().message() << std::endl;
+    return 1;
+  }
+  // Every agent addressed in a round holds a thread while it waits for its
+  // reply, so fewer threads than agents would serialize the round.
+  ThreadPool pool(std::max<size_t>(std::thread::hardware_concurrency(),
+                                   agents->size()));
+  Channel channel(fetch, pool);
+  for (AgentConfig& agent : *agents) {
+    auto model = ConnectToModel(providers, agent.model);
+    absl::Status status = model.ok()
+                              ? channel.AddAgent(std::move(agent),
+                                                 *std::move(model))
+                              : model.status();
+    if (!status.ok()) {
+      std::cerr << "Error: " << status.message() << std::endl;
+      return 1;
+    }
+  }
+  std::cout << "Address agents with @name. Type your message below:";
+  InputReader reader(std::cin);
+  Renderer renderer(std::cout, StdoutRenderSettings());
+  while (true) {
+    std::cout << "\n> ";
+    auto prompt = reader();
+    if (prompt == std::nullopt) {
+      return 0;
+    }
+    if (prompt->empty()) {
+      continue;
+    }
+    Cancellation cancellation;
+    RequestOptions options = {
+        .cancellation = &cancellation,
+        .timeout = absl::GetFlag(FLAGS_request_timeout),
+    };
+    InterruptScope interrupt_scope(&cancellation);
+    absl::Status status = channel.Post(
+        *prompt,
+        [&](const ChannelMessage& message) {
+          renderer.Append(message.line());
+          renderer.Finish();
+        },
+        options);
+    if (!status.ok()) {
+      std::cerr << "Error: " << status.message() << std::endl;
+    }
+  }
+}
 
-ABSL_FLAG(std::string, model, "gpt-4o-mini-search-preview",
-          "A well known model or provider:model tuple.");
-ABSL_FLAG(size_t, max_tokens, 1024, "Maximum number of tokens to generate.");
+// Answers the prompts of a JSON lines file through the batch API of the
+// provider of `model`, printing each result as a JSON line.
+int RunBatchFile(Model* model, const Fetch& fetch, const std::string& path) {
+  BatchApi* api = model->batch_api();
+  if (api == nullptr) {
+    std::cerr << "Error: " << model->name() << " has no batch API"
+              << std::endl;
+    return 1;
+  }
+  std::ifstream input(path);
+  if (!input) {
+    std::cerr << "Error: Failed to open " << path << std::endl;
+    return 1;
+  }
+  auto requests = ReadBatchRequests(input);
+  if (!requests.ok()) {
+    std::cerr << "Error: " << requests.status().message() << std::endl;
+    return 1;
+  }
+  Cancellation cancellation;
+  InterruptScope interrupt_scope(&cancellation);
+  size_t failed = 0;
+  absl::Status status = RunBatch(
+      *api, fetch, *requests,
+      {.poll_interval = absl::GetFlag(FLAGS_batch_poll_interval),
+       .cancellation = &cancellation},
+      [&](BatchResult result) {
+        failed += result.reply.ok() ? 0 : 1;
+        std::cout << FormatBatchResult(result) << std::endl;
+      });
+  if (!status.ok()) {
+    std::cerr << "Error: " << status.message() << std::endl;
+    return 1;
+  }
+  if (failed > 0) {
+    std::cerr << failed << " of " << requests->size() << " requests failed"
+              << std::endl;
+  }
+  return 0;
+}
 
-ABSL_FLAG(bool, list, false, "List available models.");
+// Forwards one prompt to a running daemon. The prompt is taken from the
+// positional arguments, or from stdin if there are none.
+int RunClient(const std::string& socket_path, absl::Span<char* const> args) {
+  auto client = DaemonClient::Connect(socket_path);
+  if (!client.ok()) {
+    std::cerr << "Error: " << client.status().message() << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_list)) {
+    auto providers = client->ListModels();
+    if (!providers.ok()) {
+      std::cerr << "Error: " << providers.status().message() << std::endl;
+      return 1;
+    }
+    for (const auto& provider : *providers) {
+      std::cout << "Available models for " << provider.provider << ":\n";
+      for (const auto& model : provider.models) {
+        std::cout << "  " << model << "\n";
+      }
+    }
+    return 0;
+  }
+  if (std::optional<uint64_t> job = absl::GetFlag(FLAGS_poll)) {
+    auto state = client->Poll(*job);
+    if (!state.ok()) {
+      std::cerr << "Error: " << state.status().message() << std::endl;
+      return 1;
+    }
+    std::cout << JobStateName(*state) << std::endl;
+    return 0;
+  }
+  if (std::optional<uint64_t> job = absl::GetFlag(FLAGS_fetch)) {
+    auto text = client->FetchResult(*job);
+    if (!text.ok()) {
+      std::cerr << "Error: " << text.status().message() << std::endl;
+      return 1;
+    }
+    Renderer renderer(std::cout, StdoutRenderSettings());
+    renderer.Append(*text);
+    return 0;
+  }
+  std::string prompt = absl::StrJoin(args, " ");
+  if (prompt.empty()) {
+    prompt.assign(std::istreambuf_iterator<char>(std::cin),
+                  std::istreambuf_iterator<char>());
+  }
+  if (absl::GetFlag(FLAGS_submit)) {
+    auto job = client->Submit(absl::GetFlag(FLAGS_model), prompt);
+    if (!job.ok()) {
+      std::cerr << "Error: " << job.status().message() << std::endl;
+      return 1;
+    }
+    std::cout << *job << std::endl;
+    return 0;
+  }
+  Renderer renderer(std::cout, StdoutRenderSettings());
+  absl::Status status =
+      client->Prompt(absl::GetFlag(FLAGS_model), prompt,
+                     absl::GetFlag(FLAGS_request_timeout), renderer);
+  if (!status.ok()) {
+    std::cerr << "Error: " << status.message() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Written to by OnShutdownSignal, which may only make async-signal-safe
+// calls.
+int shutdown_pipe[2] = {-1, -1};
+
+void OnShutdownSignal(int /* signal */) {
+  char byte = 0;
+  [[maybe_unused]] ssize_t written = write(shutdown_pipe[1], &byte, 1);
+}
+
+// Serves on `socket_path` until SIGTERM or SIGINT, then lets the open
+// requests finish so the socket is removed and the caller's cleanups run.
+absl::Status ServeUntilSignalled(Daemon& daemon,
+                                 const std::string& socket_path) {
+  if (pipe2(shutdown_pipe, O_CLOEXEC) != 0) {
+    return absl::InternalError(absl::StrCat("pipe: ", std::strerror(errno)));
+  }
+  struct sigaction action = {};
+  action.sa_handler = OnShutdownSignal;
+  struct sigaction previous_term, previous_int;
+  sigaction(SIGTERM, &action, &previous_term);
+  sigaction(SIGINT, &action, &previous_int);
+  std::thread watcher([&daemon]() {
+    char byte;
+    while (read(shutdown_pipe[0], &byte, 1) < 0 && errno == EINTR) {
+    }
+    daemon.Shutdown();
+  });
+  absl::Status status = daemon.Serve(socket_path);
+  sigaction(SIGTERM, &previous_term, nullptr);
+  sigaction(SIGINT, &previous_int, nullptr);
+  // Wakes the watcher when Serve returned without a signal.
+  close(shutdown_pipe[1]);
+  watcher.join();
+  close(shutdown_pipe[0]);
+  return status;
+}
+
+}  // namespace
+}  // namespace uchen::chat
 
 int main(int argc, char* argv[], char* envp[]) {
-  curl_global_init(CURL_GLOBAL_ALL);
   std::vector<std::string> segments =
       absl::StrSplit(argv[0], absl::ByAnyChar("/\\"));
   absl::SetProgramUsageMessage(
@@ -66,13 +563,145 @@ int main(int argc, char* argv[], char* envp[]) {
                        segments.back()));
   std::vector<char*> positional_args = absl::ParseCommandLine(argc, argv);
   absl::InitializeLog();
-  auto fetch = std::make_shared<uchen::chat::CurlFetch>();
+  if (absl::GetFlag(FLAGS_request_timeout) <= absl::ZeroDuration()) {
+    std::cerr << "Error: --request_timeout must be positive" << std::endl;
+    return 1;
+  }
+  if (absl::GetFlag(FLAGS_max_continuations) < 0) {
+    std::cerr << "Error: --max_continuations must not be negative"
+              << std::endl;
+    return 1;
+  }
+  const std::string trace_file = absl::GetFlag(FLAGS_trace_file);
+  if (!trace_file.empty()) {
+    uchen::chat::EnableTracing();
+  }
+  // Runs after everything below is torn down, so the spans of worker threads
+  // are complete.
+  absl::Cleanup write_trace = [&trace_file] {
+    if (trace_file.empty()) {
+      return;
+    }
+    if (absl::Status status = uchen::chat::WriteChromeTrace(trace_file);
+        !status.ok()) {
+      std::cerr << "Error: " << status.message() << std::endl;
+    }
+  };
+  const std::string request_journal = absl::GetFlag(FLAGS_request_journal);
+  if (!request_journal.empty()) {
+    uchen::chat::EnableRequestJournal(
+        absl::GetFlag(FLAGS_request_journal_records));
+  }
+  absl::Cleanup write_journal = [&request_journal] {
+    if (request_journal.empty()) {
+      return;
+    }
+    if (absl::Status status =
+            uchen::chat::GlobalRequestJournal()->Write(request_journal);
+        !status.ok()) {
+      std::cerr << "Error: " << status.message() << std::endl;
+    }
+  };
+  const std::string daemon_socket = absl::GetFlag(FLAGS_daemon_socket);
+  if (!daemon_socket.empty() && !absl::GetFlag(FLAGS_serve)) {
+    // The thin client never touches curl or the providers.
+    return uchen::chat::RunClient(
+        daemon_socket, absl::MakeConstSpan(positional_args).subspan(1));
+  }
+  curl_global_init(CURL_GLOBAL_ALL);
+  auto curl_fetch = std::make_shared<uchen::chat::CurlFetch>();
+  std::shared_ptr<uchen::chat::Fetch> fetch = curl_fetch;
+  std::shared_ptr<uchen::chat::SharedResponseCache> shared_cache;
+  if (std::string path = absl::GetFlag(FLAGS_shared_cache); !path.empty()) {
+    auto opened = uchen::chat::SharedResponseCache::Open(
+        path, {.data_bytes = absl::GetFlag(FLAGS_shared_cache_size),
+               .eviction = absl::GetFlag(FLAGS_shared_cache_eviction),
+               .max_age = absl::GetFlag(FLAGS_shared_cache_max_age)});
+    if (!opened.ok()) {
+      std::cerr << "Error: " << opened.status().message() << std::endl;
+      return 1;
+    }
+    shared_cache = *std::move(opened);
+    fetch = uchen::chat::WithSharedCache(fetch, shared_cache);
+  }
+  absl::Cleanup report_shared_cache = [&shared_cache] {
+    if (shared_cache != nullptr) {
+      std::cerr << "Shared cache: "
+                << uchen::chat::FormatSharedCacheStats(shared_cache->stats())
+                << std::endl;
+    }
+  };
   uchen::chat::Parameters parameters(absl::GetFlag(FLAGS_max_tokens), envp);
   std::string model = absl::GetFlag(FLAGS_model);
-  std::array<std::unique_ptr<uchen::chat::ModelProvider>, 2> providers = {
+  // The OpenAI provider takes any model name, so it goes after the providers
+  // matching a prefix.
+  std::array<std::unique_ptr<uchen::chat::ModelProvider>, 3> providers = {
+      uchen::chat::MakeLocalModelProvider(parameters),
       uchen::chat::MakeOpenAIModelProvider(fetch, parameters),
       uchen::chat::MakeAnthropicModelProvider(fetch, parameters),
   };
+  std::shared_ptr<uchen::chat::PromptCache> prompt_cache;
+  if (std::string path = absl::GetFlag(FLAGS_prompt_cache); !path.empty()) {
+    // The cache keys responses by the prompt alone, not the history it was
+    // sent with.
+    if (absl::GetFlag(FLAGS_context_tokens) > 0) {
+      std::cerr << "Error: --prompt_cache cannot be combined with "
+                   "--context_tokens"
+                << std::endl;
+      return 1;
+    }
+    auto opened = uchen::chat::PromptCache::Open(
+        path, {.similarity = absl::GetFlag(FLAGS_prompt_cache_similarity),
+               .capacity = absl::GetFlag(FLAGS_prompt_cache_size)});
+    if (!opened.ok()) {
+      std::cerr << "Error: " << opened.status().message() << std::endl;
+      return 1;
+    }
+    prompt_cache = *std::move(opened);
+    for (auto& provider : providers) {
+      provider =
+          uchen::chat::WithPromptCache(std::move(provider), prompt_cache);
+    }
+  }
+  absl::Cleanup report_prompt_cache = [&prompt_cache] {
+    if (prompt_cache != nullptr) {
+      std::cerr << "Prompt cache: "
+                << uchen::chat::FormatPromptCacheStats(prompt_cache->stats())
+                << std::endl;
+    }
+  };
+
+  if (absl::GetFlag(FLAGS_serve)) {
+    if (daemon_socket.empty()) {
+      std::cerr << "Error: --serve requires --daemon_socket" << std::endl;
+      return 1;
+    }
+    std::unique_ptr<uchen::chat::JobQueue> jobs;
+    std::optional<uchen::chat::JobRunner> job_runner;
+    if (std::string journal = absl::GetFlag(FLAGS_jobs_journal);
+        !journal.empty()) {
+      auto opened = uchen::chat::JobQueue::Open(journal);
+      if (!opened.ok()) {
+        std::cerr << "Error: " << opened.status().message() << std::endl;
+        return 1;
+      }
+      jobs = *std::move(opened);
+      job_runner.emplace(*jobs, *fetch, providers,
+                         absl::GetFlag(FLAGS_job_workers));
+    }
+    uchen::chat::Daemon daemon(*fetch, providers, jobs.get());
+    absl::Status status =
+        uchen::chat::ServeUntilSignalled(daemon, daemon_socket);
+    if (!status.ok()) {
+      std::cerr << "Error: " << status.message() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (std::string agents = absl::GetFlag(FLAGS_agents); !agents.empty()) {
+    return uchen::chat::RunChannel(*fetch, providers, agents);
+  }
 
   if (absl::GetFlag(FLAGS_list)) {
     for (const auto& provider : providers) {
@@ -85,23 +714,35 @@ int main(int argc, char* argv[], char* envp[]) {
       }
     }
   } else {
-    absl::StatusOr<uchen::chat::ModelHandle> model;
-    for (const auto& provider : providers) {
-      model = provider->ConnectToModel(absl::GetFlag(FLAGS_model));
-      if (model.ok()) {
-        break;
-      }
-      if (model.status().code() != absl::StatusCode::kNotFound) {
-        std::cerr << "Error: " << model.status().message() << std::endl;
-        return 1;
-      }
-    }
+    absl::StatusOr<uchen::chat::ModelHandle> model =
+        uchen::chat::ConnectToModel(providers, absl::GetFlag(FLAGS_model));
     if (!model.ok()) {
-      std::cerr << "Error: No model found for " << absl::GetFlag(FLAGS_model)
-                << std::endl;
+      std::cerr << "Error: " << model.status().message() << std::endl;
       return 1;
     }
     CHECK_NE(model->get(), nullptr);
-    return uchen::chat::Chat(model->get());
+    if (std::string batch = absl::GetFlag(FLAGS_batch); !batch.empty()) {
+      return uchen::chat::RunBatchFile(model->get(), *fetch, batch);
+    }
+    if (size_t tokens = absl::GetFlag(FLAGS_context_tokens); tokens > 0) {
+      *model = uchen::chat::WithContextWindow(
+          *std::move(model), fetch, {.max_tokens = tokens},
+          absl::GetFlag(FLAGS_pin_first_prompt));
+    }
+    if (absl::Duration interval = absl::GetFlag(FLAGS_keep_warm_interval);
+        interval > absl::ZeroDuration() && !(*model)->endpoint().empty()) {
+      curl_fetch->KeepWarm(std::string((*model)->endpoint()), interval);
+    }
+    std::optional<uchen::chat::ToolRunner> tools;
+    if (std::string path = absl::GetFlag(FLAGS_tools); !path.empty()) {
+      auto loaded = uchen::chat::LoadTools(path);
+      if (!loaded.ok()) {
+        std::cerr << "Error: " << loaded.status().message() << std::endl;
+        return 1;
+      }
+      tools.emplace(*std::move(loaded));
+    }
+    return uchen::chat::Chat(model->get(), *fetch,
+                             tools.has_value() ? &*tools : nullptr);
   }
 }
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include "src/model.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+
+#include "src/json_arena.h"
+#include "src/stop.h"
+
+ABSL_FLAG(int, max_continuations, 4,
+          "How many times to ask the model to continue an answer that was "
+          "cut short by --max_tokens.");
+
+namespace uchen::chat {
+namespace {
+
+constexpr std::string_view kContinue =
+    "Your answer was cut off. Continue exactly where it stopped, without "
+    "repeating anything.";
+
+}  // namespace
+
+absl::Status CompleteWithContinuations(
+    Model& model, const Fetch& fetch, Message prompt,
+    const RequestOptions& options, int max_continuations,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  return CompleteWithContinuations(model, fetch, {}, std::move(prompt),
+                                   options, max_continuations, on_segment);
+}
+
+absl::Status CompleteWithContinuations(
+    Model& model, const Fetch& fetch, absl::Span<const Message> history,
+    Message prompt, const RequestOptions& options, int max_continuations,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  std::vector<Message> messages(history.begin(), history.end());
+  messages.push_back(std::move(prompt));
+  const size_t answer = messages.size();
+  for (int continuation = 0;; ++continuation) {
+    auto reply = model.Complete(fetch, messages, {}, options);
+    if (!reply.ok()) {
+      return std::move(reply).status();
+    }
+    on_segment(reply->text);
+    if (!reply->truncated || continuation >= max_continuations) {
+      return absl::OkStatus();
+    }
+    // The answer so far goes into a single assistant message, so every
+    // continuation is the same two messages longer than the prompt.
+    if (messages.size() == answer) {
+      messages.push_back({.role = Message::Role::kAssistant});
+      messages.push_back({.content = std::string(kContinue)});
+    }
+    messages[answer].content += reply->text;
+  }
+}
+
+absl::StatusOr<std::string> PromptFromStream(
+    Model& model, const Fetch& fetch, std::string_view prompt,
+    absl::Span<const std::string_view> input_contents,
+    const RequestOptions& options) {
+  std::string response;
+  absl::Status status = model.StreamPrompt(
+      fetch, prompt, input_contents, options,
+      [&](std::string_view segment) { response += segment; });
+  if (!status.ok()) {
+    return status;
+  }
+  return response;
+}
+
+absl::Status Model::StreamPromptUntil(
+    const Fetch& fetch, std::string_view prompt,
+    absl::Span<const std::string_view> input_contents,
+    absl::Span<const StopCondition> stop, const RequestOptions& options,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  auto matcher = StopMatcher::Create(stop);
+  if (!matcher.ok()) {
+    return std::move(matcher).status();
+  }
+  absl::Status status = StreamPrompt(
+      fetch, prompt, input_contents, options, [&](std::string_view segment) {
+        if (std::string_view text = matcher->Feed(segment); !text.empty()) {
+          on_segment(text);
+        }
+      });
+  if (!status.ok()) {
+    return status;
+  }
+  if (std::string_view rest = matcher->Finish(); !rest.empty()) {
+    on_segment(rest);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status Model::StreamConversationUntil(
+    const Fetch& fetch, absl::Span<const Message> history, Message prompt,
+    absl::Span<const StopCondition> stop, const RequestOptions& options,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  auto matcher = StopMatcher::Create(stop);
+  if (!matcher.ok()) {
+    return std::move(matcher).status();
+  }
+  absl::Status status = CompleteWithContinuations(
+      *this, fetch, history, std::move(prompt), options,
+      absl::GetFlag(FLAGS_max_continuations), [&](std::string_view segment) {
+        if (std::string_view text = matcher->Feed(segment); !text.empty()) {
+          on_segment(text);
+        }
+      });
+  if (!status.ok()) {
+    return status;
+  }
+  if (std::string_view rest = matcher->Finish(); !rest.empty()) {
+    on_segment(rest);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status StreamWithContinuations(
+    absl::Span<const Message> history, Message prompt,
+    absl::Span<const StopCondition> stop, int max_continuations,
+    StreamingComplete complete,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  auto matcher = StopMatcher::Create(stop);
+  if (!matcher.ok()) {
+    return std::move(matcher).status();
+  }
+  std::vector<Message> messages(history.begin(), history.end());
+  messages.push_back(std::move(prompt));
+  const size_t answer = messages.size();
+  for (int continuation = 0;; ++continuation) {
+    auto reply = complete(messages, [&](std::string_view text) {
+      if (std::string_view final_text = matcher->Feed(text);
+          !final_text.empty()) {
+        on_segment(final_text);
+      }
+      return !matcher->stopped();
+    });
+    if (!reply.ok()) {
+      return std::move(reply).status();
+    }
+    if (matcher->stopped()) {
+      return absl::OkStatus();
+    }
+    if (!reply->truncated || continuation >= max_continuations) {
+      if (std::string_view rest = matcher->Finish(); !rest.empty()) {
+        on_segment(rest);
+      }
+      return absl::OkStatus();
+    }
+    if (messages.size() == answer) {
+      messages.push_back({.role = Message::Role::kAssistant});
+      messages.push_back({.content = std::string(kContinue)});
+    }
+    messages[answer].content += reply->text;
+  }
+}
+
+absl::StatusOr<json::Json> ParseToolJson(std::string_view text) {
+  auto parsed = json::Json::parse(text, nullptr, /*allow_exceptions=*/false);
+  if (parsed.is_discarded()) {
+    return absl::InvalidArgumentError(absl::StrCat("Invalid JSON: ", text));
+  }
+  return parsed;
+}
+
+absl::StatusOr<ModelHandle> ConnectToModel(
+    absl::Span<const std::unique_ptr<ModelProvider>> providers,
+    std::string_view model) {
+  for (const auto& provider : providers) {
+    auto handle = provider->ConnectToModel(model);
+    if (handle.ok() || handle.status().code() != absl::StatusCode::kNotFound) {
+      return handle;
+    }
+  }
+  return absl::NotFoundError(absl::StrCat("No model found for ", model));
+}
+
+}  // namespace uchen::chat
@@ -5,13 +5,101 @@
 #include <memory>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
+#include "absl/flags/declare.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
 
 #include "src/fetch.h"
+#include "src/json_arena.h"
+#include "src/stop.h"
+
+ABSL_DECLARE_FLAG(int, max_continuations);
 
 namespace uchen::chat {
 
+// A tool invocation requested by the model.
+struct ToolCall {
+  // Provider-assigned id that the result must refer to.
+  std::string id;
+  std::string name;
+  // JSON object with the arguments.
+  std::string arguments;
+};
+
+// A tool the model may call.
+struct ToolSpec {
+  std::string name;
+  std::string description;
+  // JSON schema of the arguments object.
+  std::string parameters;
+};
+
+struct Message {
+  enum class Role { kUser, kAssistant, kTool };
+
+  Role role = Role::kUser;
+  std::string content;
+  // kAssistant only: tools the model asked for in this message.
+  std::vector<ToolCall> tool_calls;
+  // kTool only: the call that `content` is the output of.
+  std::string tool_call_id;
+};
+
+struct Reply {
+  std::string text;
+  // When not empty, the model waits for a kTool message with the result of
+  // each call.
+  std::vector<ToolCall> tool_calls;
+  // The model hit max_tokens before it was done.
+  bool truncated = false;
+};
+
+// One conversation of a batch.
+struct BatchRequest {
+  // Unique within the batch, the result refers to it.
+  std::string id;
+  std::vector<Message> messages;
+};
+
+struct BatchResult {
+  std::string id;
+  absl::StatusOr<Reply> reply;
+};
+
+// Asynchronous batch endpoint of a provider. A batch is answered within a
+// day, with higher rate limits and cheaper tokens than separate requests.
+class BatchApi {
+ public:
+  virtual ~BatchApi() = default;
+
+  // Most requests one batch may hold.
+  virtual size_t max_batch_requests() const = 0;
+
+  // Creates a batch of `requests` and returns its id.
+  virtual absl::StatusOr<std::string> SubmitBatch(
+      const Fetch& fetch, absl::Span<const BatchRequest> requests,
+      const RequestOptions& options) = 0;
+
+  // Whether the results of batch `batch_id` are ready. Fails when the batch
+  // failed or was cancelled as a whole.
+  virtual absl::StatusOr<bool> PollBatch(const Fetch& fetch,
+                                         std::string_view batch_id,
+                                         const RequestOptions& options) = 0;
+
+  // Passes the result of every request of a finished batch to `on_result`,
+  // in the order the provider returns them.
+  virtual absl::Status BatchResults(
+      const Fetch& fetch, std::string_view batch_id,
+      const RequestOptions& options,
+      absl::FunctionRef<void(BatchResult)> on_result) = 0;
+};
+
 // Interface for LLM clients
 class Model {
  public:
@@ -19,10 +107,61 @@ class Model {
 
   virtual std::string_view name() const = 0;
 
+  // URL the requests of this model go to, if it talks to a server, so the
+  // connection can be set up ahead of the first one.
+  virtual std::string_view endpoint() const { return {}; }
+
   // Queries the LLM with a prompt and multiple input contents
   virtual absl::StatusOr<std::string> Prompt(
       const Fetch& fetch, std::string_view prompt,
-      absl::Span<const std::string_view> input_contents) = 0;
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options) = 0;
+
+  // Like Prompt, but hands the response to `on_segment` piece by piece as
+  // the pieces arrive.
+  virtual absl::Status StreamPrompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) {
+    auto response = Prompt(fetch, prompt, input_contents, options);
+    if (!response.ok()) {
+      return std::move(response).status();
+    }
+    on_segment(*response);
+    return absl::OkStatus();
+  }
+
+  // Like StreamPrompt, but the answer ends where the first of `stop`
+  // matches. By default the conditions are applied to what StreamPrompt
+  // returns; models that can stream the reply from the provider close the
+  // transfer as soon as one matches instead, and pass literal stops on to
+  // the provider.
+  virtual absl::Status StreamPromptUntil(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment);
+  // The same for a prompt that follows the earlier turns of a conversation
+  // in `history`. By default the answer comes from Complete, continued while
+  // it is truncated, and is cut where the first of `stop` matches.
+  virtual absl::Status StreamConversationUntil(
+      const Fetch& fetch, absl::Span<const Message> history, Message prompt,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment);
+
+  // Continues a conversation in which the model may call `tools`.
+  virtual absl::StatusOr<Reply> Complete(
+      const Fetch& /* fetch */, absl::Span<const Message> /* messages */,
+      absl::Span<const ToolSpec> /* tools */,
+      const RequestOptions& /* options */) {
+    return absl::UnimplementedError(
+        absl::StrCat(name(), " does not support tool calls"));
+  }
+
+  // The batch endpoint of the provider, nullptr if it has none. Batches use
+  // the same requests as Complete, without tools.
+  virtual BatchApi* batch_api() { return nullptr; }
 };
 
 class Parameters {
@@ -63,6 +202,54 @@ class ModelProvider {
   virtual std::vector<std::string> ListModels() const = 0;
 };
 
+// Prompt for models that stream: collects what `model.StreamPrompt` hands
+// out into one response.
+absl::StatusOr<std::string> PromptFromStream(
+    Model& model, const Fetch& fetch, std::string_view prompt,
+    absl::Span<const std::string_view> input_contents,
+    const RequestOptions& options);
+
+// Answers `prompt` with Model::Complete. While the reply is truncated, up to
+// `max_continuations` times, the model is shown its answer so far and asked
+// to go on. The conversation before the answer is sent unchanged, so the
+// provider can serve it from its prompt cache. Every reply is passed to
+// `on_segment` before the next request goes out.
+absl::Status CompleteWithContinuations(
+    Model& model, const Fetch& fetch, Message prompt,
+    const RequestOptions& options, int max_continuations,
+    absl::FunctionRef<void(std::string_view)> on_segment);
+// The same for a prompt that follows the earlier turns of a conversation in
+// `history`.
+absl::Status CompleteWithContinuations(
+    Model& model, const Fetch& fetch, absl::Span<const Message> history,
+    Message prompt, const RequestOptions& options, int max_continuations,
+    absl::FunctionRef<void(std::string_view)> on_segment);
+
+// Sends `messages` with the reply streamed, handing its text to `on_text` as
+// it arrives and closing the transfer once `on_text` returns false. Returns
+// the reply with all the text that arrived.
+using StreamingComplete = absl::FunctionRef<absl::StatusOr<Reply>(
+    absl::Span<const Message> messages,
+    absl::FunctionRef<bool(std::string_view)> on_text)>;
+
+// CompleteWithContinuations for models that stream: `complete` sends each
+// request, and the answer ends where the first of `stop` matches, without
+// waiting for the rest of the reply.
+absl::Status StreamWithContinuations(
+    absl::Span<const Message> history, Message prompt,
+    absl::Span<const StopCondition> stop,
+    int max_continuations, StreamingComplete complete,
+    absl::FunctionRef<void(std::string_view)> on_segment);
+
+// Parses the JSON arguments of a ToolCall or parameters of a ToolSpec for a
+// provider request.
+absl::StatusOr<json::Json> ParseToolJson(std::string_view text);
+
+// Connects to `model` using the first provider that supports it.
+absl::StatusOr<ModelHandle> ConnectToModel(
+    absl::Span<const std::unique_ptr<ModelProvider>> providers,
+    std::string_view model);
+
 }  // namespace uchen::chat
 
 #endif  // SRC_MODEL_H_
\ No newline at end of file
@@ -9,60 +9,456 @@
 #include <vector>
 
 #include "absl/flags/flag.h"
+#include "absl/functional/function_ref.h"
 #include "absl/log/log.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
 #include "absl/strings/substitute.h"
 
-#include "nlohmann/json.hpp"
 #include "src/fetch.h"
+#include "src/json_arena.h"
 #include "src/json_decode.h"
+#include "src/json_template.h"
 #include "src/model.h"
+#include "src/sse.h"
+#include "src/stop.h"
+#include "src/trace.h"
 
 ABSL_FLAG(std::optional<std::string>, openai_api_key, std::nullopt,
           "OpenAI API key. If not set, will use the environment variable "
           "OPENAI_API_KEY.");
+ABSL_FLAG(std::string, openai_api_url, "https://api.openai.com/v1",
+          "Base URL of the OpenAI API, e.g. of a proxy or a compatible "
+          "server.");
 
 namespace uchen::chat {
 namespace {
 
-class OpenAIModel : public Model {
+// Path of the Chat Completions endpoint in batch input files, whatever the
+// base URL.
+constexpr char kBatchEndpoint[] = "/v1/chat/completions";
+// The API takes up to four stop sequences.
+constexpr size_t kMaxStopSequences = 4;
+
+class OpenAIModel : public Model, public BatchApi {
  public:
-  explicit OpenAIModel(std::string_view model, std::string_view api_key,
-                       int max_tokens)
-      : model_(model), api_key_(api_key), max_tokens_(max_tokens) {}
+  explicit OpenAIModel(std::string_view model, std::string_view api_url,
+                       std::string_view api_key, int max_tokens,
+                       int max_continuations)
+      : model_(model),
+        api_url_(api_url),
+        completions_url_(absl::StrCat(api_url, "/chat/completions")),
+        api_key_(api_key),
+        max_tokens_(max_tokens),
+        max_continuations_(max_continuations),
+        headers_({{.key = "Content-Type", .value = "application/json"},
+                  AuthorizationHeader()}),
+        request_template_({{"model", model_}, {"max_tokens", max_tokens_}},
+                          "messages"),
+        stream_template_({{"model", model_},
+                          {"max_tokens", max_tokens_},
+                          {"stream", true}},
+                         "messages") {}
   ~OpenAIModel() override = default;
 
   std::string_view name() const override { return model_; }
+  std::string_view endpoint() const override { return completions_url_; }
 
   absl::StatusOr<std::string> Prompt(
       const Fetch& fetch, std::string_view prompt,
-      absl::Span<const std::string_view> input_contents) override;
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options) override;
+
+  absl::Status StreamPrompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override;
+
+  absl::Status StreamPromptUntil(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override;
+
+  absl::Status StreamConversationUntil(
+      const Fetch& fetch, absl::Span<const Message> history, Message prompt,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override;
+
+  absl::StatusOr<Reply> Complete(const Fetch& fetch,
+                                 absl::Span<const Message> messages,
+                                 absl::Span<const ToolSpec> tools,
+                                 const RequestOptions& options) override;
+
+  BatchApi* batch_api() override { return this; }
+
+  // The limit of the Batch API per input file.
+  size_t max_batch_requests() const override { return 50000; }
+
+  absl::StatusOr<std::string> SubmitBatch(
+      const Fetch& fetch, absl::Span<const BatchRequest> requests,
+      const RequestOptions& options) override;
+
+  absl::StatusOr<bool> PollBatch(const Fetch& fetch,
+                                 std::string_view batch_id,
+                                 const RequestOptions& options) override;
+
+  absl::Status BatchResults(
+      const Fetch& fetch, std::string_view batch_id,
+      const RequestOptions& options,
+      absl::FunctionRef<void(BatchResult)> on_result) override;
 
  private:
+  // Builds the body of a Chat Completions request. Allocates from the arena
+  // of the caller.
+  absl::StatusOr<json::Json> BuildRequest(
+      absl::Span<const Message> messages,
+      absl::Span<const ToolSpec> tools) const;
+  // The serialized body of a Chat Completions request. Conversations
+  // without tools only serialize their messages into request_template_, or
+  // stream_template_ when the reply is to be streamed.
+  absl::StatusOr<std::string> SerializeRequest(
+      absl::Span<const Message> messages, absl::Span<const ToolSpec> tools,
+      bool stream = false,
+      absl::Span<const std::string> stop_sequences = {}) const;
+  // Complete without tools, with the reply streamed. Its text goes to
+  // `on_text` as it arrives, until that returns false.
+  absl::StatusOr<Reply> StreamComplete(
+      const Fetch& fetch, absl::Span<const Message> messages,
+      absl::Span<const std::string> stop_sequences,
+      const RequestOptions& options,
+      absl::FunctionRef<bool(std::string_view)> on_text);
+
+  Header AuthorizationHeader() const {
+    return {.key = "Authorization", .value = absl::StrCat("Bearer ", api_key_)};
+  }
+
   std::string model_;
+  std::string api_url_;
+  std::string completions_url_;
   std::string api_key_;
   int max_tokens_;
+  int max_continuations_;
+  std::vector<Header> headers_;
+  json::JsonTemplate request_template_;
+  json::JsonTemplate stream_template_;
 };
 
+// The document of a response of the batch and file endpoints.
+absl::StatusOr<json::Json> DecodeJson(absl::StatusOr<Response> response) {
+  if (!response.ok()) {
+    return std::move(response).status();
+  }
+  auto json = response->Json();
+  if (!json.ok()) {
+    return std::move(json).status();
+  }
+  if (auto error = json->find("error");
+      error != json->end() && !error->is_null()) {
+    return absl::InternalError(
+        absl::StrCat("OpenAI API error: ", error->dump()));
+  }
+  return json;
+}
+
+absl::StatusOr<std::string> DecodeString(const json::JsonDecode& value) {
+  auto decoded = value.String();
+  if (!decoded.ok()) {
+    return absl::InternalError(
+        absl::StrCat("OpenAI API error: ", decoded.error()));
+  }
+  return decoded.value();
+}
+
+json::Json EncodeMessage(const Message& message) {
+  switch (message.role) {
+    case Message::Role::kUser:
+      return json::Json{{"role", "user"}, {"content", message.content}};
+    case Message::Role::kTool:
+      return json::Json{{"role", "tool"},
+                        {"tool_call_id", message.tool_call_id},
+                        {"content", message.content}};
+    case Message::Role::kAssistant:
+      break;
+  }
+  json::Json encoded = {{"role", "assistant"}, {"content", message.content}};
+  if (message.content.empty() && !message.tool_calls.empty()) {
+    encoded["content"] = nullptr;
+  }
+  for (const ToolCall& call : message.tool_calls) {
+    encoded["tool_calls"].push_back(
+        {{"id", call.id},
+         {"type", "function"},
+         {"function", {{"name", call.name}, {"arguments", call.arguments}}}});
+  }
+  return encoded;
+}
+
+// Decodes a Chat Completions response.
+absl::StatusOr<Reply> DecodeReply(const json::JsonDecode& decoded) {
+  if (auto error = decoded["error"]; error.ok()) {
+    auto error_message = error["message"].String().value_or(
+        [&]() { return std::string(error->dump()); });
+    return absl::InternalError(
+        absl::StrCat("OpenAI API error: ", error_message));
+  }
+
+  json::JsonDecode choice = decoded["choices"][0];
+  json::JsonDecode message = choice["message"];
+  Reply reply;
+  reply.truncated = choice["finish_reason"].String() == "length";
+  if (auto calls = message["tool_calls"]; calls.ok() && calls->is_array()) {
+    for (size_t i = 0; i < calls->size(); ++i) {
+      json::JsonDecode function = calls[i]["function"];
+      auto id = calls[i]["id"].String();
+      auto name = function["name"].String();
+      auto arguments = function["arguments"].String();
+      for (const auto* field : {&id, &name, &arguments}) {
+        if (!field->ok()) {
+          return absl::InternalError(
+              absl::StrCat("OpenAI API error: ", field->error()));
+        }
+      }
+      reply.tool_calls.push_back({.id = id.value(),
+                                  .name = name.value(),
+                                  .arguments = arguments.value()});
+    }
+  }
+  auto content = message["content"].String();
+  if (content.ok()) {
+    reply.text = content.value();
+  } else if (reply.tool_calls.empty()) {
+    // Content is only optional next to tool calls.
+    return absl::InternalError(
+        absl::StrCat("OpenAI API error: ", content.error()));
+  }
+  return reply;
+}
+
 absl::StatusOr<std::string> OpenAIModel::Prompt(
     const Fetch& fetch, std::string_view prompt,
-    absl::Span<const std::string_view> input_contents) {
+    absl::Span<const std::string_view> input_contents,
+    const RequestOptions& options) {
+  return PromptFromStream(*this, fetch, prompt, input_contents, options);
+}
+
+absl::Status OpenAIModel::StreamPrompt(
+    const Fetch& fetch, std::string_view prompt,
+    absl::Span<const std::string_view> input_contents,
+    const RequestOptions& options,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
   std::string combined_input = absl::StrJoin(input_contents, "\n\n");
+  Message message = {.content = absl::StrCat(prompt, "\n\n", combined_input)};
+  return CompleteWithContinuations(*this, fetch, std::move(message), options,
+                                   max_continuations_, on_segment);
+}
+
+absl::Status OpenAIModel::StreamPromptUntil(
+    const Fetch& fetch, std::string_view prompt,
+    absl::Span<const std::string_view> input_contents,
+    absl::Span<const StopCondition> stop, const RequestOptions& options,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  if (stop.empty()) {
+    return StreamPrompt(fetch, prompt, input_contents, options, on_segment);
+  }
+  std::string combined_input = absl::StrJoin(input_contents, "\n\n");
+  Message message = {.content = absl::StrCat(prompt, "\n\n", combined_input)};
+  return StreamConversationUntil(fetch, {}, std::move(message), stop, options,
+                                 on_segment);
+}
 
-  auto response = fetch.Post(
-      "https://api.openai.com/v1/chat/completions",
-      {
-          {.key = "Content-Type", .value = "application/json"},
-          {.key = "Authorization", .value = absl::StrCat("Bearer ", api_key_)},
+absl::Status OpenAIModel::StreamConversationUntil(
+    const Fetch& fetch, absl::Span<const Message> history, Message prompt,
+    absl::Span<const StopCondition> stop, const RequestOptions& options,
+    absl::FunctionRef<void(std::string_view)> on_segment) {
+  const std::vector<std::string> stop_sequences =
+      LiteralStops(stop, kMaxStopSequences);
+  return StreamWithContinuations(
+      history, std::move(prompt), stop, max_continuations_,
+      [&](absl::Span<const Message> messages,
+          absl::FunctionRef<bool(std::string_view)> on_text) {
+        return StreamComplete(fetch, messages, stop_sequences, options,
+                              on_text);
       },
-      {{"model", model_},
-       {"max_tokens", max_tokens_},
-       {"messages",
-        nlohmann::json::array(
-            {{{"role", "user"},
-              {"content", absl::StrCat(prompt, "\n\n", combined_input)}}})}});
+      on_segment);
+}
+
+absl::StatusOr<Reply> OpenAIModel::StreamComplete(
+    const Fetch& fetch, absl::Span<const Message> messages,
+    absl::Span<const std::string> stop_sequences,
+    const RequestOptions& options,
+    absl::FunctionRef<bool(std::string_view)> on_text) {
+  TraceSpan span("OpenAIModel::StreamComplete");
+  json::Arena arena;
+  json::ArenaScope arena_scope(arena);
+  auto request = SerializeRequest(messages, {}, /*stream=*/true,
+                                  stop_sequences);
+  if (!request.ok()) {
+    return std::move(request).status();
+  }
+  Reply reply;
+  SseReader events;
+  // The body as long as it is not an event stream, e.g. an error.
+  std::string body;
+  absl::Status error;
+  auto on_event = [&](std::string_view /* event */, std::string_view data) {
+    if (data == "[DONE]") {
+      return true;
+    }
+    json::Json chunk = json::Json::parse(data, nullptr, false);
+    if (!chunk.is_object()) {
+      error = absl::InternalError(absl::StrCat("Invalid event: ", data));
+      return false;
+    }
+    if (auto found = chunk.find("error"); found != chunk.end()) {
+      error = absl::InternalError(
+          absl::StrCat("OpenAI API error: ", found->dump()));
+      return false;
+    }
+    auto choices = chunk.find("choices");
+    if (choices == chunk.end() || !choices->is_array() || choices->empty()) {
+      return true;
+    }
+    const json::Json& choice = choices->front();
+    if (auto reason = choice.find("finish_reason");
+        reason != choice.end() && *reason == "length") {
+      reply.truncated = true;
+    }
+    auto delta = choice.find("delta");
+    if (delta == choice.end()) {
+      return true;
+    }
+    auto content = delta->find("content");
+    if (content == delta->end() || !content->is_string()) {
+      return true;
+    }
+    const auto& text = content->get_ref<const json::String&>();
+    reply.text.append(text.data(), text.size());
+    return on_text(std::string_view(text.data(), text.size()));
+  };
+  absl::Status status = fetch.PostJsonStream(
+      completions_url_, headers_, *request, options,
+      [&](std::string_view data) {
+        if (events.events() == 0) {
+          body.append(data);
+        }
+        return events.Feed(data, on_event);
+      });
+  if (!status.ok()) {
+    return status;
+  }
+  if (!error.ok()) {
+    return error;
+  }
+  if (events.events() == 0) {
+    // Errors come back as a plain JSON response.
+    auto response = json::Json::parse(body, nullptr, false);
+    if (response.is_discarded()) {
+      return absl::InternalError(
+          absl::StrCat("Failed to parse JSON: ", body));
+    }
+    return DecodeReply(json::JsonDecode(std::move(response)));
+  }
+  return reply;
+}
+
+absl::StatusOr<json::Json> OpenAIModel::BuildRequest(
+    absl::Span<const Message> messages,
+    absl::Span<const ToolSpec> tools) const {
+  TraceSpan span("OpenAIModel::BuildRequest");
+  json::Json request = {{"model", model_},
+                        {"max_tokens", max_tokens_},
+                        {"messages", json::Json::array()}};
+  for (const Message& message : messages) {
+    request["messages"].push_back(EncodeMessage(message));
+  }
+  for (const ToolSpec& tool : tools) {
+    auto parameters = ParseToolJson(tool.parameters);
+    if (!parameters.ok()) {
+      return std::move(parameters).status();
+    }
+    request["tools"].push_back({{"type", "function"},
+                                {"function",
+                                 {{"name", tool.name},
+                                  {"description", tool.description},
+                                  {"parameters", *std::move(parameters)}}}});
+  }
+  return request;
+}
+
+absl::StatusOr<std::string> OpenAIModel::SerializeRequest(
+    absl::Span<const Message> messages, absl::Span<const ToolSpec> tools,
+    bool stream, absl::Span<const std::string> stop_sequences) const {
+  const bool plain =
+      tools.empty() &&
+      std::ranges::none_of(messages, [](const Message& message) {
+        return message.role == Message::Role::kTool ||
+               !message.tool_calls.empty();
+      });
+  if (!plain) {
+    auto request = BuildRequest(messages, tools);
+    if (!request.ok()) {
+      return std::move(request).status();
+    }
+    if (stream) {
+      (*request)["stream"] = true;
+    }
+    for (const std::string& stop : stop_sequences) {
+      (*request)["stop"].push_back(stop);
+    }
+    return std::string(request->dump());
+  }
+  TraceSpan span("OpenAIModel::RenderRequest");
+  size_t size = 0;
+  for (const Message& message : messages) {
+    size += message.content.size() + 32;
+  }
+  return (stream ? stream_template_ : request_template_)
+      .Render(
+          [&](std::string& out) {
+            out.push_back('[');
+            for (const Message& message : messages) {
+              if (out.back() != '[') {
+                out.push_back(',');
+              }
+              out += message.role == Message::Role::kUser
+                         ? R"({"role":"user","content":)"
+                         : R"({"role":"assistant","content":)";
+              json::AppendJsonString(out, message.content);
+              out.push_back('}');
+            }
+            out.push_back(']');
+            if (!stop_sequences.empty()) {
+              out += R"(,"stop":[)";
+              for (const std::string& stop : stop_sequences) {
+                if (out.back() != '[') {
+                  out.push_back(',');
+                }
+                json::AppendJsonString(out, stop);
+              }
+              out.push_back(']');
+            }
+          },
+          size);
+}
+
+absl::StatusOr<Reply> OpenAIModel::Complete(const Fetch& fetch,
+                                            absl::Span<const Message> messages,
+                                            absl::Span<const ToolSpec> tools,
+                                            const RequestOptions& options) {
+  TraceSpan span("OpenAIModel::Complete");
+  // All JSON of this turn is released at once when the arena goes away.
+  json::Arena arena;
+  json::ArenaScope arena_scope(arena);
+  auto request = SerializeRequest(messages, tools);
+  if (!request.ok()) {
+    return std::move(request).status();
+  }
+  auto response =
+      fetch.PostJson(completions_url_, headers_, *request, options);
 
   if (!response.ok()) {
     return std::move(response).status();
@@ -74,22 +470,134 @@ absl::StatusOr<std::string> OpenAIModel::Prompt(
     return std::move(json_response).status();
   }
 
-  auto error = json::JsonDecode(*json_response)["error"];
-  if (error.ok()) {
-    auto error_message =
-        error["message"].String().value_or([&]() { return error->dump(); });
-    return absl::InternalError(
-        absl::StrCat("OpenAI API error: ", error_message));
+  TraceSpan decode_span("OpenAIModel::DecodeResponse");
+  return DecodeReply(json::JsonDecode(*std::move(json_response)));
+}
+
+absl::StatusOr<std::string> OpenAIModel::SubmitBatch(
+    const Fetch& fetch, absl::Span<const BatchRequest> requests,
+    const RequestOptions& options) {
+  TraceSpan span("OpenAIModel::SubmitBatch");
+  json::Arena arena;
+  json::ArenaScope arena_scope(arena);
+  // The requests go into a JSON lines file, which is uploaded first.
+  std::string input;
+  for (const BatchRequest& request : requests) {
+    auto body = BuildRequest(request.messages, {});
+    if (!body.ok()) {
+      return std::move(body).status();
+    }
+    json::Json line = {{"custom_id", request.id},
+                       {"method", "POST"},
+                       {"url", kBatchEndpoint},
+                       {"body", *std::move(body)}};
+    absl::StrAppend(&input, line.dump(), "\n");
+  }
+  auto file = DecodeJson(fetch.PostForm(
+      absl::StrCat(api_url_, "/files"), {AuthorizationHeader()},
+      {{.name = "purpose", .value = "batch"},
+       {.name = "file", .value = std::move(input), .filename = "batch.jsonl"}},
+      options));
+  if (!file.ok()) {
+    return std::move(file).status();
+  }
+  auto file_id = DecodeString(json::JsonDecode(*std::move(file))["id"]);
+  if (!file_id.ok()) {
+    return std::move(file_id).status();
   }
+  auto batch = DecodeJson(fetch.Post(
+      absl::StrCat(api_url_, "/batches"),
+      {{.key = "Content-Type", .value = "application/json"},
+       AuthorizationHeader()},
+      {{"input_file_id", *file_id},
+       {"endpoint", kBatchEndpoint},
+       {"completion_window", "24h"}},
+      options));
+  if (!batch.ok()) {
+    return std::move(batch).status();
+  }
+  return DecodeString(json::JsonDecode(*std::move(batch))["id"]);
+}
 
-  auto message =
-      json::JsonDecode(*json_response)["choices"][0]["message"]["content"]
-          .String();
-  if (!message.ok()) {
+absl::StatusOr<bool> OpenAIModel::PollBatch(const Fetch& fetch,
+                                            std::string_view batch_id,
+                                            const RequestOptions& options) {
+  TraceSpan span("OpenAIModel::PollBatch");
+  auto batch =
+      DecodeJson(fetch.Get(absl::StrCat(api_url_, "/batches/", batch_id),
+                           {AuthorizationHeader()}, options));
+  if (!batch.ok()) {
+    return std::move(batch).status();
+  }
+  json::JsonDecode decoded(*std::move(batch));
+  auto status = DecodeString(decoded["status"]);
+  if (!status.ok()) {
+    return std::move(status).status();
+  }
+  // Requests an expired batch did not get to are in its error file.
+  if (*status == "completed" || *status == "expired") {
+    return true;
+  }
+  if (*status == "failed" || *status == "cancelling" ||
+      *status == "cancelled") {
+    json::JsonDecode errors = decoded["errors"];
     return absl::InternalError(
-        absl::StrCat("OpenAI API error: ", message.error()));
+        absl::StrCat("OpenAI batch ", batch_id, " ", *status,
+                     errors.ok() ? absl::StrCat(": ", errors->dump()) : ""));
+  }
+  return false;
+}
+
+absl::Status OpenAIModel::BatchResults(
+    const Fetch& fetch, std::string_view batch_id,
+    const RequestOptions& options,
+    absl::FunctionRef<void(BatchResult)> on_result) {
+  TraceSpan span("OpenAIModel::BatchResults");
+  auto batch =
+      DecodeJson(fetch.Get(absl::StrCat(api_url_, "/batches/", batch_id),
+                           {AuthorizationHeader()}, options));
+  if (!batch.ok()) {
+    return batch.status();
+  }
+  json::JsonDecode decoded(*std::move(batch));
+  // Successful requests are in the output file, failed ones in the error
+  // file. Either is missing when it would be empty.
+  for (std::string_view file : {"output_file_id", "error_file_id"}) {
+    auto file_id = decoded[file].String();
+    if (!file_id.ok()) {
+      continue;
+    }
+    auto content = fetch.Get(
+        absl::StrCat(api_url_, "/files/", file_id.value(), "/content"),
+        {AuthorizationHeader()}, options);
+    if (!content.ok()) {
+      return content.status();
+    }
+    for (std::string_view line : absl::StrSplit(
+             content->body(), '\n', absl::SkipWhitespace())) {
+      auto parsed = json::Json::parse(line, nullptr, false);
+      if (parsed.is_discarded()) {
+        return absl::InternalError(
+            absl::StrCat("Invalid line in the batch results: ", line));
+      }
+      json::JsonDecode result(std::move(parsed));
+      auto id = DecodeString(result["custom_id"]);
+      if (!id.ok()) {
+        return id.status();
+      }
+      if (auto error = result["error"]; error.ok() && !error->is_null()) {
+        auto message = error["message"].String().value_or(
+            [&]() { return std::string(error->dump()); });
+        on_result({.id = *std::move(id),
+                   .reply = absl::InternalError(
+                       absl::StrCat("OpenAI API error: ", message))});
+        continue;
+      }
+      on_result({.id = *std::move(id),
+                 .reply = DecodeReply(result["response"]["body"])});
+    }
   }
-  return message.value();
+  return absl::OkStatus();
 }
 
 class OpenAIModelProvider : public ModelProvider {
@@ -110,8 +618,9 @@ class OpenAIModelProvider : public ModelProvider {
     if (!api_key.has_value()) {
       return absl::InvalidArgumentError("API key is required");
     }
-    auto client = std::make_unique<OpenAIModel>(model, *api_key,
-                                                parameters_.max_tokens());
+    auto client = std::make_unique<OpenAIModel>(
+        model, absl::GetFlag(FLAGS_openai_api_url), *api_key,
+        parameters_.max_tokens(), absl::GetFlag(FLAGS_max_continuations));
     return ModelHandle(std::move(client));
   }
 
@@ -120,12 +629,13 @@ class OpenAIModelProvider : public ModelProvider {
     if (!api_key.has_value()) {
       return {};
     }
-    auto response =
-        fetch_->Get("https://api.openai.com/v1/models",
-                    {
-                        {.key = "Authorization",
-                         .value = absl::StrCat("Bearer ", *api_key)},
-                    });
+    auto response = fetch_->Get(
+        absl::StrCat(absl::GetFlag(FLAGS_openai_api_url), "/models"),
+        {
+            {.key = "Authorization",
+             .value = absl::StrCat("Bearer ", *api_key)},
+        },
+        {});
     if (!response.ok()) {
       LOG(ERROR) << "Failed to fetch models: " << response.status();
       return {};
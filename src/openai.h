@@ -11,6 +11,7 @@
 #include "src/fetch.h"
 
 ABSL_DECLARE_FLAG(std::optional<std::string>, openai_api_key);
+ABSL_DECLARE_FLAG(std::string, openai_api_url);
 
 namespace uchen::chat {
 
@@ -0,0 +1,462 @@
+#include "src/prompt_cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/functional/function_ref.h"
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/stop.h"
+#include "src/trace.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr size_t kShingleSize = 5;
+// More bands than this make the buckets too coarse to be worth it, which
+// sets kMinPromptSimilarity.
+constexpr size_t kMaxBands = 16;
+static_assert(kMinPromptSimilarity == 1 - (kMaxBands - 1) / 64.0);
+
+absl::Status ErrnoStatus(std::string_view what) {
+  return absl::InternalError(absl::StrCat(what, ": ", std::strerror(errno)));
+}
+
+// Digits, and the separators of dates and times between them, from the
+// start of `text`, which is a digit.
+std::string_view NumericSpan(std::string_view text) {
+  size_t end = 1;
+  while (end < text.size()) {
+    if (std::isdigit(static_cast<unsigned char>(text[end]))) {
+      ++end;
+    } else if (end + 1 < text.size() &&
+               std::string_view(":-/.T").find(text[end]) !=
+                   std::string_view::npos &&
+               std::isdigit(static_cast<unsigned char>(text[end + 1]))) {
+      end += 2;
+    } else {
+      break;
+    }
+  }
+  return text.substr(0, end);
+}
+
+// 10:22:13, 2024-05-01 or 05/01/2024, but not 12-7, 3.14 or 1.2.3.
+bool IsDateOrTime(std::string_view span) {
+  return absl::StrContains(span, ':') || std::ranges::count(span, '-') >= 2 ||
+         std::ranges::count(span, '/') >= 2;
+}
+
+// The runs of digits of a normalized prompt.
+std::string PromptNumbers(std::string_view normalized) {
+  std::string numbers;
+  for (size_t i = 0; i < normalized.size(); ++i) {
+    if (!std::isdigit(static_cast<unsigned char>(normalized[i]))) {
+      continue;
+    }
+    if (!numbers.empty() &&
+        !std::isdigit(static_cast<unsigned char>(normalized[i - 1]))) {
+      numbers.push_back(' ');
+    }
+    numbers.push_back(normalized[i]);
+  }
+  return numbers;
+}
+
+// FNV-1a followed by the SplitMix64 finalizer, so that every bit of the
+// hash depends on every byte.
+uint64_t HashShingle(std::string_view shingle) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (char c : shingle) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+  return hash ^ (hash >> 31);
+}
+
+std::string CacheKey(std::string_view prompt,
+                     absl::Span<const std::string_view> input_contents) {
+  std::string key(prompt);
+  if (!input_contents.empty()) {
+    absl::StrAppend(&key, "\n\n", absl::StrJoin(input_contents, "\n\n"));
+  }
+  return key;
+}
+
+class CachedModel : public Model {
+ public:
+  CachedModel(ModelHandle model, std::shared_ptr<PromptCache> cache)
+      : model_(std::move(model)), cache_(std::move(cache)) {}
+
+  std::string_view name() const override { return model_->name(); }
+  std::string_view endpoint() const override { return model_->endpoint(); }
+
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options) override {
+    return PromptFromStream(*this, fetch, prompt, input_contents, options);
+  }
+
+  absl::Status StreamPrompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override {
+    std::string key = CacheKey(prompt, input_contents);
+    if (std::optional<std::string> cached = cache_->Lookup(name(), key)) {
+      on_segment(*cached);
+      return absl::OkStatus();
+    }
+    std::string response;
+    absl::Status status = model_->StreamPrompt(
+        fetch, prompt, input_contents, options,
+        [&](std::string_view segment) {
+          response += segment;
+          on_segment(segment);
+        });
+    if (status.ok()) {
+      if (absl::Status insert = cache_->Insert(name(), key, response);
+          !insert.ok()) {
+        LOG(WARNING) << "Failed to cache the response: " << insert;
+      }
+    }
+    return status;
+  }
+
+  // Answers cut at a stop are not cached, as the same prompt without the
+  // stop conditions would get them back.
+  absl::Status StreamPromptUntil(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override {
+    if (stop.empty()) {
+      return StreamPrompt(fetch, prompt, input_contents, options, on_segment);
+    }
+    return model_->StreamPromptUntil(fetch, prompt, input_contents, stop,
+                                     options, on_segment);
+  }
+
+  absl::Status StreamConversationUntil(
+      const Fetch& fetch, absl::Span<const Message> history, Message prompt,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override {
+    return model_->StreamConversationUntil(fetch, history, std::move(prompt),
+                                           stop, options, on_segment);
+  }
+
+  absl::StatusOr<Reply> Complete(const Fetch& fetch,
+                                 absl::Span<const Message> messages,
+                                 absl::Span<const ToolSpec> tools,
+                                 const RequestOptions& options) override {
+    return model_->Complete(fetch, messages, tools, options);
+  }
+
+  BatchApi* batch_api() override { return model_->batch_api(); }
+
+ private:
+  ModelHandle model_;
+  std::shared_ptr<PromptCache> cache_;
+};
+
+class CachedModelProvider : public ModelProvider {
+ public:
+  CachedModelProvider(std::unique_ptr<ModelProvider> provider,
+                      std::shared_ptr<PromptCache> cache)
+      : provider_(std::move(provider)), cache_(std::move(cache)) {}
+
+  std::string_view name() const override { return provider_->name(); }
+
+  absl::StatusOr<ModelHandle> ConnectToModel(
+      std::string_view model) const override {
+    auto connected = provider_->ConnectToModel(model);
+    if (!connected.ok()) {
+      return connected;
+    }
+    return WithPromptCache(*std::move(connected), cache_);
+  }
+
+  std::vector<std::string> ListModels() const override {
+    return provider_->ListModels();
+  }
+
+ private:
+  std::unique_ptr<ModelProvider> provider_;
+  std::shared_ptr<PromptCache> cache_;
+};
+
+}  // namespace
+
+std::string NormalizePrompt(std::string_view prompt) {
+  std::string normalized;
+  normalized.reserve(prompt.size());
+  for (size_t i = 0; i < prompt.size(); ++i) {
+    const unsigned char byte = static_cast<unsigned char>(prompt[i]);
+    if (std::isspace(byte)) {
+      if (!normalized.empty() && normalized.back() != ' ') {
+        normalized.push_back(' ');
+      }
+    } else if (std::isdigit(byte)) {
+      const std::string_view span = NumericSpan(prompt.substr(i));
+      if (IsDateOrTime(span)) {
+        normalized.push_back('0');
+      } else {
+        for (char c : span) {
+          normalized.push_back(std::tolower(static_cast<unsigned char>(c)));
+        }
+      }
+      i += span.size() - 1;
+    } else {
+      normalized.push_back(std::tolower(byte));
+    }
+  }
+  if (!normalized.empty() && normalized.back() == ' ') {
+    normalized.pop_back();
+  }
+  return normalized;
+}
+
+uint64_t SimHash(std::string_view text) {
+  // Per bit, the number of shingles with the bit set minus those without.
+  int weights[64] = {};
+  const size_t shingles =
+      text.size() < kShingleSize ? 1 : text.size() - kShingleSize + 1;
+  for (size_t i = 0; i < shingles; ++i) {
+    const uint64_t hash = HashShingle(text.substr(i, kShingleSize));
+    for (int bit = 0; bit < 64; ++bit) {
+      weights[bit] += (hash >> bit) & 1 ? 1 : -1;
+    }
+  }
+  uint64_t signature = 0;
+  for (int bit = 0; bit < 64; ++bit) {
+    if (weights[bit] > 0) {
+      signature |= uint64_t{1} << bit;
+    }
+  }
+  return signature;
+}
+
+absl::StatusOr<std::unique_ptr<PromptCache>> PromptCache::Open(
+    const std::string& path, PromptCacheOptions options) {
+  if (!(options.similarity >= kMinPromptSimilarity &&
+        options.similarity <= 1)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Prompt cache similarity must be between ",
+                     kMinPromptSimilarity, " and 1, got ", options.similarity));
+  }
+  std::vector<nlohmann::json> records;
+  if (std::ifstream file(path); file) {
+    std::string line;
+    while (std::getline(file, line)) {
+      auto record =
+          nlohmann::json::parse(line, nullptr, /*allow_exceptions=*/false);
+      if (record.is_object() && record["signature"].is_number_unsigned() &&
+          record["numbers"].is_string() && record["model"].is_string() &&
+          record["response"].is_string()) {
+        records.push_back(std::move(record));
+      } else {
+        LOG(WARNING) << path << ": skipping malformed record";
+      }
+    }
+  }
+  if (records.size() > options.capacity) {
+    records.erase(records.begin(),
+                  records.end() - static_cast<ptrdiff_t>(options.capacity));
+    const std::string compacted = absl::StrCat(path, ".tmp");
+    std::ofstream file(compacted, std::ios::trunc);
+    for (const nlohmann::json& record : records) {
+      file << record.dump() << '\n';
+    }
+    file.close();
+    if (!file || std::rename(compacted.c_str(), path.c_str()) != 0) {
+      return ErrnoStatus(absl::StrCat("compact ", path));
+    }
+  }
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return ErrnoStatus(absl::StrCat("open ", path));
+  }
+  std::unique_ptr<PromptCache> cache(new PromptCache(fd, options));
+  absl::MutexLock lock(&cache->mu_);
+  for (nlohmann::json& record : records) {
+    cache->Add({.signature = record["signature"].get<uint64_t>(),
+                .numbers = record["numbers"].get<std::string>(),
+                .model = record["model"].get<std::string>(),
+                .response = record["response"].get<std::string>()});
+  }
+  return cache;
+}
+
+PromptCache::PromptCache(int fd, PromptCacheOptions options)
+    : fd_(fd),
+      options_(options),
+      max_distance_(static_cast<int>(
+          std::floor((1 - options.similarity) * 64 + 1e-9))),
+      band_count_(max_distance_ + 1),
+      band_bits_(64 / band_count_),
+      bands_(band_count_) {}
+
+PromptCache::~PromptCache() { close(fd_); }
+
+uint64_t PromptCache::Band(uint64_t signature, size_t band) const {
+  const size_t shift = band * band_bits_;
+  // The last band takes the bits left over.
+  const size_t bits = band + 1 == band_count_ ? 64 - shift : band_bits_;
+  return bits == 64 ? signature
+                    : (signature >> shift) & ((uint64_t{1} << bits) - 1);
+}
+
+void PromptCache::Add(Entry entry) {
+  const uint64_t id = next_id_++;
+  for (size_t band = 0; band < band_count_; ++band) {
+    bands_[band][Band(entry.signature, band)].push_back(id);
+  }
+  entries_.emplace(id, std::move(entry));
+  while (entries_.size() > options_.capacity) {
+    auto oldest = entries_.begin();
+    for (size_t band = 0; band < band_count_; ++band) {
+      auto bucket = bands_[band].find(Band(oldest->second.signature, band));
+      std::erase(bucket->second, oldest->first);
+      if (bucket->second.empty()) {
+        bands_[band].erase(bucket);
+      }
+    }
+    entries_.erase(oldest);
+  }
+}
+
+absl::Status PromptCache::Append(const nlohmann::json& record) {
+  std::string line = record.dump();
+  line.push_back('\n');
+  // O_APPEND keeps records of concurrent processes apart as long as each
+  // goes out in one write.
+  std::string_view remaining = line;
+  while (!remaining.empty()) {
+    ssize_t written = write(fd_, remaining.data(), remaining.size());
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      return ErrnoStatus("write prompt cache");
+    }
+    remaining.remove_prefix(written);
+  }
+  return absl::OkStatus();
+}
+
+std::optional<std::string> PromptCache::Lookup(std::string_view model,
+                                               std::string_view prompt) {
+  TraceSpan span("PromptCache::Lookup");
+  const absl::Time start = absl::Now();
+  const std::string normalized = NormalizePrompt(prompt);
+  const uint64_t signature = SimHash(normalized);
+  const std::string numbers = PromptNumbers(normalized);
+  absl::MutexLock lock(&mu_);
+  const Entry* best = nullptr;
+  int best_distance = max_distance_ + 1;
+  for (size_t band = 0; band < band_count_; ++band) {
+    auto bucket = bands_[band].find(Band(signature, band));
+    if (bucket == bands_[band].end()) {
+      continue;
+    }
+    for (uint64_t id : bucket->second) {
+      const Entry& entry = entries_.at(id);
+      const int distance = std::popcount(entry.signature ^ signature);
+      if (distance < best_distance && entry.model == model &&
+          entry.numbers == numbers) {
+        best = &entry;
+        best_distance = distance;
+      }
+    }
+  }
+  const absl::Duration elapsed = absl::Now() - start;
+  ++stats_.lookups;
+  stats_.lookup_time += elapsed;
+  stats_.max_lookup_time = std::max(stats_.max_lookup_time, elapsed);
+  if (best == nullptr) {
+    return std::nullopt;
+  }
+  ++stats_.hits;
+  return best->response;
+}
+
+absl::Status PromptCache::Insert(std::string_view model,
+                                 std::string_view prompt,
+                                 std::string_view response) {
+  const std::string normalized = NormalizePrompt(prompt);
+  const uint64_t signature = SimHash(normalized);
+  std::string numbers = PromptNumbers(normalized);
+  absl::MutexLock lock(&mu_);
+  Add({.signature = signature,
+       .numbers = numbers,
+       .model = std::string(model),
+       .response = std::string(response)});
+  return Append({{"signature", signature},
+                 {"numbers", std::move(numbers)},
+                 {"model", model},
+                 {"response", response}});
+}
+
+PromptCacheStats PromptCache::stats() const {
+  absl::MutexLock lock(&mu_);
+  return stats_;
+}
+
+ModelHandle WithPromptCache(ModelHandle model,
+                            std::shared_ptr<PromptCache> cache) {
+  return std::make_unique<CachedModel>(std::move(model), std::move(cache));
+}
+
+std::unique_ptr<ModelProvider> WithPromptCache(
+    std::unique_ptr<ModelProvider> provider,
+    std::shared_ptr<PromptCache> cache) {
+  return std::make_unique<CachedModelProvider>(std::move(provider),
+                                               std::move(cache));
+}
+
+std::string FormatPromptCacheStats(const PromptCacheStats& stats) {
+  const size_t lookups = std::max<size_t>(stats.lookups, 1);
+  return absl::StrCat(stats.hits, " of ", stats.lookups,
+                      " prompts served from the cache (",
+                      stats.hits * 100 / lookups, "%), lookups took ",
+                      absl::FormatDuration(stats.lookup_time /
+                                           static_cast<int64_t>(lookups)),
+                      " on average and ",
+                      absl::FormatDuration(stats.max_lookup_time),
+                      " at most");
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,129 @@
+#ifndef SRC_PROMPT_CACHE_H_
+#define SRC_PROMPT_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+#include "nlohmann/json.hpp"
+#include "src/model.h"
+
+namespace uchen::chat {
+
+// Lower case with runs of whitespace collapsed into one space and dates and
+// times, such as 2024-05-01, 05/01/2024 or 10:22:13, replaced by a single 0,
+// so prompts that only differ in spacing or timestamps normalize to the same
+// text. Other numbers are kept.
+std::string NormalizePrompt(std::string_view prompt);
+
+// 64-bit SimHash of the 5-byte shingles of `text`. The fraction of equal bits
+// of two signatures estimates the similarity of the texts. Stable across
+// runs and platforms.
+uint64_t SimHash(std::string_view text);
+
+// Lowest PromptCacheOptions::similarity a cache can be opened with: below
+// it, the index would need more bands than it keeps.
+inline constexpr double kMinPromptSimilarity = 1 - 15.0 / 64;
+
+struct PromptCacheOptions {
+  // Fraction of the signature bits a cached prompt must share with the new
+  // one to be served, from kMinPromptSimilarity to 1 for the same
+  // signature only.
+  double similarity = 0.95;
+  // The oldest responses are dropped beyond this many.
+  size_t capacity = 10000;
+};
+
+struct PromptCacheStats {
+  size_t lookups = 0;
+  size_t hits = 0;
+  absl::Duration lookup_time;
+  absl::Duration max_lookup_time;
+};
+
+// Responses by the SimHash of their prompt, in an LSH index: the signature is
+// cut into bands, one more than the number of bits two signatures may
+// differ in, so near duplicates share at least one band and are found
+// without comparing against every entry. A response is only served for a
+// prompt with the same numbers, outside of dates and times, as the one it
+// answered. Responses are appended to a JSON lines file, which is compacted
+// to the `capacity` newest when opened.
+class PromptCache {
+ public:
+  // Fails with InvalidArgument for a similarity out of range.
+  static absl::StatusOr<std::unique_ptr<PromptCache>> Open(
+      const std::string& path, PromptCacheOptions options = {});
+  ~PromptCache();
+
+  PromptCache(const PromptCache&) = delete;
+  PromptCache& operator=(const PromptCache&) = delete;
+
+  // The response to the most similar prompt sent to `model`, if it is similar
+  // enough.
+  std::optional<std::string> Lookup(std::string_view model,
+                                    std::string_view prompt);
+  absl::Status Insert(std::string_view model, std::string_view prompt,
+                      std::string_view response);
+
+  PromptCacheStats stats() const;
+
+ private:
+  struct Entry {
+    uint64_t signature;
+    // The numbers of the normalized prompt, which must match exactly.
+    std::string numbers;
+    std::string model;
+    std::string response;
+  };
+
+  PromptCache(int fd, PromptCacheOptions options);
+
+  void Add(Entry entry) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  absl::Status Append(const nlohmann::json& record)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  uint64_t Band(uint64_t signature, size_t band) const;
+
+  const int fd_;
+  const PromptCacheOptions options_;
+  // Signatures within this Hamming distance are a hit.
+  const int max_distance_;
+  const size_t band_count_;
+  const size_t band_bits_;
+  mutable absl::Mutex mu_;
+  // By insertion order, so the oldest entry is the first.
+  std::map<uint64_t, Entry> entries_ ABSL_GUARDED_BY(mu_);
+  uint64_t next_id_ ABSL_GUARDED_BY(mu_) = 0;
+  // Per band, the entries by the value of their signature in that band.
+  std::vector<absl::flat_hash_map<uint64_t, std::vector<uint64_t>>> bands_
+      ABSL_GUARDED_BY(mu_);
+  PromptCacheStats stats_ ABSL_GUARDED_BY(mu_);
+};
+
+// Serves Model::Prompt from `cache` and caches successful responses. Tool
+// conversations through Model::Complete and batches are passed through.
+ModelHandle WithPromptCache(ModelHandle model,
+                            std::shared_ptr<PromptCache> cache);
+// Applies WithPromptCache to every model `provider` connects to.
+std::unique_ptr<ModelProvider> WithPromptCache(
+    std::unique_ptr<ModelProvider> provider,
+    std::shared_ptr<PromptCache> cache);
+
+// "12 of 40 prompts served from the cache (30%), lookups took 18us on
+// average and 95us at most"
+std::string FormatPromptCacheStats(const PromptCacheStats& stats);
+
+}  // namespace uchen::chat
+
+#endif  // SRC_PROMPT_CACHE_H_
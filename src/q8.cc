@@ -0,0 +1,175 @@
+#include "src/q8.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace uchen::chat {
+namespace {
+
+using DotKernel = float (*)(Q8Tensor a, Q8Tensor b, size_t n,
+                            size_t group_size);
+
+float DotScalar(Q8Tensor a, Q8Tensor b, size_t n, size_t group_size) {
+  float sum = 0;
+  for (size_t group = 0; group < n / group_size; ++group) {
+    const int8_t* qa = a.q + group * group_size;
+    const int8_t* qb = b.q + group * group_size;
+    int32_t dot = 0;
+    for (size_t i = 0; i < group_size; ++i) {
+      dot += int32_t{qa[i]} * int32_t{qb[i]};
+    }
+    sum += static_cast<float>(dot) * a.s[group] * b.s[group];
+  }
+  return sum;
+}
+
+#if defined(__x86_64__)
+
+// Both kernels widen to int16 and multiply-add pairs into int32 lanes, which
+// cannot overflow for groups of up to 64K values.
+__attribute__((target("avx512f,avx512bw"))) float DotAvx512(
+    Q8Tensor a, Q8Tensor b, size_t n, size_t group_size) {
+  float sum = 0;
+  for (size_t group = 0; group < n / group_size; ++group) {
+    const int8_t* qa = a.q + group * group_size;
+    const int8_t* qb = b.q + group * group_size;
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 32 <= group_size; i += 32) {
+      __m512i va = _mm512_cvtepi8_epi16(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(qa + i)));
+      __m512i vb = _mm512_cvtepi8_epi16(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(qb + i)));
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+    }
+    int32_t dot = _mm512_reduce_add_epi32(acc);
+    for (; i < group_size; ++i) {
+      dot += int32_t{qa[i]} * int32_t{qb[i]};
+    }
+    sum += static_cast<float>(dot) * a.s[group] * b.s[group];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2"))) float DotAvx2(Q8Tensor a, Q8Tensor b,
+                                              size_t n, size_t group_size) {
+  float sum = 0;
+  for (size_t group = 0; group < n / group_size; ++group) {
+    const int8_t* qa = a.q + group * group_size;
+    const int8_t* qb = b.q + group * group_size;
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= group_size; i += 16) {
+      __m256i va = _mm256_cvtepi8_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(qa + i)));
+      __m256i vb = _mm256_cvtepi8_epi16(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(qb + i)));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                 _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+    int32_t dot = _mm_cvtsi128_si32(half);
+    for (; i < group_size; ++i) {
+      dot += int32_t{qa[i]} * int32_t{qb[i]};
+    }
+    sum += static_cast<float>(dot) * a.s[group] * b.s[group];
+  }
+  return sum;
+}
+
+#elif defined(__aarch64__)
+
+// int8 products fit in int16 lanes, pairs of which are accumulated into int32
+// lanes.
+float DotNeon(Q8Tensor a, Q8Tensor b, size_t n, size_t group_size) {
+  float sum = 0;
+  for (size_t group = 0; group < n / group_size; ++group) {
+    const int8_t* qa = a.q + group * group_size;
+    const int8_t* qb = b.q + group * group_size;
+    int32x4_t acc = vdupq_n_s32(0);
+    size_t i = 0;
+    for (; i + 16 <= group_size; i += 16) {
+      int8x16_t va = vld1q_s8(qa + i);
+      int8x16_t vb = vld1q_s8(qb + i);
+      acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+      acc = vpadalq_s16(acc, vmull_high_s8(va, vb));
+    }
+    int32_t dot = vaddvq_s32(acc);
+    for (; i < group_size; ++i) {
+      dot += int32_t{qa[i]} * int32_t{qb[i]};
+    }
+    sum += static_cast<float>(dot) * a.s[group] * b.s[group];
+  }
+  return sum;
+}
+
+#endif
+
+struct Kernel {
+  DotKernel dot;
+  std::string_view name;
+};
+
+Kernel SelectKernel() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return {&DotAvx512, "avx512"};
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return {&DotAvx2, "avx2"};
+  }
+#elif defined(__aarch64__)
+  return {&DotNeon, "neon"};
+#endif
+  return {&DotScalar, "scalar"};
+}
+
+const Kernel& BestKernel() {
+  static const Kernel kernel = SelectKernel();
+  return kernel;
+}
+
+}  // namespace
+
+void QuantizeQ8(const float* x, size_t n, size_t group_size, int8_t* q,
+                float* s) {
+  for (size_t group = 0; group < n / group_size; ++group) {
+    const float* values = x + group * group_size;
+    float max = 0;
+    for (size_t i = 0; i < group_size; ++i) {
+      max = std::max(max, std::fabs(values[i]));
+    }
+    const float scale = max / 127.0f;
+    s[group] = scale;
+    for (size_t i = 0; i < group_size; ++i) {
+      q[group * group_size + i] = static_cast<int8_t>(
+          scale == 0 ? 0 : std::lround(values[i] / scale));
+    }
+  }
+}
+
+void DequantizeQ8(Q8Tensor tensor, size_t n, size_t group_size, float* out) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = tensor.q[i] * tensor.s[i / group_size];
+  }
+}
+
+float DotQ8(Q8Tensor a, Q8Tensor b, size_t n, size_t group_size) {
+  return BestKernel().dot(a, b, n, group_size);
+}
+
+std::string_view Q8KernelName() { return BestKernel().name; }
+
+}  // namespace uchen::chat
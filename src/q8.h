@@ -0,0 +1,33 @@
+#ifndef SRC_Q8_H_
+#define SRC_Q8_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace uchen::chat {
+
+// Values quantized to int8 in groups that share a scale:
+// x[i] ~= q[i] * s[i / group_size].
+struct Q8Tensor {
+  const int8_t* q = nullptr;
+  const float* s = nullptr;
+};
+
+// Quantizes `n` values, a multiple of `group_size`, so that the largest
+// magnitude of each group maps to 127.
+void QuantizeQ8(const float* x, size_t n, size_t group_size, int8_t* q,
+                float* s);
+void DequantizeQ8(Q8Tensor tensor, size_t n, size_t group_size, float* out);
+
+// Dot product of two quantized vectors of `n` values, a multiple of
+// `group_size`. Uses the widest SIMD kernel the CPU supports: AVX-512 or AVX2
+// picked at run time on x86, NEON on ARM64.
+float DotQ8(Q8Tensor a, Q8Tensor b, size_t n, size_t group_size);
+
+// "avx512", "avx2", "neon" or "scalar".
+std::string_view Q8KernelName();
+
+}  // namespace uchen::chat
+
+#endif  // SRC_Q8_H_
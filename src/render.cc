@@ -0,0 +1,192 @@
+#include "src/render.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <string_view>
+
+#include "absl/strings/ascii.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "src/trace.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr std::string_view kFence = "```";
+constexpr std::string_view kFenceStyle = "\033[2m";
+constexpr std::string_view kCodeStyle = "\033[36m";
+constexpr std::string_view kResetStyle = "\033[0m";
+
+bool IsUtf8Continuation(char c) { return (c & 0xC0) == 0x80; }
+
+}  // namespace
+
+RenderSettings StdoutRenderSettings() {
+  RenderSettings settings;
+#ifdef _WIN32
+  settings.terminal = _isatty(_fileno(stdout));
+#else
+  settings.terminal = isatty(STDOUT_FILENO);
+  struct winsize size;
+  if (settings.terminal && ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 &&
+      size.ws_col > 0) {
+    settings.width = size.ws_col;
+  }
+#endif
+  return settings;
+}
+
+void Renderer::Append(std::string_view text) {
+  TraceSpan span("Renderer::Append");
+  if (text.empty()) {
+    return;
+  }
+  if (!settings_.terminal) {
+    out_ << text;
+    line_empty_ = text.back() == '\n';
+    return;
+  }
+  for (char c : text) {
+    Format(c);
+  }
+  Write(false);
+}
+
+void Renderer::Finish() {
+  TraceSpan span("Renderer::Finish");
+  if (!settings_.terminal) {
+    if (!line_empty_) {
+      out_ << '\n';
+      line_empty_ = true;
+    }
+    out_.flush();
+    return;
+  }
+  if (line_kind_ == LineKind::kUndecided && !line_start_.empty()) {
+    DecideLine();
+  }
+  if (line_kind_ == LineKind::kText) {
+    FlushWord();
+  }
+  if (!line_empty_) {
+    EndLine();
+  }
+  in_code_block_ = false;
+  line_kind_ = LineKind::kUndecided;
+  Write(true);
+}
+
+void Renderer::Format(char c) {
+  if (line_kind_ == LineKind::kUndecided) {
+    if (c != '\n') {
+      line_start_.push_back(c);
+      std::string_view rest = absl::StripLeadingAsciiWhitespace(line_start_);
+      if (rest.size() < kFence.size() && kFence.starts_with(rest)) {
+        return;
+      }
+    }
+    DecideLine();
+    if (c != '\n') {
+      return;
+    }
+  }
+  switch (line_kind_) {
+    case LineKind::kFence:
+    case LineKind::kCode:
+      if (c == '\n') {
+        EndLine();
+      } else {
+        frame_.push_back(c);
+      }
+      break;
+    case LineKind::kText:
+      if (c == '\n') {
+        EndLine();
+      } else if (c == ' ') {
+        FlushWord();
+        ++pending_spaces_;
+      } else {
+        word_.push_back(c);
+        word_width_ += IsUtf8Continuation(c) ? 0 : 1;
+      }
+      break;
+    case LineKind::kUndecided:
+      break;
+  }
+}
+
+void Renderer::DecideLine() {
+  if (absl::StripLeadingAsciiWhitespace(line_start_).starts_with(kFence)) {
+    line_kind_ = LineKind::kFence;
+    frame_.append(kFenceStyle);
+  } else if (in_code_block_) {
+    line_kind_ = LineKind::kCode;
+    frame_.append(kCodeStyle);
+  } else {
+    line_kind_ = LineKind::kText;
+  }
+  line_empty_ = false;
+  std::string line_start = std::move(line_start_);
+  line_start_.clear();
+  for (char c : line_start) {
+    Format(c);
+  }
+}
+
+void Renderer::EndLine() {
+  if (line_kind_ == LineKind::kText) {
+    FlushWord();
+    pending_spaces_ = 0;
+  } else {
+    frame_.append(kResetStyle);
+  }
+  if (line_kind_ == LineKind::kFence) {
+    in_code_block_ = !in_code_block_;
+  }
+  frame_.push_back('\n');
+  line_kind_ = LineKind::kUndecided;
+  column_ = 0;
+  line_empty_ = true;
+}
+
+void Renderer::FlushWord() {
+  if (word_.empty()) {
+    return;
+  }
+  if (column_ > 0 &&
+      column_ + pending_spaces_ + word_width_ > settings_.width) {
+    frame_.push_back('\n');
+    column_ = 0;
+  } else {
+    frame_.append(pending_spaces_, ' ');
+    column_ += pending_spaces_;
+  }
+  pending_spaces_ = 0;
+  frame_.append(word_);
+  column_ += word_width_;
+  word_.clear();
+  word_width_ = 0;
+}
+
+void Renderer::Write(bool force) {
+  if (frame_.empty()) {
+    return;
+  }
+  absl::Time now = absl::Now();
+  if (!force && now - last_write_ < settings_.frame_interval) {
+    return;
+  }
+  out_.write(frame_.data(), frame_.size());
+  out_.flush();
+  frame_.clear();
+  last_write_ = now;
+}
+
+}  // namespace uchen::chat
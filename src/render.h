@@ -0,0 +1,70 @@
+#ifndef SRC_RENDER_H_
+#define SRC_RENDER_H_
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include "absl/time/time.h"
+
+namespace uchen::chat {
+
+struct RenderSettings {
+  // When false, text is passed through untouched.
+  bool terminal = false;
+  size_t width = 80;
+  // Output is written to the stream at most this often, except on Finish().
+  absl::Duration frame_interval = absl::Milliseconds(33);
+};
+
+// Returns settings describing stdout: whether it is a terminal and how wide.
+RenderSettings StdoutRenderSettings();
+
+// Formats model output for the terminal. Text may be appended in pieces of
+// any size as it arrives. Every byte is formatted exactly once: prose is
+// word-wrapped to the terminal width and fenced code blocks are highlighted
+// and left unwrapped. A word is held back until it is complete, so text that
+// was already written never needs to be redrawn.
+class Renderer {
+ public:
+  Renderer(std::ostream& out, RenderSettings settings)
+      : out_(out), settings_(settings) {}
+  ~Renderer() { Finish(); }
+
+  Renderer(const Renderer&) = delete;
+  Renderer& operator=(const Renderer&) = delete;
+
+  void Append(std::string_view text);
+
+  // Writes out everything held back and terminates a non-empty last line.
+  void Finish();
+
+ private:
+  enum class LineKind { kUndecided, kText, kFence, kCode };
+
+  void Format(char c);
+  void DecideLine();
+  void EndLine();
+  void FlushWord();
+  void Write(bool force);
+
+  std::ostream& out_;
+  RenderSettings settings_;
+  // Formatted output that was not written to `out_` yet.
+  std::string frame_;
+  absl::Time last_write_ = absl::InfinitePast();
+  bool in_code_block_ = false;
+  LineKind line_kind_ = LineKind::kUndecided;
+  // Start of the line, kept until it is known whether it is a fence.
+  std::string line_start_;
+  std::string word_;
+  size_t word_width_ = 0;
+  size_t pending_spaces_ = 0;
+  size_t column_ = 0;
+  bool line_empty_ = true;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_RENDER_H_
@@ -0,0 +1,636 @@
+#include "src/shared_cache.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/cleanup/cleanup.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/json_arena.h"
+#include "src/trace.h"
+
+namespace uchen::chat {
+namespace {
+
+// "UCHCACH1"
+constexpr uint64_t kMagic = 0x3148434143484355;
+constexpr size_t kHeaderSize = 64;
+// Slots a key may go to, from its home slot on. Lookups read all of them.
+constexpr size_t kProbeLength = 16;
+// Times a reader rereads a slot that is being written before skipping it.
+constexpr int kReadAttempts = 4;
+// Times a writer looks for a slot again after losing one to another writer.
+constexpr int kStoreAttempts = 4;
+constexpr absl::Duration kMaxPollInterval = absl::Milliseconds(50);
+
+enum SlotKind : uint32_t { kEmpty = 0, kClaimed = 1, kReady = 2 };
+
+// Precedes every value in the ring, so that a reader can tell that the bytes
+// it copied are still the value its slot points to.
+struct EntryHeader {
+  uint64_t key_high;
+  uint64_t key_low;
+  uint64_t size;
+};
+
+constexpr uint64_t RoundUp(uint64_t n, uint64_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+uint64_t Mix(uint64_t hash) {
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+  return hash ^ (hash >> 31);
+}
+
+bool ProcessAlive(uint32_t pid) {
+  return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+}
+
+absl::Status ErrnoStatus(std::string_view what) {
+  return absl::InternalError(absl::StrCat(what, ": ", std::strerror(errno)));
+}
+
+}  // namespace
+
+struct SharedResponseCache::Header {
+  uint64_t magic;
+  uint64_t slot_count;
+  uint64_t data_bytes;
+  // Bytes ever appended to the ring, including the padding that keeps values
+  // from wrapping around its end.
+  std::atomic<uint64_t> head;
+  // Orders publications and hits for the eviction policies.
+  std::atomic<uint64_t> clock;
+};
+
+struct SharedResponseCache::Slot {
+  // Odd while a writer fills the slot.
+  std::atomic<uint64_t> sequence;
+  std::atomic<uint64_t> key_high;
+  std::atomic<uint64_t> key_low;
+  // SlotKind in the low half, the pid of the writer in the high half.
+  std::atomic<uint64_t> kind_and_pid;
+  // Where the value starts in the ring, counted like Header::head.
+  std::atomic<uint64_t> offset;
+  std::atomic<uint64_t> size;
+  // When the value was published or the key claimed.
+  std::atomic<int64_t> time_ns;
+  std::atomic<uint64_t> published;
+  // Bumped by readers on a hit, outside of the sequence.
+  std::atomic<uint64_t> used;
+};
+
+struct SharedResponseCache::SlotState {
+  uint64_t sequence = 0;
+  Key key = {};
+  uint32_t kind = kEmpty;
+  uint32_t pid = 0;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  int64_t time_ns = 0;
+  uint64_t published = 0;
+  uint64_t used = 0;
+};
+
+bool AbslParseFlag(std::string_view text, EvictionPolicy* policy,
+                   std::string* error) {
+  if (text == "lru") {
+    *policy = EvictionPolicy::kLeastRecentlyUsed;
+    return true;
+  }
+  if (text == "fifo") {
+    *policy = EvictionPolicy::kOldestFirst;
+    return true;
+  }
+  *error = "expected lru or fifo";
+  return false;
+}
+
+std::string AbslUnparseFlag(EvictionPolicy policy) {
+  return policy == EvictionPolicy::kLeastRecentlyUsed ? "lru" : "fifo";
+}
+
+absl::StatusOr<std::unique_ptr<SharedResponseCache>> SharedResponseCache::Open(
+    const std::string& path, SharedCacheOptions options) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return ErrnoStatus(absl::StrCat("open ", path));
+  }
+  // The lock only keeps two processes from setting up a new file at once.
+  // The mapping keeps the file open, so closing would not drop the lock.
+  absl::Cleanup close_fd = [fd] {
+    flock(fd, LOCK_UN);
+    close(fd);
+  };
+  if (flock(fd, LOCK_EX) != 0) {
+    return ErrnoStatus(absl::StrCat("lock ", path));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return ErrnoStatus(absl::StrCat("stat ", path));
+  }
+  const bool created = st.st_size == 0;
+  uint64_t slot_count = std::bit_ceil(std::max(options.slots, kProbeLength));
+  uint64_t data_bytes = RoundUp(std::max<size_t>(options.data_bytes, 4096), 64);
+  if (!created) {
+    // magic, slot_count and data_bytes.
+    uint64_t header[3];
+    if (static_cast<size_t>(st.st_size) < kHeaderSize ||
+        pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        header[0] != kMagic) {
+      return absl::InvalidArgumentError(
+          absl::StrCat(path, " is not a shared cache"));
+    }
+    slot_count = header[1];
+    data_bytes = header[2];
+  }
+  const uint64_t size =
+      RoundUp(kHeaderSize + slot_count * sizeof(Slot), 64) + data_bytes;
+  if (created && ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    return ErrnoStatus(absl::StrCat("resize ", path));
+  }
+  if (static_cast<uint64_t>(created ? size : st.st_size) != size) {
+    return absl::InvalidArgumentError(
+        absl::StrCat(path, " is not a shared cache"));
+  }
+  void* data =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return ErrnoStatus(absl::StrCat("map ", path));
+  }
+  Header* header = static_cast<Header*>(data);
+  if (created) {
+    header->slot_count = slot_count;
+    header->data_bytes = data_bytes;
+    header->magic = kMagic;
+  }
+  return std::unique_ptr<SharedResponseCache>(
+      new SharedResponseCache(data, size, options));
+}
+
+SharedResponseCache::SharedResponseCache(void* data, size_t size,
+                                         SharedCacheOptions options)
+    : header_(static_cast<Header*>(data)),
+      size_(size),
+      options_(options),
+      pid_(static_cast<uint32_t>(getpid())) {
+  static_assert(sizeof(Header) <= kHeaderSize);
+  // Atomics that take a lock would not work across processes.
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+  static_assert(std::atomic<int64_t>::is_always_lock_free);
+}
+
+SharedResponseCache::~SharedResponseCache() { munmap(header_, size_); }
+
+SharedResponseCache::Key SharedResponseCache::HashKey(std::string_view key) {
+  // Two independent multiply-xorshift lanes over 8-byte words. Stable
+  // across processes and runs, unlike absl::Hash.
+  uint64_t high = 0x243f6a8885a308d3;
+  uint64_t low = 0x13198a2e03707344;
+  size_t i = 0;
+  for (; i + 8 <= key.size(); i += 8) {
+    uint64_t word;
+    std::memcpy(&word, key.data() + i, 8);
+    high = (high ^ word) * 0x9e3779b97f4a7c15;
+    high ^= high >> 32;
+    low = (low + word) * 0xff51afd7ed558ccd;
+    low ^= low >> 29;
+  }
+  uint64_t tail = 0;
+  if (i < key.size()) {
+    std::memcpy(&tail, key.data() + i, key.size() - i);
+  }
+  return {.high = Mix(high ^ tail ^ key.size()),
+          .low = Mix(low + tail + (key.size() << 3))};
+}
+
+SharedResponseCache::Slot& SharedResponseCache::slot(uint64_t index) const {
+  return reinterpret_cast<Slot*>(reinterpret_cast<char*>(header_) +
+                                 kHeaderSize)[index];
+}
+
+char* SharedResponseCache::ring() const {
+  return reinterpret_cast<char*>(header_) +
+         RoundUp(kHeaderSize + header_->slot_count * sizeof(Slot), 64);
+}
+
+uint64_t SharedResponseCache::Probe(Key key, size_t i) const {
+  return (key.high + i) & (header_->slot_count - 1);
+}
+
+bool SharedResponseCache::ReadSlot(const Slot& slot, SlotState& state) const {
+  for (int attempt = 0; attempt < kReadAttempts; ++attempt) {
+    const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence % 2 == 1) {
+      continue;
+    }
+    state.key = {.high = slot.key_high.load(std::memory_order_relaxed),
+                 .low = slot.key_low.load(std::memory_order_relaxed)};
+    const uint64_t kind_and_pid =
+        slot.kind_and_pid.load(std::memory_order_relaxed);
+    state.kind = static_cast<uint32_t>(kind_and_pid);
+    state.pid = static_cast<uint32_t>(kind_and_pid >> 32);
+    state.offset = slot.offset.load(std::memory_order_relaxed);
+    state.size = slot.size.load(std::memory_order_relaxed);
+    state.time_ns = slot.time_ns.load(std::memory_order_relaxed);
+    state.published = slot.published.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+      state.sequence = sequence;
+      state.used = slot.used.load(std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SharedResponseCache::Live(const SlotState& state, int64_t now_ns) const {
+  switch (state.kind) {
+    case kReady:
+      return now_ns - state.time_ns <= absl::ToInt64Nanoseconds(
+                                           options_.max_age) &&
+             header_->head.load(std::memory_order_acquire) <=
+                 state.offset + header_->data_bytes;
+    case kClaimed:
+      return now_ns - state.time_ns <
+                 absl::ToInt64Nanoseconds(options_.claim_timeout) &&
+             ProcessAlive(state.pid);
+    default:
+      return false;
+  }
+}
+
+SharedResponseCache::Found SharedResponseCache::Find(Key key,
+                                                     std::string* value) {
+  const int64_t now_ns = absl::ToUnixNanos(absl::Now());
+  const char* ring = this->ring();
+  const uint64_t data_bytes = header_->data_bytes;
+  bool claimed = false;
+  for (size_t i = 0; i < kProbeLength; ++i) {
+    Slot& candidate = slot(Probe(key, i));
+    SlotState state;
+    if (!ReadSlot(candidate, state) || state.key.high != key.high ||
+        state.key.low != key.low || !Live(state, now_ns)) {
+      continue;
+    }
+    if (state.kind == kClaimed) {
+      claimed = true;
+      continue;
+    }
+    const uint64_t start = state.offset % data_bytes;
+    if (start + sizeof(EntryHeader) + state.size > data_bytes) {
+      continue;
+    }
+    EntryHeader entry;
+    std::memcpy(&entry, ring + start, sizeof(entry));
+    value->assign(ring + start + sizeof(entry), state.size);
+    // Only if the ring did not come around while copying are the bytes the
+    // value the slot points to.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->head.load(std::memory_order_relaxed) >
+            state.offset + data_bytes ||
+        entry.key_high != key.high || entry.key_low != key.low ||
+        entry.size != state.size) {
+      continue;
+    }
+    candidate.used.store(
+        header_->clock.fetch_add(1, std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    return Found::kHit;
+  }
+  return claimed ? Found::kClaimed : Found::kMiss;
+}
+
+bool SharedResponseCache::Store(Key key, const SlotState& state, bool claim) {
+  for (int attempt = 0; attempt < kStoreAttempts; ++attempt) {
+    const int64_t now_ns = absl::ToUnixNanos(absl::Now());
+    // The same key goes first, then a free slot, then the victim of the
+    // eviction policy. Live claims of other keys are never taken.
+    Slot* same = nullptr;
+    Slot* free = nullptr;
+    Slot* victim = nullptr;
+    uint64_t same_sequence = 0;
+    uint64_t free_sequence = 0;
+    uint64_t victim_sequence = 0;
+    uint64_t victim_rank = UINT64_MAX;
+    for (size_t i = 0; i < kProbeLength; ++i) {
+      Slot& candidate = slot(Probe(key, i));
+      SlotState current;
+      if (!ReadSlot(candidate, current)) {
+        continue;
+      }
+      const bool live = Live(current, now_ns);
+      if (current.kind != kEmpty && current.key.high == key.high &&
+          current.key.low == key.low) {
+        if (claim && live) {
+          return false;
+        }
+        if (same == nullptr) {
+          same = &candidate;
+          same_sequence = current.sequence;
+        }
+      } else if (!live) {
+        if (free == nullptr) {
+          free = &candidate;
+          free_sequence = current.sequence;
+        }
+      } else if (current.kind == kReady) {
+        const uint64_t rank =
+            options_.eviction == EvictionPolicy::kLeastRecentlyUsed
+                ? std::max(current.used, current.published)
+                : current.published;
+        if (rank < victim_rank) {
+          victim = &candidate;
+          victim_sequence = current.sequence;
+          victim_rank = rank;
+        }
+      }
+    }
+    auto [target, sequence] =
+        same != nullptr   ? std::pair(same, same_sequence)
+        : free != nullptr ? std::pair(free, free_sequence)
+                          : std::pair(victim, victim_sequence);
+    if (target == nullptr) {
+      return false;
+    }
+    if (!target->sequence.compare_exchange_strong(
+            sequence, sequence + 1, std::memory_order_acquire)) {
+      continue;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    target->key_high.store(key.high, std::memory_order_relaxed);
+    target->key_low.store(key.low, std::memory_order_relaxed);
+    target->kind_and_pid.store(
+        state.kind | (static_cast<uint64_t>(state.pid) << 32),
+        std::memory_order_relaxed);
+    target->offset.store(state.offset, std::memory_order_relaxed);
+    target->size.store(state.size, std::memory_order_relaxed);
+    target->time_ns.store(state.time_ns, std::memory_order_relaxed);
+    target->published.store(state.published, std::memory_order_relaxed);
+    target->used.store(state.used, std::memory_order_relaxed);
+    target->sequence.store(sequence + 2, std::memory_order_release);
+    return true;
+  }
+  return false;
+}
+
+std::optional<uint64_t> SharedResponseCache::Append(Key key,
+                                                    std::string_view value) {
+  const uint64_t data_bytes = header_->data_bytes;
+  const uint64_t size = RoundUp(sizeof(EntryHeader) + value.size(), 8);
+  if (size > data_bytes / 4) {
+    return std::nullopt;
+  }
+  uint64_t head = header_->head.load(std::memory_order_relaxed);
+  uint64_t start;
+  do {
+    start = head;
+    if (start % data_bytes + size > data_bytes) {
+      start = RoundUp(start, data_bytes);
+    }
+  } while (!header_->head.compare_exchange_weak(head, start + size,
+                                                std::memory_order_acq_rel));
+  // Readers that see any of the bytes below also see the new head, and with
+  // it that the value they were copying is gone.
+  std::atomic_thread_fence(std::memory_order_release);
+  char* ring = this->ring();
+  const EntryHeader entry = {
+      .key_high = key.high, .key_low = key.low, .size = value.size()};
+  std::memcpy(ring + start % data_bytes, &entry, sizeof(entry));
+  std::memcpy(ring + start % data_bytes + sizeof(entry), value.data(),
+              value.size());
+  return start;
+}
+
+std::optional<std::string> SharedResponseCache::Lookup(std::string_view key) {
+  lookups_.fetch_add(1, std::memory_order_relaxed);
+  std::string value;
+  if (Find(HashKey(key), &value) != Found::kHit) {
+    return std::nullopt;
+  }
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  return value;
+}
+
+SharedCacheLookup SharedResponseCache::LookupOrClaim(
+    std::string_view key, const Cancellation* cancellation) {
+  lookups_.fetch_add(1, std::memory_order_relaxed);
+  const Key hashed = HashKey(key);
+  const absl::Time deadline = absl::Now() + options_.claim_timeout;
+  absl::Duration interval = absl::Milliseconds(1);
+  bool waited = false;
+  int misses = 0;
+  std::string value;
+  while (true) {
+    switch (Find(hashed, &value)) {
+      case Found::kHit:
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        if (waited) {
+          coalesced_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return {.value = std::move(value)};
+      case Found::kMiss: {
+        const SlotState claim = {
+            .kind = kClaimed,
+            .pid = pid_,
+            .time_ns = absl::ToUnixNanos(absl::Now()),
+        };
+        if (Store(hashed, claim, /*claim=*/true)) {
+          return {.claimed = true};
+        }
+        // Either another process claimed it first, which the next Find
+        // sees, or there is no slot to claim.
+        if (++misses == 2) {
+          return {};
+        }
+        continue;
+      }
+      case Found::kClaimed:
+        break;
+    }
+    if ((cancellation != nullptr && cancellation->cancelled()) ||
+        absl::Now() >= deadline) {
+      return {};
+    }
+    waited = true;
+    absl::SleepFor(interval);
+    interval = std::min(interval * 2, kMaxPollInterval);
+  }
+}
+
+void SharedResponseCache::Publish(std::string_view key,
+                                  std::string_view value) {
+  const Key hashed = HashKey(key);
+  std::optional<uint64_t> offset = Append(hashed, value);
+  if (!offset.has_value()) {
+    Abandon(key);
+    return;
+  }
+  const uint64_t tick =
+      header_->clock.fetch_add(1, std::memory_order_relaxed) + 1;
+  const SlotState state = {
+      .kind = kReady,
+      .pid = pid_,
+      .offset = *offset,
+      .size = value.size(),
+      .time_ns = absl::ToUnixNanos(absl::Now()),
+      .published = tick,
+      .used = tick,
+  };
+  if (!Store(hashed, state, /*claim=*/false)) {
+    Abandon(key);
+  }
+}
+
+void SharedResponseCache::Abandon(std::string_view key) {
+  const Key hashed = HashKey(key);
+  for (size_t i = 0; i < kProbeLength; ++i) {
+    Slot& candidate = slot(Probe(hashed, i));
+    SlotState state;
+    if (!ReadSlot(candidate, state) || state.kind != kClaimed ||
+        state.pid != pid_ || state.key.high != hashed.high ||
+        state.key.low != hashed.low) {
+      continue;
+    }
+    uint64_t sequence = state.sequence;
+    if (candidate.sequence.compare_exchange_strong(
+            sequence, sequence + 1, std::memory_order_acquire)) {
+      std::atomic_thread_fence(std::memory_order_release);
+      candidate.kind_and_pid.store(kEmpty, std::memory_order_relaxed);
+      candidate.sequence.store(sequence + 2, std::memory_order_release);
+    }
+  }
+}
+
+SharedCacheStats SharedResponseCache::stats() const {
+  return {.lookups = lookups_.load(std::memory_order_relaxed),
+          .hits = hits_.load(std::memory_order_relaxed),
+          .coalesced = coalesced_.load(std::memory_order_relaxed)};
+}
+
+namespace {
+
+class SharedCacheFetch : public Fetch {
+ public:
+  SharedCacheFetch(std::shared_ptr<Fetch> fetch,
+                   std::shared_ptr<SharedResponseCache> cache)
+      : fetch_(std::move(fetch)), cache_(std::move(cache)) {}
+
+  absl::StatusOr<Response> Post(const std::string& url,
+                                absl::Span<const Header> headers,
+                                const json::Json& payload,
+                                const RequestOptions& options) const override {
+    if (!Cacheable(url)) {
+      return fetch_->Post(url, headers, payload, options);
+    }
+    return Cached(url, payload.dump(), options,
+                  [&] { return fetch_->Post(url, headers, payload, options); });
+  }
+
+  absl::StatusOr<Response> PostJson(
+      const std::string& url, absl::Span<const Header> headers,
+      std::string_view body, const RequestOptions& options) const override {
+    if (!Cacheable(url)) {
+      return fetch_->PostJson(url, headers, body, options);
+    }
+    return Cached(url, body, options, [&] {
+      return fetch_->PostJson(url, headers, body, options);
+    });
+  }
+
+  // Streams are often closed early, so they are never cached.
+  absl::Status PostJsonStream(
+      const std::string& url, absl::Span<const Header> headers,
+      std::string_view body, const RequestOptions& options,
+      absl::FunctionRef<bool(std::string_view)> on_data) const override {
+    return fetch_->PostJsonStream(url, headers, body, options, on_data);
+  }
+
+  absl::StatusOr<Response> Get(const std::string& url,
+                               absl::Span<const Header> headers,
+                               const RequestOptions& options) const override {
+    return fetch_->Get(url, headers, options);
+  }
+
+  absl::StatusOr<Response> PostForm(
+      const std::string& url, absl::Span<const Header> headers,
+      absl::Span<const FormField> fields,
+      const RequestOptions& options) const override {
+    return fetch_->PostForm(url, headers, fields, options);
+  }
+
+ private:
+  // The chat endpoints. Batch and file endpoints change state on the
+  // server, so their responses are not reused.
+  static bool Cacheable(std::string_view url) {
+    return absl::EndsWith(url, "/chat/completions") ||
+           absl::EndsWith(url, "/messages");
+  }
+
+  absl::StatusOr<Response> Cached(
+      std::string_view url, std::string_view body,
+      const RequestOptions& options,
+      absl::FunctionRef<absl::StatusOr<Response>()> send) const {
+    const std::string key = absl::StrCat(url, "\n", body);
+    SharedCacheLookup lookup;
+    {
+      TraceSpan span("SharedResponseCache::LookupOrClaim");
+      lookup = cache_->LookupOrClaim(key, options.cancellation);
+    }
+    if (lookup.value.has_value()) {
+      return Response::FromBody(*lookup.value);
+    }
+    absl::StatusOr<Response> response = send();
+    if (response.ok() && response->http_status() / 100 == 2) {
+      cache_->Publish(key, response->body());
+    } else if (lookup.claimed) {
+      cache_->Abandon(key);
+    }
+    return response;
+  }
+
+  std::shared_ptr<Fetch> fetch_;
+  std::shared_ptr<SharedResponseCache> cache_;
+};
+
+}  // namespace
+
+std::shared_ptr<Fetch> WithSharedCache(
+    std::shared_ptr<Fetch> fetch, std::shared_ptr<SharedResponseCache> cache) {
+  return std::make_shared<SharedCacheFetch>(std::move(fetch),
+                                            std::move(cache));
+}
+
+std::string FormatSharedCacheStats(const SharedCacheStats& stats) {
+  return absl::StrCat(stats.hits, " of ", stats.lookups,
+                      " requests served from the shared cache, ",
+                      stats.coalesced, " after waiting for another process");
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,153 @@
+#ifndef SRC_SHARED_CACHE_H_
+#define SRC_SHARED_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+
+#include "src/fetch.h"
+
+namespace uchen::chat {
+
+// Which response makes room when all slots a new one may go to are taken.
+enum class EvictionPolicy {
+  // The one served or published the longest ago.
+  kLeastRecentlyUsed,
+  // The one published the longest ago, however often it was served since.
+  kOldestFirst,
+};
+
+// "lru" or "fifo", for --shared_cache_eviction.
+bool AbslParseFlag(std::string_view text, EvictionPolicy* policy,
+                   std::string* error);
+std::string AbslUnparseFlag(EvictionPolicy policy);
+
+struct SharedCacheOptions {
+  // Geometry of a new segment. An existing file keeps the geometry it was
+  // created with.
+  size_t slots = 16384;
+  size_t data_bytes = 64 << 20;
+  EvictionPolicy eviction = EvictionPolicy::kLeastRecentlyUsed;
+  // Older responses are not served.
+  absl::Duration max_age = absl::Hours(24);
+  // A process that claimed a key and has not published it by then is
+  // presumed stuck, and others stop waiting for it.
+  absl::Duration claim_timeout = absl::Minutes(5);
+};
+
+// What this process saw of the cache.
+struct SharedCacheStats {
+  size_t lookups = 0;
+  size_t hits = 0;
+  // Hits that waited for another process to publish the response.
+  size_t coalesced = 0;
+};
+
+// Result of SharedResponseCache::LookupOrClaim.
+struct SharedCacheLookup {
+  std::optional<std::string> value;
+  // Whether this process now computes the value, and must Publish or
+  // Abandon it.
+  bool claimed = false;
+};
+
+// Responses shared by all processes that map the same file. The file holds
+// an open-addressing index of fixed-size slots and a ring of values behind
+// it. Lookups and publications never take a lock: each slot is guarded by a
+// sequence number that writers bump with a compare-and-swap, and readers
+// retry or skip a slot that changed under them. Values are appended to the
+// ring, overwriting the oldest, and a reader that finds its value lapped by
+// the ring treats it as a miss.
+//
+// A process about to compute a value claims its key first, so that others
+// wait for its result instead of computing the same. Claims of processes
+// that died or hung expire.
+class SharedResponseCache {
+ public:
+  static absl::StatusOr<std::unique_ptr<SharedResponseCache>> Open(
+      const std::string& path, SharedCacheOptions options = {});
+  ~SharedResponseCache();
+
+  SharedResponseCache(const SharedResponseCache&) = delete;
+  SharedResponseCache& operator=(const SharedResponseCache&) = delete;
+
+  // The value of `key`, without waiting.
+  std::optional<std::string> Lookup(std::string_view key);
+
+  // The value of `key`. While another process computes it, waits for up to
+  // the claim timeout or until `cancellation` is cancelled. On a miss the
+  // key is claimed by this process if no one else has it.
+  SharedCacheLookup LookupOrClaim(
+      std::string_view key, const Cancellation* cancellation = nullptr);
+
+  // Stores `value` for `key`, releasing a claim on it. Values larger than
+  // a quarter of the ring are not stored.
+  void Publish(std::string_view key, std::string_view value);
+
+  // Releases the claim of this process on `key`, for the next waiting
+  // process to compute the value.
+  void Abandon(std::string_view key);
+
+  SharedCacheStats stats() const;
+
+ private:
+  struct Header;
+  struct Slot;
+  // A consistent copy of the guarded fields of a slot.
+  struct SlotState;
+  struct Key {
+    uint64_t high;
+    uint64_t low;
+  };
+  enum class Found { kMiss, kHit, kClaimed };
+
+  SharedResponseCache(void* data, size_t size, SharedCacheOptions options);
+
+  static Key HashKey(std::string_view key);
+
+  Slot& slot(uint64_t index) const;
+  // Start of the ring of values, after the slots.
+  char* ring() const;
+  // The probe window of `key`: kProbeLength slots from its home slot.
+  uint64_t Probe(Key key, size_t i) const;
+  bool ReadSlot(const Slot& slot, SlotState& state) const;
+  // Whether a reader may use what `state` points to now.
+  bool Live(const SlotState& state, int64_t now_ns) const;
+  Found Find(Key key, std::string* value);
+  // Takes a slot of the window of `key` and fills it with `state`.
+  // `claim` only takes a slot no one else claimed or published `key` in.
+  bool Store(Key key, const SlotState& state, bool claim);
+  // Appends a value to the ring and returns its offset.
+  std::optional<uint64_t> Append(Key key, std::string_view value);
+
+  Header* const header_;
+  const size_t size_;
+  const SharedCacheOptions options_;
+  const uint32_t pid_;
+  std::atomic<size_t> lookups_ = 0;
+  std::atomic<size_t> hits_ = 0;
+  std::atomic<size_t> coalesced_ = 0;
+};
+
+// Serves POSTs to the chat endpoints of the providers from `cache`, so that
+// the same request from any process goes out once. Only successful
+// responses are kept. Other requests, and streamed ones, go to `fetch`.
+// Requests are keyed by URL and body: headers such as API keys are not
+// part of the key.
+std::shared_ptr<Fetch> WithSharedCache(
+    std::shared_ptr<Fetch> fetch, std::shared_ptr<SharedResponseCache> cache);
+
+// "12 of 40 requests served from the shared cache, 3 after waiting for
+// another process"
+std::string FormatSharedCacheStats(const SharedCacheStats& stats);
+
+}  // namespace uchen::chat
+
+#endif  // SRC_SHARED_CACHE_H_
@@ -0,0 +1,63 @@
+#include "src/sse.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "absl/functional/function_ref.h"
+#include "absl/strings/strip.h"
+
+namespace uchen::chat {
+
+bool SseReader::Feed(
+    std::string_view piece,
+    absl::FunctionRef<bool(std::string_view event, std::string_view data)>
+        on_event) {
+  while (!piece.empty()) {
+    const size_t newline = piece.find('\n');
+    if (newline == std::string_view::npos) {
+      line_.append(piece);
+      return true;
+    }
+    std::string_view line = piece.substr(0, newline);
+    piece.remove_prefix(newline + 1);
+    if (!line_.empty()) {
+      line_.append(line);
+      line = line_;
+    }
+    absl::ConsumeSuffix(&line, "\r");
+    if (line.empty()) {
+      // A blank line ends the event.
+      bool go_on = true;
+      if (has_data_) {
+        ++events_;
+        go_on = on_event(event_, data_);
+      }
+      event_.clear();
+      data_.clear();
+      has_data_ = false;
+      line_.clear();
+      if (!go_on) {
+        return false;
+      }
+      continue;
+    }
+    std::string_view field = line.substr(0, line.find(':'));
+    std::string_view value =
+        field.size() < line.size() ? line.substr(field.size() + 1) : "";
+    absl::ConsumePrefix(&value, " ");
+    if (field == "event") {
+      event_ = value;
+    } else if (field == "data") {
+      if (has_data_) {
+        data_.push_back('\n');
+      }
+      data_.append(value);
+      has_data_ = true;
+    }
+    line_.clear();
+  }
+  return true;
+}
+
+}  // namespace uchen::chat
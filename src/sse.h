@@ -0,0 +1,39 @@
+#ifndef SRC_SSE_H_
+#define SRC_SSE_H_
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "absl/functional/function_ref.h"
+
+namespace uchen::chat {
+
+// Splits a text/event-stream body into events as its pieces arrive, however
+// the pieces cut the lines. Only the `event` and `data` fields are kept.
+class SseReader {
+ public:
+  // Adds the next piece of the body and passes every event it completes to
+  // `on_event`: the event type, empty if it has none, and the data. Returns
+  // false as soon as `on_event` does.
+  bool Feed(std::string_view piece,
+            absl::FunctionRef<bool(std::string_view event,
+                                   std::string_view data)>
+                on_event);
+
+  // Events passed on so far. A body without any is not an event stream,
+  // e.g. an error in JSON.
+  size_t events() const { return events_; }
+
+ private:
+  // The line cut off at the end of the last piece.
+  std::string line_;
+  std::string event_;
+  std::string data_;
+  bool has_data_ = false;
+  size_t events_ = 0;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_SSE_H_
@@ -0,0 +1,213 @@
+#include "src/stop.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+
+#include "re2/re2.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr uint32_t kNoState = UINT32_MAX;
+
+}  // namespace
+
+std::vector<std::string> LiteralStops(absl::Span<const StopCondition> stop,
+                                      size_t limit) {
+  std::vector<std::string> literals;
+  for (const StopCondition& condition : stop) {
+    if (condition.kind == StopCondition::Kind::kLiteral &&
+        literals.size() < limit) {
+      literals.push_back(condition.pattern);
+    }
+  }
+  return literals;
+}
+
+StopMatcher::StopMatcher(StopMatcher&&) = default;
+StopMatcher& StopMatcher::operator=(StopMatcher&&) = default;
+StopMatcher::~StopMatcher() = default;
+
+absl::StatusOr<StopMatcher> StopMatcher::Create(
+    absl::Span<const StopCondition> conditions) {
+  StopMatcher matcher;
+  std::string alternation;
+  for (const StopCondition& condition : conditions) {
+    switch (condition.kind) {
+      case StopCondition::Kind::kLiteral: {
+        if (condition.pattern.empty()) {
+          return absl::InvalidArgumentError("Empty stop sequence");
+        }
+        std::vector<State>& states = matcher.states_;
+        if (states.empty()) {
+          states.emplace_back().next.fill(kNoState);
+        }
+        uint32_t state = 0;
+        for (char c : condition.pattern) {
+          const uint8_t byte = static_cast<uint8_t>(c);
+          if (states[state].next[byte] == kNoState) {
+            states[state].next[byte] = states.size();
+            State& added = states.emplace_back();
+            added.next.fill(kNoState);
+            added.depth = states[state].depth + 1;
+          }
+          state = states[state].next[byte];
+        }
+        states[state].match = condition.pattern.size();
+        break;
+      }
+      case StopCondition::Kind::kRegex: {
+        re2::RE2 regex(condition.pattern, re2::RE2::Quiet);
+        if (!regex.ok()) {
+          return absl::InvalidArgumentError(absl::StrCat(
+              "Invalid stop regex ", condition.pattern, ": ", regex.error()));
+        }
+        absl::StrAppend(&alternation, alternation.empty() ? "" : "|", "(?:",
+                        condition.pattern, ")");
+        break;
+      }
+      case StopCondition::Kind::kBalancedJson:
+        matcher.balanced_json_ = true;
+        break;
+    }
+  }
+  if (!alternation.empty()) {
+    matcher.regex_ = std::make_unique<re2::RE2>(alternation, re2::RE2::Quiet);
+    if (!matcher.regex_->ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid stop regex: ", matcher.regex_->error()));
+    }
+  }
+  if (matcher.states_.empty()) {
+    return matcher;
+  }
+  // Turns the trie into a DFA: a missing transition goes where the failure
+  // link, the longest proper suffix that is in the trie, would go.
+  std::vector<uint32_t> fail(matcher.states_.size(), 0);
+  std::queue<uint32_t> queue;
+  for (uint32_t& next : matcher.states_[0].next) {
+    if (next == kNoState) {
+      next = 0;
+    } else {
+      queue.push(next);
+    }
+  }
+  while (!queue.empty()) {
+    const uint32_t state = queue.front();
+    queue.pop();
+    State& current = matcher.states_[state];
+    if (current.match == 0) {
+      current.match = matcher.states_[fail[state]].match;
+    }
+    for (size_t c = 0; c < 256; ++c) {
+      const uint32_t fallback = matcher.states_[fail[state]].next[c];
+      if (current.next[c] == kNoState) {
+        current.next[c] = fallback;
+      } else {
+        fail[current.next[c]] = fallback;
+        queue.push(current.next[c]);
+      }
+    }
+  }
+  return matcher;
+}
+
+std::string_view StopMatcher::Feed(std::string_view piece) {
+  if (stopped_) {
+    return {};
+  }
+  const size_t start = output_.size();
+  output_.append(piece);
+  // The earliest position at which a condition holds, and where the answer
+  // ends then.
+  size_t detected = output_.size();
+  size_t end = std::string::npos;
+  for (size_t i = start; i < output_.size(); ++i) {
+    const char c = output_[i];
+    if (!states_.empty()) {
+      state_ = states_[state_].next[static_cast<uint8_t>(c)];
+      if (const uint32_t match = states_[state_].match; match > 0) {
+        detected = i + 1;
+        end = i + 1 - match;
+        break;
+      }
+    }
+    if (!balanced_json_) {
+      continue;
+    }
+    if (in_json_string_) {
+      if (json_escape_) {
+        json_escape_ = false;
+      } else if (c == '\\') {
+        json_escape_ = true;
+      } else if (c == '"') {
+        in_json_string_ = false;
+      }
+    } else if (c == '"' && json_depth_ > 0) {
+      in_json_string_ = true;
+    } else if (c == '{' || c == '[') {
+      ++json_depth_;
+    } else if ((c == '}' || c == ']') && json_depth_ > 0 &&
+               --json_depth_ == 0) {
+      detected = i + 1;
+      end = i + 1;
+      break;
+    }
+  }
+  if (size_t regex_end = FirstRegexStop(start, detected);
+      regex_end != std::string::npos && regex_end <= detected) {
+    end = std::min(end, regex_end);
+  }
+  if (end != std::string::npos) {
+    stopped_ = true;
+    return Emit(std::max(end, emitted_));
+  }
+  return Emit(output_.size() - (states_.empty() ? 0 : states_[state_].depth));
+}
+
+std::string_view StopMatcher::Finish() {
+  return stopped_ ? std::string_view() : Emit(output_.size());
+}
+
+size_t StopMatcher::FirstRegexStop(size_t from, size_t size) const {
+  if (regex_ == nullptr ||
+      !re2::RE2::PartialMatch(std::string_view(output_).substr(0, size),
+                              *regex_)) {
+    return std::string::npos;
+  }
+  // Containing a match only gets more likely the longer the prefix, so the
+  // shortest prefix with one is found by bisection.
+  size_t low = from;
+  size_t high = size;
+  while (high - low > 1) {
+    const size_t middle = low + (high - low) / 2;
+    if (re2::RE2::PartialMatch(std::string_view(output_).substr(0, middle),
+                               *regex_)) {
+      high = middle;
+    } else {
+      low = middle;
+    }
+  }
+  return high;
+}
+
+std::string_view StopMatcher::Emit(size_t end) {
+  std::string_view text = std::string_view(output_).substr(
+      emitted_, end > emitted_ ? end - emitted_ : 0);
+  emitted_ = std::max(emitted_, end);
+  return text;
+}
+
+}  // namespace uchen::chat
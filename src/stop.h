@@ -0,0 +1,105 @@
+#ifndef SRC_STOP_H_
+#define SRC_STOP_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+
+namespace re2 {
+class RE2;
+}  // namespace re2
+
+namespace uchen::chat {
+
+// Where an answer should end, so the client stops reading it.
+struct StopCondition {
+  enum class Kind {
+    // `pattern` appears in the answer. The answer ends before it, as it
+    // does with the stop sequences of the providers.
+    kLiteral,
+    // The answer so far contains a match of the RE2 regex `pattern`. The
+    // answer ends with the match.
+    kRegex,
+    // The first JSON object or array of the answer is complete. The answer
+    // ends with it. `pattern` is not used.
+    kBalancedJson,
+  };
+
+  Kind kind = Kind::kLiteral;
+  std::string pattern;
+};
+
+// The patterns of the literal conditions, which providers can apply on
+// their side too, at most `limit` of them.
+std::vector<std::string> LiteralStops(absl::Span<const StopCondition> stop,
+                                      size_t limit);
+
+// Matches stop conditions against an answer as its pieces arrive. Literals
+// go through one Aho-Corasick automaton, a table lookup per byte whatever
+// their number. Balanced JSON is a bracket counter. Regexes are the
+// expensive ones: they are joined into one RE2 alternation, which every
+// piece runs over the whole answer so far.
+class StopMatcher {
+ public:
+  // Fails on empty literals and regexes that do not compile.
+  static absl::StatusOr<StopMatcher> Create(
+      absl::Span<const StopCondition> conditions);
+
+  StopMatcher(StopMatcher&&);
+  StopMatcher& operator=(StopMatcher&&);
+  ~StopMatcher();
+
+  // Adds the next piece of the answer and returns the text that became
+  // final: everything up to the stop once a condition matched, otherwise
+  // all but the end that could still be the start of a literal. Once
+  // stopped, later pieces are ignored. Valid until the next call.
+  std::string_view Feed(std::string_view piece);
+
+  // The text held back at the end of an answer that ended without a stop.
+  std::string_view Finish();
+
+  bool stopped() const { return stopped_; }
+
+ private:
+  // A state of the automaton with its transitions for every byte.
+  struct State {
+    std::array<uint32_t, 256> next;
+    // Length of the longest prefix of a literal the output ends with.
+    uint32_t depth = 0;
+    // Length of the longest literal the output ends with, 0 if none.
+    uint32_t match = 0;
+  };
+
+  StopMatcher() = default;
+
+  // Where the answer ends if the first `size` bytes of the output hold a
+  // regex match that ends past `from`, else npos.
+  size_t FirstRegexStop(size_t from, size_t size) const;
+
+  std::string_view Emit(size_t end);
+
+  std::vector<State> states_;
+  // All regexes as one alternation, nullptr if there are none.
+  std::unique_ptr<re2::RE2> regex_;
+  bool balanced_json_ = false;
+
+  std::string output_;
+  size_t emitted_ = 0;
+  bool stopped_ = false;
+  uint32_t state_ = 0;
+  // Nesting of brackets of the balanced JSON condition.
+  size_t json_depth_ = 0;
+  bool in_json_string_ = false;
+  bool json_escape_ = false;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_STOP_H_
@@ -0,0 +1,100 @@
+#include "src/thread_pool.h"
+
+#include <cstddef>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "absl/synchronization/mutex.h"
+
+namespace uchen::chat {
+namespace {
+
+// The pool and queue of the worker running on this thread, if any.
+thread_local const void* current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+}  // namespace
+
+ThreadPool::ThreadPool(size_t threads) {
+  for (size_t i = 0; i < threads; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back([this, i]() { Work(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    absl::MutexLock lock(&mu_);
+    stopping_ = true;
+  }
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Schedule(Task task) {
+  size_t index = current_pool == this
+                     ? current_queue
+                     : next_queue_.fetch_add(1, std::memory_order_relaxed) %
+                           queues_.size();
+  {
+    Queue& queue = *queues_[index];
+    absl::MutexLock lock(&queue.mu);
+    queue.tasks.push_back(std::move(task));
+  }
+  absl::MutexLock lock(&mu_);
+  ++unclaimed_;
+}
+
+std::optional<ThreadPool::Task> ThreadPool::TryTake(size_t index) {
+  {
+    Queue& own = *queues_[index];
+    absl::MutexLock lock(&own.mu);
+    if (!own.tasks.empty()) {
+      Task task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return task;
+    }
+  }
+  for (size_t i = 1; i < queues_.size(); ++i) {
+    Queue& victim = *queues_[(index + i) % queues_.size()];
+    absl::MutexLock lock(&victim.mu);
+    if (!victim.tasks.empty()) {
+      Task task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return task;
+    }
+  }
+  return std::nullopt;
+}
+
+void ThreadPool::Work(size_t index) {
+  current_pool = this;
+  current_queue = index;
+  while (true) {
+    {
+      absl::MutexLock lock(&mu_);
+      mu_.Await(absl::Condition(
+          +[](ThreadPool* pool) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pool->mu_) {
+            return pool->unclaimed_ > 0 || pool->stopping_;
+          },
+          this));
+      if (unclaimed_ == 0) {
+        return;
+      }
+      --unclaimed_;
+    }
+    // The claim guarantees that a task is queued somewhere, another worker
+    // may only have raced us to the queue it was in.
+    std::optional<Task> task;
+    while (!(task = TryTake(index)).has_value()) {
+      std::this_thread::yield();
+    }
+    std::move(*task)();
+  }
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,60 @@
+#ifndef SRC_THREAD_POOL_H_
+#define SRC_THREAD_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/functional/any_invocable.h"
+#include "absl/synchronization/mutex.h"
+
+namespace uchen::chat {
+
+// Fixed set of worker threads with one task queue each. A task scheduled
+// from a worker goes to that worker's queue and is picked up newest first,
+// which keeps continuations on a warm thread. Idle workers steal the oldest
+// tasks of other queues, so a burst scheduled by one worker spreads out over
+// the pool.
+class ThreadPool {
+ public:
+  using Task = absl::AnyInvocable<void() &&>;
+
+  explicit ThreadPool(
+      size_t threads = std::max(1u, std::thread::hardware_concurrency()));
+  // Runs the tasks that are still queued, then joins the workers.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void Schedule(Task task);
+
+  size_t size() const { return threads_.size(); }
+
+ private:
+  struct Queue {
+    absl::Mutex mu;
+    std::deque<Task> tasks ABSL_GUARDED_BY(mu);
+  };
+
+  void Work(size_t index);
+  std::optional<Task> TryTake(size_t index);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_queue_ = 0;
+  absl::Mutex mu_;
+  // Queued tasks not claimed by a worker yet.
+  size_t unclaimed_ ABSL_GUARDED_BY(mu_) = 0;
+  bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_THREAD_POOL_H_
@@ -0,0 +1,357 @@
+#include "src/tools.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "nlohmann/json.hpp"
+#include "src/trace.h"
+
+extern char** environ;
+
+namespace uchen::chat {
+namespace {
+
+constexpr std::string_view kPassedEnvironment[] = {"PATH", "HOME", "LANG",
+                                                   "TMPDIR"};
+// How often cancellation is checked while tools run.
+constexpr absl::Duration kPollInterval = absl::Milliseconds(100);
+
+// A running tool. Everything the child needs between fork() and exec() is
+// prepared up front, as the child may only make async-signal-safe calls.
+struct Process {
+  pid_t pid = -1;
+  int stdin_fd = -1;
+  int stdout_fd = -1;
+  // Part of the arguments not written to stdin yet.
+  std::string_view pending_input;
+  std::string output;
+  bool truncated = false;
+  // Why the process was killed, if it was.
+  std::string killed;
+  // Set once waitpid() collected `status`.
+  bool reaped = false;
+  int status = 0;
+  // Set when the process could not be started.
+  std::string error;
+};
+
+void CloseFd(int& fd) {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+void SetLimit(int resource, rlim_t value) {
+  rlimit limit = {.rlim_cur = value, .rlim_max = value};
+  setrlimit(resource, &limit);
+}
+
+// Writes to a pipe whose reader may be gone without raising SIGPIPE. The
+// signal is blocked on this thread only for the duration of the write, and
+// a signal raised by it is consumed before unblocking.
+ssize_t WriteToPipe(int fd, std::string_view data) {
+  sigset_t pipe_signal, previous;
+  sigemptyset(&pipe_signal);
+  sigaddset(&pipe_signal, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_signal, &previous);
+  ssize_t written = write(fd, data.data(), data.size());
+  if (written < 0 && errno == EPIPE) {
+    timespec no_wait = {};
+    sigtimedwait(&pipe_signal, nullptr, &no_wait);
+    errno = EPIPE;
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+  return written;
+}
+
+void Start(const Tool& tool, const ToolCall& call, const ToolLimits& limits,
+           Process& process) {
+  std::vector<char*> argv;
+  for (const std::string& arg : tool.command) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  std::vector<char*> envp;
+  for (char** var = environ; *var != nullptr; ++var) {
+    std::string_view name(*var, std::strcspn(*var, "="));
+    if (std::ranges::find(kPassedEnvironment, name) !=
+        std::end(kPassedEnvironment)) {
+      envp.push_back(*var);
+    }
+  }
+  envp.push_back(nullptr);
+
+  int stdin_pipe[2];
+  int stdout_pipe[2];
+  if (pipe2(stdin_pipe, O_CLOEXEC) != 0) {
+    process.error = absl::StrCat("pipe: ", std::strerror(errno));
+    return;
+  }
+  if (pipe2(stdout_pipe, O_CLOEXEC) != 0) {
+    process.error = absl::StrCat("pipe: ", std::strerror(errno));
+    close(stdin_pipe[0]);
+    close(stdin_pipe[1]);
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    setpgid(0, 0);
+    dup2(stdin_pipe[0], STDIN_FILENO);
+    dup2(stdout_pipe[1], STDOUT_FILENO);
+    dup2(stdout_pipe[1], STDERR_FILENO);
+    SetLimit(RLIMIT_CPU, std::max<rlim_t>(
+                             1, absl::ToInt64Seconds(limits.cpu_time)));
+    SetLimit(RLIMIT_AS, limits.address_space_bytes);
+    SetLimit(RLIMIT_FSIZE, limits.file_size_bytes);
+    SetLimit(RLIMIT_CORE, 0);
+    environ = envp.data();
+    execvp(argv[0], argv.data());
+    constexpr std::string_view kExecFailed = "exec failed\n";
+    // Nothing is left to report a failed write to.
+    [[maybe_unused]] ssize_t written =
+        write(STDERR_FILENO, kExecFailed.data(), kExecFailed.size());
+    _exit(127);
+  }
+  close(stdin_pipe[0]);
+  close(stdout_pipe[1]);
+  if (pid < 0) {
+    process.error = absl::StrCat("fork: ", std::strerror(errno));
+    close(stdin_pipe[1]);
+    close(stdout_pipe[0]);
+    return;
+  }
+  // Also set by the child; doing it here too closes the race with kill().
+  setpgid(pid, pid);
+  process.pid = pid;
+  process.stdin_fd = stdin_pipe[1];
+  process.stdout_fd = stdout_pipe[0];
+  fcntl(process.stdin_fd, F_SETFL, O_NONBLOCK);
+  process.pending_input = call.arguments;
+}
+
+// Collects the exit status of a process that closed its output, without
+// waiting for it. Returns whether it is still running.
+bool Running(Process& process) {
+  if (process.pid <= 0 || process.reaped) {
+    return false;
+  }
+  if (process.stdout_fd >= 0) {
+    return true;
+  }
+  pid_t reaped;
+  while ((reaped = waitpid(process.pid, &process.status, WNOHANG)) < 0 &&
+         errno == EINTR) {
+  }
+  process.reaped = reaped != 0;
+  return !process.reaped;
+}
+
+void Kill(Process& process, std::string_view reason) {
+  if (process.pid > 0 && !process.reaped && process.killed.empty()) {
+    kill(-process.pid, SIGKILL);
+    process.killed = reason;
+  }
+}
+
+std::string Result(Process& process) {
+  if (!process.error.empty()) {
+    return absl::StrCat("Error: ", process.error);
+  }
+  std::string result = std::move(process.output);
+  if (process.truncated) {
+    absl::StrAppend(&result, "\n[output truncated]");
+  }
+  while (!process.reaped &&
+         waitpid(process.pid, &process.status, 0) < 0 && errno == EINTR) {
+  }
+  const int status = process.status;
+  if (!process.killed.empty()) {
+    absl::StrAppend(&result, "\n[", process.killed, "]");
+  } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+    absl::StrAppend(&result, "\n[exit status ", WEXITSTATUS(status), "]");
+  } else if (WIFSIGNALED(status)) {
+    absl::StrAppend(&result, "\n[killed by signal ", WTERMSIG(status), "]");
+  }
+  return result;
+}
+
+}  // namespace
+
+absl::StatusOr<std::vector<Tool>> LoadTools(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) {
+    return absl::NotFoundError(absl::StrCat("Cannot open ", path));
+  }
+  auto config =
+      nlohmann::json::parse(file, nullptr, /*allow_exceptions=*/false);
+  if (config.is_discarded() || !config.is_array()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat(path, ": expected a JSON array of tools"));
+  }
+  std::vector<Tool> tools;
+  for (const auto& entry : config) {
+    Tool tool;
+    if (!entry.is_object() || !entry.contains("name") ||
+        !entry["name"].is_string() || !entry.contains("command") ||
+        !entry["command"].is_array() || entry["command"].empty()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          path, ": a tool needs a name and a command: ", entry.dump()));
+    }
+    tool.spec.name = entry["name"].get<std::string>();
+    tool.spec.description = entry.value("description", "");
+    tool.spec.parameters =
+        entry.value("parameters", nlohmann::json{{"type", "object"}}).dump();
+    for (const auto& arg : entry["command"]) {
+      if (!arg.is_string()) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            path, ": command of ", tool.spec.name, " must be strings"));
+      }
+      tool.command.push_back(arg.get<std::string>());
+    }
+    tools.push_back(std::move(tool));
+  }
+  return tools;
+}
+
+std::vector<ToolSpec> ToolRunner::specs() const {
+  std::vector<ToolSpec> specs;
+  for (const Tool& tool : tools_) {
+    specs.push_back(tool.spec);
+  }
+  return specs;
+}
+
+const Tool* ToolRunner::Find(std::string_view name) const {
+  auto it = std::ranges::find(
+      tools_, name,
+      [](const Tool& tool) -> std::string_view { return tool.spec.name; });
+  return it == tools_.end() ? nullptr : &*it;
+}
+
+std::vector<Message> ToolRunner::Run(
+    absl::Span<const ToolCall> calls,
+    absl::FunctionRef<void(size_t call, std::string_view output)> on_output,
+    const Cancellation* cancellation) const {
+  TraceSpan span("ToolRunner::Run");
+  std::vector<Process> processes(calls.size());
+  for (size_t i = 0; i < calls.size(); ++i) {
+    if (const Tool* tool = Find(calls[i].name); tool != nullptr) {
+      Start(*tool, calls[i], limits_, processes[i]);
+    } else {
+      processes[i].error = absl::StrCat("Unknown tool ", calls[i].name);
+    }
+  }
+
+  absl::Time deadline = absl::Now() + limits_.wall_time;
+  std::vector<pollfd> poll_fds;
+  std::vector<size_t> poll_owners;
+  while (true) {
+    poll_fds.clear();
+    poll_owners.clear();
+    for (size_t i = 0; i < processes.size(); ++i) {
+      if (processes[i].stdout_fd >= 0) {
+        poll_fds.push_back({.fd = processes[i].stdout_fd, .events = POLLIN});
+        poll_owners.push_back(i);
+      }
+      if (processes[i].stdin_fd >= 0) {
+        poll_fds.push_back({.fd = processes[i].stdin_fd, .events = POLLOUT});
+        poll_owners.push_back(i);
+      }
+    }
+    // A tool that closed its output may still be running, and is held to
+    // the same deadline.
+    bool running = false;
+    for (Process& process : processes) {
+      running = Running(process) || running;
+    }
+    if (poll_fds.empty() && !running) {
+      break;
+    }
+    bool cancelled = cancellation != nullptr && cancellation->cancelled();
+    if (cancelled || absl::Now() >= deadline) {
+      std::string reason =
+          cancelled ? "cancelled"
+                    : absl::StrCat("timed out after ",
+                                   absl::FormatDuration(limits_.wall_time));
+      for (Process& process : processes) {
+        Kill(process, reason);
+        CloseFd(process.stdin_fd);
+        CloseFd(process.stdout_fd);
+      }
+      break;
+    }
+    absl::Duration wait = std::min(kPollInterval, deadline - absl::Now());
+    int ready = poll(poll_fds.data(), poll_fds.size(),
+                     std::max<int64_t>(0, absl::ToInt64Milliseconds(wait)));
+    if (ready <= 0) {
+      continue;
+    }
+    for (size_t j = 0; j < poll_fds.size(); ++j) {
+      if (poll_fds[j].revents == 0) {
+        continue;
+      }
+      Process& process = processes[poll_owners[j]];
+      if (poll_fds[j].fd == process.stdin_fd) {
+        ssize_t written = WriteToPipe(process.stdin_fd, process.pending_input);
+        if (written > 0) {
+          process.pending_input.remove_prefix(written);
+        }
+        if (process.pending_input.empty() ||
+            (written < 0 && errno != EAGAIN && errno != EINTR)) {
+          // EOF on stdin tells the tool that the arguments are complete.
+          CloseFd(process.stdin_fd);
+        }
+        continue;
+      }
+      char chunk[4096];
+      ssize_t read_bytes = read(process.stdout_fd, chunk, sizeof(chunk));
+      if (read_bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+      if (read_bytes <= 0) {
+        CloseFd(process.stdout_fd);
+        continue;
+      }
+      std::string_view output(chunk, read_bytes);
+      on_output(poll_owners[j], output);
+      size_t room = limits_.output_bytes - process.output.size();
+      if (output.size() > room) {
+        output = output.substr(0, room);
+        process.truncated = true;
+      }
+      process.output.append(output);
+    }
+  }
+
+  std::vector<Message> results;
+  for (size_t i = 0; i < calls.size(); ++i) {
+    results.push_back({.role = Message::Role::kTool,
+                       .content = Result(processes[i]),
+                       .tool_call_id = calls[i].id});
+  }
+  return results;
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,73 @@
+#ifndef SRC_TOOLS_H_
+#define SRC_TOOLS_H_
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/functional/function_ref.h"
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+
+namespace uchen::chat {
+
+// Resource limits applied to every tool process.
+struct ToolLimits {
+  absl::Duration cpu_time = absl::Seconds(30);
+  // The process group is killed when a tool runs longer than this.
+  absl::Duration wall_time = absl::Seconds(60);
+  size_t address_space_bytes = size_t{2} << 30;
+  // Largest file a tool may write.
+  size_t file_size_bytes = size_t{64} << 20;
+  // Output past this is dropped, the process keeps running.
+  size_t output_bytes = size_t{1} << 20;
+};
+
+// A tool backed by an executable. The arguments object chosen by the model is
+// written to its stdin, and everything it prints is the result.
+struct Tool {
+  ToolSpec spec;
+  std::vector<std::string> command;
+};
+
+// Reads tool definitions from a JSON file holding an array of
+// {"name", "description", "parameters", "command"} objects, where
+// "parameters" is the JSON schema of the arguments and "command" the argv.
+absl::StatusOr<std::vector<Tool>> LoadTools(const std::string& path);
+
+// Runs tool calls as child processes. Each process gets its own process
+// group, the limits above and an environment reduced to PATH, HOME, LANG and
+// TMPDIR, so API keys do not leak into tools.
+class ToolRunner {
+ public:
+  explicit ToolRunner(std::vector<Tool> tools, ToolLimits limits = {})
+      : tools_(std::move(tools)), limits_(limits) {}
+
+  std::vector<ToolSpec> specs() const;
+
+  // Starts all `calls` at once and waits for the last one, so a batch takes
+  // as long as its slowest tool. Returns one Role::kTool message per call, in
+  // order. Failures are reported to the model in the message rather than as
+  // an error. `on_output` is called with each chunk of output as it arrives.
+  // Running tools are killed when `cancellation` fires.
+  std::vector<Message> Run(
+      absl::Span<const ToolCall> calls,
+      absl::FunctionRef<void(size_t call, std::string_view output)> on_output,
+      const Cancellation* cancellation = nullptr) const;
+
+ private:
+  const Tool* Find(std::string_view name) const;
+
+  std::vector<Tool> tools_;
+  ToolLimits limits_;
+};
+
+}  // namespace uchen::chat
+
+#endif  // SRC_TOOLS_H_
@@ -0,0 +1,185 @@
+#include "src/trace.h"
+
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+
+namespace uchen::chat {
+namespace {
+
+struct Event {
+  const char* name;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+constexpr size_t kChunkEvents = 4096;
+// About 24 MiB per thread. Later spans of a thread are dropped.
+constexpr size_t kMaxThreadEvents = 1 << 20;
+
+struct Chunk {
+  std::array<Event, kChunkEvents> events;
+  std::atomic<Chunk*> next = nullptr;
+};
+
+// Spans of one thread. Only that thread appends; readers see the events
+// published by the release store of `size_`. Chunks are never moved, so
+// readers need no lock.
+class ThreadBuffer {
+ public:
+  explicit ThreadBuffer(uint64_t tid) : tid_(tid) {}
+  ~ThreadBuffer() {
+    Chunk* chunk = head_.next.load(std::memory_order_relaxed);
+    while (chunk != nullptr) {
+      Chunk* next = chunk->next.load(std::memory_order_relaxed);
+      delete chunk;
+      chunk = next;
+    }
+  }
+
+  void Add(const Event& event) {
+    size_t size = size_.load(std::memory_order_relaxed);
+    if (size == kMaxThreadEvents) {
+      return;
+    }
+    if (size > 0 && size % kChunkEvents == 0) {
+      Chunk* chunk = new Chunk;
+      tail_->next.store(chunk, std::memory_order_release);
+      tail_ = chunk;
+    }
+    tail_->events[size % kChunkEvents] = event;
+    size_.store(size + 1, std::memory_order_release);
+  }
+
+  template <typename F>
+  void ForEach(F f) const {
+    size_t size = size_.load(std::memory_order_acquire);
+    const Chunk* chunk = &head_;
+    for (size_t i = 0; i < size; ++i) {
+      if (i > 0 && i % kChunkEvents == 0) {
+        chunk = chunk->next.load(std::memory_order_acquire);
+      }
+      f(chunk->events[i % kChunkEvents]);
+    }
+  }
+
+  uint64_t tid() const { return tid_; }
+
+ private:
+  const uint64_t tid_;
+  Chunk head_;
+  Chunk* tail_ = &head_;
+  std::atomic<size_t> size_ = 0;
+};
+
+// Buffers outlive their threads so that spans of finished threads still end
+// up in the trace.
+class Registry {
+ public:
+  ThreadBuffer* Register() {
+    absl::MutexLock lock(&mu_);
+    buffers_.push_back(std::make_unique<ThreadBuffer>(buffers_.size() + 1));
+    return buffers_.back().get();
+  }
+
+  template <typename F>
+  void ForEach(F f) const {
+    absl::MutexLock lock(&mu_);
+    for (const auto& buffer : buffers_) {
+      f(*buffer);
+    }
+  }
+
+ private:
+  mutable absl::Mutex mu_;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_ ABSL_GUARDED_BY(mu_);
+};
+
+Registry& GlobalRegistry() {
+  static Registry* const registry = new Registry;
+  return *registry;
+}
+
+ThreadBuffer& CurrentThreadBuffer() {
+  thread_local ThreadBuffer* buffer = GlobalRegistry().Register();
+  return *buffer;
+}
+
+int64_t SteadyClockNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Timestamps are relative to the first one taken to keep them short.
+int64_t OriginNanos() {
+  static const int64_t origin = SteadyClockNanos();
+  return origin;
+}
+
+// Chrome trace timestamps are in microseconds.
+void AppendMicros(std::string& out, int64_t ns) {
+  absl::StrAppend(&out, ns / 1000, ".", absl::Dec(ns % 1000, absl::kZeroPad3));
+}
+
+}  // namespace
+
+namespace trace_internal {
+
+int64_t NowNanos() { return SteadyClockNanos() - OriginNanos(); }
+
+void Record(const char* name, int64_t start_ns, int64_t end_ns) {
+  CurrentThreadBuffer().Add(
+      {.name = name, .start_ns = start_ns, .end_ns = end_ns});
+}
+
+}  // namespace trace_internal
+
+void EnableTracing() {
+  trace_internal::enabled.store(true, std::memory_order_relaxed);
+}
+
+std::string ChromeTraceJson() {
+  const int pid = getpid();
+  std::string out = R"({"displayTimeUnit":"ms","traceEvents":[)";
+  bool first = true;
+  GlobalRegistry().ForEach([&](const ThreadBuffer& buffer) {
+    buffer.ForEach([&](const Event& event) {
+      absl::StrAppend(&out, first ? "" : ",\n", R"({"name":")", event.name,
+                      R"(","ph":"X","pid":)", pid, R"(,"tid":)", buffer.tid(),
+                      R"(,"ts":)");
+      AppendMicros(out, event.start_ns);
+      absl::StrAppend(&out, R"(,"dur":)");
+      AppendMicros(out, event.end_ns - event.start_ns);
+      out.push_back('}');
+      first = false;
+    });
+  });
+  out.append("]}\n");
+  return out;
+}
+
+absl::Status WriteChromeTrace(const std::string& path) {
+  std::ofstream file(path, std::ios::trunc);
+  file << ChromeTraceJson();
+  file.close();
+  if (!file) {
+    return absl::InternalError(absl::StrCat("Failed to write trace to ", path));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace uchen::chat
@@ -0,0 +1,63 @@
+#ifndef SRC_TRACE_H_
+#define SRC_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "absl/status/status.h"
+
+namespace uchen::chat {
+
+namespace trace_internal {
+
+inline std::atomic<bool> enabled = false;
+
+int64_t NowNanos();
+void Record(const char* name, int64_t start_ns, int64_t end_ns);
+
+}  // namespace trace_internal
+
+// Tracing is off until enabled and cannot be turned off again, so spans that
+// are open when it is enabled are simply not recorded.
+inline bool TracingEnabled() {
+  return trace_internal::enabled.load(std::memory_order_relaxed);
+}
+void EnableTracing();
+
+// Times the enclosing scope. While tracing is off this is a single relaxed
+// load, so spans stay compiled in everywhere. `name` must be a string literal
+// and need no JSON escaping; only the pointer is kept.
+//
+// Each thread records into its own buffer without taking locks.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name) {
+    if (TracingEnabled()) {
+      name_ = name;
+      start_ns_ = trace_internal::NowNanos();
+    }
+  }
+  ~TraceSpan() {
+    if (name_ != nullptr) {
+      trace_internal::Record(name_, start_ns_, trace_internal::NowNanos());
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* name_ = nullptr;
+  int64_t start_ns_ = 0;
+};
+
+// All spans recorded so far as Chrome trace-event JSON, which both
+// chrome://tracing and the Perfetto UI open. Safe to call while other threads
+// are still recording; their newest spans may be missing.
+std::string ChromeTraceJson();
+absl::Status WriteChromeTrace(const std::string& path);
+
+}  // namespace uchen::chat
+
+#endif  // SRC_TRACE_H_
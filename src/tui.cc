@@ -0,0 +1,32 @@
+#include "src/tui.h"
+
+#include <atomic>
+#include <csignal>
+
+#include "src/fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+std::atomic<Cancellation*> interrupt_target = nullptr;
+
+void OnInterrupt(int /* signal */) {
+  if (Cancellation* cancellation = interrupt_target.load();
+      cancellation != nullptr) {
+    cancellation->Cancel();
+  }
+}
+
+}  // namespace
+
+InterruptScope::InterruptScope(Cancellation* cancellation) {
+  interrupt_target.store(cancellation);
+  previous_handler_ = std::signal(SIGINT, OnInterrupt);
+}
+
+InterruptScope::~InterruptScope() {
+  std::signal(SIGINT, previous_handler_);
+  interrupt_target.store(nullptr);
+}
+
+}  // namespace uchen::chat
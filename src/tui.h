@@ -1,16 +1,40 @@
 #ifndef SRC_TUI_H_
 #define SRC_TUI_H_
 
+#include <csignal>
 #include <iostream>
 #include <thread>
 
 #include "absl/cleanup/cleanup.h"
 #include "absl/synchronization/mutex.h"
 
+#include "src/fetch.h"
+#include "src/render.h"
+
 namespace uchen::chat {
 
+// Routes Ctrl-C to `cancellation` while the scope is alive, so that it aborts
+// the running request instead of the whole process. The previous handler is
+// restored on destruction. Scopes must not be nested.
+class InterruptScope {
+ public:
+  explicit InterruptScope(Cancellation* cancellation);
+  ~InterruptScope();
+
+  InterruptScope(const InterruptScope&) = delete;
+  InterruptScope& operator=(const InterruptScope&) = delete;
+
+ private:
+  void (*previous_handler_)(int);
+};
+
+// Runs `func` on a separate thread, animating a spinner on stdout until it
+// returns. The spinner is skipped when stdout is not a terminal.
 template <typename T>
 std::invoke_result_t<T> SpinWhile(const T& func) {
+  if (!StdoutRenderSettings().terminal) {
+    return func();
+  }
   absl::Mutex mu;
   absl::CondVar cv;
   std::optional<std::invoke_result_t<T>> result;
@@ -0,0 +1,189 @@
+#include "src/batch.h"
+
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "absl/flags/flag.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "curl/curl.h"
+#include "src/anthropic.h"
+#include "src/fetch.h"
+#include "src/loadgen.h"
+#include "src/model.h"
+#include "src/openai.h"
+
+namespace uchen::chat {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+
+constexpr BatchOptions kFastPolls = {
+    .poll_interval = absl::Milliseconds(10),
+    .max_poll_interval = absl::Milliseconds(20),
+    .timeout = absl::Seconds(10),
+};
+
+std::vector<BatchRequest> Requests(std::vector<std::string> ids) {
+  std::vector<BatchRequest> requests;
+  for (std::string& id : ids) {
+    requests.push_back({.id = std::move(id),
+                        .messages = {{.content = "Say hello."}}});
+  }
+  return requests;
+}
+
+class BatchTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    curl_global_init(CURL_GLOBAL_ALL);
+    auto stub = StubServer::Start({.time_to_first_byte = absl::ZeroDuration(),
+                                   .latency = absl::ZeroDuration(),
+                                   .reply = "stubbed",
+                                   .batch_polls = 2});
+    ASSERT_TRUE(stub.ok()) << stub.status();
+    stub_ = *std::move(stub);
+    absl::SetFlag(&FLAGS_openai_api_url, stub_->api_url());
+    absl::SetFlag(&FLAGS_openai_api_key, "key");
+    absl::SetFlag(&FLAGS_anthropic_api_url, stub_->api_url());
+    absl::SetFlag(&FLAGS_anthropic_api_key, "key");
+  }
+
+  // Runs `requests` through the batch API of `provider`, by request id.
+  std::map<std::string, absl::StatusOr<Reply>> Run(
+      const ModelProvider& provider, std::string_view model_name,
+      absl::Span<const BatchRequest> requests) {
+    std::map<std::string, absl::StatusOr<Reply>> results;
+    auto model = provider.ConnectToModel(model_name);
+    EXPECT_TRUE(model.ok()) << model.status();
+    BatchApi* api = (*model)->batch_api();
+    EXPECT_NE(api, nullptr);
+    absl::Status status =
+        RunBatch(*api, *fetch_, requests, kFastPolls, [&](BatchResult result) {
+          results.emplace(result.id, std::move(result.reply));
+        });
+    EXPECT_TRUE(status.ok()) << status;
+    return results;
+  }
+
+  std::shared_ptr<CurlFetch> fetch_ = std::make_shared<CurlFetch>();
+  char* env_[1] = {nullptr};
+  Parameters parameters_{64, env_};
+  std::unique_ptr<StubServer> stub_;
+};
+
+TEST_F(BatchTest, OpenAIBatchAgainstTheStub) {
+  auto provider = MakeOpenAIModelProvider(fetch_, parameters_);
+  std::map<std::string, absl::StatusOr<Reply>> results =
+      Run(*provider, "gpt-4o", Requests({"a", "b", "error-c"}));
+  ASSERT_EQ(results.size(), 3);
+  ASSERT_TRUE(results.at("a").ok()) << results.at("a").status();
+  EXPECT_EQ(results.at("a")->text, "stubbed");
+  ASSERT_TRUE(results.at("b").ok()) << results.at("b").status();
+  EXPECT_THAT(results.at("error-c").status().message(),
+              HasSubstr("Failed in the stub"));
+  // The upload, the creation, three status checks, one more for the file
+  // ids and the output and error files.
+  EXPECT_EQ(stub_->requests_received(), 8);
+}
+
+TEST_F(BatchTest, AnthropicBatchAgainstTheStub) {
+  auto provider = MakeAnthropicModelProvider(fetch_, parameters_);
+  std::map<std::string, absl::StatusOr<Reply>> results =
+      Run(*provider, "claude-model", Requests({"a", "error-b"}));
+  ASSERT_EQ(results.size(), 2);
+  ASSERT_TRUE(results.at("a").ok()) << results.at("a").status();
+  EXPECT_EQ(results.at("a")->text, "stubbed");
+  EXPECT_THAT(results.at("error-b").status().message(),
+              HasSubstr("Failed in the stub"));
+}
+
+// Answers every request of a batch except those with "lost" in their id.
+class FakeBatchApi : public BatchApi {
+ public:
+  size_t max_batch_requests() const override { return 2; }
+
+  absl::StatusOr<std::string> SubmitBatch(
+      const Fetch& /* fetch */, absl::Span<const BatchRequest> requests,
+      const RequestOptions& /* options */) override {
+    submitted.emplace_back(requests.begin(), requests.end());
+    return absl::StrCat(submitted.size() - 1);
+  }
+
+  absl::StatusOr<bool> PollBatch(const Fetch& /* fetch */,
+                                 std::string_view /* batch_id */,
+                                 const RequestOptions& /* options */) override {
+    return true;
+  }
+
+  absl::Status BatchResults(
+      const Fetch& /* fetch */, std::string_view batch_id,
+      const RequestOptions& /* options */,
+      absl::FunctionRef<void(BatchResult)> on_result) override {
+    const size_t batch = std::stoul(std::string(batch_id));
+    for (const BatchRequest& request : submitted[batch]) {
+      if (request.id.find("lost") == std::string::npos) {
+        on_result({.id = request.id, .reply = Reply{.text = request.id}});
+      }
+    }
+    return absl::OkStatus();
+  }
+
+  std::vector<std::vector<BatchRequest>> submitted;
+};
+
+TEST_F(BatchTest, SplitsBatchesAndReportsMissingResults) {
+  FakeBatchApi api;
+  std::vector<std::string> lines;
+  absl::Status status = RunBatch(
+      api, *fetch_, Requests({"a", "b", "lost-c", "d", "e"}), kFastPolls,
+      [&](BatchResult result) { lines.push_back(FormatBatchResult(result)); });
+  ASSERT_TRUE(status.ok()) << status;
+  EXPECT_EQ(api.submitted.size(), 3);
+  EXPECT_THAT(lines,
+              ElementsAre(R"({"id":"a","text":"a"})",
+                          R"({"id":"b","text":"b"})",
+                          R"({"id":"d","text":"d"})",
+                          R"({"error":"INTERNAL: No result in batch 1",)"
+                          R"("id":"lost-c"})",
+                          R"({"id":"e","text":"e"})"));
+
+  EXPECT_EQ(RunBatch(api, *fetch_, Requests({"a", "a"}), kFastPolls,
+                     [](BatchResult) {})
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ReadBatchRequestsTest, ReadsPromptsWithAndWithoutIds) {
+  std::istringstream input(R"({"id": "first", "prompt": "Hi"}
+
+{"prompt": "Bye"}
+)");
+  auto requests = ReadBatchRequests(input);
+  ASSERT_TRUE(requests.ok()) << requests.status();
+  ASSERT_EQ(requests->size(), 2);
+  EXPECT_EQ((*requests)[0].id, "first");
+  EXPECT_EQ((*requests)[0].messages[0].content, "Hi");
+  EXPECT_EQ((*requests)[1].id, "3");
+
+  std::istringstream invalid(R"({"id": 1, "prompt": "Hi"})");
+  EXPECT_EQ(ReadBatchRequests(invalid).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,215 @@
+#include "src/channel.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/thread_pool.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::UnorderedElementsAre;
+
+// Replies with the number of history lines it was shown, after a delay.
+class CountingModel : public Model {
+ public:
+  explicit CountingModel(absl::Duration delay) : delay_(delay) {}
+
+  std::string_view name() const override { return "counting"; }
+
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& /* fetch */, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& /* options */) override {
+    absl::SleepFor(delay_);
+    if (prompt == "fail") {
+      return absl::InternalError("failed");
+    }
+    return absl::StrCat(prompt, " saw [", absl::StrJoin(input_contents, "|"),
+                        "]");
+  }
+
+ private:
+  absl::Duration delay_;
+};
+
+ModelHandle Counting(absl::Duration delay = absl::ZeroDuration()) {
+  return std::make_unique<CountingModel>(delay);
+}
+
+std::vector<std::string> Lines(const ChannelHistory& history) {
+  std::vector<std::string> lines;
+  for (const ChannelMessage& message : history.Snapshot()) {
+    lines.emplace_back(message.line());
+  }
+  return lines;
+}
+
+TEST(ChannelHistoryTest, SnapshotsDoNotSeeLaterMessages) {
+  ChannelHistory history;
+  for (int i = 0; i < 100; ++i) {
+    history.Append("user", absl::StrCat(i));
+  }
+  ChannelHistory::View view = history.Snapshot();
+  const ChannelMessage* first = &*view.begin();
+  for (int i = 100; i < 300; ++i) {
+    history.Append("bot", absl::StrCat(i));
+  }
+  EXPECT_EQ(view.size(), 100);
+  EXPECT_EQ(&*view.begin(), first);
+  int expected = 0;
+  for (const ChannelMessage& message : view) {
+    EXPECT_EQ(message.author(), "user");
+    EXPECT_EQ(message.text(), absl::StrCat(expected++));
+  }
+  EXPECT_EQ(expected, 100);
+  EXPECT_EQ(history.Snapshot().size(), 300);
+}
+
+TEST(ChannelHistoryTest, ReadersRunAlongsideTheWriter) {
+  ChannelHistory history;
+  std::thread writer([&]() {
+    for (int i = 0; i < 1000; ++i) {
+      history.Append("bot", absl::StrCat(i));
+    }
+  });
+  size_t last_size = 0;
+  while (last_size < 1000) {
+    ChannelHistory::View view = history.Snapshot();
+    size_t count = 0;
+    for (const ChannelMessage& message : view) {
+      EXPECT_EQ(message.text(), absl::StrCat(count++));
+    }
+    EXPECT_EQ(count, view.size());
+    last_size = view.size();
+  }
+  writer.join();
+}
+
+TEST(ChannelTest, AddressedAgentsRunInParallel) {
+  NoFetch fetch;
+  ThreadPool pool(4);
+  Channel channel(fetch, pool);
+  for (std::string name : {"a", "b", "c"}) {
+    ASSERT_TRUE(channel
+                    .AddAgent({.name = name, .prompt = name},
+                              Counting(absl::Milliseconds(300)))
+                    .ok());
+  }
+  std::vector<std::string> authors;
+  absl::Time start = absl::Now();
+  absl::Status status = channel.Post(
+      "@a and @b, please",
+      [&](const ChannelMessage& message) {
+        authors.emplace_back(message.author());
+      },
+      {});
+  EXPECT_TRUE(status.ok()) << status;
+  EXPECT_LT(absl::Now() - start, absl::Milliseconds(550));
+  EXPECT_THAT(authors, UnorderedElementsAre("a", "b"));
+}
+
+TEST(ChannelTest, DependentAgentSeesItsInputs) {
+  NoFetch fetch;
+  ThreadPool pool(4);
+  Channel channel(fetch, pool);
+  ASSERT_TRUE(channel.AddAgent({.name = "coder", .prompt = "code"}, Counting())
+                  .ok());
+  ASSERT_TRUE(channel
+                  .AddAgent({.name = "reviewer",
+                             .prompt = "review",
+                             .inputs = {"coder"}},
+                            Counting())
+                  .ok());
+  std::vector<std::string> authors;
+  EXPECT_TRUE(channel
+                  .Post(
+                      "go",
+                      [&](const ChannelMessage& message) {
+                        authors.emplace_back(message.author());
+                      },
+                      {})
+                  .ok());
+  EXPECT_THAT(authors, ElementsAre("coder", "reviewer"));
+  EXPECT_THAT(Lines(channel.history()),
+              ElementsAre("user: go", "coder: code saw [user: go]",
+                          "reviewer: review saw [user: go|coder: code saw "
+                          "[user: go]]"));
+}
+
+TEST(ChannelTest, ReportsFailuresAndStillRunsDependents) {
+  NoFetch fetch;
+  ThreadPool pool(2);
+  Channel channel(fetch, pool);
+  ASSERT_TRUE(
+      channel.AddAgent({.name = "broken", .prompt = "fail"}, Counting()).ok());
+  ASSERT_TRUE(channel
+                  .AddAgent({.name = "next",
+                             .prompt = "next",
+                             .inputs = {"broken"}},
+                            Counting())
+                  .ok());
+  absl::Status status =
+      channel.Post("hi", [](const ChannelMessage&) {}, {});
+  EXPECT_EQ(status, absl::InternalError("broken: failed"));
+  EXPECT_THAT(Lines(channel.history()),
+              ElementsAre("user: hi", "next: next saw [user: hi]"));
+}
+
+TEST(ChannelTest, RejectsUnknownInputs) {
+  NoFetch fetch;
+  ThreadPool pool(1);
+  Channel channel(fetch, pool);
+  EXPECT_FALSE(
+      channel.AddAgent({.name = "a", .inputs = {"b"}}, Counting()).ok());
+  EXPECT_FALSE(channel.AddAgent({.name = "user"}, Counting()).ok());
+}
+
+TEST(LoadAgentsTest, RejectsFieldsOfTheWrongType) {
+  const std::string path =
+      absl::StrCat(::testing::TempDir(), "/agents_", getpid(), ".json");
+  auto load = [&](std::string_view config) {
+    std::ofstream(path) << config;
+    return LoadAgents(path);
+  };
+  auto agents = load(
+      R"([{"name": "a", "model": "gpt", "prompt": "Be brief."},
+          {"name": "b", "model": "gpt", "inputs": ["a"]}])");
+  ASSERT_TRUE(agents.ok()) << agents.status();
+  EXPECT_EQ((*agents)[0].prompt, "Be brief.");
+  EXPECT_THAT((*agents)[1].inputs, ElementsAre("a"));
+  for (std::string_view config : {
+           R"([{"name": "a", "model": "gpt", "prompt": 5}])",
+           R"([{"name": "a", "model": "gpt", "inputs": "b"}])",
+           R"([{"name": "a", "model": "gpt", "inputs": [1]}])",
+       }) {
+    EXPECT_EQ(load(config).status().code(),
+              absl::StatusCode::kInvalidArgument)
+        << config;
+  }
+  std::remove(path.c_str());
+}
+
+}  // namespace
+}  // namespace uchen::chat
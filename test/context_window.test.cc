@@ -0,0 +1,208 @@
+#include "src/context_window.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/stop.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+// Replies "reply <n>" to conversations, and to requests for a summary with
+// `summary` once `release` is notified.
+class FakeModel : public Model {
+ public:
+  std::string_view name() const override { return "fake"; }
+
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& /* fetch */, std::string_view /* prompt */,
+      absl::Span<const std::string_view> /* input_contents */,
+      const RequestOptions& /* options */) override {
+    return absl::UnimplementedError("Only Complete is faked");
+  }
+
+  absl::StatusOr<Reply> Complete(const Fetch& /* fetch */,
+                                 absl::Span<const Message> messages,
+                                 absl::Span<const ToolSpec> /* tools */,
+                                 const RequestOptions& /* options */) override {
+    if (absl::StartsWith(messages.back().content, "Summarize")) {
+      summary_requested.Notify();
+      release.WaitForNotification();
+      return summary;
+    }
+    absl::MutexLock lock(&mu_);
+    requests_.emplace_back(messages.begin(), messages.end());
+    if (!tool_calls.empty()) {
+      return Reply{.tool_calls = std::move(tool_calls)};
+    }
+    return Reply{.text = absl::StrCat("reply ", requests_.size())};
+  }
+
+  absl::Status StreamConversationUntil(
+      const Fetch& fetch, absl::Span<const Message> history, Message prompt,
+      absl::Span<const StopCondition> stop, const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override {
+    stops_seen += stop.size();
+    return Model::StreamConversationUntil(fetch, history, std::move(prompt),
+                                          stop, options, on_segment);
+  }
+
+  std::vector<std::vector<Message>> requests() {
+    absl::MutexLock lock(&mu_);
+    return requests_;
+  }
+
+  absl::StatusOr<Reply> summary = Reply{.text = "the summary"};
+  // Returned instead of the next reply.
+  std::vector<ToolCall> tool_calls;
+  absl::Notification summary_requested;
+  absl::Notification release;
+  size_t stops_seen = 0;
+
+ private:
+  absl::Mutex mu_;
+  std::vector<std::vector<Message>> requests_;
+};
+
+// A message of about 25 tokens.
+Message Say(Message::Role role, int n) {
+  return {.role = role, .content = absl::StrCat(n, std::string(80, '.'))};
+}
+
+void AddTurns(ContextWindow& window, int first, int count) {
+  for (int i = first; i < first + count; ++i) {
+    window.Add(Say(Message::Role::kUser, i));
+    window.Add(Say(Message::Role::kAssistant, i));
+  }
+}
+
+TEST(ContextWindowTest, KeepsTheNewestTurnsAndThePinnedMessages) {
+  FakeModel model;
+  model.release.Notify();
+  model.summary = absl::UnavailableError("No summaries today");
+  ContextWindow window(model, std::make_shared<NoFetch>(),
+                       {.max_tokens = 200});
+  window.Add({.content = "Answer in French."}, /*pinned=*/true);
+  window.Add({.role = Message::Role::kAssistant, .content = "D'accord."});
+  AddTurns(window, 0, 3);
+  EXPECT_EQ(window.tokens(), 9 + 7 + 6 * 25);
+
+  AddTurns(window, 3, 10);
+  const Message turn = Say(Message::Role::kUser, 13);
+  std::vector<Message> history = window.History({&turn, 1});
+  EXPECT_LE(window.tokens() + EstimateTokens(turn), 200);
+  ASSERT_GE(history.size(), 3);
+  EXPECT_EQ(history[0].content, "Answer in French.");
+  EXPECT_EQ(history[1].role, Message::Role::kUser);
+  EXPECT_EQ(history.back().content,
+            Say(Message::Role::kAssistant, 12).content);
+  EXPECT_GT(window.stats().dropped, 0);
+  EXPECT_EQ(window.stats().summaries, 0);
+}
+
+TEST(ContextWindowTest, SummarizesAheadOfTheCutover) {
+  FakeModel model;
+  ContextWindow window(
+      model, std::make_shared<NoFetch>(),
+      {.max_tokens = 400, .summarize_at = 0.5, .keep = 0.25});
+  AddTurns(window, 0, 4);
+  model.summary_requested.WaitForNotification();
+  // The history is sent in full while the summary is written.
+  const Message turn = Say(Message::Role::kUser, 4);
+  EXPECT_EQ(window.History({&turn, 1}).size(), 8);
+
+  model.release.Notify();
+  absl::SleepFor(absl::Milliseconds(50));
+  AddTurns(window, 4, 4);
+  std::vector<Message> history = window.History({&turn, 1});
+  EXPECT_EQ(window.stats().summaries, 1);
+  EXPECT_EQ(window.stats().dropped, 0);
+  ASSERT_FALSE(history.empty());
+  EXPECT_EQ(history[0].content,
+            "Summary of the conversation so far:\nthe summary");
+  // The summary took the place of the turns that did not fit 100 tokens.
+  EXPECT_EQ(history[1].content, Say(Message::Role::kUser, 2).content);
+  EXPECT_LE(window.tokens(), 400);
+}
+
+TEST(ContextWindowTest, SendsPromptsAsOneConversation) {
+  auto fake = std::make_unique<FakeModel>();
+  FakeModel& model = *fake;
+  ModelHandle chat = WithContextWindow(std::move(fake),
+                                       std::make_shared<NoFetch>(), {},
+                                       /*pin_first_prompt=*/true);
+  NoFetch fetch;
+  EXPECT_EQ(chat->Prompt(fetch, "Hi", {}, {}).value_or(""), "reply 1");
+
+  // Tool rounds join the history with the reply that ends them.
+  model.tool_calls = {{.id = "1", .name = "date", .arguments = "{}"}};
+  std::vector<Message> messages = {{.content = "What day is it?"}};
+  auto reply = chat->Complete(fetch, messages, {}, {});
+  ASSERT_TRUE(reply.ok()) << reply.status();
+  messages.push_back({.role = Message::Role::kAssistant,
+                      .tool_calls = reply->tool_calls});
+  messages.push_back({.role = Message::Role::kTool,
+                      .content = "Monday",
+                      .tool_call_id = "1"});
+  EXPECT_EQ(chat->Complete(fetch, messages, {}, {})->text, "reply 3");
+
+  EXPECT_EQ(chat->Prompt(fetch, "And tomorrow?", {}, {}).value_or(""),
+            "reply 4");
+  const std::vector<std::vector<Message>> requests = model.requests();
+  ASSERT_EQ(requests.size(), 4);
+  EXPECT_EQ(requests[1].size(), 3);
+  const std::vector<Message>& last = requests[3];
+  ASSERT_EQ(last.size(), 7);
+  EXPECT_EQ(last[0].content, "Hi");
+  EXPECT_EQ(last[1].content, "reply 1");
+  EXPECT_EQ(last[4].content, "Monday");
+  EXPECT_EQ(last[5].content, "reply 3");
+  EXPECT_EQ(last[6].content, "And tomorrow?");
+}
+
+TEST(ContextWindowTest, RecordsAnswersCutAtAStop) {
+  auto fake = std::make_unique<FakeModel>();
+  FakeModel& model = *fake;
+  ModelHandle chat =
+      WithContextWindow(std::move(fake), std::make_shared<NoFetch>(), {},
+                        /*pin_first_prompt=*/false);
+  NoFetch fetch;
+  const std::vector<StopCondition> stop = {{.pattern = "ly"}};
+  std::string answer;
+  ASSERT_TRUE(chat->StreamPromptUntil(fetch, "Hi", {}, stop, {},
+                                      [&](std::string_view segment) {
+                                        answer += segment;
+                                      })
+                  .ok());
+  EXPECT_EQ(answer, "rep");
+  EXPECT_EQ(model.stops_seen, 1);
+
+  EXPECT_EQ(chat->Prompt(fetch, "Go on", {}, {}).value_or(""), "reply 2");
+  const std::vector<std::vector<Message>> requests = model.requests();
+  ASSERT_EQ(requests.size(), 2);
+  ASSERT_EQ(requests[1].size(), 3);
+  EXPECT_EQ(requests[1][1].content, "rep");
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,256 @@
+#include "src/daemon.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+#include "src/job_queue.h"
+#include "src/model.h"
+#include "src/render.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+class EchoModel : public Model {
+ public:
+  std::string_view name() const override { return "echo"; }
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options) override {
+    return absl::StrCat("echo: ", prompt);
+  }
+  absl::Status StreamPrompt(
+      const Fetch& fetch, std::string_view prompt,
+      absl::Span<const std::string_view> input_contents,
+      const RequestOptions& options,
+      absl::FunctionRef<void(std::string_view)> on_segment) override {
+    on_segment("echo: ");
+    // Gives the daemon time to notice a client that hung up.
+    absl::SleepFor(absl::Milliseconds(100));
+    if (options.cancellation != nullptr && options.cancellation->cancelled()) {
+      return absl::CancelledError("Cancelled");
+    }
+    on_segment(prompt);
+    return absl::OkStatus();
+  }
+};
+
+class EchoProvider : public ModelProvider {
+ public:
+  std::string_view name() const override { return "Echo"; }
+  absl::StatusOr<ModelHandle> ConnectToModel(
+      std::string_view model) const override {
+    if (model != "echo") {
+      return absl::NotFoundError(model);
+    }
+    return std::make_unique<EchoModel>();
+  }
+  std::vector<std::string> ListModels() const override { return {"echo"}; }
+};
+
+class DaemonTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    providers_.push_back(std::make_unique<EchoProvider>());
+    unlink(journal_.c_str());
+    jobs_ = *JobQueue::Open(journal_);
+    job_runner_ = std::make_unique<JobRunner>(*jobs_, fetch_, providers_, 1);
+    daemon_ = std::make_unique<Daemon>(fetch_, providers_, jobs_.get());
+    server_ =
+        std::thread([this]() { ASSERT_TRUE(daemon_->Serve(socket_).ok()); });
+  }
+
+  void TearDown() override {
+    daemon_->Shutdown();
+    server_.join();
+    job_runner_.reset();
+    jobs_.reset();
+    unlink(journal_.c_str());
+  }
+
+  DaemonClient Connect() {
+    for (int attempt = 0;; ++attempt) {
+      auto client = DaemonClient::Connect(socket_);
+      if (client.ok() || attempt > 100) {
+        return std::move(client).value();
+      }
+      absl::SleepFor(absl::Milliseconds(10));
+    }
+  }
+
+  // Opens a connection that is read and written unchecked.
+  int ConnectRaw() {
+    Connect();
+    sockaddr_un address = {.sun_family = AF_UNIX};
+    std::strcpy(address.sun_path, socket_.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT_EQ(connect(fd, reinterpret_cast<const sockaddr*>(&address),
+                      sizeof(address)),
+              0);
+    return fd;
+  }
+
+  // Sends each of `lines` as a frame, unchecked, on one connection, and
+  // returns the status frame that answers it.
+  std::vector<nlohmann::json> SendRaw(absl::Span<const std::string> lines) {
+    int fd = ConnectRaw();
+    std::vector<nlohmann::json> replies;
+    std::string buffer;
+    for (const std::string& line : lines) {
+      std::string frame = absl::StrCat(line, "\n");
+      EXPECT_EQ(send(fd, frame.data(), frame.size(), MSG_NOSIGNAL),
+                frame.size());
+      size_t end;
+      while ((end = buffer.find('\n')) == std::string::npos) {
+        char chunk[4096];
+        ssize_t read = recv(fd, chunk, sizeof(chunk), 0);
+        if (read <= 0) {
+          close(fd);
+          return replies;
+        }
+        buffer.append(chunk, read);
+      }
+      replies.push_back(nlohmann::json::parse(buffer.substr(0, end)));
+      buffer.erase(0, end + 1);
+    }
+    close(fd);
+    return replies;
+  }
+
+  std::string socket_ =
+      absl::StrCat("/tmp/uchenchat_daemon_test_", getpid(), ".sock");
+  std::string journal_ =
+      absl::StrCat("/tmp/uchenchat_daemon_test_", getpid(), ".journal");
+  NoFetch fetch_;
+  std::vector<std::unique_ptr<ModelProvider>> providers_;
+  std::unique_ptr<JobQueue> jobs_;
+  std::unique_ptr<JobRunner> job_runner_;
+  std::unique_ptr<Daemon> daemon_;
+  std::thread server_;
+};
+
+TEST_F(DaemonTest, AnswersPrompts) {
+  DaemonClient client = Connect();
+  for (std::string_view prompt : {"first", "second\nline"}) {
+    std::ostringstream out;
+    Renderer renderer(out, {.terminal = false});
+    EXPECT_TRUE(
+        client.Prompt("echo", prompt, absl::InfiniteDuration(), renderer).ok());
+    EXPECT_EQ(out.str(), absl::StrCat("echo: ", prompt, "\n"));
+  }
+}
+
+TEST_F(DaemonTest, StreamsToClientsThatStoppedSending) {
+  int fd = ConnectRaw();
+  std::string request = R"({"model":"echo","prompt":"hi"})"
+                        "\n";
+  ASSERT_EQ(send(fd, request.data(), request.size(), MSG_NOSIGNAL),
+            request.size());
+  shutdown(fd, SHUT_WR);
+  std::string reply;
+  char chunk[4096];
+  ssize_t read;
+  while ((read = recv(fd, chunk, sizeof(chunk), 0)) > 0) {
+    reply.append(chunk, read);
+  }
+  close(fd);
+  EXPECT_EQ(reply, "{\"text\":\"echo: \"}\n{\"text\":\"hi\"}\n"
+                   "{\"code\":0,\"error\":\"\"}\n");
+}
+
+TEST_F(DaemonTest, RefusesASocketThatIsServed) {
+  Connect();
+  Daemon other(fetch_, providers_);
+  EXPECT_EQ(other.Serve(socket_).code(),
+            absl::StatusCode::kFailedPrecondition);
+  // The first daemon still serves.
+  std::ostringstream out;
+  Renderer renderer(out, {.terminal = false});
+  EXPECT_TRUE(Connect()
+                  .Prompt("echo", "hi", absl::InfiniteDuration(), renderer)
+                  .ok());
+}
+
+TEST_F(DaemonTest, ReportsErrors) {
+  DaemonClient client = Connect();
+  std::ostringstream out;
+  Renderer renderer(out, {.terminal = false});
+  absl::Status status =
+      client.Prompt("missing", "hi", absl::InfiniteDuration(), renderer);
+  EXPECT_EQ(status.code(), absl::StatusCode::kNotFound);
+  EXPECT_EQ(out.str(), "");
+}
+
+TEST_F(DaemonTest, RejectsMalformedRequests) {
+  const std::vector<std::string> frames = {
+      "[1]", R"("x")", R"({"model":5})", R"({"model":"echo","prompt":[]})",
+      R"({"model":"echo","timeout_ms":"1"})", R"({"list":1})",
+      R"({"poll":"7"})", R"({"fetch":-1})", R"({"submit":"yes"})"};
+  std::vector<nlohmann::json> replies = SendRaw(frames);
+  ASSERT_EQ(replies.size(), frames.size());
+  for (const nlohmann::json& reply : replies) {
+    EXPECT_EQ(reply["code"],
+              static_cast<int>(absl::StatusCode::kInvalidArgument))
+        << reply;
+  }
+  // The daemon still serves.
+  std::ostringstream out;
+  Renderer renderer(out, {.terminal = false});
+  EXPECT_TRUE(Connect()
+                  .Prompt("echo", "hi", absl::InfiniteDuration(), renderer)
+                  .ok());
+}
+
+TEST_F(DaemonTest, ListsModels) {
+  DaemonClient client = Connect();
+  auto providers = client.ListModels();
+  ASSERT_TRUE(providers.ok());
+  ASSERT_EQ(providers->size(), 1);
+  EXPECT_EQ((*providers)[0].provider, "Echo");
+  EXPECT_EQ((*providers)[0].models, std::vector<std::string>{"echo"});
+}
+
+TEST_F(DaemonTest, RunsBackgroundJobs) {
+  DaemonClient client = Connect();
+  auto job = client.Submit("echo", "later");
+  ASSERT_TRUE(job.ok()) << job.status();
+  absl::StatusOr<JobState> state;
+  for (int attempt = 0; attempt < 500; ++attempt) {
+    state = client.Poll(*job);
+    if (!state.ok() || *state == JobState::kDone) {
+      break;
+    }
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  ASSERT_TRUE(state.ok()) << state.status();
+  EXPECT_EQ(*state, JobState::kDone);
+  auto text = client.FetchResult(*job);
+  ASSERT_TRUE(text.ok()) << text.status();
+  EXPECT_EQ(*text, "echo: later");
+  EXPECT_EQ(client.Poll(*job + 1).status().code(), absl::StatusCode::kNotFound);
+}
+
+}  // namespace
+}  // namespace uchen::chat
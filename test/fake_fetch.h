@@ -0,0 +1,85 @@
+#ifndef TEST_FAKE_FETCH_H_
+#define TEST_FAKE_FETCH_H_
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+
+#include "nlohmann/json.hpp"
+#include "src/fetch.h"
+
+namespace uchen::chat {
+
+// Fails every request, for tests of code that must not touch the network.
+class NoFetch : public Fetch {
+ public:
+  absl::StatusOr<Response> Post(const std::string&, absl::Span<const Header>,
+                                const json::Json&,
+                                const RequestOptions&) const override {
+    return absl::UnimplementedError("No network in tests");
+  }
+  absl::StatusOr<Response> Get(const std::string&, absl::Span<const Header>,
+                               const RequestOptions&) const override {
+    return absl::UnimplementedError("No network in tests");
+  }
+};
+
+// Answers every post with `response`, or fails it with its status, and keeps
+// the request bodies. Streamed responses are handed over byte by byte, to
+// cut every line.
+class CannedFetch : public Fetch {
+ public:
+  explicit CannedFetch(absl::StatusOr<std::string> response)
+      : response_(std::move(response)) {}
+
+  absl::StatusOr<Response> Post(const std::string& url,
+                                absl::Span<const Header> headers,
+                                const json::Json& payload,
+                                const RequestOptions& options) const override {
+    return PostJson(url, headers, std::string(payload.dump()), options);
+  }
+  absl::StatusOr<Response> PostJson(const std::string&,
+                                    absl::Span<const Header>,
+                                    std::string_view body,
+                                    const RequestOptions&) const override {
+    requests.push_back(nlohmann::json::parse(body));
+    if (!response_.ok()) {
+      return response_.status();
+    }
+    return Response::FromBody(*response_);
+  }
+  absl::Status PostJsonStream(
+      const std::string&, absl::Span<const Header>, std::string_view body,
+      const RequestOptions&,
+      absl::FunctionRef<bool(std::string_view)> on_data) const override {
+    requests.push_back(nlohmann::json::parse(body));
+    if (!response_.ok()) {
+      return response_.status();
+    }
+    for (const char& c : *response_) {
+      if (!on_data(std::string_view(&c, 1))) {
+        break;
+      }
+    }
+    return absl::OkStatus();
+  }
+  absl::StatusOr<Response> Get(const std::string&, absl::Span<const Header>,
+                               const RequestOptions&) const override {
+    return absl::UnimplementedError("Only posts are canned");
+  }
+
+  mutable std::vector<nlohmann::json> requests;
+
+ private:
+  absl::StatusOr<std::string> response_;
+};
+
+}  // namespace uchen::chat
+
+#endif  // TEST_FAKE_FETCH_H_
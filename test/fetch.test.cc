@@ -0,0 +1,128 @@
+#include "src/fetch.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/status/status.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "curl/curl.h"
+#include "nlohmann/json.hpp"
+#include "src/journal.h"
+#include "src/loadgen.h"
+
+namespace uchen::chat {
+namespace {
+
+class FetchTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    curl_global_init(CURL_GLOBAL_ALL);
+    auto stub = StubServer::Start({.time_to_first_byte = absl::ZeroDuration(),
+                                   .latency = absl::ZeroDuration()});
+    ASSERT_TRUE(stub.ok()) << stub.status();
+    stub_ = *std::move(stub);
+  }
+
+  bool WaitForConnections(size_t count) {
+    absl::Time deadline = absl::Now() + absl::Seconds(5);
+    while (stub_->connections_accepted() < count) {
+      if (absl::Now() > deadline) {
+        return false;
+      }
+      absl::SleepFor(absl::Milliseconds(5));
+    }
+    return true;
+  }
+
+  std::unique_ptr<StubServer> stub_;
+};
+
+TEST_F(FetchTest, RequestsReuseTheWarmConnection) {
+  CurlFetch fetch;
+  std::string url = stub_->api_url() + "/chat/completions";
+  fetch.KeepWarm(url);
+  ASSERT_TRUE(WaitForConnections(1));
+  // Lets the warm-up finish and return the connection to the pool.
+  absl::SleepFor(absl::Milliseconds(100));
+  auto response = fetch.Post(url, {}, {{"model", "m"}}, {});
+  ASSERT_TRUE(response.ok()) << response.status();
+  EXPECT_TRUE(response->Json().ok());
+  EXPECT_EQ(stub_->connections_accepted(), 1);
+}
+
+TEST_F(FetchTest, KeepsRefreshingAnIdleConnection) {
+  CurlFetch fetch;
+  fetch.KeepWarm(stub_->api_url() + "/chat/completions",
+                 absl::Milliseconds(50));
+  absl::SleepFor(absl::Milliseconds(500));
+  EXPECT_GE(stub_->requests_received(), 5);
+  // The refreshes all went over the first connection.
+  EXPECT_EQ(stub_->connections_accepted(), 1);
+}
+
+TEST_F(FetchTest, RecordsRequestsInTheJournal) {
+  EnableRequestJournal(16);
+  CurlFetch fetch;
+  std::string url = stub_->api_url() + "/chat/completions";
+  auto response = fetch.PostJson(url, {}, R"({"model":"m"})", {});
+  ASSERT_TRUE(response.ok()) << response.status();
+  std::vector<JournalRecord> records = GlobalRequestJournal()->Records();
+  ASSERT_FALSE(records.empty());
+  const JournalRecord& record = records.back();
+  EXPECT_EQ(record.method, JournalRecord::kPost);
+  EXPECT_EQ(record.url(), url);
+  EXPECT_EQ(record.http_status, 200);
+  EXPECT_EQ(record.request_body(), R"({"model":"m"})");
+  EXPECT_EQ(record.response_bytes, response->body().size());
+  EXPECT_GT(record.total_time_ns, 0);
+}
+
+TEST_F(FetchTest, CancelsATransferInProgress) {
+  // The headers arrive right away, the body would take 10s.
+  auto slow = StubServer::Start({.time_to_first_byte = absl::ZeroDuration(),
+                                 .latency = absl::Seconds(10)});
+  ASSERT_TRUE(slow.ok()) << slow.status();
+  CurlFetch fetch;
+  Cancellation cancellation;
+  std::thread canceller([&] {
+    absl::SleepFor(absl::Milliseconds(200));
+    cancellation.Cancel();
+  });
+  const absl::Time start = absl::Now();
+  auto response = fetch.Post((*slow)->api_url() + "/chat/completions", {},
+                             {{"model", "m"}},
+                             {.cancellation = &cancellation});
+  canceller.join();
+  EXPECT_EQ(response.status().code(), absl::StatusCode::kCancelled);
+  EXPECT_LT(absl::Now() - start, absl::Seconds(5));
+  EXPECT_EQ(fetch.idle_handles(), 1);
+}
+
+TEST_F(FetchTest, TimesOutAndReusesTheHandle) {
+  auto slow = StubServer::Start({.time_to_first_byte = absl::ZeroDuration(),
+                                 .latency = absl::Seconds(10)});
+  ASSERT_TRUE(slow.ok()) << slow.status();
+  CurlFetch fetch;
+  const absl::Time start = absl::Now();
+  auto response = fetch.Post((*slow)->api_url() + "/chat/completions", {},
+                             {{"model", "m"}},
+                             {.timeout = absl::Milliseconds(200)});
+  EXPECT_EQ(response.status().code(), absl::StatusCode::kDeadlineExceeded);
+  EXPECT_LT(absl::Now() - start, absl::Seconds(5));
+  EXPECT_EQ(fetch.idle_handles(), 1);
+
+  // The handle of the aborted transfer serves the next request.
+  response = fetch.Post(stub_->api_url() + "/chat/completions", {},
+                        {{"model", "m"}}, {.timeout = absl::Seconds(5)});
+  ASSERT_TRUE(response.ok()) << response.status();
+  EXPECT_EQ(fetch.idle_handles(), 1);
+}
+
+}  // namespace
+}  // namespace uchen::chat
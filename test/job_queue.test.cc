@@ -0,0 +1,186 @@
+#include "src/job_queue.h"
+
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+class UpperCaseModel : public Model {
+ public:
+  explicit UpperCaseModel(std::atomic<int>& calls) : calls_(calls) {}
+
+  std::string_view name() const override { return "upper"; }
+
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& /* fetch */, std::string_view prompt,
+      absl::Span<const std::string_view> /* input_contents */,
+      const RequestOptions& /* options */) override {
+    ++calls_;
+    std::string response(prompt);
+    for (char& c : response) {
+      c = std::toupper(c);
+    }
+    return response;
+  }
+
+ private:
+  std::atomic<int>& calls_;
+};
+
+class UpperCaseProvider : public ModelProvider {
+ public:
+  std::string_view name() const override { return "test"; }
+  absl::StatusOr<ModelHandle> ConnectToModel(
+      std::string_view model) const override {
+    if (model != "upper") {
+      return absl::NotFoundError(absl::StrCat("No model ", model));
+    }
+    return std::make_unique<UpperCaseModel>(calls);
+  }
+  std::vector<std::string> ListModels() const override { return {"upper"}; }
+
+  mutable std::atomic<int> calls = 0;
+};
+
+class JobQueueTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = absl::StrCat(::testing::TempDir(), "/jobs_", getpid(), ".journal");
+    unlink(path_.c_str());
+  }
+  void TearDown() override { unlink(path_.c_str()); }
+
+  std::unique_ptr<JobQueue> Open() {
+    auto queue = JobQueue::Open(path_);
+    EXPECT_TRUE(queue.ok()) << queue.status();
+    return queue.ok() ? *std::move(queue) : nullptr;
+  }
+
+  JobState WaitForJob(JobQueue& queue, uint64_t id) {
+    absl::Time deadline = absl::Now() + absl::Seconds(5);
+    while (absl::Now() < deadline) {
+      JobState state = queue.Get(id)->state;
+      if (state == JobState::kDone || state == JobState::kFailed) {
+        return state;
+      }
+      absl::SleepFor(absl::Milliseconds(5));
+    }
+    return queue.Get(id)->state;
+  }
+
+  std::string path_;
+};
+
+TEST_F(JobQueueTest, OutcomesSurviveReopening) {
+  {
+    auto queue = Open();
+    ASSERT_EQ(*queue->Submit("m", "first"), 1);
+    ASSERT_EQ(*queue->Submit("m", "second"), 2);
+    ASSERT_EQ(*queue->Submit("m", "third"), 3);
+    ASSERT_EQ(queue->Claim()->id, 1);
+    ASSERT_TRUE(queue->Finish(1, "answer").ok());
+    ASSERT_EQ(queue->Claim()->id, 2);
+    ASSERT_TRUE(queue->Finish(2, absl::InternalError("broken")).ok());
+    // The third job is claimed but the process dies before it finishes.
+    ASSERT_EQ(queue->Claim()->id, 3);
+  }
+  auto queue = Open();
+  EXPECT_EQ(queue->Get(1)->state, JobState::kDone);
+  EXPECT_EQ(queue->Get(1)->result, "answer");
+  EXPECT_EQ(queue->Get(2)->status, absl::InternalError("broken"));
+  EXPECT_EQ(queue->Get(3)->state, JobState::kPending);
+  std::optional<Job> job = queue->Claim();
+  EXPECT_EQ(job->id, 3);
+  EXPECT_EQ(job->prompt, "third");
+  EXPECT_EQ(*queue->Submit("m", "fourth"), 4);
+}
+
+TEST_F(JobQueueTest, DropsARecordCutShortByACrash) {
+  {
+    auto queue = Open();
+    ASSERT_EQ(*queue->Submit("m", "kept"), 1);
+  }
+  {
+    std::ofstream journal(path_, std::ios::app);
+    journal << R"({"op":"done","id":1,"res)";
+  }
+  {
+    auto queue = Open();
+    EXPECT_EQ(queue->Get(1)->state, JobState::kPending);
+    ASSERT_EQ(*queue->Submit("m", "after"), 2);
+  }
+  auto queue = Open();
+  EXPECT_EQ(queue->Get(2)->prompt, "after");
+}
+
+TEST_F(JobQueueTest, SkipsRecordsOfTheWrongShape) {
+  {
+    auto queue = Open();
+    ASSERT_EQ(*queue->Submit("m", "kept"), 1);
+  }
+  {
+    std::ofstream journal(path_, std::ios::app);
+    journal << R"({"op":"submit","id":2,"model":5,"prompt":"p"})" << "\n"
+            << R"({"op":7,"id":1})" << "\n"
+            << R"({"op":"done","id":1,"result":["a"]})" << "\n"
+            << R"({"op":"failed","id":1,"code":"2","error":"e"})" << "\n";
+  }
+  auto queue = Open();
+  EXPECT_EQ(queue->Get(1)->state, JobState::kPending);
+  EXPECT_FALSE(queue->Get(2).has_value());
+}
+
+TEST_F(JobQueueTest, CancelledJobsStayPending) {
+  auto queue = Open();
+  ASSERT_EQ(*queue->Submit("m", "p"), 1);
+  ASSERT_EQ(queue->Claim()->id, 1);
+  EXPECT_TRUE(queue->Finish(1, absl::CancelledError("shutdown")).ok());
+  EXPECT_EQ(queue->Get(1)->state, JobState::kPending);
+  EXPECT_EQ(queue->Claim()->id, 1);
+}
+
+TEST_F(JobQueueTest, RunnerDoesNotRepeatFinishedJobs) {
+  NoFetch fetch;
+  std::array<std::unique_ptr<ModelProvider>, 1> providers = {
+      std::make_unique<UpperCaseProvider>()};
+  auto* provider = static_cast<UpperCaseProvider*>(providers[0].get());
+  {
+    auto queue = Open();
+    JobRunner runner(*queue, fetch, providers, 2);
+    auto hello = queue->Submit("upper", "hello");
+    auto missing = queue->Submit("missing", "hello");
+    EXPECT_EQ(WaitForJob(*queue, *hello), JobState::kDone);
+    EXPECT_EQ(WaitForJob(*queue, *missing), JobState::kFailed);
+    EXPECT_EQ(queue->Get(*hello)->result, "HELLO");
+  }
+  EXPECT_EQ(provider->calls, 1);
+  auto queue = Open();
+  JobRunner runner(*queue, fetch, providers, 2);
+  auto next = queue->Submit("upper", "again");
+  EXPECT_EQ(WaitForJob(*queue, *next), JobState::kDone);
+  EXPECT_EQ(provider->calls, 2);
+}
+
+}  // namespace
+}  // namespace uchen::chat
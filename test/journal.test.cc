@@ -0,0 +1,123 @@
+#include "src/journal.h"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+
+#include "nlohmann/json.hpp"
+
+namespace uchen::chat {
+namespace {
+
+JournalEntry Entry(const std::string& url, const std::string& body) {
+  return {.method = JournalRecord::kPost,
+          .url = url,
+          .request_body = body,
+          .request_bytes = body.size(),
+          .response_body = R"({"ok":true})",
+          .start = absl::FromUnixSeconds(1700000000),
+          .time_to_first_byte = absl::Milliseconds(20),
+          .total_time = absl::Milliseconds(50),
+          .http_status = 200};
+}
+
+TEST(RequestJournalTest, KeepsTheNewestRequestsTruncated) {
+  RequestJournal journal(4);
+  const std::string long_body(3000, 'x');
+  for (int i = 0; i < 6; ++i) {
+    journal.Record(Entry(absl::StrCat("https://api/", i), long_body));
+  }
+  std::vector<JournalRecord> records = journal.Records();
+  ASSERT_EQ(records.size(), 4);
+  EXPECT_EQ(records.front().sequence, 2);
+  EXPECT_EQ(records.front().url(), "https://api/2");
+  EXPECT_EQ(records.back().url(), "https://api/5");
+  EXPECT_EQ(records.back().request_body().size(), JournalRecord::kMaxBody);
+  EXPECT_EQ(records.back().request_bytes, long_body.size());
+  EXPECT_EQ(records.back().response_body(), R"({"ok":true})");
+  EXPECT_EQ(journal.dropped(), 0);
+}
+
+TEST(RequestJournalTest, RoundTripsThroughTheFile) {
+  RequestJournal journal(8);
+  journal.Record(Entry("https://api/chat", "{\"prompt\":\"h\xc3\xa9\"}"));
+  // Cuts the two bytes of "é" in half.
+  journal.Record(Entry("https://api/chat",
+                       std::string(JournalRecord::kMaxBody - 1, 'a') + "é"));
+  const std::string path = ::testing::TempDir() + "/requests.journal";
+  ASSERT_TRUE(journal.Write(path).ok());
+  auto records = ReadRequestJournal(path);
+  ASSERT_TRUE(records.ok()) << records.status();
+  ASSERT_EQ(records->size(), 2);
+
+  auto line = nlohmann::json::parse(FormatJournalRecord((*records)[0]));
+  EXPECT_EQ(line["method"], "POST");
+  EXPECT_EQ(line["url"], "https://api/chat");
+  EXPECT_EQ(line["http_status"], 200);
+  EXPECT_EQ(line["start"], "2023-11-14T22:13:20+00:00");
+  EXPECT_EQ(line["time_to_first_byte_ms"], 20);
+  EXPECT_EQ(line["total_time_ms"], 50);
+  EXPECT_EQ(line["request_body"], "{\"prompt\":\"h\xc3\xa9\"}");
+  EXPECT_FALSE(line.contains("error"));
+  line = nlohmann::json::parse(FormatJournalRecord((*records)[1]));
+  EXPECT_EQ(line["request_body"].get<std::string>().substr(
+                JournalRecord::kMaxBody - 1),
+            "\xef\xbf\xbd");
+
+  EXPECT_EQ(
+      ReadRequestJournal(::testing::TempDir() + "/missing").status().code(),
+      absl::StatusCode::kNotFound);
+}
+
+TEST(RequestJournalTest, RejectsCountsBeyondTheFile) {
+  RequestJournal journal(8);
+  journal.Record(Entry("https://api/chat", "{}"));
+  const std::string path = ::testing::TempDir() + "/corrupt.journal";
+  ASSERT_TRUE(journal.Write(path).ok());
+  {
+    // The record count follows the magic and the record size.
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(12);
+    const uint32_t count = 0xffffffff;
+    file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  }
+  EXPECT_EQ(ReadRequestJournal(path).status().code(),
+            absl::StatusCode::kDataLoss);
+}
+
+TEST(RequestJournalTest, RecordsFromManyThreads) {
+  RequestJournal journal(64);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&journal, i]() {
+      const std::string url = absl::StrCat("https://api/", i);
+      const std::string body(100 + i, 'a' + i);
+      for (int j = 0; j < 5000; ++j) {
+        journal.Record(Entry(url, body));
+      }
+    });
+  }
+  // Reading while the threads write sees no torn records.
+  for (int reads = 0; reads < 100; ++reads) {
+    for (const JournalRecord& record : journal.Records()) {
+      const int thread = record.url().back() - '0';
+      ASSERT_EQ(record.request_body(),
+                std::string(100 + thread, 'a' + thread));
+    }
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(journal.Records().size(), 64);
+}
+
+}  // namespace
+}  // namespace uchen::chat
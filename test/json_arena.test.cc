@@ -0,0 +1,110 @@
+#include "src/json_arena.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <string_view>
+
+#include <gtest/gtest.h>
+
+#include "nlohmann/json.hpp"
+
+namespace {
+
+std::atomic_int heap_allocations = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size)) {
+    return p;
+  }
+  std::abort();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t /* size */) noexcept { std::free(p); }
+
+namespace uchen::json {
+namespace {
+
+constexpr std::string_view kResponse = R"({
+  "id": "chatcmpl-123",
+  "choices": [{
+    "index": 0,
+    "message": {"role": "assistant", "content": "A reply long enough to not fit into the small string buffer."},
+    "finish_reason": "stop"
+  }],
+  "usage": {"prompt_tokens": 9, "completion_tokens": 12, "total_tokens": 21}
+})";
+
+TEST(JsonArenaTest, ScopesNest) {
+  EXPECT_EQ(CurrentArenaResource(), nullptr);
+  Arena outer;
+  ArenaScope outer_scope(outer);
+  EXPECT_EQ(CurrentArenaResource(), outer.resource());
+  {
+    Arena inner;
+    ArenaScope inner_scope(inner);
+    EXPECT_EQ(CurrentArenaResource(), inner.resource());
+  }
+  EXPECT_EQ(CurrentArenaResource(), outer.resource());
+}
+
+TEST(JsonArenaTest, NodesInScopeDoNotTouchTheHeap) {
+  Arena arena;
+  ArenaScope scope(arena);
+  Json request;
+  int before = heap_allocations.load();
+  request["model"] = "some-model-with-a-long-name";
+  request["max_tokens"] = 1024;
+  Json& message = request["messages"][0];
+  message["role"] = "user";
+  message["content"] = "A prompt that does not fit into SSO.";
+  EXPECT_EQ(heap_allocations.load(), before);
+}
+
+// nlohmann's parser keeps its scratch stacks on the heap, the document itself
+// goes to the arena.
+TEST(JsonArenaTest, ParsingAllocatesLessFromTheHeap) {
+  int before = heap_allocations.load();
+  {
+    nlohmann::json plain = nlohmann::json::parse(kResponse, nullptr, false);
+    ASSERT_FALSE(plain.is_discarded());
+  }
+  int plain_allocations = heap_allocations.load() - before;
+  Arena arena;
+  ArenaScope scope(arena);
+  before = heap_allocations.load();
+  {
+    Json json = Json::parse(kResponse, nullptr, false);
+    ASSERT_FALSE(json.is_discarded());
+  }
+  EXPECT_LT((heap_allocations.load() - before) * 2, plain_allocations);
+}
+
+TEST(JsonArenaTest, ValuesMayCrossScopes) {
+  Json heap_value = Json::parse(kResponse, nullptr, false);
+  {
+    Arena arena;
+    ArenaScope scope(arena);
+    Json arena_value = heap_value;
+    EXPECT_EQ(arena_value, heap_value);
+    // Allocated on the heap, freed inside the scope.
+    heap_value = nullptr;
+  }
+  heap_value["key"] = "value";
+  EXPECT_EQ(heap_value.dump(), R"({"key":"value"})");
+}
+
+TEST(JsonArenaTest, ConvertsFromPlainJson) {
+  nlohmann::json plain = {{"error", {{"code", 404}, {"message", "Not Found"}}}};
+  Json json = plain;
+  EXPECT_EQ(std::string_view(json.dump()), plain.dump());
+  EXPECT_EQ(json["error"]["message"].get<std::string>(), "Not Found");
+}
+
+}  // namespace
+}  // namespace uchen::json
@@ -0,0 +1,123 @@
+#include "src/json_template.h"
+
+#include <random>
+#include <string>
+#include <string_view>
+
+#include <gtest/gtest.h>
+
+#include "absl/flags/flag.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+
+#include "nlohmann/json.hpp"
+#include "src/anthropic.h"
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/openai.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+std::string Escape(std::string_view text) {
+  std::string out;
+  json::AppendJsonString(out, text);
+  return out;
+}
+
+TEST(AppendJsonStringTest, MatchesNlohmann) {
+  // Plain text, every escape, and UTF-8 of two, three and four bytes, at
+  // every offset from the vector boundaries.
+  constexpr std::string_view kPieces[] = {
+      "a", "Z", " ", "/", "\"", "\\", "\n", "\t", "\r", "\b", "\f",
+      std::string_view("\0", 1), "\x1f", "\x7f", "\xc3\xa9", "\xe2\x82\xac",
+      "\xf0\x9f\x98\x80"};
+  std::mt19937 rng(3);
+  std::uniform_int_distribution<size_t> piece(0, std::size(kPieces) - 1);
+  for (size_t length = 0; length < 100; ++length) {
+    std::string text;
+    for (size_t i = 0; i < length; ++i) {
+      text += kPieces[piece(rng)];
+    }
+    EXPECT_EQ(Escape(text), nlohmann::json(text).dump())
+        << json::JsonEscapeKernelName() << " with " << length << " pieces";
+  }
+}
+
+TEST(AppendJsonStringTest, ReplacesInvalidUtf8) {
+  constexpr std::string_view kReplacement = "\xef\xbf\xbd";
+  EXPECT_EQ(Escape("a\xff" "b"), absl::StrCat("\"a", kReplacement, "b\""));
+  // A sequence cut short by the end of the text.
+  EXPECT_EQ(Escape(std::string(20, 'x') + "\xe2\x82"),
+            absl::StrCat("\"", std::string(20, 'x'), kReplacement,
+                         kReplacement, "\""));
+  // Overlong encoding of '/' and an encoded surrogate.
+  EXPECT_EQ(Escape("\xc0\xaf"), absl::StrCat("\"", kReplacement,
+                                             kReplacement, "\""));
+  EXPECT_EQ(Escape("\xed\xa0\x80"),
+            absl::StrCat("\"", kReplacement, kReplacement, kReplacement,
+                         "\""));
+}
+
+TEST(JsonTemplateTest, SplicesTheVariableMember) {
+  json::JsonTemplate with_members({{"model", "m"}, {"max_tokens", 8}},
+                                  "messages");
+  EXPECT_EQ(with_members.Render([](std::string& out) { out += "[1,2]"; }),
+            R"({"max_tokens":8,"model":"m","messages":[1,2]})");
+  json::JsonTemplate empty(nlohmann::json::object(), "value");
+  EXPECT_EQ(empty.Render([](std::string& out) { out += "null"; }),
+            R"({"value":null})");
+}
+
+class RequestBodyTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    absl::SetFlag(&FLAGS_openai_api_key, "key");
+    absl::SetFlag(&FLAGS_anthropic_api_key, "key");
+  }
+
+  nlohmann::json Send(const ModelProvider& provider,
+                      std::string_view model_name) {
+    auto model = provider.ConnectToModel(model_name);
+    EXPECT_TRUE(model.ok()) << model.status();
+    EXPECT_EQ((*model)->Complete(fetch_, kConversation, {}, {}).status().code(),
+              absl::StatusCode::kUnavailable);
+    return fetch_.requests.back();
+  }
+
+  const Message kConversation[3] = {
+      {.content = "Say \"hi\"\n\tplease"},
+      {.role = Message::Role::kAssistant, .content = "hi \xc3\xa9"},
+      {.content = "\x01 and \\"},
+  };
+  CannedFetch fetch_{absl::UnavailableError("Captured")};
+  char* env_[1] = {nullptr};
+  Parameters parameters_{64, env_};
+};
+
+TEST_F(RequestBodyTest, OpenAIRequestFromTheTemplate) {
+  auto provider = MakeOpenAIModelProvider(nullptr, parameters_);
+  EXPECT_EQ(Send(*provider, "gpt-4o"),
+            nlohmann::json::parse(R"({
+              "model": "gpt-4o", "max_tokens": 64, "messages": [
+                {"role": "user", "content": "Say \"hi\"\n\tplease"},
+                {"role": "assistant", "content": "hi é"},
+                {"role": "user", "content": "\u0001 and \\"}]})"));
+}
+
+TEST_F(RequestBodyTest, AnthropicRequestFromTheTemplate) {
+  auto provider = MakeAnthropicModelProvider(nullptr, parameters_);
+  EXPECT_EQ(Send(*provider, "claude-model"),
+            nlohmann::json::parse(R"({
+              "model": "claude-model", "max_tokens": 64, "messages": [
+                {"role": "user", "content": "Say \"hi\"\n\tplease"},
+                {"role": "assistant",
+                 "content": [{"type": "text", "text": "hi é"}]},
+                {"role": "user", "content": "\u0001 and \\"}]})"));
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,289 @@
+#include "src/llama.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/types/span.h"
+
+#include "src/context_window.h"
+#include "src/fetch.h"
+#include "src/local_model.h"
+#include "src/model.h"
+#include "src/q8.h"
+#include "src/thread_pool.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr LlamaConfig kConfig = {
+    .dim = 32,
+    .hidden_dim = 64,
+    .n_layers = 2,
+    .n_heads = 4,
+    .n_kv_heads = 2,
+    .vocab_size = 267,
+    .seq_len = 24,
+    .group_size = 16,
+};
+
+// Pieces after the three special tokens and the 256 byte tokens, with their
+// merge scores.
+constexpr std::pair<std::string_view, float> kPieces[] = {
+    {" ", 0}, {"a", 0}, {"b", 0},  {"c", 0},
+    {" a", 1}, {"ab", 2}, {" ab", 3}, {"bc", 0},
+};
+
+class Writer {
+ public:
+  explicit Writer(const std::string& path)
+      : file_(path, std::ios::binary | std::ios::trunc) {}
+
+  template <typename T>
+  void Write(const T& value) {
+    file_.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void WriteBytes(std::string_view bytes) {
+    file_.write(bytes.data(), bytes.size());
+  }
+
+ private:
+  std::ofstream file_;
+};
+
+// Writes a checkpoint with random weights in the llama2.c int8 format.
+void WriteCheckpoint(const std::string& path, const LlamaConfig& config) {
+  std::mt19937 rng(7);
+  std::normal_distribution<float> normal(0, 0.5);
+  Writer writer(path);
+  writer.Write(uint32_t{0x616b3432});
+  writer.Write(int32_t{2});
+  for (size_t dim : {config.dim, config.hidden_dim, config.n_layers,
+                     config.n_heads, config.n_kv_heads, config.vocab_size,
+                     config.seq_len}) {
+    writer.Write(static_cast<int32_t>(dim));
+  }
+  writer.Write(uint8_t{1});
+  writer.Write(static_cast<int32_t>(config.group_size));
+  writer.WriteBytes(std::string(256 - 41, '\0'));
+  for (size_t i = 0; i < (2 * config.n_layers + 1) * config.dim; ++i) {
+    writer.Write(1.0f + normal(rng) / 10);
+  }
+  auto write_q8 = [&](size_t n) {
+    std::vector<float> values(n);
+    for (float& value : values) {
+      value = normal(rng);
+    }
+    std::vector<int8_t> q(n);
+    std::vector<float> s(n / config.group_size);
+    QuantizeQ8(values.data(), n, config.group_size, q.data(), s.data());
+    writer.WriteBytes(
+        std::string_view(reinterpret_cast<const char*>(q.data()), n));
+    for (float scale : s) {
+      writer.Write(scale);
+    }
+  };
+  write_q8(config.vocab_size * config.dim);
+  for (size_t n : {config.dim * config.dim, config.dim * config.kv_dim(),
+                   config.dim * config.kv_dim(), config.dim * config.dim,
+                   config.dim * config.hidden_dim,
+                   config.hidden_dim * config.dim,
+                   config.dim * config.hidden_dim}) {
+    for (size_t layer = 0; layer < config.n_layers; ++layer) {
+      write_q8(n);
+    }
+  }
+}
+
+void WriteTokenizer(const std::string& path) {
+  std::vector<std::pair<std::string, float>> pieces = {
+      {"<unk>", 0}, {"\n<s>\n", 0}, {"\n</s>\n", 0}};
+  for (int byte = 0; byte < 256; ++byte) {
+    pieces.emplace_back(absl::StrFormat("<0x%02X>", byte), 0);
+  }
+  for (const auto& [text, score] : kPieces) {
+    pieces.emplace_back(text, score);
+  }
+  Writer writer(path);
+  writer.Write(int32_t{8});
+  for (const auto& [text, score] : pieces) {
+    writer.Write(score);
+    writer.Write(static_cast<int32_t>(text.size()));
+    writer.WriteBytes(text);
+  }
+}
+
+int PieceId(std::string_view text) {
+  for (size_t i = 0; i < std::size(kPieces); ++i) {
+    if (kPieces[i].first == text) {
+      return 259 + i;
+    }
+  }
+  return -1;
+}
+
+class LlamaTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = absl::StrCat(::testing::TempDir(), "/llama_", getpid());
+    mkdir(dir_.c_str(), 0700);
+    checkpoint_path_ = dir_ + "/model.bin";
+    tokenizer_path_ = dir_ + "/tokenizer.bin";
+    WriteCheckpoint(checkpoint_path_, kConfig);
+    WriteTokenizer(tokenizer_path_);
+    auto weights = LlamaWeights::Load(checkpoint_path_);
+    ASSERT_TRUE(weights.ok()) << weights.status();
+    weights_ = *std::move(weights);
+  }
+
+  void TearDown() override {
+    std::remove(checkpoint_path_.c_str());
+    std::remove(tokenizer_path_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  std::string dir_;
+  std::string checkpoint_path_;
+  std::string tokenizer_path_;
+  std::shared_ptr<const LlamaWeights> weights_;
+};
+
+TEST_F(LlamaTest, LoadsTheHeader) {
+  const LlamaConfig& config = weights_->config();
+  EXPECT_EQ(config.dim, kConfig.dim);
+  EXPECT_EQ(config.n_kv_heads, kConfig.n_kv_heads);
+  EXPECT_EQ(config.vocab_size, kConfig.vocab_size);
+  EXPECT_EQ(config.group_size, kConfig.group_size);
+  EXPECT_TRUE(config.shared_classifier);
+}
+
+TEST_F(LlamaTest, RejectsOtherFiles) {
+  Writer(tokenizer_path_).WriteBytes(std::string(1024, 'x'));
+  EXPECT_EQ(LlamaWeights::Load(tokenizer_path_).status().code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // The header of the checkpoint without the weights.
+  {
+    std::ifstream in(checkpoint_path_, std::ios::binary);
+    std::string header(300, '\0');
+    in.read(header.data(), header.size());
+    Writer(tokenizer_path_).WriteBytes(header);
+  }
+  EXPECT_EQ(LlamaWeights::Load(tokenizer_path_).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(LlamaTest, TokenizerMergesTheBestPairsFirst) {
+  auto tokenizer = LlamaTokenizer::Load(tokenizer_path_, kConfig.vocab_size);
+  ASSERT_TRUE(tokenizer.ok()) << tokenizer.status();
+  const int ab = PieceId(" ab");
+  EXPECT_EQ(tokenizer->Encode("ab ab"),
+            (std::vector<int>{LlamaTokenizer::kBos, ab, ab}));
+  EXPECT_EQ(tokenizer->Decode(LlamaTokenizer::kBos, ab), "ab");
+  EXPECT_EQ(tokenizer->Decode(ab, ab), " ab");
+
+  // Characters without a piece fall back to their bytes.
+  std::vector<int> tokens = tokenizer->Encode("\xc3\xa9");
+  ASSERT_EQ(tokens.size(), 4);
+  EXPECT_EQ(tokens[1], PieceId(" "));
+  EXPECT_EQ(tokenizer->Decode(tokens[1], tokens[2]), "\xc3");
+  EXPECT_EQ(tokenizer->Decode(tokens[2], tokens[3]), "\xa9");
+}
+
+TEST_F(LlamaTest, ThreadsDoNotChangeTheLogits) {
+  ThreadPool pool(3);
+  LlamaSession single(weights_, nullptr);
+  LlamaSession threaded(weights_, &pool);
+  std::vector<int> tokens = {1, 260, 261, 262, 265};
+  absl::Span<const float> logits = single.Prefill(tokens);
+  std::vector<float> expected(logits.begin(), logits.end());
+  logits = threaded.Prefill(tokens);
+  EXPECT_EQ(std::vector<float>(logits.begin(), logits.end()), expected);
+  logits = single.Append(263);
+  expected.assign(logits.begin(), logits.end());
+  logits = threaded.Append(263);
+  EXPECT_EQ(std::vector<float>(logits.begin(), logits.end()), expected);
+}
+
+TEST_F(LlamaTest, PrefillReusesTheCachedPrefix) {
+  LlamaSession fresh(weights_, nullptr);
+  std::vector<int> tokens = {1, 260, 261, 262, 265, 266, 259};
+  absl::Span<const float> logits = fresh.Prefill(tokens);
+  std::vector<float> expected(logits.begin(), logits.end());
+
+  LlamaSession reused(weights_, nullptr);
+  reused.Prefill(absl::MakeConstSpan(tokens).subspan(0, 4));
+  reused.Append(264);
+  logits = reused.Prefill(tokens);
+  EXPECT_EQ(std::vector<float>(logits.begin(), logits.end()), expected);
+  EXPECT_EQ(reused.tokens(), tokens);
+}
+
+TEST_F(LlamaTest, LocalModelProviderServesLocalPrefix) {
+  char* envp[] = {nullptr};
+  auto provider = MakeLocalModelProvider(Parameters(8, envp));
+  EXPECT_EQ(provider->ConnectToModel("gpt-4o").status().code(),
+            absl::StatusCode::kNotFound);
+  EXPECT_FALSE(provider->ConnectToModel("local:/does/not/exist.bin").ok());
+
+  auto model =
+      provider->ConnectToModel(absl::StrCat("local:", checkpoint_path_));
+  ASSERT_TRUE(model.ok()) << model.status();
+  NoFetch fetch;
+  auto first = (*model)->Prompt(fetch, "ab", {}, {});
+  ASSERT_TRUE(first.ok()) << first.status();
+  auto second = (*model)->Prompt(fetch, "ab", {}, {});
+  ASSERT_TRUE(second.ok()) << second.status();
+  EXPECT_EQ(*first, *second);
+
+  Cancellation cancellation;
+  cancellation.Cancel();
+  EXPECT_EQ(
+      (*model)->Prompt(fetch, "ab", {}, {.cancellation = &cancellation})
+          .status()
+          .code(),
+      absl::StatusCode::kCancelled);
+}
+
+TEST_F(LlamaTest, LocalModelKeepsAConversation) {
+  char* envp[] = {nullptr};
+  auto model = MakeLocalModelProvider(Parameters(4, envp))
+                   ->ConnectToModel(absl::StrCat("local:", checkpoint_path_));
+  ASSERT_TRUE(model.ok()) << model.status();
+  auto fetch = std::make_shared<NoFetch>();
+  EXPECT_EQ((*model)
+                ->Complete(*fetch, {{.content = "ab"}},
+                           {{.name = "tool", .parameters = "{}"}}, {})
+                .status()
+                .code(),
+            absl::StatusCode::kUnimplemented);
+
+  // The history is cut to what fits the 24 token context of the checkpoint,
+  // and the summaries it asks for do not fit at all.
+  ModelHandle chat =
+      WithContextWindow(*std::move(model), fetch, {.max_tokens = 16});
+  for (std::string_view prompt : {"ab", "ab ab", "ab"}) {
+    auto response = chat->Prompt(*fetch, prompt, {}, {});
+    EXPECT_TRUE(response.ok()) << response.status();
+  }
+}
+
+}  // namespace
+}  // namespace uchen::chat
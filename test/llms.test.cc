@@ -0,0 +1,141 @@
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/flags/flag.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+
+#include "nlohmann/json.hpp"
+#include "src/anthropic.h"
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/openai.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+const std::vector<ToolSpec> kTools = {
+    {.name = "weather",
+     .description = "Current weather of a city.",
+     .parameters = R"({"type":"object","properties":{"city":{}}})"}};
+
+// A turn that called the weather tool and got its result.
+const std::vector<Message> kToolRound = {
+    {.content = "Is it sunny in Paris?"},
+    {.role = Message::Role::kAssistant,
+     .tool_calls = {{.id = "call_1",
+                     .name = "weather",
+                     .arguments = R"({"city":"Paris"})"}}},
+    {.role = Message::Role::kTool,
+     .content = "Sunny",
+     .tool_call_id = "call_1"},
+};
+
+class LlmsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    absl::SetFlag(&FLAGS_openai_api_url, "http://canned");
+    absl::SetFlag(&FLAGS_openai_api_key, "key");
+    absl::SetFlag(&FLAGS_anthropic_api_url, "http://canned");
+    absl::SetFlag(&FLAGS_anthropic_api_key, "key");
+  }
+
+  ModelHandle Connect(const ModelProvider& provider, std::string_view model) {
+    auto handle = provider.ConnectToModel(model);
+    EXPECT_TRUE(handle.ok()) << handle.status();
+    return *std::move(handle);
+  }
+
+  char* env_[1] = {nullptr};
+  Parameters parameters_{64, env_};
+};
+
+TEST_F(LlmsTest, OpenAIToolCalls) {
+  auto fetch = std::make_shared<CannedFetch>(R"({"choices": [{
+      "finish_reason": "tool_calls",
+      "message": {"role": "assistant", "content": null, "tool_calls": [{
+          "id": "call_2", "type": "function",
+          "function": {"name": "weather",
+                       "arguments": "{\"city\":\"Lyon\"}"}}]}}]})");
+  ModelHandle model =
+      Connect(*MakeOpenAIModelProvider(fetch, parameters_), "gpt-4o");
+  auto reply = model->Complete(*fetch, kToolRound, kTools, {});
+  ASSERT_TRUE(reply.ok()) << reply.status();
+  EXPECT_EQ(reply->text, "");
+  ASSERT_EQ(reply->tool_calls.size(), 1);
+  EXPECT_EQ(reply->tool_calls[0].id, "call_2");
+  EXPECT_EQ(reply->tool_calls[0].name, "weather");
+  EXPECT_EQ(reply->tool_calls[0].arguments, R"({"city":"Lyon"})");
+
+  ASSERT_EQ(fetch->requests.size(), 1);
+  const nlohmann::json& request = fetch->requests[0];
+  EXPECT_EQ(request["tools"][0]["function"]["parameters"]["type"], "object");
+  const nlohmann::json& messages = request["messages"];
+  ASSERT_EQ(messages.size(), 3);
+  EXPECT_TRUE(messages[1]["content"].is_null());
+  EXPECT_EQ(messages[1]["tool_calls"][0]["id"], "call_1");
+  EXPECT_EQ(messages[1]["tool_calls"][0]["function"]["arguments"],
+            R"({"city":"Paris"})");
+  EXPECT_EQ(messages[2]["role"], "tool");
+  EXPECT_EQ(messages[2]["tool_call_id"], "call_1");
+  EXPECT_EQ(messages[2]["content"], "Sunny");
+}
+
+TEST_F(LlmsTest, AnthropicToolUse) {
+  auto fetch = std::make_shared<CannedFetch>(R"({
+      "stop_reason": "tool_use",
+      "content": [
+          {"type": "text", "text": "Checking."},
+          {"type": "tool_use", "id": "toolu_2", "name": "weather",
+           "input": {"city": "Lyon"}}]})");
+  ModelHandle model = Connect(*MakeAnthropicModelProvider(fetch, parameters_),
+                              "claude-model");
+  auto reply = model->Complete(*fetch, kToolRound, kTools, {});
+  ASSERT_TRUE(reply.ok()) << reply.status();
+  EXPECT_EQ(reply->text, "Checking.");
+  ASSERT_EQ(reply->tool_calls.size(), 1);
+  EXPECT_EQ(reply->tool_calls[0].id, "toolu_2");
+  EXPECT_EQ(reply->tool_calls[0].name, "weather");
+  EXPECT_EQ(reply->tool_calls[0].arguments, R"({"city":"Lyon"})");
+
+  ASSERT_EQ(fetch->requests.size(), 1);
+  const nlohmann::json& request = fetch->requests[0];
+  EXPECT_EQ(request["tools"][0]["input_schema"]["type"], "object");
+  const nlohmann::json& messages = request["messages"];
+  ASSERT_EQ(messages.size(), 3);
+  const nlohmann::json& tool_use = messages[1]["content"][0];
+  EXPECT_EQ(tool_use["type"], "tool_use");
+  EXPECT_EQ(tool_use["id"], "call_1");
+  EXPECT_EQ(tool_use["input"]["city"], "Paris");
+  const nlohmann::json& tool_result = messages[2]["content"][0];
+  EXPECT_EQ(messages[2]["role"], "user");
+  EXPECT_EQ(tool_result["type"], "tool_result");
+  EXPECT_EQ(tool_result["tool_use_id"], "call_1");
+  EXPECT_EQ(tool_result["content"], "Sunny");
+}
+
+TEST_F(LlmsTest, RejectsToolsThatAreNotJson) {
+  auto fetch = std::make_shared<CannedFetch>("{}");
+  const std::vector<ToolSpec> tools = {
+      {.name = "weather", .parameters = "{not json"}};
+  ModelHandle openai =
+      Connect(*MakeOpenAIModelProvider(fetch, parameters_), "gpt-4o");
+  ModelHandle anthropic = Connect(
+      *MakeAnthropicModelProvider(fetch, parameters_), "claude-model");
+  for (Model* model : {openai.get(), anthropic.get()}) {
+    EXPECT_EQ(model->Complete(*fetch, kToolRound, tools, {}).status().code(),
+              absl::StatusCode::kInvalidArgument)
+        << model->name();
+  }
+  EXPECT_TRUE(fetch->requests.empty());
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,98 @@
+#include "src/loadgen.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "absl/flags/flag.h"
+#include "absl/status/status.h"
+#include "absl/time/time.h"
+
+#include "curl/curl.h"
+#include "src/anthropic.h"
+#include "src/fetch.h"
+#include "src/model.h"
+#include "src/openai.h"
+
+namespace uchen::chat {
+namespace {
+
+using ::testing::HasSubstr;
+
+class LoadgenTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    curl_global_init(CURL_GLOBAL_ALL);
+    auto stub = StubServer::Start({.time_to_first_byte = absl::Milliseconds(50),
+                                   .latency = absl::Milliseconds(100),
+                                   .reply = "stubbed"});
+    ASSERT_TRUE(stub.ok()) << stub.status();
+    stub_ = *std::move(stub);
+    absl::SetFlag(&FLAGS_openai_api_url, stub_->api_url());
+    absl::SetFlag(&FLAGS_openai_api_key, "key");
+    absl::SetFlag(&FLAGS_anthropic_api_url, stub_->api_url() + "/missing");
+    absl::SetFlag(&FLAGS_anthropic_api_key, "key");
+  }
+
+  std::vector<ModelHandle> Connect(const ModelProvider& provider,
+                                   size_t sessions) {
+    std::vector<ModelHandle> models;
+    for (size_t i = 0; i < sessions; ++i) {
+      auto model = provider.ConnectToModel("model");
+      EXPECT_TRUE(model.ok()) << model.status();
+      models.push_back(*std::move(model));
+    }
+    return models;
+  }
+
+  std::shared_ptr<CurlFetch> fetch_ = std::make_shared<CurlFetch>();
+  char* env_[1] = {nullptr};
+  Parameters parameters_{64, env_};
+  std::unique_ptr<StubServer> stub_;
+};
+
+TEST_F(LoadgenTest, MeasuresRequestsAgainstTheStub) {
+  auto provider = MakeOpenAIModelProvider(fetch_, parameters_);
+  std::vector<ModelHandle> sessions = Connect(*provider, 4);
+  LoadReport report = RunLoad(*fetch_, sessions, {.qps = 0, .requests = 12});
+  ASSERT_EQ(report.samples.size(), 12);
+  for (const RequestSample& sample : report.samples) {
+    EXPECT_TRUE(sample.status.ok()) << sample.status;
+    EXPECT_GE(sample.time_to_first_byte, absl::Milliseconds(50));
+    EXPECT_LT(sample.time_to_first_byte, sample.latency);
+    EXPECT_GE(sample.latency, absl::Milliseconds(100));
+  }
+  // Three rounds of four requests in parallel.
+  EXPECT_LT(report.wall_time, absl::Milliseconds(12 * 100));
+  const std::string formatted = FormatReport(report);
+  EXPECT_THAT(formatted, HasSubstr("12 ok, 0 failed"));
+  EXPECT_THAT(formatted, HasSubstr("KiB per request"));
+}
+
+TEST_F(LoadgenTest, KeepsToTheTargetRate) {
+  auto provider = MakeOpenAIModelProvider(fetch_, parameters_);
+  std::vector<ModelHandle> sessions = Connect(*provider, 8);
+  LoadReport report = RunLoad(*fetch_, sessions, {.qps = 20, .requests = 10});
+  // The last request starts 450ms in and takes 100ms.
+  EXPECT_GE(report.wall_time, absl::Milliseconds(550));
+  for (const RequestSample& sample : report.samples) {
+    EXPECT_LT(sample.start_delay, absl::Milliseconds(50));
+  }
+}
+
+TEST_F(LoadgenTest, CountsErrors) {
+  auto provider = MakeAnthropicModelProvider(fetch_, parameters_);
+  std::vector<ModelHandle> sessions = Connect(*provider, 2);
+  LoadReport report = RunLoad(*fetch_, sessions, {.qps = 0, .requests = 4});
+  for (const RequestSample& sample : report.samples) {
+    EXPECT_EQ(sample.status.code(), absl::StatusCode::kInternal);
+  }
+  EXPECT_THAT(FormatReport(report),
+              HasSubstr("0 ok, 4 failed (100.0%)\n  INTERNAL x4"));
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,107 @@
+#include "src/model.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+// Replies with the scripted segments, all but the last one truncated.
+class ScriptedModel : public Model {
+ public:
+  explicit ScriptedModel(std::vector<absl::StatusOr<std::string>> segments)
+      : segments_(std::move(segments)) {}
+
+  std::string_view name() const override { return "scripted"; }
+
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& /* fetch */, std::string_view /* prompt */,
+      absl::Span<const std::string_view> /* input_contents */,
+      const RequestOptions& /* options */) override {
+    return absl::UnimplementedError("Only Complete is scripted");
+  }
+
+  absl::StatusOr<Reply> Complete(const Fetch& /* fetch */,
+                                 absl::Span<const Message> messages,
+                                 absl::Span<const ToolSpec> /* tools */,
+                                 const RequestOptions& /* options */) override {
+    requests_.emplace_back(messages.begin(), messages.end());
+    const size_t turn = requests_.size() - 1;
+    if (!segments_[turn].ok()) {
+      return segments_[turn].status();
+    }
+    return Reply{.text = *segments_[turn],
+                 .truncated = turn + 1 < segments_.size()};
+  }
+
+  const std::vector<std::vector<Message>>& requests() const {
+    return requests_;
+  }
+
+ private:
+  std::vector<absl::StatusOr<std::string>> segments_;
+  std::vector<std::vector<Message>> requests_;
+};
+
+TEST(CompleteWithContinuationsTest, ContinuesTruncatedReplies) {
+  ScriptedModel model({"Once upon", " a time", " the end."});
+  std::vector<std::string> segments;
+  absl::Status status = CompleteWithContinuations(
+      model, NoFetch(), {.content = "Tell a story"}, {}, 4,
+      [&](std::string_view segment) { segments.emplace_back(segment); });
+  ASSERT_TRUE(status.ok()) << status;
+  EXPECT_EQ(segments,
+            (std::vector<std::string>{"Once upon", " a time", " the end."}));
+
+  ASSERT_EQ(model.requests().size(), 3);
+  for (const std::vector<Message>& request : model.requests()) {
+    EXPECT_EQ(request[0].content, "Tell a story");
+  }
+  ASSERT_EQ(model.requests()[2].size(), 3);
+  EXPECT_EQ(model.requests()[2][1].role, Message::Role::kAssistant);
+  EXPECT_EQ(model.requests()[2][1].content, "Once upon a time");
+  EXPECT_EQ(model.requests()[2][2].role, Message::Role::kUser);
+}
+
+TEST(CompleteWithContinuationsTest, StopsAfterMaxContinuations) {
+  ScriptedModel model({"a", "b", "c", "d"});
+  std::string text;
+  absl::Status status = CompleteWithContinuations(
+      model, NoFetch(), {.content = "Letters"}, {}, 1,
+      [&](std::string_view segment) { text += segment; });
+  ASSERT_TRUE(status.ok()) << status;
+  EXPECT_EQ(text, "ab");
+  EXPECT_EQ(model.requests().size(), 2);
+
+  // A negative limit allows no continuation at all.
+  ScriptedModel once({"a", "b"});
+  text.clear();
+  ASSERT_TRUE(CompleteWithContinuations(
+                  once, NoFetch(), {.content = "Letters"}, {}, -1,
+                  [&](std::string_view segment) { text += segment; })
+                  .ok());
+  EXPECT_EQ(text, "a");
+}
+
+TEST(CompleteWithContinuationsTest, ReturnsTheErrorOfAContinuation) {
+  ScriptedModel model({"partial", absl::UnavailableError("overloaded")});
+  std::string text;
+  absl::Status status = CompleteWithContinuations(
+      model, NoFetch(), {.content = "Anything"}, {}, 4,
+      [&](std::string_view segment) { text += segment; });
+  EXPECT_EQ(status.code(), absl::StatusCode::kUnavailable);
+  EXPECT_EQ(text, "partial");
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,165 @@
+#include "src/prompt_cache.h"
+
+#include <unistd.h>
+
+#include <bit>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <gtest/gtest.h>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+constexpr std::string_view kReviewPrompt =
+    "Review the following change for bugs and style problems. Reply with a "
+    "short list of findings, most important first, and say LGTM if there "
+    "are none. The change was uploaded at 2024-05-01 10:22:13.";
+
+class CountingModel : public Model {
+ public:
+  explicit CountingModel(int& calls) : calls_(calls) {}
+
+  std::string_view name() const override { return "counting"; }
+
+  absl::StatusOr<std::string> Prompt(
+      const Fetch& /* fetch */, std::string_view /* prompt */,
+      absl::Span<const std::string_view> /* input_contents */,
+      const RequestOptions& /* options */) override {
+    return absl::StrCat("response ", ++calls_);
+  }
+
+ private:
+  int& calls_;
+};
+
+class PromptCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = absl::StrCat(::testing::TempDir(), "/prompt_cache_", getpid(),
+                         ".jsonl");
+    std::remove(path_.c_str());
+  }
+  void TearDown() override { std::remove(path_.c_str()); }
+
+  std::string path_;
+};
+
+TEST(NormalizePromptTest, IgnoresCaseSpacingAndTimestamps) {
+  EXPECT_EQ(NormalizePrompt("  Build #1234\n\tfailed at 10:22:13  "),
+            "build #1234 failed at 0");
+  EXPECT_EQ(NormalizePrompt("Report for 2024-05-01 at 9:01:59"),
+            NormalizePrompt("report FOR 12/31/2023 at   23:59:00"));
+  EXPECT_EQ(NormalizePrompt("What is 12-7 or 3.14?"), "what is 12-7 or 3.14?");
+}
+
+TEST(SimHashTest, SmallEditsFlipFewBits) {
+  const uint64_t original = SimHash(NormalizePrompt(kReviewPrompt));
+  const uint64_t edited = SimHash(NormalizePrompt(
+      absl::StrCat(kReviewPrompt, " Thanks!")));
+  const uint64_t unrelated =
+      SimHash(NormalizePrompt("Write a haiku about the sea at night."));
+  EXPECT_LE(std::popcount(original ^ edited), 8);
+  EXPECT_GE(std::popcount(original ^ unrelated), 16);
+}
+
+TEST_F(PromptCacheTest, ServesNearDuplicatesOfTheSameModel) {
+  auto cache = PromptCache::Open(path_, {.similarity = 0.85});
+  ASSERT_TRUE(cache.ok()) << cache.status();
+  ASSERT_TRUE((*cache)->Insert("gpt", kReviewPrompt, "LGTM").ok());
+
+  EXPECT_EQ((*cache)->Lookup(
+                "gpt", absl::StrCat("  ", kReviewPrompt, " Thanks!\n")),
+            "LGTM");
+  EXPECT_EQ((*cache)->Lookup("claude", kReviewPrompt), std::nullopt);
+  EXPECT_EQ((*cache)->Lookup("gpt", "Write a haiku about the sea at night."),
+            std::nullopt);
+
+  PromptCacheStats stats = (*cache)->stats();
+  EXPECT_EQ(stats.lookups, 3);
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_GE(stats.max_lookup_time, stats.lookup_time / 3);
+}
+
+TEST_F(PromptCacheTest, ExactThresholdOnlyServesTheSameNormalizedPrompt) {
+  auto cache = PromptCache::Open(path_, {.similarity = 1});
+  ASSERT_TRUE(cache.ok()) << cache.status();
+  ASSERT_TRUE((*cache)->Insert("gpt", kReviewPrompt, "LGTM").ok());
+  EXPECT_EQ((*cache)->Lookup("gpt", absl::StrCat(kReviewPrompt, "  ")),
+            "LGTM");
+  EXPECT_EQ((*cache)->Lookup("gpt", absl::StrCat(kReviewPrompt, " Thanks!")),
+            std::nullopt);
+}
+
+TEST_F(PromptCacheTest, OnlyServesPromptsWithTheSameNumbers) {
+  auto cache = PromptCache::Open(path_, {.similarity = 0.9});
+  ASSERT_TRUE(cache.ok()) << cache.status();
+  ASSERT_TRUE((*cache)->Insert("gpt", "What is 12*7?", "84").ok());
+  EXPECT_EQ((*cache)->Lookup("gpt", "What is 3*4?"), std::nullopt);
+  EXPECT_EQ((*cache)->Lookup("gpt", "What is 12*70?"), std::nullopt);
+  EXPECT_EQ((*cache)->Lookup("gpt", "what is 12*7?"), "84");
+
+  ASSERT_TRUE(
+      (*cache)->Insert("gpt", "Summarize the log of 2024-05-01", "Quiet").ok());
+  EXPECT_EQ((*cache)->Lookup("gpt", "Summarize the log of 2024-05-02"),
+            "Quiet");
+}
+
+TEST_F(PromptCacheTest, RejectsThresholdsTheIndexCannotHonor) {
+  EXPECT_EQ(PromptCache::Open(path_, {.similarity = 0.5}).status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(PromptCache::Open(path_, {.similarity = 1.5}).status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_TRUE(
+      PromptCache::Open(path_, {.similarity = kMinPromptSimilarity}).ok());
+}
+
+TEST_F(PromptCacheTest, KeepsTheNewestResponsesAcrossOpens) {
+  {
+    auto cache = PromptCache::Open(path_, {.similarity = 1});
+    ASSERT_TRUE(cache.ok()) << cache.status();
+    ASSERT_TRUE((*cache)->Insert("gpt", "first prompt", "first").ok());
+    ASSERT_TRUE((*cache)->Insert("gpt", "second prompt", "second").ok());
+    ASSERT_TRUE((*cache)->Insert("gpt", "third prompt", "third").ok());
+  }
+  auto cache = PromptCache::Open(path_, {.similarity = 1, .capacity = 2});
+  ASSERT_TRUE(cache.ok()) << cache.status();
+  EXPECT_EQ((*cache)->Lookup("gpt", "first prompt"), std::nullopt);
+  EXPECT_EQ((*cache)->Lookup("gpt", "second prompt"), "second");
+  EXPECT_EQ((*cache)->Lookup("gpt", "third prompt"), "third");
+
+  ASSERT_TRUE((*cache)->Insert("gpt", "fourth prompt", "fourth").ok());
+  EXPECT_EQ((*cache)->Lookup("gpt", "second prompt"), std::nullopt);
+  EXPECT_EQ((*cache)->Lookup("gpt", "fourth prompt"), "fourth");
+}
+
+TEST_F(PromptCacheTest, ModelOnlyAnswersPromptsNotInTheCache) {
+  auto cache = PromptCache::Open(path_);
+  ASSERT_TRUE(cache.ok()) << cache.status();
+  int calls = 0;
+  ModelHandle model = WithPromptCache(std::make_unique<CountingModel>(calls),
+                                      *std::move(cache));
+  NoFetch fetch;
+  EXPECT_EQ(model->Prompt(fetch, kReviewPrompt, {}, {}).value(), "response 1");
+  EXPECT_EQ(model->Prompt(fetch, absl::StrCat(kReviewPrompt, "\n"), {}, {})
+                .value(),
+            "response 1");
+  EXPECT_EQ(model->Prompt(fetch, "Something else entirely.", {}, {}).value(),
+            "response 2");
+  EXPECT_EQ(calls, 2);
+}
+
+}  // namespace
+}  // namespace uchen::chat
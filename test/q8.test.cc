@@ -0,0 +1,64 @@
+#include "src/q8.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace uchen::chat {
+namespace {
+
+std::vector<float> RandomValues(size_t n, std::mt19937& rng) {
+  std::normal_distribution<float> distribution;
+  std::vector<float> values(n);
+  for (float& value : values) {
+    value = distribution(rng);
+  }
+  return values;
+}
+
+TEST(Q8Test, RoundTripKeepsValuesWithinHalfAStep) {
+  constexpr size_t kGroupSize = 32;
+  std::mt19937 rng(1);
+  std::vector<float> values = RandomValues(4 * kGroupSize, rng);
+  std::vector<int8_t> q(values.size());
+  std::vector<float> s(values.size() / kGroupSize);
+  QuantizeQ8(values.data(), values.size(), kGroupSize, q.data(), s.data());
+  std::vector<float> restored(values.size());
+  DequantizeQ8({.q = q.data(), .s = s.data()}, values.size(), kGroupSize,
+               restored.data());
+  for (size_t i = 0; i < values.size(); ++i) {
+    EXPECT_NEAR(restored[i], values[i], s[i / kGroupSize] / 2 + 1e-6) << i;
+  }
+}
+
+TEST(Q8Test, DotMatchesTheScalarResult) {
+  std::mt19937 rng(2);
+  // Group sizes that do and do not fill whole vector registers.
+  for (size_t group_size : {4, 20, 32, 64, 100}) {
+    const size_t n = 6 * group_size;
+    std::vector<int8_t> qa(n), qb(n);
+    std::uniform_int_distribution<int> byte(-128, 127);
+    for (size_t i = 0; i < n; ++i) {
+      qa[i] = byte(rng);
+      qb[i] = byte(rng);
+    }
+    std::vector<float> sa = RandomValues(n / group_size, rng);
+    std::vector<float> sb = RandomValues(n / group_size, rng);
+    double expected = 0;
+    for (size_t i = 0; i < n; ++i) {
+      expected += static_cast<double>(qa[i]) * qb[i] * sa[i / group_size] *
+                  sb[i / group_size];
+    }
+    float dot = DotQ8({.q = qa.data(), .s = sa.data()},
+                      {.q = qb.data(), .s = sb.data()}, n, group_size);
+    EXPECT_NEAR(dot, expected, std::abs(expected) * 1e-5 + 1e-3)
+        << Q8KernelName() << " with groups of " << group_size;
+  }
+}
+
+}  // namespace
+}  // namespace uchen::chat
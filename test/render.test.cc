@@ -0,0 +1,88 @@
+#include "src/render.h"
+
+#include <sstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "absl/time/time.h"
+
+namespace uchen::chat {
+namespace {
+
+RenderSettings Terminal(size_t width) {
+  return {.terminal = true,
+          .width = width,
+          .frame_interval = absl::ZeroDuration()};
+}
+
+TEST(RendererTest, PassesThroughWhenNotATerminal) {
+  std::ostringstream out;
+  Renderer renderer(out, {.terminal = false, .width = 5});
+  renderer.Append("```\nsome long line");
+  renderer.Finish();
+  EXPECT_EQ(out.str(), "```\nsome long line\n");
+}
+
+TEST(RendererTest, WrapsAtWordBoundaries) {
+  std::ostringstream out;
+  Renderer renderer(out, Terminal(10));
+  renderer.Append("the quick brown fox jumps");
+  renderer.Finish();
+  EXPECT_EQ(out.str(), "the quick\nbrown fox\njumps\n");
+}
+
+TEST(RendererTest, OutputDoesNotDependOnChunking) {
+  constexpr std::string_view kText =
+      "Intro text that wraps\n```cpp\nint main() { return 0; }\n```\n"
+      "  indented tail";
+  std::ostringstream whole;
+  {
+    Renderer renderer(whole, Terminal(12));
+    renderer.Append(kText);
+  }
+  std::ostringstream pieces;
+  {
+    Renderer renderer(pieces, Terminal(12));
+    for (char c : kText) {
+      renderer.Append(std::string_view(&c, 1));
+    }
+  }
+  EXPECT_EQ(pieces.str(), whole.str());
+}
+
+TEST(RendererTest, DoesNotWrapCodeBlocks) {
+  std::ostringstream out;
+  Renderer renderer(out, Terminal(8));
+  renderer.Append("```\nlong code line\n```\nsome text");
+  renderer.Finish();
+  EXPECT_EQ(out.str(),
+            "\033[2m```\033[0m\n"
+            "\033[36mlong code line\033[0m\n"
+            "\033[2m```\033[0m\n"
+            "some\ntext\n");
+}
+
+TEST(RendererTest, CountsUtf8CodePoints) {
+  std::ostringstream out;
+  Renderer renderer(out, Terminal(7));
+  renderer.Append("héllo wörld");
+  renderer.Finish();
+  EXPECT_EQ(out.str(), "héllo\nwörld\n");
+}
+
+TEST(RendererTest, HoldsBackOutputUntilNextFrame) {
+  std::ostringstream out;
+  Renderer renderer(out, {.terminal = true,
+                          .width = 80,
+                          .frame_interval = absl::Hours(1)});
+  renderer.Append("first ");
+  EXPECT_EQ(out.str(), "first");
+  renderer.Append("second ");
+  EXPECT_EQ(out.str(), "first");
+  renderer.Finish();
+  EXPECT_EQ(out.str(), "first second\n");
+}
+
+}  // namespace
+}  // namespace uchen::chat
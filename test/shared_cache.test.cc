@@ -0,0 +1,183 @@
+#include "src/shared_cache.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "curl/curl.h"
+#include "src/fetch.h"
+#include "src/loadgen.h"
+
+namespace uchen::chat {
+namespace {
+
+// Every test gets a file of its own, mapped as many times as it needs, the
+// way separate processes would.
+class SharedResponseCacheTest : public ::testing::Test {
+ protected:
+  std::unique_ptr<SharedResponseCache> Open(SharedCacheOptions options = {}) {
+    auto cache = SharedResponseCache::Open(path_, options);
+    EXPECT_TRUE(cache.ok()) << cache.status();
+    return cache.ok() ? *std::move(cache) : nullptr;
+  }
+
+  void TearDown() override { std::remove(path_.c_str()); }
+
+  const std::string path_ = absl::StrCat(
+      ::testing::TempDir(), "/",
+      ::testing::UnitTest::GetInstance()->current_test_info()->name(),
+      ".cache");
+};
+
+TEST_F(SharedResponseCacheTest, SharesValuesBetweenMappings) {
+  auto writer = Open({.data_bytes = 4096});
+  auto reader = Open();
+  writer->Publish("key", "value");
+  EXPECT_EQ(reader->Lookup("key"), "value");
+  EXPECT_EQ(reader->Lookup("other"), std::nullopt);
+
+  // Four values of a quarter of the ring push the first one out.
+  const std::string large(1000, 'x');
+  for (int i = 0; i < 4; ++i) {
+    writer->Publish(absl::StrCat("large", i), large);
+  }
+  EXPECT_EQ(reader->Lookup("key"), std::nullopt);
+  EXPECT_EQ(reader->Lookup("large3"), large);
+  // Values that do not fit a quarter of the ring are not kept.
+  writer->Publish("huge", std::string(2000, 'x'));
+  EXPECT_EQ(reader->Lookup("huge"), std::nullopt);
+  EXPECT_EQ(reader->stats().hits, 2);
+}
+
+TEST_F(SharedResponseCacheTest, RejectsOtherFiles) {
+  {
+    std::FILE* file = std::fopen(path_.c_str(), "w");
+    std::fputs("not a cache", file);
+    std::fclose(file);
+  }
+  EXPECT_FALSE(SharedResponseCache::Open(path_).ok());
+}
+
+TEST_F(SharedResponseCacheTest, EvictsByPolicy) {
+  for (EvictionPolicy policy :
+       {EvictionPolicy::kLeastRecentlyUsed, EvictionPolicy::kOldestFirst}) {
+    std::remove(path_.c_str());
+    // One probe window makes up the whole index.
+    auto cache = Open({.slots = 16, .eviction = policy});
+    for (int i = 0; i < 16; ++i) {
+      cache->Publish(absl::StrCat("key", i), "value");
+    }
+    ASSERT_EQ(cache->Lookup("key0"), "value");
+    cache->Publish("key16", "value");
+    EXPECT_EQ(cache->Lookup("key16"), "value");
+    if (policy == EvictionPolicy::kLeastRecentlyUsed) {
+      EXPECT_EQ(cache->Lookup("key0"), "value");
+      EXPECT_EQ(cache->Lookup("key1"), std::nullopt);
+    } else {
+      EXPECT_EQ(cache->Lookup("key0"), std::nullopt);
+      EXPECT_EQ(cache->Lookup("key1"), "value");
+    }
+  }
+}
+
+TEST_F(SharedResponseCacheTest, WaitsForTheClaimingProcess) {
+  auto first = Open();
+  auto second = Open();
+  ASSERT_TRUE(first->LookupOrClaim("key").claimed);
+  SharedCacheLookup waited;
+  std::thread waiter([&] { waited = second->LookupOrClaim("key"); });
+  absl::SleepFor(absl::Milliseconds(50));
+  first->Publish("key", "value");
+  waiter.join();
+  EXPECT_EQ(waited.value, "value");
+  EXPECT_FALSE(waited.claimed);
+  EXPECT_EQ(second->stats().coalesced, 1);
+
+  // An abandoned claim goes to the next process.
+  ASSERT_TRUE(first->LookupOrClaim("other").claimed);
+  std::thread next([&] { waited = second->LookupOrClaim("other"); });
+  absl::SleepFor(absl::Milliseconds(50));
+  first->Abandon("other");
+  next.join();
+  EXPECT_EQ(waited.value, std::nullopt);
+  EXPECT_TRUE(waited.claimed);
+}
+
+TEST_F(SharedResponseCacheTest, CoalescesAcrossProcesses) {
+  auto parent = Open();
+  ASSERT_TRUE(parent->LookupOrClaim("key").claimed);
+  const pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    auto cache = SharedResponseCache::Open(path_);
+    _exit(cache.ok() && (*cache)->LookupOrClaim("key").value == "value" &&
+                  (*cache)->stats().coalesced == 1
+              ? 0
+              : 1);
+  }
+  absl::SleepFor(absl::Milliseconds(50));
+  parent->Publish("key", "value");
+  int status = 0;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST_F(SharedResponseCacheTest, SendsConcurrentDuplicatesOnce) {
+  curl_global_init(CURL_GLOBAL_ALL);
+  auto stub = StubServer::Start({.time_to_first_byte = absl::ZeroDuration(),
+                                 .latency = absl::Milliseconds(200)});
+  ASSERT_TRUE(stub.ok()) << stub.status();
+  const std::string url = absl::StrCat((*stub)->api_url(), "/chat/completions");
+  auto curl = std::make_shared<CurlFetch>();
+  std::vector<std::shared_ptr<SharedResponseCache>> caches;
+  std::vector<std::thread> threads;
+  std::vector<std::string> bodies(4);
+  for (int i = 0; i < 4; ++i) {
+    caches.push_back(Open());
+  }
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&, i] {
+      auto response = WithSharedCache(curl, caches[i])
+                          ->PostJson(url, {}, R"({"model":"m"})", {});
+      ASSERT_TRUE(response.ok()) << response.status();
+      bodies[i] = std::string(response->body());
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ((*stub)->requests_received(), 1);
+  size_t coalesced = 0;
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(bodies[i], bodies[0]);
+    coalesced += caches[i]->stats().coalesced;
+  }
+  EXPECT_EQ(coalesced, 3);
+
+  // Other bodies and endpoints go out.
+  auto fetch = WithSharedCache(curl, caches[0]);
+  EXPECT_TRUE(fetch->PostJson(url, {}, R"({"model":"n"})", {}).ok());
+  EXPECT_TRUE(
+      fetch->PostJson(absl::StrCat((*stub)->api_url(), "/batches"), {},
+                      R"({"model":"m"})", {})
+          .ok());
+  EXPECT_EQ((*stub)->requests_received(), 3);
+}
+
+}  // namespace
+}  // namespace uchen::chat
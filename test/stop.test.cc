@@ -0,0 +1,192 @@
+#include "src/stop.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "absl/flags/flag.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+
+#include "curl/curl.h"
+#include "nlohmann/json.hpp"
+#include "src/anthropic.h"
+#include "src/fetch.h"
+#include "src/loadgen.h"
+#include "src/model.h"
+#include "src/openai.h"
+#include "test/fake_fetch.h"
+
+namespace uchen::chat {
+namespace {
+
+using ::testing::ElementsAre;
+
+StopMatcher Matcher(std::vector<StopCondition> conditions) {
+  auto matcher = StopMatcher::Create(conditions);
+  EXPECT_TRUE(matcher.ok()) << matcher.status();
+  return *std::move(matcher);
+}
+
+TEST(StopMatcherTest, HoldsBackWhatMayStartALiteral) {
+  StopMatcher matcher = Matcher({{.pattern = "END"}, {.pattern = "\n\n"}});
+  EXPECT_EQ(matcher.Feed("Hello E"), "Hello ");
+  EXPECT_EQ(matcher.Feed("x\n"), "Ex");
+  EXPECT_EQ(matcher.Feed("tra E"), "\ntra ");
+  EXPECT_EQ(matcher.Feed("N"), "");
+  EXPECT_EQ(matcher.Feed("Dless"), "");
+  EXPECT_TRUE(matcher.stopped());
+  EXPECT_EQ(matcher.Feed("more"), "");
+  EXPECT_EQ(matcher.Finish(), "");
+
+  StopMatcher unmatched = Matcher({{.pattern = "END"}});
+  EXPECT_EQ(unmatched.Feed("The E"), "The ");
+  EXPECT_FALSE(unmatched.stopped());
+  EXPECT_EQ(unmatched.Finish(), "E");
+}
+
+TEST(StopMatcherTest, FindsTheFirstOfManyLiterals) {
+  // "he" is a suffix of "she", which the automaton finds through its
+  // failure links.
+  StopMatcher matcher = Matcher(
+      {{.pattern = "hers"}, {.pattern = "she"}, {.pattern = "his"}});
+  std::string answer;
+  for (char c : std::string_view("ushers and his")) {
+    answer += matcher.Feed(std::string_view(&c, 1));
+  }
+  EXPECT_EQ(answer, "u");
+}
+
+TEST(StopMatcherTest, EndsWithTheFirstCompleteJson) {
+  StopMatcher matcher = Matcher({{.kind = StopCondition::Kind::kBalancedJson}});
+  std::string answer;
+  answer += matcher.Feed(R"(Here: {"a": "}\"", "b": )");
+  EXPECT_FALSE(matcher.stopped());
+  answer += matcher.Feed(R"([1, {}]} and then {"c": 2})");
+  EXPECT_TRUE(matcher.stopped());
+  EXPECT_EQ(answer, R"(Here: {"a": "}\"", "b": [1, {}]})");
+}
+
+TEST(StopMatcherTest, EndsWithTheEarliestRegexMatch) {
+  StopMatcher matcher =
+      Matcher({{.kind = StopCondition::Kind::kRegex, .pattern = R"(\d+\.)"},
+               {.kind = StopCondition::Kind::kRegex, .pattern = "Sincerely"}});
+  std::string answer;
+  answer += matcher.Feed("Count to 1");
+  answer += matcher.Feed("2. Sincerely 3.");
+  EXPECT_TRUE(matcher.stopped());
+  EXPECT_EQ(answer, "Count to 12.");
+
+  EXPECT_EQ(StopMatcher::Create(
+                {{.kind = StopCondition::Kind::kRegex, .pattern = "(a"}})
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(StopMatcher::Create({{.pattern = ""}}).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+class StreamPromptUntilTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    curl_global_init(CURL_GLOBAL_ALL);
+    absl::SetFlag(&FLAGS_openai_api_key, "key");
+    absl::SetFlag(&FLAGS_anthropic_api_key, "key");
+  }
+
+  std::string StreamUntil(Model& model, const Fetch& fetch,
+                          absl::Span<const StopCondition> stop) {
+    std::string answer;
+    absl::Status status = model.StreamPromptUntil(
+        fetch, "Count.", {}, stop, {},
+        [&](std::string_view segment) { answer += segment; });
+    EXPECT_TRUE(status.ok()) << status;
+    return answer;
+  }
+
+  char* env_[1] = {nullptr};
+  Parameters parameters_{64, env_};
+};
+
+TEST_F(StreamPromptUntilTest, PassesLiteralsToTheProviders) {
+  const std::vector<StopCondition> stop = {
+      {.pattern = "\n"},
+      {.pattern = "three"},
+      {.kind = StopCondition::Kind::kRegex, .pattern = "t[a-z]o"},
+  };
+  auto openai_fetch = std::make_shared<CannedFetch>(
+      "data: {\"choices\":[{\"delta\":{\"content\":\"one\"}}]}\r\n\r\n"
+      "data: {\"choices\":[{\"delta\":{\"content\":\" two\"}}]}\r\n\r\n"
+      "data: {\"choices\":[{\"delta\":{},\"finish_reason\":\"stop\"}]}\n\n"
+      "data: [DONE]\n\n");
+  auto openai = MakeOpenAIModelProvider(openai_fetch, parameters_)
+                    ->ConnectToModel("gpt-4o");
+  ASSERT_TRUE(openai.ok()) << openai.status();
+  EXPECT_EQ(StreamUntil(**openai, *openai_fetch, stop), "one two");
+  ASSERT_EQ(openai_fetch->requests.size(), 1);
+  EXPECT_EQ(openai_fetch->requests[0]["stream"], true);
+  EXPECT_THAT(openai_fetch->requests[0]["stop"], ElementsAre("\n", "three"));
+
+  auto anthropic_fetch = std::make_shared<CannedFetch>(
+      "event: message_start\ndata: {\"type\":\"message_start\"}\n\n"
+      "event: content_block_delta\n"
+      "data: {\"delta\":{\"type\":\"text_delta\",\"text\":\"one tw\"}}\n\n"
+      "event: content_block_delta\n"
+      "data: {\"delta\":{\"type\":\"text_delta\",\"text\":\"o three\"}}\n\n");
+  auto anthropic = MakeAnthropicModelProvider(anthropic_fetch, parameters_)
+                       ->ConnectToModel("claude-model");
+  ASSERT_TRUE(anthropic.ok()) << anthropic.status();
+  EXPECT_EQ(StreamUntil(**anthropic, *anthropic_fetch, stop), "one two");
+  ASSERT_EQ(anthropic_fetch->requests.size(), 1);
+  // Whitespace only stop sequences are left to the client.
+  EXPECT_THAT(anthropic_fetch->requests[0]["stop_sequences"],
+              ElementsAre("three"));
+}
+
+TEST_F(StreamPromptUntilTest, ClosesTheStreamAtTheStop) {
+  std::string reply = "one two three STOP";
+  for (int i = 0; i < 50; ++i) {
+    absl::StrAppend(&reply, " more");
+  }
+  auto stub = StubServer::Start({.time_to_first_byte = absl::ZeroDuration(),
+                                 .latency = absl::ZeroDuration(),
+                                 .reply = reply,
+                                 .stream_interval = absl::Milliseconds(40)});
+  ASSERT_TRUE(stub.ok()) << stub.status();
+  absl::SetFlag(&FLAGS_openai_api_url, (*stub)->api_url());
+  absl::SetFlag(&FLAGS_anthropic_api_url, (*stub)->api_url());
+  auto fetch = std::make_shared<CurlFetch>();
+  std::vector<std::unique_ptr<ModelProvider>> providers;
+  providers.push_back(MakeOpenAIModelProvider(fetch, parameters_));
+  providers.push_back(MakeAnthropicModelProvider(fetch, parameters_));
+  for (const auto& provider : providers) {
+    auto model = provider->ConnectToModel("model");
+    ASSERT_TRUE(model.ok()) << model.status();
+    const absl::Time start = absl::Now();
+    EXPECT_EQ(StreamUntil(**model, *fetch, {{{.pattern = " STOP"}}}),
+              "one two three");
+    // The whole stream takes two seconds.
+    EXPECT_LT(absl::Now() - start, absl::Seconds(1));
+  }
+
+  // Without a stop, the stream is read to its end.
+  auto model = MakeOpenAIModelProvider(fetch, parameters_)
+                   ->ConnectToModel("model");
+  ASSERT_TRUE(model.ok()) << model.status();
+  EXPECT_EQ(StreamUntil(**model, *fetch,
+                        {{{.kind = StopCondition::Kind::kRegex,
+                           .pattern = "never"}}}),
+            reply);
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,53 @@
+#include "src/thread_pool.h"
+
+#include <atomic>
+#include <set>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace uchen::chat {
+namespace {
+
+TEST(ThreadPoolTest, RunsQueuedTasksBeforeShutdown) {
+  std::atomic<int> done = 0;
+  {
+    ThreadPool pool(4);
+    for (int i = 0; i < 1000; ++i) {
+      pool.Schedule([&]() { done.fetch_add(1); });
+    }
+  }
+  EXPECT_EQ(done.load(), 1000);
+}
+
+TEST(ThreadPoolTest, IdleWorkersStealFromABusyOne) {
+  ThreadPool pool(4);
+  constexpr int kTasks = 8;
+  absl::BlockingCounter done(kTasks);
+  absl::Mutex mu;
+  std::set<std::thread::id> threads;
+  // All tasks land in the queue of the worker running the outer task.
+  pool.Schedule([&]() {
+    for (int i = 0; i < kTasks; ++i) {
+      pool.Schedule([&]() {
+        absl::SleepFor(absl::Milliseconds(50));
+        absl::MutexLock lock(&mu);
+        threads.insert(std::this_thread::get_id());
+        done.DecrementCount();
+      });
+    }
+  });
+  absl::Time start = absl::Now();
+  done.Wait();
+  EXPECT_LT(absl::Now() - start, absl::Milliseconds(kTasks * 50));
+  absl::MutexLock lock(&mu);
+  EXPECT_GT(threads.size(), 1);
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,117 @@
+#include "src/tools.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "src/fetch.h"
+#include "src/model.h"
+
+namespace uchen::chat {
+namespace {
+
+using ::testing::HasSubstr;
+
+Tool ShellTool(std::string name, std::string script) {
+  return {.spec = {.name = std::move(name)},
+          .command = {"/bin/sh", "-c", std::move(script)}};
+}
+
+std::vector<Message> RunQuietly(const ToolRunner& runner,
+                                const std::vector<ToolCall>& calls) {
+  return runner.Run(calls, [](size_t, std::string_view) {});
+}
+
+TEST(ToolRunnerTest, PassesArgumentsOnStdin) {
+  ToolRunner runner({ShellTool("echo", "cat")});
+  auto results = RunQuietly(
+      runner,
+      {{.id = "call_1", .name = "echo", .arguments = R"({"text":"hi"})"}});
+  ASSERT_EQ(results.size(), 1);
+  EXPECT_EQ(results[0].role, Message::Role::kTool);
+  EXPECT_EQ(results[0].tool_call_id, "call_1");
+  EXPECT_EQ(results[0].content, R"({"text":"hi"})");
+}
+
+TEST(ToolRunnerTest, RunsCallsConcurrently) {
+  ToolRunner runner({ShellTool("slow", "sleep 1; cat")});
+  std::vector<ToolCall> calls;
+  for (int i = 0; i < 4; ++i) {
+    calls.push_back({.id = std::to_string(i),
+                     .name = "slow",
+                     .arguments = std::to_string(i)});
+  }
+  absl::Time start = absl::Now();
+  auto results = RunQuietly(runner, calls);
+  EXPECT_LT(absl::Now() - start, absl::Seconds(3));
+  ASSERT_EQ(results.size(), calls.size());
+  for (size_t i = 0; i < calls.size(); ++i) {
+    EXPECT_EQ(results[i].tool_call_id, calls[i].id);
+    EXPECT_EQ(results[i].content, calls[i].arguments);
+  }
+}
+
+TEST(ToolRunnerTest, StreamsOutput) {
+  ToolRunner runner({ShellTool("count", "echo 1; sleep 0.2; echo 2")});
+  std::vector<std::string> chunks;
+  auto results = runner.Run(
+      std::vector<ToolCall>{{.id = "a", .name = "count"}},
+      [&](size_t call, std::string_view output) {
+        EXPECT_EQ(call, 0);
+        chunks.emplace_back(output);
+      });
+  EXPECT_THAT(chunks, ::testing::ElementsAre("1\n", "2\n"));
+  EXPECT_EQ(results[0].content, "1\n2\n");
+}
+
+TEST(ToolRunnerTest, ReportsFailuresToTheModel) {
+  ToolRunner runner({ShellTool("fail", "echo oops; exit 3")});
+  auto results = RunQuietly(
+      runner, {{.id = "a", .name = "fail"}, {.id = "b", .name = "missing"}});
+  ASSERT_EQ(results.size(), 2);
+  EXPECT_EQ(results[0].content, "oops\n\n[exit status 3]");
+  EXPECT_EQ(results[1].content, "Error: Unknown tool missing");
+}
+
+TEST(ToolRunnerTest, EnforcesLimits) {
+  ToolRunner runner({ShellTool("sleep", "sleep 10"),
+                     ShellTool("chatty", "yes | head -c 100000")},
+                    {.wall_time = absl::Milliseconds(500), .output_bytes = 10});
+  absl::Time start = absl::Now();
+  auto results = RunQuietly(
+      runner, {{.id = "a", .name = "sleep"}, {.id = "b", .name = "chatty"}});
+  EXPECT_LT(absl::Now() - start, absl::Seconds(5));
+  EXPECT_THAT(results[0].content, HasSubstr("[timed out after 500ms]"));
+  EXPECT_EQ(results[1].content, "y\ny\ny\ny\ny\n\n[output truncated]");
+}
+
+TEST(ToolRunnerTest, EnforcesLimitsAfterTheOutputIsClosed) {
+  ToolRunner runner({ShellTool("detached", "exec >&- 2>&-; sleep 1000")},
+                    {.wall_time = absl::Milliseconds(500)});
+  absl::Time start = absl::Now();
+  auto results = RunQuietly(runner, {{.id = "a", .name = "detached"}});
+  EXPECT_LT(absl::Now() - start, absl::Seconds(5));
+  EXPECT_THAT(results[0].content, HasSubstr("[timed out after 500ms]"));
+
+  Cancellation cancellation;
+  cancellation.Cancel();
+  results = runner.Run({{.id = "b", .name = "detached"}},
+                       [](size_t, std::string_view) {}, &cancellation);
+  EXPECT_THAT(results[0].content, HasSubstr("[cancelled]"));
+}
+
+TEST(ToolRunnerTest, KeepsSecretsOutOfTheEnvironment) {
+  setenv("OPENAI_API_KEY", "secret", 1);
+  ToolRunner runner({ShellTool("env", "echo ${OPENAI_API_KEY:-unset}")});
+  auto results = RunQuietly(runner, {{.id = "a", .name = "env"}});
+  EXPECT_EQ(results[0].content, "unset\n");
+}
+
+}  // namespace
+}  // namespace uchen::chat
@@ -0,0 +1,76 @@
+#include "src/trace.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include "nlohmann/json.hpp"
+
+namespace uchen::chat {
+namespace {
+
+std::vector<nlohmann::json> EventsNamed(const std::string& name) {
+  auto trace = nlohmann::json::parse(ChromeTraceJson(), nullptr, false);
+  EXPECT_FALSE(trace.is_discarded());
+  std::vector<nlohmann::json> events;
+  for (const auto& event : trace["traceEvents"]) {
+    if (event["name"] == name) {
+      events.push_back(event);
+    }
+  }
+  return events;
+}
+
+// Tracing cannot be turned off again, so this test must run first.
+TEST(TraceTest, SpansAreNotRecordedUntilEnabled) {
+  ASSERT_FALSE(TracingEnabled());
+  { TraceSpan span("before"); }
+  EnableTracing();
+  { TraceSpan span("after"); }
+  EXPECT_TRUE(EventsNamed("before").empty());
+  EXPECT_EQ(EventsNamed("after").size(), 1);
+}
+
+TEST(TraceTest, RecordsNestedSpansOfEveryThread) {
+  EnableTracing();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([]() {
+      TraceSpan outer("outer");
+      for (int j = 0; j < 5000; ++j) {
+        TraceSpan inner("inner");
+      }
+      absl::SleepFor(absl::Milliseconds(1));
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  std::vector<nlohmann::json> outer = EventsNamed("outer");
+  ASSERT_EQ(outer.size(), 4);
+  std::map<int, const nlohmann::json*> outer_by_thread;
+  for (const auto& event : outer) {
+    EXPECT_EQ(event["ph"], "X");
+    EXPECT_GE(event["dur"].get<double>(), 1000);
+    outer_by_thread[event["tid"].get<int>()] = &event;
+  }
+  EXPECT_EQ(outer_by_thread.size(), 4);
+  std::vector<nlohmann::json> inner = EventsNamed("inner");
+  EXPECT_EQ(inner.size(), 4 * 5000);
+  for (const auto& event : inner) {
+    const nlohmann::json& parent = *outer_by_thread.at(event["tid"]);
+    EXPECT_GE(event["ts"].get<double>(), parent["ts"].get<double>());
+    EXPECT_LE(event["ts"].get<double>() + event["dur"].get<double>(),
+              parent["ts"].get<double>() + parent["dur"].get<double>());
+  }
+}
+
+}  // namespace
+}  // namespace uchen::chat